@@ -31,6 +31,10 @@ G_BEGIN_DECLS
  * GabbleCapabilitySet:
  *
  * A set of capabilities.
+ *
+ * A set can be frozen with gabble_capability_set_freeze(), after which it
+ * must not be changed, but may be shared with gabble_capability_set_ref().
+ * gabble_capability_set_free() releases one reference.
  */
 typedef struct _GabbleCapabilitySet GabbleCapabilitySet;
 
@@ -60,6 +64,9 @@ gboolean gabble_capability_set_equals (const GabbleCapabilitySet *a,
     const GabbleCapabilitySet *b);
 void gabble_capability_set_clear (GabbleCapabilitySet *caps);
 void gabble_capability_set_free (GabbleCapabilitySet *caps);
+GabbleCapabilitySet *gabble_capability_set_freeze (GabbleCapabilitySet *caps);
+gboolean gabble_capability_set_is_frozen (const GabbleCapabilitySet *caps);
+GabbleCapabilitySet *gabble_capability_set_ref (GabbleCapabilitySet *caps);
 void gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
     GFunc func, gpointer user_data);
 gchar *gabble_capability_set_dump (const GabbleCapabilitySet *caps,
@@ -1570,6 +1570,46 @@ handle_message (WockyPorter *porter,
 void
 wocky_muc_join (WockyMuc *muc,
     GCancellable *cancel)
+{
+  wocky_muc_join_with_history (muc, -1, -1, -1, NULL, cancel);
+}
+
+static void
+set_history_limit (WockyNode *history,
+    const gchar *name,
+    gint value)
+{
+  gchar *str;
+
+  if (value < 0)
+    return;
+
+  str = g_strdup_printf ("%d", value);
+  wocky_node_set_attribute (history, name, str);
+  g_free (str);
+}
+
+/**
+ * wocky_muc_join_with_history:
+ * @muc: a MUC
+ * @max_chars: the most characters of history to ask for, or -1
+ * @max_stanzas: the most messages of history to ask for, or -1
+ * @seconds: how many seconds of history to ask for, or -1
+ * @since: if not %NULL, only ask for history sent after this time
+ * @cancel: unused
+ *
+ * Like wocky_muc_join(), but limits the discussion history the room sends
+ * on joining, as described in XEP-0045 §7.2.15. Limits of -1 and a %NULL
+ * @since are left to the room; if more than one limit is given, the room
+ * should send only the history which falls within all of them.
+ */
+void
+wocky_muc_join_with_history (WockyMuc *muc,
+    gint max_chars,
+    gint max_stanzas,
+    gint seconds,
+    GDateTime *since,
+    GCancellable *cancel)
 {
   WockyMucPrivate *priv = muc->priv;
   WockyStanza *presence = wocky_muc_create_presence (muc,
@@ -1580,6 +1620,25 @@ wocky_muc_join (WockyMuc *muc,
   if (priv->pass != NULL)
     wocky_node_add_child_with_content (x, "password", priv->pass);
 
+  if (max_chars >= 0 || max_stanzas >= 0 || seconds >= 0 || since != NULL)
+    {
+      WockyNode *history = wocky_node_add_child (x, "history");
+
+      set_history_limit (history, "maxchars", max_chars);
+      set_history_limit (history, "maxstanzas", max_stanzas);
+      set_history_limit (history, "seconds", seconds);
+
+      if (since != NULL)
+        {
+          GDateTime *utc = g_date_time_to_utc (since);
+          gchar *stamp = g_date_time_format (utc, "%Y-%m-%dT%H:%M:%SZ");
+
+          wocky_node_set_attribute (history, "since", stamp);
+          g_free (stamp);
+          g_date_time_unref (utc);
+        }
+    }
+
   if (priv->state < WOCKY_MUC_INITIATED)
     {
       register_presence_handler (muc);
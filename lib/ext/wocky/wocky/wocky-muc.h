@@ -299,6 +299,13 @@ WockyStanza *wocky_muc_create_presence (WockyMuc *muc,
 void wocky_muc_join (WockyMuc *muc,
     GCancellable *cancel);
 
+void wocky_muc_join_with_history (WockyMuc *muc,
+    gint max_chars,
+    gint max_stanzas,
+    gint seconds,
+    GDateTime *since,
+    GCancellable *cancel);
+
 /* meta data */
 const gchar * wocky_muc_jid (WockyMuc *muc);
 const gchar * wocky_muc_user (WockyMuc *muc);
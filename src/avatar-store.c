@@ -0,0 +1,558 @@
+/*
+ * avatar-store.c - An on-disk store of avatars keyed by SHA-1
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Contacts advertise their avatar's SHA-1 in their presence (XEP-0153), and
+ * the same image is often used by many contacts, so avatars are stored in one
+ * file per hash rather than per contact. Each file holds the avatar's MIME
+ * type on its first line, followed by the image itself.
+ *
+ * Hashes come from the network, so they are checked to be what they claim to
+ * be before being used as filenames; and files are checked against their
+ * names when read back, so a damaged file is never handed out.
+ *
+ * The store holds at most a given number of avatars. Once it has more, the
+ * ones saved longest ago are deleted; the directory is scanned for what
+ * earlier connections saved the first time the store is used.
+ *
+ * Reading an avatar back, and checking it, can be done on a worker thread
+ * with gabble_avatar_store_lookup_async(), so that a client asking for many
+ * contacts' avatars at once doesn't hold up the main loop. */
+
+#include "config.h"
+#include "avatar-store.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_CONNECTION
+
+#include "debug.h"
+#include "util.h"
+
+struct _GabbleAvatarStore {
+    gchar *path;
+    guint max_entries;
+    /* hashes we know to have a file, so adding them again is free:
+     * gchar * => GList *, its link in @order */
+    GHashTable *present;
+    /* the keys of @present, in the order they were saved, oldest first */
+    GQueue order;
+    /* TRUE once the files already in @path are in @present */
+    gboolean scanned;
+
+    guint hits;
+    guint misses;
+};
+
+/**
+ * gabble_avatar_store_new:
+ * @path: the directory to keep avatars in, which is created if necessary
+ * @max_entries: how many avatars to keep, at least 1
+ *
+ * Returns: a new avatar store, to be freed with gabble_avatar_store_free()
+ */
+GabbleAvatarStore *
+gabble_avatar_store_new (const gchar *path,
+    guint max_entries)
+{
+  GabbleAvatarStore *store;
+
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (max_entries > 0, NULL);
+
+  store = g_slice_new0 (GabbleAvatarStore);
+  store->path = g_strdup (path);
+  store->max_entries = max_entries;
+  store->present = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+  g_queue_init (&store->order);
+
+  return store;
+}
+
+void
+gabble_avatar_store_free (GabbleAvatarStore *store)
+{
+  g_return_if_fail (store != NULL);
+
+  DEBUG ("%u avatars served from %s, %u not there", store->hits,
+      store->path, store->misses);
+
+  g_queue_clear (&store->order);
+  g_hash_table_unref (store->present);
+  g_free (store->path);
+  g_slice_free (GabbleAvatarStore, store);
+}
+
+/* Returns TRUE if @sha1 looks like a hash we made: forty lower-case hex
+ * digits, and so safe to use as a filename */
+static gboolean
+sha1_is_valid (const gchar *sha1)
+{
+  guint i;
+
+  for (i = 0; i < SHA1_HASH_SIZE * 2; i++)
+    {
+      if (!g_ascii_isxdigit (sha1[i]) || g_ascii_isupper (sha1[i]))
+        return FALSE;
+    }
+
+  return sha1[i] == '\0';
+}
+
+static gchar *
+build_filename (GabbleAvatarStore *store,
+    const gchar *sha1)
+{
+  return g_build_filename (store->path, sha1, NULL);
+}
+
+/* Notes that @sha1 has a file, saved after all those already noted */
+static void
+store_remember (GabbleAvatarStore *store,
+    const gchar *sha1)
+{
+  gchar *key;
+
+  if (g_hash_table_lookup (store->present, sha1) != NULL)
+    return;
+
+  key = g_strdup (sha1);
+  g_queue_push_tail (&store->order, key);
+  g_hash_table_insert (store->present, key, store->order.tail);
+}
+
+static void
+store_forget (GabbleAvatarStore *store,
+    const gchar *sha1)
+{
+  GList *link = g_hash_table_lookup (store->present, sha1);
+
+  if (link == NULL)
+    return;
+
+  /* the key is owned by the hash table, so unlink it from the queue first */
+  g_queue_delete_link (&store->order, link);
+  g_hash_table_remove (store->present, sha1);
+}
+
+typedef struct {
+    gchar *sha1;
+    gint64 mtime;
+} ScannedAvatar;
+
+static gint
+scanned_avatar_cmp_oldest_first (gconstpointer a,
+    gconstpointer b)
+{
+  const ScannedAvatar *left = a;
+  const ScannedAvatar *right = b;
+
+  return (left->mtime > right->mtime) - (left->mtime < right->mtime);
+}
+
+/* Notes the avatars saved by earlier connections, in the order they were
+ * saved, so that they're counted towards the limit and pruned in turn. This
+ * must happen before anything else is noted. */
+static void
+store_scan (GabbleAvatarStore *store)
+{
+  GDir *dir;
+  GArray *found;
+  const gchar *name;
+  guint i;
+
+  if (store->scanned)
+    return;
+
+  store->scanned = TRUE;
+  dir = g_dir_open (store->path, 0, NULL);
+
+  /* Nothing has been saved yet */
+  if (dir == NULL)
+    return;
+
+  found = g_array_new (FALSE, FALSE, sizeof (ScannedAvatar));
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *filename;
+      GStatBuf st;
+
+      /* g_file_set_contents() leaves temporary files behind if it's
+       * interrupted; they, and anything else, aren't ours to count */
+      if (!sha1_is_valid (name))
+        continue;
+
+      filename = build_filename (store, name);
+
+      if (g_stat (filename, &st) == 0)
+        {
+          ScannedAvatar scanned;
+
+          scanned.sha1 = g_strdup (name);
+          scanned.mtime = st.st_mtime;
+          g_array_append_val (found, scanned);
+        }
+
+      g_free (filename);
+    }
+
+  g_dir_close (dir);
+  g_array_sort (found, scanned_avatar_cmp_oldest_first);
+
+  for (i = 0; i < found->len; i++)
+    {
+      ScannedAvatar *scanned = &g_array_index (found, ScannedAvatar, i);
+
+      store_remember (store, scanned->sha1);
+      g_free (scanned->sha1);
+    }
+
+  DEBUG ("found %u avatars in %s", found->len, store->path);
+  g_array_unref (found);
+}
+
+/* Deletes the avatars saved longest ago, until there are few enough */
+static void
+store_prune (GabbleAvatarStore *store)
+{
+  while (store->order.length > store->max_entries)
+    {
+      gchar *sha1 = g_queue_peek_head (&store->order);
+      gchar *filename = build_filename (store, sha1);
+
+      DEBUG ("deleting avatar %s to make room", sha1);
+
+      if (g_unlink (filename) != 0 && errno != ENOENT)
+        DEBUG ("unlink failed: %s", g_strerror (errno));
+
+      g_free (filename);
+      store_forget (store, sha1);
+    }
+}
+
+/**
+ * gabble_avatar_store_add:
+ * @store: an avatar store
+ * @sha1: the hash @data is expected to have
+ * @data: an avatar
+ * @len: the length of @data
+ * @mime_type: the MIME type of @data, or "" if unknown
+ *
+ * Saves an avatar, unless one with the same hash is already saved, and
+ * deletes the ones saved longest ago if there are now too many.
+ *
+ * Returns: %TRUE if @data's hash is @sha1 and it is now in @store
+ */
+gboolean
+gabble_avatar_store_add (GabbleAvatarStore *store,
+    const gchar *sha1,
+    const gchar *data,
+    gsize len,
+    const gchar *mime_type)
+{
+  gchar *actual, *filename, *contents;
+  gsize header_len;
+  gboolean ret = FALSE;
+  GError *error = NULL;
+
+  g_return_val_if_fail (store != NULL, FALSE);
+  g_return_val_if_fail (sha1 != NULL, FALSE);
+  g_return_val_if_fail (mime_type != NULL, FALSE);
+
+  /* Before this avatar joins them, so it's the newest however coarse the
+   * files' timestamps are */
+  store_scan (store);
+
+  if (g_hash_table_lookup (store->present, sha1) != NULL)
+    return TRUE;
+
+  if (!sha1_is_valid (sha1) || strchr (mime_type, '\n') != NULL)
+    {
+      DEBUG ("not storing avatar '%s' of type '%s'", sha1, mime_type);
+      return FALSE;
+    }
+
+  actual = sha1_hex (data, len);
+
+  if (tp_strdiff (actual, sha1))
+    {
+      DEBUG ("avatar claiming to be %s is actually %s; not storing it", sha1,
+          actual);
+      g_free (actual);
+      return FALSE;
+    }
+
+  g_free (actual);
+
+  header_len = strlen (mime_type) + 1;
+  contents = g_malloc (header_len + len);
+  memcpy (contents, mime_type, header_len - 1);
+  contents[header_len - 1] = '\n';
+  memcpy (contents + header_len, data, len);
+
+  filename = build_filename (store, sha1);
+
+  if (g_mkdir_with_parents (store->path, 0700) != 0)
+    {
+      DEBUG ("couldn't create %s: %s", store->path, g_strerror (errno));
+    }
+  else if (!g_file_set_contents (filename, contents, header_len + len,
+        &error))
+    {
+      DEBUG ("couldn't save avatar %s: %s", sha1, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      DEBUG ("saved %" G_GSIZE_FORMAT "-byte avatar %s", len, sha1);
+      store_remember (store, sha1);
+      store_prune (store);
+      ret = TRUE;
+    }
+
+  g_free (filename);
+  g_free (contents);
+  return ret;
+}
+
+/* What reading an avatar's file turned up. This is filled in without
+ * touching the store, or logging anything, so it can happen on any
+ * thread. */
+typedef struct {
+    gchar *sha1;
+    gchar *filename;
+    GBytes *avatar;
+    gchar *mime_type;
+    /* TRUE if the file was there but wasn't what its name says */
+    gboolean damaged;
+} LoadedAvatar;
+
+static void
+loaded_avatar_free (gpointer data)
+{
+  LoadedAvatar *loaded = data;
+
+  g_free (loaded->sha1);
+  g_free (loaded->filename);
+
+  if (loaded->avatar != NULL)
+    g_bytes_unref (loaded->avatar);
+
+  g_free (loaded->mime_type);
+  g_slice_free (LoadedAvatar, loaded);
+}
+
+static LoadedAvatar *
+loaded_avatar_new (GabbleAvatarStore *store,
+    const gchar *sha1)
+{
+  LoadedAvatar *loaded = g_slice_new0 (LoadedAvatar);
+
+  loaded->sha1 = g_strdup (sha1);
+  loaded->filename = build_filename (store, sha1);
+  return loaded;
+}
+
+/* Reads and checks @loaded's file */
+static void
+loaded_avatar_read (LoadedAvatar *loaded)
+{
+  gchar *contents, *newline, *actual = NULL;
+  gsize len, header_len;
+
+  if (!g_file_get_contents (loaded->filename, &contents, &len, NULL))
+    return;
+
+  newline = memchr (contents, '\n', len);
+
+  if (newline != NULL)
+    {
+      newline++;
+      actual = sha1_hex (newline, len - (newline - contents));
+    }
+
+  if (tp_strdiff (actual, loaded->sha1))
+    {
+      loaded->damaged = TRUE;
+      g_free (actual);
+      g_free (contents);
+      return;
+    }
+
+  g_free (actual);
+  header_len = newline - contents;
+  loaded->mime_type = g_strndup (contents, header_len - 1);
+
+  /* Rather than copying the image out of the file's buffer, slide it to the
+   * front and hand the buffer over */
+  memmove (contents, newline, len - header_len);
+  loaded->avatar = g_bytes_new_take (contents, len - header_len);
+}
+
+/* Updates @store with what reading @loaded's file turned up, and returns
+ * it, if it was there, to the caller */
+static gboolean
+loaded_avatar_finish (GabbleAvatarStore *store,
+    LoadedAvatar *loaded,
+    GBytes **avatar,
+    gchar **mime_type)
+{
+  if (loaded->avatar == NULL)
+    {
+      if (loaded->damaged)
+        {
+          DEBUG ("stored avatar %s is damaged; removing it", loaded->sha1);
+
+          if (g_unlink (loaded->filename) != 0)
+            DEBUG ("unlink failed: %s", g_strerror (errno));
+
+          store_forget (store, loaded->sha1);
+        }
+
+      store->misses++;
+      return FALSE;
+    }
+
+  /* Hand them over, so the caller holds the only reference to the image */
+  if (avatar != NULL)
+    {
+      *avatar = loaded->avatar;
+      loaded->avatar = NULL;
+    }
+
+  if (mime_type != NULL)
+    {
+      *mime_type = loaded->mime_type;
+      loaded->mime_type = NULL;
+    }
+
+  store_scan (store);
+  store_remember (store, loaded->sha1);
+  store->hits++;
+  return TRUE;
+}
+
+/**
+ * gabble_avatar_store_lookup:
+ * @store: an avatar store
+ * @sha1: the hash of the avatar wanted
+ * @avatar: if not %NULL, used to return the avatar, to be freed with
+ *  g_bytes_unref()
+ * @mime_type: if not %NULL, used to return the avatar's MIME type, to be
+ *  freed with g_free()
+ *
+ * Returns: %TRUE if the avatar with hash @sha1 was in @store
+ */
+gboolean
+gabble_avatar_store_lookup (GabbleAvatarStore *store,
+    const gchar *sha1,
+    GBytes **avatar,
+    gchar **mime_type)
+{
+  LoadedAvatar *loaded;
+  gboolean ret;
+
+  g_return_val_if_fail (store != NULL, FALSE);
+  g_return_val_if_fail (sha1 != NULL, FALSE);
+
+  if (!sha1_is_valid (sha1))
+    return FALSE;
+
+  loaded = loaded_avatar_new (store, sha1);
+  loaded_avatar_read (loaded);
+  ret = loaded_avatar_finish (store, loaded, avatar, mime_type);
+  loaded_avatar_free (loaded);
+  return ret;
+}
+
+static void
+lookup_thread (GSimpleAsyncResult *result,
+    GObject *source G_GNUC_UNUSED,
+    GCancellable *cancellable G_GNUC_UNUSED)
+{
+  loaded_avatar_read (g_simple_async_result_get_op_res_gpointer (result));
+}
+
+/**
+ * gabble_avatar_store_lookup_async:
+ * @store: an avatar store, which must not be freed until @callback has been
+ *  called
+ * @sha1: the hash of the avatar wanted
+ * @callback: called in the current thread-default main context once the
+ *  avatar has been read
+ * @user_data: data for @callback
+ *
+ * Like gabble_avatar_store_lookup(), but reads and checks the file on a
+ * worker thread. The result has no source object.
+ */
+void
+gabble_avatar_store_lookup_async (GabbleAvatarStore *store,
+    const gchar *sha1,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *result;
+
+  g_return_if_fail (store != NULL);
+  g_return_if_fail (sha1 != NULL);
+
+  result = g_simple_async_result_new (NULL, callback, user_data,
+      gabble_avatar_store_lookup_async);
+  g_simple_async_result_set_op_res_gpointer (result,
+      loaded_avatar_new (store, sha1), loaded_avatar_free);
+
+  /* Not a name we'd have saved a file under, so there's nothing to read */
+  if (!sha1_is_valid (sha1))
+    g_simple_async_result_complete_in_idle (result);
+  else
+    g_simple_async_result_run_in_thread (result, lookup_thread,
+        G_PRIORITY_DEFAULT, NULL);
+
+  g_object_unref (result);
+}
+
+/**
+ * gabble_avatar_store_lookup_finish:
+ * @store: the store passed to gabble_avatar_store_lookup_async()
+ * @result: the result passed to its callback
+ * @avatar: as for gabble_avatar_store_lookup()
+ * @mime_type: as for gabble_avatar_store_lookup()
+ *
+ * Returns: %TRUE if the avatar was in @store
+ */
+gboolean
+gabble_avatar_store_lookup_finish (GabbleAvatarStore *store,
+    GAsyncResult *result,
+    GBytes **avatar,
+    gchar **mime_type)
+{
+  GSimpleAsyncResult *simple = (GSimpleAsyncResult *) result;
+
+  g_return_val_if_fail (store != NULL, FALSE);
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
+      gabble_avatar_store_lookup_async), FALSE);
+
+  return loaded_avatar_finish (store,
+      g_simple_async_result_get_op_res_gpointer (simple), avatar, mime_type);
+}
@@ -0,0 +1,53 @@
+/*
+ * avatar-store.h - Header for an on-disk store of avatars keyed by SHA-1
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_AVATAR_STORE_H__
+#define __GABBLE_AVATAR_STORE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleAvatarStore GabbleAvatarStore;
+
+GabbleAvatarStore *gabble_avatar_store_new (const gchar *path,
+    guint max_entries);
+void gabble_avatar_store_free (GabbleAvatarStore *store);
+
+gboolean gabble_avatar_store_add (GabbleAvatarStore *store,
+    const gchar *sha1,
+    const gchar *data,
+    gsize len,
+    const gchar *mime_type);
+gboolean gabble_avatar_store_lookup (GabbleAvatarStore *store,
+    const gchar *sha1,
+    GBytes **avatar,
+    gchar **mime_type);
+void gabble_avatar_store_lookup_async (GabbleAvatarStore *store,
+    const gchar *sha1,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+gboolean gabble_avatar_store_lookup_finish (GabbleAvatarStore *store,
+    GAsyncResult *result,
+    GBytes **avatar,
+    gchar **mime_type);
+
+G_END_DECLS
+
+#endif /* __GABBLE_AVATAR_STORE_H__ */
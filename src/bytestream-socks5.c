@@ -187,7 +187,7 @@ struct _GabbleBytestreamSocks5Private
   gboolean write_blocked;
   gboolean read_blocked;
   GibberListener *listener;
-  guint timer_id;
+  GabbleTimer *timer;
 
   GString *read_buffer;
 
@@ -221,11 +221,11 @@ stop_timer (GabbleBytestreamSocks5 *self)
   GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
       self);
 
-  if (priv->timer_id == 0)
+  if (priv->timer == NULL)
     return;
 
-  g_source_remove (priv->timer_id);
-  priv->timer_id = 0;
+  gabble_timer_wheel_cancel (priv->timer);
+  priv->timer = NULL;
 }
 
 static void
@@ -704,15 +704,17 @@ check_domain (const gchar *domain,
   return TRUE;
 }
 
-static gboolean
+static void
 socks5_timer_cb (gpointer data)
 {
   GabbleBytestreamSocks5 *self = GABBLE_BYTESTREAM_SOCKS5 (data);
+  GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
+      self);
 
   DEBUG ("Timed out; closing SOCKS5 connection");
 
+  priv->timer = NULL;
   socks5_error (self);
-  return FALSE;
 }
 
 static void
@@ -722,9 +724,10 @@ start_timer (GabbleBytestreamSocks5 *self,
   GabbleBytestreamSocks5Private *priv = GABBLE_BYTESTREAM_SOCKS5_GET_PRIVATE (
       self);
 
-  g_assert (priv->timer_id == 0);
+  g_assert (priv->timer == NULL);
 
-  priv->timer_id = g_timeout_add_seconds (seconds, socks5_timer_cb, self);
+  priv->timer = gabble_timer_wheel_add_seconds (priv->conn->timer_wheel,
+      seconds, socks5_timer_cb, self);
 }
 
 static void
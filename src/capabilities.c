@@ -57,6 +57,7 @@ static const Feature self_advertised_features[] =
   { FEATURE_FIXED, NS_CHAT_STATES },
   { FEATURE_FIXED, NS_NICK },
   { FEATURE_FIXED, NS_NICK "+notify" },
+  { FEATURE_FIXED, NS_AVATAR_METADATA "+notify" },
   { FEATURE_FIXED, NS_SI },
   { FEATURE_FIXED, NS_IBB },
   { FEATURE_FIXED, NS_TUBES },
@@ -260,6 +261,11 @@ gabble_capabilities_init (gpointer conn)
       feature_handles = tp_dynamic_handle_repo_new (TP_HANDLE_TYPE_CONTACT,
           NULL, NULL);
 
+      /* Register the features we know about before any contact's, so they get
+       * the low handles which GabbleCapabilitySet stores most compactly */
+      tp_handle_ensure (feature_handles, QUIRK_OMITS_CONTENT_CREATORS, NULL,
+          NULL);
+
       /* make the pre-cooked bundles */
 
       legacy_caps = gabble_capability_set_new ();
@@ -377,20 +383,200 @@ gabble_capabilities_finalize (gpointer conn)
     }
 }
 
+/* feature_handles never forgets a handle, so they are small, dense integers,
+ * and the features we know about are registered first (in
+ * gabble_capabilities_init()) so that they come lowest of all. Rather than a
+ * TpHandleSet, a capability set is a bitmap of the first CAPS_INLINE_BITS
+ * handles, so the set operations which run for every presence and every caps
+ * query are a few word-wide ANDs and ORs; only the rare handles beyond that,
+ * for namespaces hardly anyone uses, overflow into a TpIntset. */
+#define CAPS_WORD_BITS 64
+#define CAPS_INLINE_WORDS 4
+#define CAPS_INLINE_BITS (CAPS_WORD_BITS * CAPS_INLINE_WORDS)
+
+#define CAPS_WORD(handle) ((handle) / CAPS_WORD_BITS)
+#define CAPS_MASK(handle) \
+  (G_GUINT64_CONSTANT (1) << ((handle) % CAPS_WORD_BITS))
+
 struct _GabbleCapabilitySet {
-    TpHandleSet *handles;
+    guint64 bits[CAPS_INLINE_WORDS];
+    /* handles >= CAPS_INLINE_BITS, or NULL if there are none */
+    TpIntset *overflow;
+
+    guint refcount;
+    /* if TRUE, the set may be shared, and must not be changed */
+    gboolean frozen;
 };
 
+static guint
+word_count_bits (guint64 word)
+{
+#ifdef __GNUC__
+  return __builtin_popcountll (word);
+#else
+  guint n;
+
+  for (n = 0; word != 0; n++)
+    word &= word - 1;
+
+  return n;
+#endif
+}
+
+static guint
+word_lowest_bit (guint64 word)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll (word);
+#else
+  guint n;
+
+  for (n = 0; (word & 1) == 0; n++)
+    word >>= 1;
+
+  return n;
+#endif
+}
+
+/* Keeps caps->overflow NULL whenever it's empty, so that sets can be compared
+ * without looking inside it */
+static void
+overflow_tidy (GabbleCapabilitySet *caps)
+{
+  if (caps->overflow != NULL && tp_intset_is_empty (caps->overflow))
+    tp_clear_pointer (&caps->overflow, tp_intset_destroy);
+}
+
+static gboolean
+caps_has_handle (const GabbleCapabilitySet *caps,
+    TpHandle handle)
+{
+  if (handle < CAPS_INLINE_BITS)
+    return (caps->bits[CAPS_WORD (handle)] & CAPS_MASK (handle)) != 0;
+
+  return caps->overflow != NULL && tp_intset_is_member (caps->overflow,
+      handle);
+}
+
+static void
+caps_add_handle (GabbleCapabilitySet *caps,
+    TpHandle handle)
+{
+  if (handle < CAPS_INLINE_BITS)
+    {
+      caps->bits[CAPS_WORD (handle)] |= CAPS_MASK (handle);
+      return;
+    }
+
+  if (caps->overflow == NULL)
+    caps->overflow = tp_intset_new ();
+
+  tp_intset_add (caps->overflow, handle);
+}
+
+static gboolean
+caps_remove_handle (GabbleCapabilitySet *caps,
+    TpHandle handle)
+{
+  gboolean ret;
+
+  if (handle < CAPS_INLINE_BITS)
+    {
+      ret = (caps->bits[CAPS_WORD (handle)] & CAPS_MASK (handle)) != 0;
+      caps->bits[CAPS_WORD (handle)] &= ~CAPS_MASK (handle);
+      return ret;
+    }
+
+  if (caps->overflow == NULL)
+    return FALSE;
+
+  ret = tp_intset_remove (caps->overflow, handle);
+  overflow_tidy (caps);
+  return ret;
+}
+
+/* Returns: a new TpIntset containing every handle in @caps */
+static TpIntset *
+caps_to_intset (const GabbleCapabilitySet *caps)
+{
+  TpIntset *ret;
+  guint i;
+
+  if (caps->overflow != NULL)
+    ret = tp_intset_copy (caps->overflow);
+  else
+    ret = tp_intset_new ();
+
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
+    {
+      guint64 word = caps->bits[i];
+
+      while (word != 0)
+        {
+          tp_intset_add (ret, i * CAPS_WORD_BITS + word_lowest_bit (word));
+          word &= word - 1;
+        }
+    }
+
+  return ret;
+}
+
 GabbleCapabilitySet *
 gabble_capability_set_new (void)
 {
-  GabbleCapabilitySet *ret = g_slice_new0 (GabbleCapabilitySet);
+  GabbleCapabilitySet *ret;
 
   g_assert (feature_handles != NULL);
-  ret->handles = tp_handle_set_new (feature_handles);
+
+  ret = g_slice_new0 (GabbleCapabilitySet);
+  ret->refcount = 1;
   return ret;
 }
 
+/**
+ * gabble_capability_set_freeze:
+ * @caps: a capability set
+ *
+ * Marks @caps as immutable, so that it can be shared: the presence cache
+ * keeps one frozen set per verified caps node, which every resource using
+ * that node points to.
+ *
+ * Returns: @caps
+ */
+GabbleCapabilitySet *
+gabble_capability_set_freeze (GabbleCapabilitySet *caps)
+{
+  g_return_val_if_fail (caps != NULL, NULL);
+
+  caps->frozen = TRUE;
+  return caps;
+}
+
+gboolean
+gabble_capability_set_is_frozen (const GabbleCapabilitySet *caps)
+{
+  g_return_val_if_fail (caps != NULL, FALSE);
+
+  return caps->frozen;
+}
+
+/**
+ * gabble_capability_set_ref:
+ * @caps: a frozen capability set
+ *
+ * Returns: a new reference to @caps, to be released with
+ *  gabble_capability_set_free()
+ */
+GabbleCapabilitySet *
+gabble_capability_set_ref (GabbleCapabilitySet *caps)
+{
+  g_return_val_if_fail (caps != NULL, NULL);
+  g_return_val_if_fail (caps->frozen, NULL);
+
+  caps->refcount++;
+  return caps;
+}
+
 GabbleCapabilitySet *
 gabble_capability_set_new_from_stanza (WockyNode *query_result)
 {
@@ -453,71 +639,96 @@ void
 gabble_capability_set_update (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
-  TpIntset *ret;
+  guint i;
+
   g_return_if_fail (target != NULL);
+  g_return_if_fail (!target->frozen);
   g_return_if_fail (source != NULL);
 
-  ret = tp_handle_set_update (target->handles,
-    tp_handle_set_peek (source->handles));
-
-  tp_intset_destroy (ret);
-}
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
+    target->bits[i] |= source->bits[i];
 
-typedef struct {
-    GSList *deleted;
-    TpHandleSet *intersect_with;
-} IntersectHelper;
-
-static void
-intersect_helper (TpHandleSet *unused G_GNUC_UNUSED,
-    TpHandle handle,
-    gpointer p)
-{
-  IntersectHelper *data = p;
-
-  if (!tp_handle_set_is_member (data->intersect_with, handle))
-    data->deleted = g_slist_prepend (data->deleted, GUINT_TO_POINTER (handle));
+  if (source->overflow != NULL)
+    {
+      if (target->overflow == NULL)
+        target->overflow = tp_intset_copy (source->overflow);
+      else
+        tp_intset_union_update (target->overflow, source->overflow);
+    }
 }
 
 void
 gabble_capability_set_intersect (GabbleCapabilitySet *target,
     const GabbleCapabilitySet *source)
 {
-  IntersectHelper data = { NULL, NULL };
+  guint i;
 
   g_return_if_fail (target != NULL);
+  g_return_if_fail (!target->frozen);
   g_return_if_fail (source != NULL);
 
   if (target == source)
     return;
 
-  data.intersect_with = source->handles;
+  if (DEBUGGING)
+    {
+      GabbleCapabilitySet dropped = { { 0 }, NULL };
+      gchar *dump;
 
-  tp_handle_set_foreach (target->handles, intersect_helper, &data);
+      for (i = 0; i < CAPS_INLINE_WORDS; i++)
+        dropped.bits[i] = target->bits[i] & ~source->bits[i];
 
-  while (data.deleted != NULL)
-    {
-      DEBUG ("dropping %s", tp_handle_inspect (feature_handles,
-            GPOINTER_TO_UINT (data.deleted->data)));
-      tp_handle_set_remove (target->handles,
-          GPOINTER_TO_UINT (data.deleted->data));
-      data.deleted = g_slist_delete_link (data.deleted, data.deleted);
+      if (target->overflow != NULL)
+        {
+          if (source->overflow != NULL)
+            dropped.overflow = tp_intset_difference (target->overflow,
+                source->overflow);
+          else
+            dropped.overflow = tp_intset_copy (target->overflow);
+        }
+
+      overflow_tidy (&dropped);
+
+      if (gabble_capability_set_size (&dropped) > 0)
+        {
+          dump = gabble_capability_set_dump (&dropped, "  ");
+          DEBUG ("dropping:\n%s", dump);
+          g_free (dump);
+        }
+
+      tp_clear_pointer (&dropped.overflow, tp_intset_destroy);
     }
-}
 
-static void
-remove_from_set (TpHandleSet *unused G_GNUC_UNUSED,
-    TpHandle handle,
-    gpointer handles)
-{
-  tp_handle_set_remove (handles, handle);
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
+    target->bits[i] &= source->bits[i];
+
+  if (target->overflow != NULL)
+    {
+      if (source->overflow != NULL)
+        {
+          TpIntset *both = tp_intset_intersection (target->overflow,
+              source->overflow);
+
+          tp_intset_destroy (target->overflow);
+          target->overflow = both;
+        }
+      else
+        {
+          tp_clear_pointer (&target->overflow, tp_intset_destroy);
+        }
+
+      overflow_tidy (target);
+    }
 }
 
 void
 gabble_capability_set_exclude (GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *removed)
 {
+  guint i;
+
   g_return_if_fail (caps != NULL);
+  g_return_if_fail (!caps->frozen);
   g_return_if_fail (removed != NULL);
 
   if (caps == removed)
@@ -526,7 +737,14 @@ gabble_capability_set_exclude (GabbleCapabilitySet *caps,
       return;
     }
 
-  tp_handle_set_foreach (removed->handles, remove_from_set, caps->handles);
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
+    caps->bits[i] &= ~removed->bits[i];
+
+  if (caps->overflow != NULL && removed->overflow != NULL)
+    {
+      tp_intset_difference_update (caps->overflow, removed->overflow);
+      overflow_tidy (caps);
+    }
 }
 
 void
@@ -536,10 +754,11 @@ gabble_capability_set_add (GabbleCapabilitySet *caps,
   TpHandle handle;
 
   g_return_if_fail (caps != NULL);
+  g_return_if_fail (!caps->frozen);
   g_return_if_fail (cap != NULL);
 
   handle = tp_handle_ensure (feature_handles, cap, NULL, NULL);
-  tp_handle_set_add (caps->handles, handle);
+  caps_add_handle (caps, handle);
 }
 
 gboolean
@@ -549,6 +768,7 @@ gabble_capability_set_remove (GabbleCapabilitySet *caps,
   TpHandle handle;
 
   g_return_val_if_fail (caps != NULL, FALSE);
+  g_return_val_if_fail (!caps->frozen, FALSE);
   g_return_val_if_fail (cap != NULL, FALSE);
 
   handle = tp_handle_lookup (feature_handles, cap, NULL, NULL);
@@ -556,33 +776,46 @@ gabble_capability_set_remove (GabbleCapabilitySet *caps,
   if (handle == 0)
     return FALSE;
 
-  return tp_handle_set_remove (caps->handles, handle);
+  return caps_remove_handle (caps, handle);
 }
 
 void
 gabble_capability_set_clear (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
+  g_return_if_fail (!caps->frozen);
 
-  /* There is no tp_handle_set_clear, so do the next best thing */
-  tp_handle_set_destroy (caps->handles);
-  caps->handles = tp_handle_set_new (feature_handles);
+  memset (caps->bits, 0, sizeof (caps->bits));
+  tp_clear_pointer (&caps->overflow, tp_intset_destroy);
 }
 
 void
 gabble_capability_set_free (GabbleCapabilitySet *caps)
 {
   g_return_if_fail (caps != NULL);
+  g_return_if_fail (caps->refcount > 0);
+
+  if (--caps->refcount > 0)
+    return;
 
-  tp_handle_set_destroy (caps->handles);
+  tp_clear_pointer (&caps->overflow, tp_intset_destroy);
   g_slice_free (GabbleCapabilitySet, caps);
 }
 
 gint
 gabble_capability_set_size (const GabbleCapabilitySet *caps)
 {
+  guint i, n = 0;
+
   g_return_val_if_fail (caps != NULL, 0);
-  return tp_handle_set_size (caps->handles);
+
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
+    n += word_count_bits (caps->bits[i]);
+
+  if (caps->overflow != NULL)
+    n += tp_intset_size (caps->overflow);
+
+  return n;
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -603,7 +836,7 @@ gabble_capability_set_has (const GabbleCapabilitySet *caps,
       return FALSE;
     }
 
-  return tp_handle_set_is_member (caps->handles, handle);
+  return caps_has_handle (caps, handle);
 }
 
 /* By design, this function can be used as a GabbleCapabilitySetPredicate */
@@ -613,15 +846,25 @@ gabble_capability_set_has_one (const GabbleCapabilitySet *caps,
 {
   TpIntsetFastIter iter;
   guint element;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (alternatives != NULL, FALSE);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (alternatives->handles));
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
+    {
+      if ((caps->bits[i] & alternatives->bits[i]) != 0)
+        return TRUE;
+    }
+
+  if (caps->overflow == NULL || alternatives->overflow == NULL)
+    return FALSE;
+
+  tp_intset_fast_iter_init (&iter, alternatives->overflow);
 
   while (tp_intset_fast_iter_next (&iter, &element))
     {
-      if (tp_handle_set_is_member (caps->handles, element))
+      if (tp_intset_is_member (caps->overflow, element))
         {
           return TRUE;
         }
@@ -635,23 +878,22 @@ gboolean
 gabble_capability_set_at_least (const GabbleCapabilitySet *caps,
     const GabbleCapabilitySet *query)
 {
-  TpIntsetFastIter iter;
-  guint element;
+  guint i;
 
   g_return_val_if_fail (caps != NULL, FALSE);
   g_return_val_if_fail (query != NULL, FALSE);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (query->handles));
-
-  while (tp_intset_fast_iter_next (&iter, &element))
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
     {
-      if (!tp_handle_set_is_member (caps->handles, element))
-        {
-          return FALSE;
-        }
+      if ((query->bits[i] & ~caps->bits[i]) != 0)
+        return FALSE;
     }
 
-  return TRUE;
+  if (query->overflow == NULL)
+    return TRUE;
+
+  return caps->overflow != NULL &&
+      tp_intset_is_subset (query->overflow, caps->overflow);
 }
 
 gboolean
@@ -661,8 +903,30 @@ gabble_capability_set_equals (const GabbleCapabilitySet *a,
   g_return_val_if_fail (a != NULL, FALSE);
   g_return_val_if_fail (b != NULL, FALSE);
 
-  return tp_intset_is_equal (tp_handle_set_peek (a->handles),
-      tp_handle_set_peek (b->handles));
+  /* in particular, when both are the same interned set */
+  if (a == b)
+    return TRUE;
+
+  if (memcmp (a->bits, b->bits, sizeof (a->bits)) != 0)
+    return FALSE;
+
+  if (a->overflow == NULL || b->overflow == NULL)
+    return a->overflow == b->overflow;
+
+  return tp_intset_is_equal (a->overflow, b->overflow);
+}
+
+static void
+foreach_handle (TpHandle handle,
+    GFunc func,
+    gpointer user_data)
+{
+  const gchar *var = tp_handle_inspect (feature_handles, handle);
+
+  g_return_if_fail (var != NULL);
+
+  if (var[0] != QUIRK_PREFIX_CHAR)
+    func ((gchar *) var, user_data);
 }
 
 /* Does not iterate over quirks, only real features. */
@@ -672,21 +936,30 @@ gabble_capability_set_foreach (const GabbleCapabilitySet *caps,
 {
   TpIntsetFastIter iter;
   guint element;
+  guint i;
 
   g_return_if_fail (caps != NULL);
   g_return_if_fail (func != NULL);
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (caps->handles));
-
-  while (tp_intset_fast_iter_next (&iter, &element))
+  for (i = 0; i < CAPS_INLINE_WORDS; i++)
     {
-      const gchar *var = tp_handle_inspect (feature_handles, element);
-
-      g_return_if_fail (var != NULL);
+      guint64 word = caps->bits[i];
 
-      if (var[0] != QUIRK_PREFIX_CHAR)
-        func ((gchar *) var, user_data);
+      while (word != 0)
+        {
+          foreach_handle (i * CAPS_WORD_BITS + word_lowest_bit (word), func,
+              user_data);
+          word &= word - 1;
+        }
     }
+
+  if (caps->overflow == NULL)
+    return;
+
+  tp_intset_fast_iter_init (&iter, caps->overflow);
+
+  while (tp_intset_fast_iter_next (&iter, &element))
+    foreach_handle (element, func, user_data);
 }
 
 static void
@@ -721,15 +994,18 @@ gabble_capability_set_dump (const GabbleCapabilitySet *caps,
     const gchar *indent)
 {
   GString *ret;
+  TpIntset *ints;
 
   g_return_val_if_fail (caps != NULL, NULL);
 
   if (indent == NULL)
     indent = "";
 
+  ints = caps_to_intset (caps);
   ret = g_string_new (indent);
   g_string_append (ret, "--begin--\n");
-  append_intset (ret, tp_handle_set_peek (caps->handles), indent);
+  append_intset (ret, ints, indent);
+  tp_intset_destroy (ints);
   g_string_append (ret, indent);
   g_string_append (ret, "--end--\n");
   return g_string_free (ret, FALSE);
@@ -746,12 +1022,12 @@ gabble_capability_set_dump_diff (const GabbleCapabilitySet *old_caps,
   g_return_val_if_fail (old_caps != NULL, NULL);
   g_return_val_if_fail (new_caps != NULL, NULL);
 
-  old_ints = tp_handle_set_peek (old_caps->handles);
-  new_ints = tp_handle_set_peek (new_caps->handles);
-
-  if (tp_intset_is_equal (old_ints, new_ints))
+  if (gabble_capability_set_equals (old_caps, new_caps))
     return g_strdup_printf ("%s--no change--", indent);
 
+  old_ints = caps_to_intset (old_caps);
+  new_ints = caps_to_intset (new_caps);
+
   rem = tp_intset_difference (old_ints, new_ints);
   add = tp_intset_difference (new_ints, old_ints);
 
@@ -776,6 +1052,8 @@ gabble_capability_set_dump_diff (const GabbleCapabilitySet *old_caps,
 
   tp_intset_destroy (add);
   tp_intset_destroy (rem);
+  tp_intset_destroy (old_ints);
+  tp_intset_destroy (new_ints);
 
   return g_string_free (ret, FALSE);
 }
@@ -117,3 +117,99 @@ gabble_caps_hash_compute (const GabbleCapabilitySet *cap_set,
 {
   return gabble_caps_hash_compute_full (cap_set, identities, NULL);
 }
+
+/* Hashing a disco reply means parsing its data forms and sorting all its
+ * contents, and during login there can be hundreds of replies to check. So
+ * they are hashed on a worker thread. There is only one, so replies are
+ * hashed, and their results delivered to the main loop, in the order they
+ * were submitted. */
+static GThreadPool *hash_pool = NULL;
+
+typedef struct {
+    GSimpleAsyncResult *result;
+    WockyNodeTree *reply;
+    GCancellable *cancellable;
+} HashJob;
+
+static void
+hash_job_run (gpointer data,
+    gpointer pool_data)
+{
+  HashJob *job = data;
+
+  /* Don't bother if nobody wants the answer any more; the result reports
+   * the cancellation when it's finished */
+  if (!g_cancellable_is_cancelled (job->cancellable))
+    {
+      gchar *hash = wocky_caps_hash_compute_from_node (
+          wocky_node_tree_get_top_node (job->reply));
+
+      g_simple_async_result_set_op_res_gpointer (job->result, hash, g_free);
+    }
+
+  g_simple_async_result_complete_in_idle (job->result);
+
+  g_object_unref (job->result);
+  g_object_unref (job->reply);
+  g_clear_object (&job->cancellable);
+  g_slice_free (HashJob, job);
+}
+
+/**
+ * caps_hash_compute_from_reply_async:
+ * @reply: a disco#info reply, which must not be changed until @callback is
+ *  called
+ * @cancellable: (allow-none): if cancelled, @callback is still called, but
+ *  the result is a %G_IO_ERROR_CANCELLED error, however far the hashing had
+ *  got
+ * @callback: called in the current thread-default main context once the
+ *  hash is known
+ * @user_data: data for @callback
+ *
+ * Like wocky_caps_hash_compute_from_node(), but on a worker thread. There is
+ * no source object, so whatever @user_data refers to should be guarded by
+ * @cancellable rather than kept alive until the hashing is done.
+ */
+void
+caps_hash_compute_from_reply_async (WockyNodeTree *reply,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  HashJob *job = g_slice_new0 (HashJob);
+
+  if (hash_pool == NULL)
+    hash_pool = g_thread_pool_new (hash_job_run, NULL, 1, FALSE, NULL);
+
+  job->result = g_simple_async_result_new (NULL, callback, user_data,
+      caps_hash_compute_from_reply_async);
+  g_simple_async_result_set_check_cancellable (job->result, cancellable);
+  job->reply = g_object_ref (reply);
+
+  if (cancellable != NULL)
+    job->cancellable = g_object_ref (cancellable);
+
+  g_thread_pool_push (hash_pool, job, NULL);
+}
+
+/**
+ * caps_hash_compute_from_reply_finish:
+ *
+ * Returns: the hash, or %NULL if the reply could not be hashed, or if the
+ *  operation was cancelled (in which case @error is set). The caller must
+ *  free it with g_free().
+ */
+gchar *
+caps_hash_compute_from_reply_finish (GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = (GSimpleAsyncResult *) result;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
+      caps_hash_compute_from_reply_async), NULL);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  return g_strdup (g_simple_async_result_get_op_res_gpointer (simple));
+}
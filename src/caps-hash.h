@@ -27,4 +27,11 @@
 gchar *caps_hash_compute_from_self_presence (
     GabbleConnection *self);
 
+void caps_hash_compute_from_reply_async (WockyNodeTree *reply,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+gchar *caps_hash_compute_from_reply_finish (GAsyncResult *result,
+    GError **error);
+
 #endif /* __CAPS_HASH_H__ */
@@ -301,9 +301,10 @@ aliases_request_pep_cb (GabbleConnection *self,
   else
     {
       /* not in PEP and we have no vCard - chain to looking up their vCard */
-      GabbleVCardManagerRequest *vcard_request = gabble_vcard_manager_request
-          (self->vcard_manager, handle, 0, aliases_request_vcard_cb,
-           aliases_request, G_OBJECT (self));
+      GabbleVCardManagerRequest *vcard_request =
+          gabble_vcard_manager_request_full (self->vcard_manager, handle, 0,
+              GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+              aliases_request_vcard_cb, aliases_request, G_OBJECT (self));
 
       g_free (alias);
       aliases_request->vcard_requests[index] = vcard_request;
@@ -341,6 +342,7 @@ static GabbleRequestPipelineItem *
 gabble_do_pep_request (GabbleConnection *self,
                        TpHandle handle,
                        TpHandleRepoIface *contact_handles,
+                       GabbleRequestPipelinePriority priority,
                        GabbleRequestPipelineCb callback,
                        gpointer user_data)
 {
@@ -372,8 +374,8 @@ gabble_do_pep_request (GabbleConnection *self,
         ')',
       ')',
       NULL);
-   pep_request = gabble_request_pipeline_enqueue (self->req_pipeline,
-      msg, 0, pep_request_cb, ctx);
+   pep_request = gabble_request_pipeline_enqueue_full (self->req_pipeline,
+      msg, 0, priority, pep_request_cb, ctx);
    g_object_unref (msg);
 
    return pep_request;
@@ -448,7 +450,9 @@ gabble_connection_request_aliases (TpSvcConnectionInterfaceAliasing *iface,
 
           request->pending_pep_requests++;
           request->pep_requests[i] = gabble_do_pep_request (self,
-              handle, contact_handles, aliases_request_pep_cb, data);
+              handle, contact_handles,
+              GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+              aliases_request_pep_cb, data);
 
         }
       else
@@ -457,8 +461,10 @@ gabble_connection_request_aliases (TpSvcConnectionInterfaceAliasing *iface,
               tp_handle_inspect (contact_handles, handle));
 
           g_free (alias);
-          vcard_request = gabble_vcard_manager_request (self->vcard_manager,
-              handle, 0, aliases_request_vcard_cb, request, G_OBJECT (self));
+          vcard_request = gabble_vcard_manager_request_full (
+              self->vcard_manager, handle, 0,
+              GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+              aliases_request_vcard_cb, request, G_OBJECT (self));
 
           request->vcard_requests[i] = vcard_request;
           request->pending_vcard_requests++;
@@ -1080,6 +1086,7 @@ maybe_request_vcard (GabbleConnection *self, TpHandle handle,
             tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
 
           gabble_do_pep_request (self, handle, contact_handles,
+            GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
             aliases_request_basic_pep_cb, GUINT_TO_POINTER (handle));
         }
       else
@@ -30,6 +30,7 @@
 #include "presence.h"
 #include "presence-cache.h"
 #include "conn-presence.h"
+#include "conn-util.h"
 #include "namespaces.h"
 #include "vcard-manager.h"
 #include "util.h"
@@ -38,6 +39,29 @@
 
 #include "debug.h"
 
+typedef struct _RequestAvatarsContext RequestAvatarsContext;
+
+static gboolean pep_avatar_request (GabbleConnection *conn, TpHandle handle,
+    DBusGMethodInvocation *context, RequestAvatarsContext *avatars_ctx);
+static gboolean stored_avatar_request (GabbleConnection *conn,
+    TpHandle handle, DBusGMethodInvocation *context,
+    RequestAvatarsContext *avatars_ctx);
+
+/* What a contact last published about their avatar with XEP-0084 */
+typedef struct {
+    /* the SHA-1 of the image, or "" if they have none */
+    gchar *id;
+    gchar *mime_type;
+} PepAvatar;
+
+static void
+pep_avatar_free (PepAvatar *pep_avatar)
+{
+  g_free (pep_avatar->id);
+  g_free (pep_avatar->mime_type);
+  g_slice_free (PepAvatar, pep_avatar);
+}
+
 /* If the SHA1 has changed, this function will copy it to self_presence,
  * emit a signal and push it to the server. */
 static gboolean
@@ -88,6 +112,11 @@ connection_avatar_update_cb (GabblePresenceCache *cache,
 
   if (handle == tp_base_connection_get_self_handle (base))
     update_own_avatar_sha1 (conn, sha1, NULL);
+  /* The vCard is only a fallback for contacts who don't use XEP-0084 */
+  else if (g_hash_table_lookup (conn->pep_avatars, GUINT_TO_POINTER (handle))
+      != NULL)
+    DEBUG ("ignoring vCard avatar hash '%s' for %u, who has published "
+        "avatar metadata", sha1, handle);
   else
     tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
         handle, sha1);
@@ -176,6 +205,38 @@ _got_self_avatar_for_get_avatar_tokens (GObject *obj,
 }
 
 
+/* Returns the avatar token @handle has told us about, "" if they have no
+ * avatar, or NULL if we don't know. Once a contact has published avatar
+ * metadata with XEP-0084, that is their avatar; the hash in their presence
+ * (XEP-0153) is only used for contacts who haven't. */
+static const gchar *
+get_known_avatar_token (GabbleConnection *conn,
+    TpHandle handle)
+{
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  GabblePresence *presence;
+
+  if (handle == tp_base_connection_get_self_handle (base))
+    {
+      presence = conn->self_presence;
+    }
+  else
+    {
+      PepAvatar *pep_avatar = g_hash_table_lookup (conn->pep_avatars,
+          GUINT_TO_POINTER (handle));
+
+      if (pep_avatar != NULL)
+        return pep_avatar->id;
+
+      presence = gabble_presence_cache_get (conn->presence_cache, handle);
+    }
+
+  if (presence == NULL)
+    return NULL;
+
+  return presence->avatar_sha1;
+}
+
 /**
  * gabble_connection_get_avatar_tokens
  *
@@ -223,6 +284,7 @@ gabble_connection_get_avatar_tokens (TpSvcConnectionInterfaceAvatars *iface,
     {
       TpHandle handle;
       GabblePresence *presence = NULL;
+      const gchar *token = NULL;
 
       handle = g_array_index (contacts, TpHandle, i);
 
@@ -243,10 +305,11 @@ gabble_connection_get_avatar_tokens (TpSvcConnectionInterfaceAvatars *iface,
           presence = gabble_presence_cache_get (self->presence_cache, handle);
         }
 
-      if (NULL != presence && NULL != presence->avatar_sha1)
-          ret[i] = g_strdup (presence->avatar_sha1);
-      else
-          ret[i] = g_strdup ("");
+      if (NULL != presence ||
+          tp_base_connection_get_self_handle (base) != handle)
+        token = get_known_avatar_token (self, handle);
+
+      ret[i] = g_strdup (token != NULL ? token : "");
     }
 
   if (wait_for_self_avatar)
@@ -353,6 +416,7 @@ gabble_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *ifac
     {
       TpHandle handle;
       GabblePresence *presence = NULL;
+      const gchar *token = NULL;
 
       handle = g_array_index (contacts, TpHandle, i);
 
@@ -372,14 +436,14 @@ gabble_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *ifac
           presence = gabble_presence_cache_get (self->presence_cache, handle);
         }
 
-      if (NULL != presence)
-        {
-          if (NULL != presence->avatar_sha1)
-              g_hash_table_insert (ret, GUINT_TO_POINTER (handle),
-                  g_strdup (presence->avatar_sha1));
-          else
-              g_hash_table_insert (ret, GUINT_TO_POINTER (handle), g_strdup (""));
-        }
+      if (NULL != presence ||
+          tp_base_connection_get_self_handle (base) != handle)
+        token = get_known_avatar_token (self, handle);
+
+      if (NULL != token)
+        g_hash_table_insert (ret, GUINT_TO_POINTER (handle), g_strdup (token));
+      else if (NULL != presence)
+        g_hash_table_insert (ret, GUINT_TO_POINTER (handle), g_strdup (""));
     }
 
   if (wait_for_self_avatar)
@@ -408,15 +472,13 @@ gabble_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *ifac
 static gboolean
 parse_avatar (WockyNode *vcard,
               const gchar **mime_type,
-              GString **avatar,
+              GBytes **avatar,
               GError **error)
 {
   WockyNode *photo_node;
   WockyNode *type_node;
   WockyNode *binval_node;
   const gchar *binval_value;
-  guchar *st;
-  gsize outlen;
 
   photo_node = wocky_node_get_child (vcard, "PHOTO");
 
@@ -456,20 +518,46 @@ parse_avatar (WockyNode *vcard,
       return FALSE;
     }
 
-  st = g_base64_decode (binval_value, &outlen);
-  *avatar = g_string_new_len ((gchar *) st, outlen);
-  g_free (st);
-
-  if (NULL == *avatar)
-    {
-      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
-        "failed to decode avatar from base64");
-      return FALSE;
-    }
+  /* Decoded once, into the buffer which is eventually sent over D-Bus */
+  *avatar = gabble_base64_decode_bytes (binval_value);
 
   return TRUE;
 }
 
+/* Saves @avatar, if we're keeping avatars, and returns its hash */
+static gchar *
+avatar_hash_and_store (GabbleConnection *conn,
+    GBytes *avatar,
+    const gchar *mime_type)
+{
+  gsize len;
+  const gchar *data = g_bytes_get_data (avatar, &len);
+  gchar *sha1 = sha1_hex (data, len);
+
+  /* Whether or not it's the avatar the contact's presence claims, it's
+   * stored under its own hash, so it's safe to keep */
+  if (conn->avatar_store != NULL)
+    gabble_avatar_store_add (conn->avatar_store, sha1, data, len, mime_type);
+
+  return sha1;
+}
+
+/* Takes ownership of @avatar, whose data is sent without being copied if
+ * this is its last reference */
+static void
+return_avatar (DBusGMethodInvocation *context,
+    GBytes *avatar,
+    const gchar *mime_type)
+{
+  /* A GByteArray is a GArray of guint8 underneath, which is what dbus-glib
+   * wants for "ay" */
+  GByteArray *arr = g_bytes_unref_to_array (avatar);
+
+  tp_svc_connection_interface_avatars_return_from_request_avatar (
+      context, (GArray *) arr, mime_type);
+  g_byte_array_unref (arr);
+}
+
 static void
 _request_avatar_cb (GabbleVCardManager *self,
                     GabbleVCardManagerRequest *request,
@@ -482,10 +570,10 @@ _request_avatar_cb (GabbleVCardManager *self,
   GabbleConnection *conn;
   TpBaseConnection *base;
   const gchar *mime_type = NULL;
-  GArray *arr;
   GError *error = NULL;
-  GString *avatar = NULL;
+  GBytes *avatar = NULL;
   GabblePresence *presence;
+  gchar *sha1 = NULL;
 
   g_object_get (self, "connection", &conn, NULL);
   base = TP_BASE_CONNECTION (conn);
@@ -521,6 +609,8 @@ _request_avatar_cb (GabbleVCardManager *self,
       goto out;
     }
 
+  sha1 = avatar_hash_and_store (conn, avatar, mime_type);
+
   if (handle == tp_base_connection_get_self_handle (base))
     presence = conn->self_presence;
   else
@@ -528,10 +618,6 @@ _request_avatar_cb (GabbleVCardManager *self,
 
   if (presence != NULL)
     {
-      gchar *sha1;
-
-      sha1 = sha1_hex (avatar->str, avatar->len);
-
       if (tp_strdiff (presence->avatar_sha1, sha1))
         {
           /* the thinking here is that we have to return an error, because we
@@ -549,32 +635,29 @@ _request_avatar_cb (GabbleVCardManager *self,
           if (handle == tp_base_connection_get_self_handle (base))
             {
               update_own_avatar_sha1 (conn, sha1, NULL);
-              g_free (sha1);
             }
           else
             {
               g_free (presence->avatar_sha1);
               presence->avatar_sha1 = sha1; /* take ownership */
+              sha1 = NULL;
 
               tp_svc_connection_interface_avatars_emit_avatar_updated (
-                  conn, handle, sha1);
+                  conn, handle, presence->avatar_sha1);
             }
 
           goto out;
         }
-
-      g_free (sha1);
     }
 
-  arr = g_array_new (FALSE, FALSE, sizeof (gchar));
-  g_array_append_vals (arr, avatar->str, avatar->len);
-  tp_svc_connection_interface_avatars_return_from_request_avatar (
-      context, arr, mime_type);
-  g_array_unref (arr);
+  return_avatar (context, avatar, mime_type);
+  avatar = NULL;
 
 out:
   if (avatar != NULL)
-    g_string_free (avatar, TRUE);
+    g_bytes_unref (avatar);
+
+  g_free (sha1);
 
   g_object_unref (conn);
 }
@@ -589,6 +672,29 @@ out:
  * @context: The D-Bus invocation context to use to return values
  *           or throw an error.
  */
+/* Answers RequestAvatar from @contact's cached vCard, or failing that from
+ * the network */
+static void
+request_avatar_fetch (GabbleConnection *self,
+    TpHandle contact,
+    DBusGMethodInvocation *context)
+{
+  WockyNode *vcard_node;
+
+  if (gabble_vcard_manager_get_cached (self->vcard_manager,
+      contact, &vcard_node))
+    {
+      _request_avatar_cb (self->vcard_manager, NULL, contact, vcard_node, NULL,
+          context);
+    }
+  else if (!pep_avatar_request (self, contact, context, NULL))
+    {
+      gabble_vcard_manager_request_full (self->vcard_manager, contact, 0,
+          GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, _request_avatar_cb,
+          context, NULL);
+    }
+}
+
 static void
 gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
                                   guint contact,
@@ -599,7 +705,6 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
   TpHandleRepoIface *contact_handles = tp_base_connection_get_handles (base,
       TP_HANDLE_TYPE_CONTACT);
   GError *err = NULL;
-  WockyNode *vcard_node;
 
   TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
 
@@ -610,17 +715,23 @@ gabble_connection_request_avatar (TpSvcConnectionInterfaceAvatars *iface,
       return;
     }
 
-  if (gabble_vcard_manager_get_cached (self->vcard_manager,
-      contact, &vcard_node))
-    {
-      _request_avatar_cb (self->vcard_manager, NULL, contact, vcard_node, NULL,
-          context);
-    }
-  else
-    {
-      gabble_vcard_manager_request (self->vcard_manager, contact, 0,
-          _request_avatar_cb, context, NULL);
-    }
+  if (!stored_avatar_request (self, contact, context, NULL))
+    request_avatar_fetch (self, contact, context);
+}
+
+/* Takes ownership of @avatar, like return_avatar() */
+static void
+emit_avatar (TpSvcConnectionInterfaceAvatars *iface,
+    TpHandle contact,
+    const gchar *sha1,
+    GBytes *avatar,
+    const gchar *mime_type)
+{
+  GByteArray *arr = g_bytes_unref_to_array (avatar);
+
+  tp_svc_connection_interface_avatars_emit_avatar_retrieved (iface, contact,
+      sha1, (GArray *) arr, mime_type);
+  g_byte_array_unref (arr);
 }
 
 static void
@@ -628,30 +739,25 @@ emit_avatar_retrieved (TpSvcConnectionInterfaceAvatars *iface,
                        TpHandle contact,
                        WockyNode *vcard_node)
 {
+  GabbleConnection *conn = GABBLE_CONNECTION (iface);
   const gchar *mime_type;
-  GString *avatar_str;
+  GBytes *avatar;
   gchar *sha1;
-  GArray *arr;
 
-  if (!parse_avatar (vcard_node, &mime_type, &avatar_str, NULL))
+  if (!parse_avatar (vcard_node, &mime_type, &avatar, NULL))
     return;
 
-  sha1 = sha1_hex (avatar_str->str, avatar_str->len);
-  arr = g_array_new (FALSE, FALSE, sizeof (gchar));
-  g_array_append_vals (arr, avatar_str->str, avatar_str->len);
-  tp_svc_connection_interface_avatars_emit_avatar_retrieved (iface, contact,
-      sha1, arr, mime_type);
-  g_array_unref (arr);
+  sha1 = avatar_hash_and_store (conn, avatar, mime_type);
+  emit_avatar (iface, contact, sha1, avatar, mime_type);
   g_free (sha1);
-  g_string_free (avatar_str, TRUE);
 }
 
 /* All references are borrowed */
-typedef struct {
+struct _RequestAvatarsContext {
     TpHandle handle;
     GabbleConnection *conn;
     TpSvcConnectionInterfaceAvatars *iface;
-} RequestAvatarsContext;
+};
 
 static void
 request_avatars_cb (GabbleVCardManager *manager,
@@ -675,6 +781,312 @@ request_avatars_cb (GabbleVCardManager *manager,
   g_slice_free (RequestAvatarsContext, ctx);
 }
 
+/* A request for an avatar's data node. Exactly one of @context and
+ * @avatars_ctx is set, depending on whether it's for RequestAvatar or
+ * RequestAvatars. */
+typedef struct {
+    TpHandle handle;
+    gchar *id;
+    gchar *mime_type;
+    DBusGMethodInvocation *context;
+    RequestAvatarsContext *avatars_ctx;
+} PepAvatarRequest;
+
+static void
+pep_avatar_request_free (PepAvatarRequest *req)
+{
+  g_free (req->id);
+  g_free (req->mime_type);
+  g_slice_free (PepAvatarRequest, req);
+}
+
+/* Returns the avatar in a reply to a request for an XEP-0084 data node, if
+ * there is one */
+static GBytes *
+pep_avatar_extract_data (WockyStanza *reply)
+{
+  WockyNode *node = wocky_node_get_child_ns (
+      wocky_stanza_get_top_node (reply), "pubsub", NS_PUBSUB);
+
+  if (node != NULL)
+    node = wocky_node_get_child (node, "items");
+
+  if (node != NULL)
+    node = wocky_node_get_child (node, "item");
+
+  if (node != NULL)
+    node = wocky_node_get_child_ns (node, "data", NS_AVATAR_DATA);
+
+  if (node == NULL || node->content == NULL)
+    return NULL;
+
+  return gabble_base64_decode_bytes (node->content);
+}
+
+static void
+pep_avatar_data_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (source);
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  PepAvatarRequest *req = user_data;
+  WockyStanza *reply = NULL;
+  GBytes *avatar = NULL;
+  gchar *sha1 = NULL;
+  GError *error = NULL;
+
+  if (!conn_util_send_iq_finish (conn, result, &reply, &error))
+    {
+      DEBUG ("fetching avatar %s for %u failed: %s", req->id, req->handle,
+          error->message);
+    }
+  else
+    {
+      avatar = pep_avatar_extract_data (reply);
+
+      if (avatar != NULL)
+        {
+          sha1 = avatar_hash_and_store (conn, avatar, req->mime_type);
+
+          if (tp_strdiff (sha1, req->id))
+            {
+              DEBUG ("avatar data for %u has hash %s, not %s", req->handle,
+                  sha1, req->id);
+              g_bytes_unref (avatar);
+              avatar = NULL;
+            }
+        }
+    }
+
+  if (avatar != NULL && req->context != NULL)
+    {
+      return_avatar (req->context, avatar, req->mime_type);
+    }
+  else if (avatar != NULL)
+    {
+      g_hash_table_remove (conn->avatar_requests,
+          GUINT_TO_POINTER (req->handle));
+      emit_avatar (req->avatars_ctx->iface, req->handle, sha1, avatar,
+          req->mime_type);
+      g_slice_free (RequestAvatarsContext, req->avatars_ctx);
+    }
+  else if (tp_base_connection_get_status (base) !=
+      TP_CONNECTION_STATUS_CONNECTED)
+    {
+      if (req->context != NULL)
+        {
+          GError disconnected = { TP_ERROR, TP_ERROR_DISCONNECTED,
+              "connection is disconnected" };
+
+          dbus_g_method_return_error (req->context, &disconnected);
+        }
+      else
+        {
+          g_hash_table_remove (conn->avatar_requests,
+              GUINT_TO_POINTER (req->handle));
+          g_slice_free (RequestAvatarsContext, req->avatars_ctx);
+        }
+    }
+  else
+    {
+      DEBUG ("falling back to the vCard for %u's avatar", req->handle);
+
+      /* vCard-based avatars are still the norm, so contacts who publish
+       * with XEP-0084 will almost always have their avatar in their vCard
+       * too */
+      if (req->context != NULL)
+        gabble_vcard_manager_request_full (conn->vcard_manager, req->handle,
+            0, GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+            _request_avatar_cb, req->context, NULL);
+      else
+        gabble_vcard_manager_request (conn->vcard_manager, req->handle, 0,
+            request_avatars_cb, req->avatars_ctx, NULL);
+    }
+
+  g_clear_error (&error);
+  tp_clear_object (&reply);
+  g_free (sha1);
+  pep_avatar_request_free (req);
+}
+
+/* If @handle has published the avatar they're currently advertising with
+ * XEP-0084, fetches just its data node rather than their whole vCard, and
+ * returns TRUE. Otherwise, returns FALSE and the caller should look in
+ * their vCard. */
+static gboolean
+pep_avatar_request (GabbleConnection *conn,
+    TpHandle handle,
+    DBusGMethodInvocation *context,
+    RequestAvatarsContext *avatars_ctx)
+{
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) conn, TP_HANDLE_TYPE_CONTACT);
+  PepAvatar *pep_avatar = g_hash_table_lookup (conn->pep_avatars,
+      GUINT_TO_POINTER (handle));
+  PepAvatarRequest *req;
+  WockyStanza *msg;
+
+  if (pep_avatar == NULL || tp_str_empty (pep_avatar->id) ||
+      tp_strdiff (pep_avatar->id, get_known_avatar_token (conn, handle)))
+    return FALSE;
+
+  DEBUG ("fetching avatar %s for %u with XEP-0084", pep_avatar->id, handle);
+
+  req = g_slice_new0 (PepAvatarRequest);
+  req->handle = handle;
+  req->id = g_strdup (pep_avatar->id);
+  req->mime_type = g_strdup (pep_avatar->mime_type);
+  req->context = context;
+  req->avatars_ctx = avatars_ctx;
+
+  msg = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_GET,
+      NULL, tp_handle_inspect (contact_repo, handle),
+      '(', "pubsub", ':', NS_PUBSUB,
+        '(', "items",
+          '@', "node", NS_AVATAR_DATA,
+          '(', "item",
+            '@', "id", pep_avatar->id,
+          ')',
+        ')',
+      ')',
+      NULL);
+
+  conn_util_send_iq_async (conn, msg, NULL, pep_avatar_data_cb, req);
+  g_object_unref (msg);
+
+  return TRUE;
+}
+
+/* Signals ctx->handle's avatar from their cached vCard, or failing that
+ * fetches it from the network, for RequestAvatars */
+static void
+request_avatars_fetch (RequestAvatarsContext *ctx)
+{
+  GabbleConnection *self = ctx->conn;
+  WockyNode *vcard_node;
+
+  if (gabble_vcard_manager_get_cached (self->vcard_manager,
+        ctx->handle, &vcard_node))
+    {
+      g_hash_table_remove (self->avatar_requests,
+          GUINT_TO_POINTER (ctx->handle));
+      emit_avatar_retrieved (ctx->iface, ctx->handle, vcard_node);
+      g_slice_free (RequestAvatarsContext, ctx);
+    }
+  else if (!pep_avatar_request (self, ctx->handle, NULL, ctx))
+    {
+      gabble_vcard_manager_request (self->vcard_manager, ctx->handle, 0,
+          request_avatars_cb, ctx, NULL);
+    }
+}
+
+/* A read from the avatar store. Like PepAvatarRequest, exactly one of
+ * @context and @avatars_ctx is set. */
+typedef struct {
+    GabbleConnection *conn;
+    TpHandle handle;
+    gchar *sha1;
+    DBusGMethodInvocation *context;
+    RequestAvatarsContext *avatars_ctx;
+} StoredAvatarRequest;
+
+static void
+stored_avatar_cb (GObject *source G_GNUC_UNUSED,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  StoredAvatarRequest *req = user_data;
+  GabbleConnection *conn = req->conn;
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  GBytes *avatar;
+  gchar *mime_type;
+
+  if (gabble_avatar_store_lookup_finish (conn->avatar_store, result,
+        &avatar, &mime_type))
+    {
+      DEBUG ("answering from the avatar store for handle %u", req->handle);
+
+      if (req->context != NULL)
+        {
+          return_avatar (req->context, avatar, mime_type);
+        }
+      else
+        {
+          g_hash_table_remove (conn->avatar_requests,
+              GUINT_TO_POINTER (req->handle));
+          emit_avatar (req->avatars_ctx->iface, req->handle, req->sha1,
+              avatar, mime_type);
+          g_slice_free (RequestAvatarsContext, req->avatars_ctx);
+        }
+
+      g_free (mime_type);
+    }
+  else if (tp_base_connection_get_status (base) !=
+      TP_CONNECTION_STATUS_CONNECTED)
+    {
+      if (req->context != NULL)
+        {
+          GError disconnected = { TP_ERROR, TP_ERROR_DISCONNECTED,
+              "connection is disconnected" };
+
+          dbus_g_method_return_error (req->context, &disconnected);
+        }
+      else
+        {
+          g_hash_table_remove (conn->avatar_requests,
+              GUINT_TO_POINTER (req->handle));
+          g_slice_free (RequestAvatarsContext, req->avatars_ctx);
+        }
+    }
+  else if (req->context != NULL)
+    {
+      request_avatar_fetch (conn, req->handle, req->context);
+    }
+  else
+    {
+      request_avatars_fetch (req->avatars_ctx);
+    }
+
+  g_object_unref (conn);
+  g_free (req->sha1);
+  g_slice_free (StoredAvatarRequest, req);
+}
+
+/* If we're keeping avatars and @handle has told us which one they have,
+ * starts reading it from the store on a worker thread and returns TRUE; if
+ * it turns out not to be there, the request carries on as if this had
+ * returned FALSE, in which case the caller should look elsewhere. Exactly
+ * one of @context and @avatars_ctx should be set. */
+static gboolean
+stored_avatar_request (GabbleConnection *conn,
+    TpHandle handle,
+    DBusGMethodInvocation *context,
+    RequestAvatarsContext *avatars_ctx)
+{
+  const gchar *token;
+  StoredAvatarRequest *req;
+
+  if (conn->avatar_store == NULL)
+    return FALSE;
+
+  token = get_known_avatar_token (conn, handle);
+
+  if (tp_str_empty (token))
+    return FALSE;
+
+  req = g_slice_new0 (StoredAvatarRequest);
+  req->conn = g_object_ref (conn);
+  req->handle = handle;
+  req->sha1 = g_strdup (token);
+  req->context = context;
+  req->avatars_ctx = avatars_ctx;
+
+  gabble_avatar_store_lookup_async (conn->avatar_store, token,
+      stored_avatar_cb, req);
+  return TRUE;
+}
+
 static void
 gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
                                    const GArray *contacts,
@@ -698,32 +1110,24 @@ gabble_connection_request_avatars (TpSvcConnectionInterfaceAvatars *iface,
 
   for (i = 0; i < contacts->len; i++)
     {
-      WockyNode *vcard_node;
       TpHandle contact = g_array_index (contacts, TpHandle, i);
+      RequestAvatarsContext *ctx;
 
-      if (gabble_vcard_manager_get_cached (self->vcard_manager,
-            contact, &vcard_node))
-        {
-          emit_avatar_retrieved (iface, contact, vcard_node);
-        }
-      else
-        {
-          if (NULL == g_hash_table_lookup (self->avatar_requests,
-                GUINT_TO_POINTER (contact)))
-            {
-              RequestAvatarsContext *ctx = g_slice_new (RequestAvatarsContext);
+      /* If it's already on its way, it'll be signalled when it arrives */
+      if (NULL != g_hash_table_lookup (self->avatar_requests,
+            GUINT_TO_POINTER (contact)))
+        continue;
 
-              ctx->conn = self;
-              ctx->iface = iface;
-              ctx->handle = contact;
+      ctx = g_slice_new (RequestAvatarsContext);
+      ctx->conn = self;
+      ctx->iface = iface;
+      ctx->handle = contact;
 
-              g_hash_table_insert (self->avatar_requests,
-                  GUINT_TO_POINTER (contact), ctx);
+      g_hash_table_insert (self->avatar_requests,
+          GUINT_TO_POINTER (contact), ctx);
 
-              gabble_vcard_manager_request (self->vcard_manager,
-                contact, 0, request_avatars_cb, ctx, NULL);
-            }
-        }
+      if (!stored_avatar_request (self, contact, NULL, ctx))
+        request_avatars_fetch (ctx);
     }
 
   tp_svc_connection_interface_avatars_return_from_request_avatars (context);
@@ -734,6 +1138,7 @@ struct _set_avatar_ctx {
   GabbleConnection *conn;
   DBusGMethodInvocation *invocation;
   GString *avatar;
+  gchar *mime_type;
 };
 
 
@@ -742,9 +1147,84 @@ _set_avatar_ctx_free (struct _set_avatar_ctx *ctx)
 {
   if (ctx->avatar)
       g_string_free (ctx->avatar, TRUE);
+  g_free (ctx->mime_type);
   g_free (ctx);
 }
 
+static void
+pep_avatar_publish_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (source);
+  WockyStanza *metadata_msg = user_data;
+  GError *error = NULL;
+
+  if (!conn_util_send_iq_finish (conn, result, NULL, &error))
+    {
+      DEBUG ("publishing avatar with XEP-0084 failed: %s", error->message);
+      g_error_free (error);
+    }
+  else if (metadata_msg != NULL)
+    {
+      /* The data is there, so now contacts can be told about it */
+      conn_util_send_iq_async (conn, metadata_msg, NULL,
+          pep_avatar_publish_cb, NULL);
+    }
+
+  tp_clear_object (&metadata_msg);
+}
+
+/* Publishes our avatar with XEP-0084 as well as in our vCard, or if @avatar
+ * is NULL, says we have none */
+static void
+pep_avatar_publish (GabbleConnection *conn,
+    GString *avatar,
+    const gchar *mime_type,
+    const gchar *sha1)
+{
+  WockyStanza *metadata_msg, *data_msg;
+  WockyNode *item, *info;
+  gchar *bytes, *base64;
+
+  if (!(conn->features & GABBLE_CONNECTION_FEATURES_PEP))
+    return;
+
+  metadata_msg = wocky_pep_service_make_publish_stanza (
+      conn->pep_avatar_metadata, &item);
+
+  if (avatar == NULL)
+    {
+      wocky_node_add_child_ns (item, "metadata", NS_AVATAR_METADATA);
+      conn_util_send_iq_async (conn, metadata_msg, NULL,
+          pep_avatar_publish_cb, NULL);
+      g_object_unref (metadata_msg);
+      return;
+    }
+
+  bytes = g_strdup_printf ("%" G_GSIZE_FORMAT, avatar->len);
+  wocky_node_set_attribute (item, "id", sha1);
+  info = wocky_node_add_child (
+      wocky_node_add_child_ns (item, "metadata", NS_AVATAR_METADATA),
+      "info");
+  wocky_node_set_attribute (info, "id", sha1);
+  wocky_node_set_attribute (info, "bytes", bytes);
+  wocky_node_set_attribute (info, "type", mime_type);
+  g_free (bytes);
+
+  data_msg = wocky_pubsub_make_publish_stanza (NULL, NS_AVATAR_DATA, NULL,
+      NULL, &item);
+  wocky_node_set_attribute (item, "id", sha1);
+  base64 = g_base64_encode ((const guchar *) avatar->str, avatar->len);
+  wocky_node_add_child_with_content_ns (item, "data", base64, NS_AVATAR_DATA);
+  g_free (base64);
+
+  /* The metadata is only published once the data it points to is there */
+  conn_util_send_iq_async (conn, data_msg, NULL, pep_avatar_publish_cb,
+      metadata_msg);
+  g_object_unref (data_msg);
+}
+
 
 static void
 _set_avatar_cb2 (GabbleVCardManager *manager,
@@ -788,6 +1268,9 @@ _set_avatar_cb2 (GabbleVCardManager *manager,
           presence->avatar_sha1 = NULL;
         }
 
+      pep_avatar_publish (ctx->conn, ctx->avatar, ctx->mime_type,
+          presence->avatar_sha1);
+
       if (conn_presence_signal_own_presence (ctx->conn, NULL, &error))
         {
           tp_svc_connection_interface_avatars_return_from_set_avatar (
@@ -844,6 +1327,7 @@ gabble_connection_set_avatar (TpSvcConnectionInterfaceAvatars *iface,
           base64_data_size + (base64_data_size / 72) + 1;
 
       ctx->avatar = g_string_new_len (avatar->data, avatar->len);
+      ctx->mime_type = g_strdup (mime_type);
       base64 = g_malloc (base64_line_wrapped_data_size);
       outlen = g_base64_encode_step ((const guchar *) avatar->data,
           avatar->len, TRUE, base64, &state, &save);
@@ -891,6 +1375,126 @@ gabble_connection_clear_avatar (TpSvcConnectionInterfaceAvatars *iface,
   gabble_connection_set_avatar (iface, NULL, NULL, context);
 }
 
+/* Picks the avatar to use from an XEP-0084 <metadata/> element: PNG if it's
+ * offered, since every client can publish that, otherwise the first one which
+ * is in the data node rather than on the web. Returns NULL if there's none we
+ * can fetch. */
+static PepAvatar *
+pep_avatar_new_from_metadata (WockyNode *metadata)
+{
+  WockyNodeIter iter;
+  WockyNode *info, *best = NULL;
+  gboolean any = FALSE;
+  PepAvatar *pep_avatar;
+
+  wocky_node_iter_init (&iter, metadata, "info", NS_AVATAR_METADATA);
+
+  while (wocky_node_iter_next (&iter, &info))
+    {
+      any = TRUE;
+
+      if (wocky_node_get_attribute (info, "id") == NULL ||
+          wocky_node_get_attribute (info, "url") != NULL)
+        continue;
+
+      if (best == NULL ||
+          !tp_strdiff (wocky_node_get_attribute (info, "type"), "image/png"))
+        best = info;
+
+      if (!tp_strdiff (wocky_node_get_attribute (info, "type"), "image/png"))
+        break;
+    }
+
+  if (best == NULL && any)
+    return NULL;
+
+  pep_avatar = g_slice_new0 (PepAvatar);
+
+  if (best == NULL)
+    {
+      /* An empty <metadata/> means they've turned their avatar off */
+      pep_avatar->id = g_strdup ("");
+    }
+  else
+    {
+      pep_avatar->id = g_ascii_strdown (
+          wocky_node_get_attribute (best, "id"), -1);
+      pep_avatar->mime_type = g_strdup (
+          wocky_node_get_attribute (best, "type"));
+    }
+
+  if (pep_avatar->mime_type == NULL)
+    pep_avatar->mime_type = g_strdup ("");
+
+  return pep_avatar;
+}
+
+static void
+pep_avatar_metadata_changed (WockyPepService *pep,
+    WockyBareContact *contact,
+    WockyStanza *stanza,
+    WockyNode *item_node,
+    GabbleConnection *conn)
+{
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  const gchar *jid = wocky_bare_contact_get_jid (contact);
+  TpHandle handle;
+  WockyNode *metadata = NULL;
+  PepAvatar *pep_avatar, *old;
+  gchar *old_token;
+
+  handle = tp_handle_ensure (contact_repo, jid, NULL, NULL);
+
+  if (handle == 0)
+    {
+      DEBUG ("Invalid from: %s", jid);
+      return;
+    }
+
+  /* Ignore echoes of what we published */
+  if (handle == tp_base_connection_get_self_handle (base))
+    return;
+
+  if (item_node != NULL)
+    metadata = wocky_node_get_child_ns (item_node, "metadata",
+        NS_AVATAR_METADATA);
+
+  if (metadata == NULL)
+    return;
+
+  pep_avatar = pep_avatar_new_from_metadata (metadata);
+
+  if (pep_avatar == NULL)
+    {
+      DEBUG ("%s only has avatars we can't fetch", jid);
+      return;
+    }
+
+  old = g_hash_table_lookup (conn->pep_avatars, GUINT_TO_POINTER (handle));
+
+  if (old != NULL && !tp_strdiff (old->id, pep_avatar->id))
+    {
+      pep_avatar_free (pep_avatar);
+      return;
+    }
+
+  DEBUG ("%s published avatar '%s'", jid, pep_avatar->id);
+
+  /* Their presence's vCard hash stays as it is, for the vCard's sake; from
+   * now on, this is the token clients see */
+  old_token = g_strdup (get_known_avatar_token (conn, handle));
+  g_hash_table_insert (conn->pep_avatars, GUINT_TO_POINTER (handle),
+      pep_avatar);
+
+  if (tp_strdiff (old_token, pep_avatar->id))
+    tp_svc_connection_interface_avatars_emit_avatar_updated (conn, handle,
+        pep_avatar->id);
+
+  g_free (old_token);
+}
+
 static void
 conn_avatars_fill_contact_attributes (GObject *obj,
     const GArray *contacts, GHashTable *attributes_hash)
@@ -903,18 +1507,23 @@ conn_avatars_fill_contact_attributes (GObject *obj,
     {
       TpHandle handle = g_array_index (contacts, guint, i);
       GabblePresence *presence = NULL;
+      const gchar *token;
 
       if (tp_base_connection_get_self_handle (base) == handle)
         presence = self->self_presence;
       else
         presence = gabble_presence_cache_get (self->presence_cache, handle);
 
-      if (NULL != presence)
+      /* Contacts who are offline may still have published an avatar with
+       * XEP-0084 */
+      token = get_known_avatar_token (self, handle);
+
+      if (NULL != presence || NULL != token)
         {
           GValue *val = tp_g_value_slice_new (G_TYPE_STRING);
 
-          if (NULL != presence->avatar_sha1)
-            g_value_set_string (val, presence->avatar_sha1);
+          if (NULL != token)
+            g_value_set_string (val, token);
           else
             g_value_set_string (val, "");
 
@@ -928,13 +1537,37 @@ conn_avatars_fill_contact_attributes (GObject *obj,
 void
 conn_avatars_init (GabbleConnection *conn)
 {
+  gboolean avatar_cache;
+  guint max_entries;
+
   g_assert (conn->vcard_manager != NULL);
 
+  g_object_get (conn,
+      "avatar-cache", &avatar_cache,
+      "avatar-cache-max-entries", &max_entries,
+      NULL);
+
+  if (avatar_cache)
+    {
+      gchar *path = g_build_filename (g_get_user_cache_dir (), "telepathy",
+          "gabble", "avatars", NULL);
+
+      conn->avatar_store = gabble_avatar_store_new (path, max_entries);
+      g_free (path);
+    }
+
   g_signal_connect (conn->vcard_manager, "got-self-initial-avatar", G_CALLBACK
       (connection_got_self_initial_avatar_cb), conn);
   g_signal_connect (conn->presence_cache, "avatar-update", G_CALLBACK
       (connection_avatar_update_cb), conn);
 
+  conn->pep_avatars = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) pep_avatar_free);
+  conn->pep_avatar_metadata = wocky_pep_service_new (NS_AVATAR_METADATA,
+      TRUE);
+  g_signal_connect (conn->pep_avatar_metadata, "changed",
+      G_CALLBACK (pep_avatar_metadata_changed), conn);
+
   tp_contacts_mixin_add_contact_attributes_iface (G_OBJECT (conn),
       TP_IFACE_CONNECTION_INTERFACE_AVATARS,
           conn_avatars_fill_contact_attributes);
@@ -43,9 +43,19 @@ get_client_types_from_handle (GabbleConnection *conn,
 {
   GabblePresence *presence = gabble_presence_cache_get (conn->presence_cache,
       handle);
+  guint snapshot_types;
 
   g_return_val_if_fail (types_out != NULL, FALSE);
 
+  if (gabble_presence_cache_peek_snapshot (conn->presence_cache, handle, NULL,
+        &snapshot_types))
+    {
+      /* We haven't heard from them yet since connecting, so report what they
+       * had last time */
+      *types_out = gabble_presence_client_types_to_strv (snapshot_types);
+      return TRUE;
+    }
+
   if (presence == NULL)
     {
       /* We have no presence information for this contact; so they have no
@@ -623,8 +623,9 @@ gabble_connection_request_contact_info (TpSvcConnectionInterfaceContactInfo *ifa
                                        contact, &vcard_node))
     _return_from_request_contact_info (vcard_node, NULL, context);
   else
-    gabble_vcard_manager_request (self->vcard_manager, contact, 0,
-        _request_vcard_cb, context, NULL);
+    gabble_vcard_manager_request_full (self->vcard_manager, contact, 0,
+        GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, _request_vcard_cb,
+        context, NULL);
 }
 
 static GabbleVCardManagerEditInfo *
@@ -0,0 +1,450 @@
+/*
+ * conn-iq-stats.c - Gabble connection code collecting per-IQ latency and
+ *  outcome statistics
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "conn-iq-stats.h"
+
+#include <dbus/dbus-glib.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "extensions/extensions.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_CONNECTION
+#include "debug.h"
+
+/* Upper bounds of the latency histogram's buckets, in milliseconds */
+static const guint latency_buckets[] = {
+    10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000, G_MAXUINT
+};
+#define N_LATENCY_BUCKETS G_N_ELEMENTS (latency_buckets)
+
+/* Indexed by WockyXmppErrorType */
+static const gchar * const error_type_names[] = {
+    "cancel", "continue", "modify", "auth", "wait"
+};
+#define N_ERROR_TYPES G_N_ELEMENTS (error_type_names)
+
+typedef struct {
+    guint sent;
+    guint replies;
+    guint timeouts;
+    guint failures;
+    guint shared;
+    guint cache_hits;
+    guint cache_misses;
+    guint cache_evictions;
+    guint errors[N_ERROR_TYPES];
+    guint64 bytes_sent;
+    guint64 bytes_received;
+    guint latency[N_LATENCY_BUCKETS];
+} NamespaceStats;
+
+struct _GabbleConnectionIqStatsPrivate
+{
+  /* TRUE while at least one client is interested in the IQStats interface;
+   * nothing is recorded otherwise */
+  gboolean interested;
+
+  /* owned gchar * namespace => owned NamespaceStats * */
+  GHashTable *namespaces;
+
+  /* Used to measure the size of stanzas; NULL if not interested */
+  WockyXmppWriter *writer;
+};
+
+static const gchar *
+get_namespace (WockyStanza *iq)
+{
+  WockyNode *payload = wocky_node_get_first_child (
+      wocky_stanza_get_top_node (iq));
+
+  if (payload == NULL)
+    return "";
+
+  return wocky_node_get_ns (payload);
+}
+
+static NamespaceStats *
+ensure_namespace_stats (GabbleConnection *conn,
+    const gchar *ns)
+{
+  GabbleConnectionIqStatsPrivate *priv = conn->iq_stats_priv;
+  NamespaceStats *stats = g_hash_table_lookup (priv->namespaces, ns);
+
+  if (stats == NULL)
+    {
+      stats = g_slice_new0 (NamespaceStats);
+      g_hash_table_insert (priv->namespaces, g_strdup (ns), stats);
+    }
+
+  return stats;
+}
+
+static void
+namespace_stats_free (gpointer stats)
+{
+  g_slice_free (NamespaceStats, stats);
+}
+
+static gsize
+get_stanza_size (GabbleConnection *conn,
+    WockyStanza *stanza)
+{
+  const guint8 *data;
+  gsize length;
+
+  wocky_xmpp_writer_write_stanza (conn->iq_stats_priv->writer, stanza, &data,
+      &length);
+  return length;
+}
+
+static void
+record_latency (NamespaceStats *stats,
+    gint64 sent_at)
+{
+  gint64 ms = (g_get_monotonic_time () - sent_at) / 1000;
+  guint i;
+
+  for (i = 0; i < N_LATENCY_BUCKETS - 1; i++)
+    {
+      if (ms <= latency_buckets[i])
+        break;
+    }
+
+  stats->latency[i]++;
+}
+
+/*
+ * conn_iq_stats_sent:
+ * @conn: the connection
+ * @iq: an <iq/> which is about to be sent
+ *
+ * Returns: the time to pass to conn_iq_stats_replied() or
+ *  conn_iq_stats_failed() when the request completes, or 0 if nobody is
+ *  interested in statistics (in which case this is very cheap).
+ */
+gint64
+conn_iq_stats_sent (GabbleConnection *conn,
+    WockyStanza *iq)
+{
+  NamespaceStats *stats;
+
+  if (G_LIKELY (!conn->iq_stats_priv->interested))
+    return 0;
+
+  stats = ensure_namespace_stats (conn, get_namespace (iq));
+  stats->sent++;
+  stats->bytes_sent += get_stanza_size (conn, iq);
+
+  return g_get_monotonic_time ();
+}
+
+/*
+ * conn_iq_stats_replied:
+ * @conn: the connection
+ * @iq: an <iq/> previously passed to conn_iq_stats_sent()
+ * @reply: the reply to @iq
+ * @sent_at: the value returned by conn_iq_stats_sent()
+ */
+void
+conn_iq_stats_replied (GabbleConnection *conn,
+    WockyStanza *iq,
+    WockyStanza *reply,
+    gint64 sent_at)
+{
+  NamespaceStats *stats;
+  WockyXmppErrorType type;
+
+  /* If nobody was interested when the request was sent, or everyone has
+   * lost interest since, there's nothing to do */
+  if (sent_at == 0 || !conn->iq_stats_priv->interested)
+    return;
+
+  stats = ensure_namespace_stats (conn, get_namespace (iq));
+  stats->replies++;
+  stats->bytes_received += get_stanza_size (conn, reply);
+  record_latency (stats, sent_at);
+
+  if (wocky_stanza_extract_errors (reply, &type, NULL, NULL, NULL) &&
+      type < N_ERROR_TYPES)
+    stats->errors[type]++;
+}
+
+/*
+ * conn_iq_stats_failed:
+ * @conn: the connection
+ * @iq: an <iq/> previously passed to conn_iq_stats_sent()
+ * @sent_at: the value returned by conn_iq_stats_sent()
+ *
+ * Records that @iq will never be answered, because the connection failed.
+ */
+void
+conn_iq_stats_failed (GabbleConnection *conn,
+    WockyStanza *iq,
+    gint64 sent_at)
+{
+  if (sent_at == 0 || !conn->iq_stats_priv->interested)
+    return;
+
+  ensure_namespace_stats (conn, get_namespace (iq))->failures++;
+}
+
+/*
+ * conn_iq_stats_timed_out:
+ * @conn: the connection
+ * @ns: the namespace of the request's payload
+ *
+ * Records that we gave up waiting for a reply to a request. Timeouts are
+ * implemented by the callers of _gabble_connection_send_with_reply(), such as
+ * the request pipeline, so they report them here.
+ */
+void
+conn_iq_stats_timed_out (GabbleConnection *conn,
+    const gchar *ns)
+{
+  if (G_LIKELY (!conn->iq_stats_priv->interested))
+    return;
+
+  ensure_namespace_stats (conn, ns)->timeouts++;
+}
+
+/*
+ * conn_iq_stats_shared:
+ * @conn: the connection
+ * @iq: an <iq/> which was not sent, because an identical one was already in
+ *  flight and its reply will be shared
+ */
+void
+conn_iq_stats_shared (GabbleConnection *conn,
+    WockyStanza *iq)
+{
+  if (G_LIKELY (!conn->iq_stats_priv->interested))
+    return;
+
+  ensure_namespace_stats (conn, get_namespace (iq))->shared++;
+}
+
+/*
+ * conn_iq_stats_cache_event:
+ * @conn: the connection
+ * @ns: the namespace of the requests whose replies are cached
+ * @event: what happened
+ *
+ * Records a lookup in, or an eviction from, an in-memory cache of parsed
+ * replies, such as the presence cache's entity capabilities.
+ */
+void
+conn_iq_stats_cache_event (GabbleConnection *conn,
+    const gchar *ns,
+    ConnIqStatsCacheEvent event)
+{
+  NamespaceStats *stats;
+
+  if (G_LIKELY (!conn->iq_stats_priv->interested))
+    return;
+
+  stats = ensure_namespace_stats (conn, ns);
+
+  switch (event)
+    {
+    case CONN_IQ_STATS_CACHE_HIT:
+      stats->cache_hits++;
+      break;
+    case CONN_IQ_STATS_CACHE_MISS:
+      stats->cache_misses++;
+      break;
+    case CONN_IQ_STATS_CACHE_EVICTION:
+      stats->cache_evictions++;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static GHashTable *
+namespace_stats_to_asv (NamespaceStats *stats)
+{
+  GHashTable *asv = tp_asv_new (
+      "Sent", G_TYPE_UINT, stats->sent,
+      "Replies", G_TYPE_UINT, stats->replies,
+      "Timeouts", G_TYPE_UINT, stats->timeouts,
+      "Failures", G_TYPE_UINT, stats->failures,
+      "Shared", G_TYPE_UINT, stats->shared,
+      "CacheHits", G_TYPE_UINT, stats->cache_hits,
+      "CacheMisses", G_TYPE_UINT, stats->cache_misses,
+      "CacheEvictions", G_TYPE_UINT, stats->cache_evictions,
+      "BytesSent", G_TYPE_UINT64, stats->bytes_sent,
+      "BytesReceived", G_TYPE_UINT64, stats->bytes_received,
+      NULL);
+  GHashTable *errors = g_hash_table_new (g_str_hash, g_str_equal);
+  GArray *latency = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+      N_LATENCY_BUCKETS);
+  guint i;
+
+  for (i = 0; i < N_ERROR_TYPES; i++)
+    {
+      if (stats->errors[i] > 0)
+        g_hash_table_insert (errors, (gchar *) error_type_names[i],
+            GUINT_TO_POINTER (stats->errors[i]));
+    }
+
+  g_array_append_vals (latency, stats->latency, N_LATENCY_BUCKETS);
+
+  tp_asv_take_boxed (asv, "Errors",
+      dbus_g_type_get_map ("GHashTable", G_TYPE_STRING, G_TYPE_UINT), errors);
+  tp_asv_take_boxed (asv, "Latency", DBUS_TYPE_G_UINT_ARRAY, latency);
+
+  return asv;
+}
+
+static void
+conn_iq_stats_get_statistics (GabbleSvcConnectionInterfaceGabbleIQStats *iface,
+    DBusGMethodInvocation *context)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (iface);
+  GHashTable *ret = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) g_hash_table_unref);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, conn->iq_stats_priv->namespaces);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (ret, key, namespace_stats_to_asv (value));
+
+  gabble_svc_connection_interface_gabble_iq_stats_return_from_get_statistics (
+      context, ret);
+  g_hash_table_unref (ret);
+}
+
+static void
+conn_iq_stats_reset_statistics (
+    GabbleSvcConnectionInterfaceGabbleIQStats *iface,
+    DBusGMethodInvocation *context)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (iface);
+
+  DEBUG ("resetting IQ statistics");
+  g_hash_table_remove_all (conn->iq_stats_priv->namespaces);
+
+  gabble_svc_connection_interface_gabble_iq_stats_return_from_reset_statistics
+      (context);
+}
+
+void
+conn_iq_stats_properties_getter (GObject *object,
+    GQuark interface,
+    GQuark name,
+    GValue *value,
+    gpointer getter_data)
+{
+  static GQuark latency_buckets_quark = 0;
+
+  if (G_UNLIKELY (latency_buckets_quark == 0))
+    latency_buckets_quark = g_quark_from_static_string ("LatencyBuckets");
+
+  if (name == latency_buckets_quark)
+    {
+      GArray *buckets = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+          N_LATENCY_BUCKETS);
+
+      g_array_append_vals (buckets, latency_buckets, N_LATENCY_BUCKETS);
+      g_value_take_boxed (value, buckets);
+    }
+  else
+    {
+      g_assert_not_reached ();
+    }
+}
+
+/* called on transition from 0 to 1 interested clients */
+static void
+iq_stats_clients_interested_cb (GabbleConnection *self,
+    const gchar *token G_GNUC_UNUSED,
+    gpointer nil G_GNUC_UNUSED)
+{
+  GabbleConnectionIqStatsPrivate *priv = self->iq_stats_priv;
+
+  DEBUG ("The first client is interested; collecting IQ statistics");
+  priv->interested = TRUE;
+  priv->writer = wocky_xmpp_writer_new_no_stream ();
+}
+
+/* called on transition from 1 to 0 interested clients */
+static void
+iq_stats_clients_uninterested_cb (GabbleConnection *self,
+    const gchar *token G_GNUC_UNUSED,
+    gpointer nil G_GNUC_UNUSED)
+{
+  GabbleConnectionIqStatsPrivate *priv = self->iq_stats_priv;
+
+  DEBUG ("All clients lost interest; discarding IQ statistics");
+  priv->interested = FALSE;
+  g_clear_object (&priv->writer);
+  g_hash_table_remove_all (priv->namespaces);
+}
+
+void
+conn_iq_stats_init (GabbleConnection *conn)
+{
+  TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+
+  conn->iq_stats_priv = g_slice_new0 (GabbleConnectionIqStatsPrivate);
+  conn->iq_stats_priv->namespaces = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, namespace_stats_free);
+
+  tp_base_connection_add_possible_client_interest (base,
+      GABBLE_IFACE_QUARK_CONNECTION_INTERFACE_GABBLE_IQ_STATS);
+
+  g_signal_connect (conn,
+      "clients-interested::"
+          GABBLE_IFACE_CONNECTION_INTERFACE_GABBLE_IQ_STATS,
+      G_CALLBACK (iq_stats_clients_interested_cb), NULL);
+  g_signal_connect (conn,
+      "clients-uninterested::"
+          GABBLE_IFACE_CONNECTION_INTERFACE_GABBLE_IQ_STATS,
+      G_CALLBACK (iq_stats_clients_uninterested_cb), NULL);
+}
+
+void
+conn_iq_stats_finalize (GabbleConnection *conn)
+{
+  GabbleConnectionIqStatsPrivate *priv = conn->iq_stats_priv;
+
+  if (priv == NULL)
+    return;
+
+  g_clear_object (&priv->writer);
+  g_hash_table_unref (priv->namespaces);
+  g_slice_free (GabbleConnectionIqStatsPrivate, priv);
+  conn->iq_stats_priv = NULL;
+}
+
+void
+conn_iq_stats_iface_init (gpointer g_iface,
+    gpointer iface_data)
+{
+#define IMPLEMENT(x) \
+  gabble_svc_connection_interface_gabble_iq_stats_implement_##x (\
+  g_iface, conn_iq_stats_##x)
+  IMPLEMENT (get_statistics);
+  IMPLEMENT (reset_statistics);
+#undef IMPLEMENT
+}
@@ -0,0 +1,55 @@
+/*
+ * conn-iq-stats.h - Header for Gabble connection code collecting per-IQ
+ *  latency and outcome statistics
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CONN_IQ_STATS_H__
+#define __CONN_IQ_STATS_H__
+
+#include <glib-object.h>
+#include <wocky/wocky.h>
+
+#include "connection.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+    CONN_IQ_STATS_CACHE_HIT,
+    CONN_IQ_STATS_CACHE_MISS,
+    CONN_IQ_STATS_CACHE_EVICTION
+} ConnIqStatsCacheEvent;
+
+void conn_iq_stats_init (GabbleConnection *conn);
+void conn_iq_stats_finalize (GabbleConnection *conn);
+void conn_iq_stats_iface_init (gpointer g_iface, gpointer iface_data);
+void conn_iq_stats_properties_getter (GObject *object, GQuark interface,
+    GQuark name, GValue *value, gpointer getter_data);
+
+gint64 conn_iq_stats_sent (GabbleConnection *conn, WockyStanza *iq);
+void conn_iq_stats_replied (GabbleConnection *conn, WockyStanza *iq,
+    WockyStanza *reply, gint64 sent_at);
+void conn_iq_stats_failed (GabbleConnection *conn, WockyStanza *iq,
+    gint64 sent_at);
+void conn_iq_stats_timed_out (GabbleConnection *conn, const gchar *ns);
+void conn_iq_stats_shared (GabbleConnection *conn, WockyStanza *iq);
+void conn_iq_stats_cache_event (GabbleConnection *conn, const gchar *ns,
+    ConnIqStatsCacheEvent event);
+
+G_END_DECLS
+
+#endif /* __CONN_IQ_STATS_H__ */
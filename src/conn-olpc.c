@@ -2781,34 +2781,34 @@ forget_activity_invites (GabbleConnection *conn,
 }
 
 static void
-muc_channel_contact_join_cb (GabbleMucChannel *chan,
-                             TpHandle contact,
-                             GabbleOlpcActivity *activity)
+muc_channel_contacts_join_cb (GabbleMucChannel *chan,
+                              TpHandleSet *contacts,
+                              GabbleOlpcActivity *activity)
 {
   GabbleConnection *conn;
   TpBaseConnection *base;
+  TpHandleSet *invitees;
 
   g_object_get (activity, "connection", &conn, NULL);
   base = TP_BASE_CONNECTION (conn);
 
-  if (contact == tp_base_connection_get_self_handle (base))
+  if (tp_handle_set_is_member (contacts,
+        tp_base_connection_get_self_handle (base)))
     {
       /* We join the channel, forget about all invites we received about
        * this activity */
       forget_activity_invites (conn, activity->room);
     }
-  else
+
+  invitees = g_object_get_qdata ((GObject *) chan, invitees_quark ());
+  if (invitees != NULL)
     {
-      GQuark quark = invitees_quark ();
-      TpHandleSet *invitees;
+      TpIntset *removed;
 
-      invitees = g_object_get_qdata ((GObject *) chan, quark);
-      if (invitees != NULL)
-        {
-          DEBUG ("contact %d joined the muc, remove the invite we sent to him",
-              contact);
-          tp_handle_set_remove (invitees, contact);
-        }
+      DEBUG ("contacts joined the muc, remove the invites we sent them");
+      removed = tp_handle_set_difference_update (invitees,
+          tp_handle_set_peek (contacts));
+      tp_intset_destroy (removed);
     }
 
   g_object_unref (conn);
@@ -2849,8 +2849,8 @@ muc_factory_new_channel_cb (gpointer key,
       activity);
   g_signal_connect (chan, "pre-invite", G_CALLBACK (muc_channel_pre_invite_cb),
       activity);
-  g_signal_connect (chan, "contact-join",
-      G_CALLBACK (muc_channel_contact_join_cb), activity);
+  g_signal_connect (chan, "contacts-join",
+      G_CALLBACK (muc_channel_contacts_join_cb), activity);
 }
 
 static void
@@ -48,6 +48,7 @@
 #include "conn-avatars.h"
 #include "conn-client-types.h"
 #include "conn-contact-info.h"
+#include "conn-iq-stats.h"
 #include "conn-location.h"
 #include "conn-presence.h"
 #include "conn-sidecars.h"
@@ -142,6 +143,9 @@ G_DEFINE_TYPE_WITH_CODE(GabbleConnection,
       conn_power_saving_iface_init);
     G_IMPLEMENT_INTERFACE (GABBLE_TYPE_SVC_CONNECTION_INTERFACE_ADDRESSING,
       conn_addressing_iface_init);
+    G_IMPLEMENT_INTERFACE
+      (GABBLE_TYPE_SVC_CONNECTION_INTERFACE_GABBLE_IQ_STATS,
+      conn_iq_stats_iface_init);
     G_IMPLEMENT_INTERFACE (GABBLE_TYPE_PLUGIN_CONNECTION,
       gabble_plugin_connection_iface_init);
     )
@@ -177,6 +181,20 @@ enum
     PROP_EXTRA_CERTIFICATE_IDENTITIES,
     PROP_POWER_SAVING,
     PROP_DOWNLOAD_AT_CONNECTION,
+    PROP_CAPS_SNAPSHOT,
+    PROP_COALESCE_PRESENCE_SIGNALS,
+    PROP_COALESCE_PRESENCE_WINDOW,
+    PROP_VCARD_CACHE,
+    PROP_VCARD_CACHE_MAX_ENTRIES,
+    PROP_VCARD_CACHE_MAX_AGE,
+    PROP_AVATAR_CACHE,
+    PROP_AVATAR_CACHE_MAX_ENTRIES,
+    PROP_ROSTER_CACHE,
+    PROP_MUC_HISTORY_CACHE,
+    PROP_MUC_PRESENCE_RATE,
+    PROP_ROOMLIST_PAGE_SIZE,
+    PROP_ROOMLIST_ROOM_INFO,
+    PROP_ROOMLIST_CACHE_TTL,
 
     LAST_PROPERTY
 };
@@ -222,6 +240,27 @@ struct _GabbleConnectionPrivate
 
   gboolean decloak_automatically;
 
+  gboolean caps_snapshot;
+
+  gboolean coalesce_presence_signals;
+  guint coalesce_presence_window;
+
+  gboolean vcard_cache;
+  guint vcard_cache_max_entries;
+  guint vcard_cache_max_age;
+
+  gboolean avatar_cache;
+  guint avatar_cache_max_entries;
+
+  gboolean roster_cache;
+
+  gboolean muc_history_cache;
+  guint muc_presence_rate;
+
+  guint roomlist_page_size;
+  gboolean roomlist_room_info;
+  guint roomlist_cache_ttl;
+
   GStrv fallback_servers;
   guint fallback_server_index;
 
@@ -299,6 +338,16 @@ struct _GabbleConnectionPrivate
    */
   GCancellable *iq_reply_cancellable;
 
+  /* Identical get IQs in flight, shared between all the callers of
+   * _gabble_connection_send_with_reply() who asked for them.
+   * owned gchar * (see iq_get_fingerprint()) => GabbleSharedGet *
+   * (owned by the pending wocky_porter_send_iq_async() call) */
+  GHashTable *shared_gets;
+  /* number of get IQs which were sent on the wire, and the number which
+   * instead piggy-backed on an identical get already in flight */
+  guint shared_gets_misses;
+  guint shared_gets_hits;
+
   gboolean closing;
   /* gobject housekeeping */
   gboolean dispose_has_run;
@@ -309,6 +358,12 @@ static void connection_capabilities_update_cb (GabblePresenceCache *cache,
     const GabbleCapabilitySet *old_cap_set,
     const GabbleCapabilitySet *new_cap_set,
     gpointer user_data);
+static void connection_capabilities_batch_update_cb (
+    GabblePresenceCache *cache,
+    const GArray *handles,
+    const GPtrArray *old_cap_sets,
+    const GPtrArray *new_cap_sets,
+    gpointer user_data);
 
 static gboolean gabble_connection_refresh_capabilities (GabbleConnection *self,
     GabbleCapabilitySet **old_out);
@@ -438,6 +493,8 @@ gabble_connection_constructor (GType type,
       (gabble_conn_aliasing_nickname_updated), self);
   g_signal_connect (self->presence_cache, "capabilities-update", G_CALLBACK
       (connection_capabilities_update_cb), self);
+  g_signal_connect (self->presence_cache, "capabilities-batch-update",
+      G_CALLBACK (connection_capabilities_batch_update_cb), self);
 
   tp_contacts_mixin_init (G_OBJECT (self),
       G_STRUCT_OFFSET (GabbleConnection, contacts));
@@ -453,6 +510,7 @@ gabble_connection_constructor (GType type,
   conn_location_init (self);
   conn_sidecars_init (self);
   conn_mail_notif_init (self);
+  conn_iq_stats_init (self);
   conn_client_types_init (self);
   conn_addressing_init (self);
 
@@ -565,6 +623,8 @@ gabble_connection_init (GabbleConnection *self)
 
   self->priv = priv;
   priv->iq_reply_cancellable = g_cancellable_new ();
+  priv->shared_gets = g_hash_table_new (g_str_hash, g_str_equal);
+  self->timer_wheel = gabble_timer_wheel_new ();
 
   priv->caps_serial = 1;
   priv->last_activity_time = time (NULL);
@@ -657,6 +717,62 @@ gabble_connection_get_property (GObject    *object,
       g_value_set_boolean (value, priv->decloak_automatically);
       break;
 
+    case PROP_CAPS_SNAPSHOT:
+      g_value_set_boolean (value, priv->caps_snapshot);
+      break;
+
+    case PROP_COALESCE_PRESENCE_SIGNALS:
+      g_value_set_boolean (value, priv->coalesce_presence_signals);
+      break;
+
+    case PROP_COALESCE_PRESENCE_WINDOW:
+      g_value_set_uint (value, priv->coalesce_presence_window);
+      break;
+
+    case PROP_VCARD_CACHE:
+      g_value_set_boolean (value, priv->vcard_cache);
+      break;
+
+    case PROP_VCARD_CACHE_MAX_ENTRIES:
+      g_value_set_uint (value, priv->vcard_cache_max_entries);
+      break;
+
+    case PROP_VCARD_CACHE_MAX_AGE:
+      g_value_set_uint (value, priv->vcard_cache_max_age);
+      break;
+
+    case PROP_AVATAR_CACHE:
+      g_value_set_boolean (value, priv->avatar_cache);
+      break;
+
+    case PROP_AVATAR_CACHE_MAX_ENTRIES:
+      g_value_set_uint (value, priv->avatar_cache_max_entries);
+      break;
+
+    case PROP_ROSTER_CACHE:
+      g_value_set_boolean (value, priv->roster_cache);
+      break;
+
+    case PROP_MUC_HISTORY_CACHE:
+      g_value_set_boolean (value, priv->muc_history_cache);
+      break;
+
+    case PROP_MUC_PRESENCE_RATE:
+      g_value_set_uint (value, priv->muc_presence_rate);
+      break;
+
+    case PROP_ROOMLIST_PAGE_SIZE:
+      g_value_set_uint (value, priv->roomlist_page_size);
+      break;
+
+    case PROP_ROOMLIST_ROOM_INFO:
+      g_value_set_boolean (value, priv->roomlist_room_info);
+      break;
+
+    case PROP_ROOMLIST_CACHE_TTL:
+      g_value_set_uint (value, priv->roomlist_cache_ttl);
+      break;
+
     case PROP_FALLBACK_SERVERS:
       g_value_set_boxed (value, priv->fallback_servers);
       break;
@@ -806,6 +922,62 @@ gabble_connection_set_property (GObject      *object,
       priv->decloak_automatically = g_value_get_boolean (value);
       break;
 
+    case PROP_CAPS_SNAPSHOT:
+      priv->caps_snapshot = g_value_get_boolean (value);
+      break;
+
+    case PROP_COALESCE_PRESENCE_SIGNALS:
+      priv->coalesce_presence_signals = g_value_get_boolean (value);
+      break;
+
+    case PROP_COALESCE_PRESENCE_WINDOW:
+      priv->coalesce_presence_window = g_value_get_uint (value);
+      break;
+
+    case PROP_VCARD_CACHE:
+      priv->vcard_cache = g_value_get_boolean (value);
+      break;
+
+    case PROP_VCARD_CACHE_MAX_ENTRIES:
+      priv->vcard_cache_max_entries = g_value_get_uint (value);
+      break;
+
+    case PROP_VCARD_CACHE_MAX_AGE:
+      priv->vcard_cache_max_age = g_value_get_uint (value);
+      break;
+
+    case PROP_AVATAR_CACHE:
+      priv->avatar_cache = g_value_get_boolean (value);
+      break;
+
+    case PROP_AVATAR_CACHE_MAX_ENTRIES:
+      priv->avatar_cache_max_entries = g_value_get_uint (value);
+      break;
+
+    case PROP_ROSTER_CACHE:
+      priv->roster_cache = g_value_get_boolean (value);
+      break;
+
+    case PROP_MUC_HISTORY_CACHE:
+      priv->muc_history_cache = g_value_get_boolean (value);
+      break;
+
+    case PROP_MUC_PRESENCE_RATE:
+      priv->muc_presence_rate = g_value_get_uint (value);
+      break;
+
+    case PROP_ROOMLIST_PAGE_SIZE:
+      priv->roomlist_page_size = g_value_get_uint (value);
+      break;
+
+    case PROP_ROOMLIST_ROOM_INFO:
+      priv->roomlist_room_info = g_value_get_boolean (value);
+      break;
+
+    case PROP_ROOMLIST_CACHE_TTL:
+      priv->roomlist_cache_ttl = g_value_get_uint (value);
+      break;
+
     case PROP_FALLBACK_SERVERS:
       if (priv->fallback_servers != NULL)
         g_strfreev (priv->fallback_servers);
@@ -903,6 +1075,7 @@ static const gchar *implemented_interfaces[] = {
     GABBLE_IFACE_CONNECTION_FUTURE,
     TP_IFACE_CONNECTION_INTERFACE_CLIENT_TYPES,
     GABBLE_IFACE_CONNECTION_INTERFACE_ADDRESSING,
+    GABBLE_IFACE_CONNECTION_INTERFACE_GABBLE_IQ_STATS,
     NULL
 };
 static const gchar **interfaces_always_present = implemented_interfaces + 3;
@@ -961,6 +1134,10 @@ gabble_connection_class_init (GabbleConnectionClass *gabble_connection_class)
         { "PowerSavingActive", "power-saving", NULL },
         { NULL }
   };
+  static TpDBusPropertiesMixinPropImpl iq_stats_props[] = {
+        { "LatencyBuckets", NULL, NULL },
+        { NULL }
+  };
   static TpDBusPropertiesMixinIfaceImpl prop_interfaces[] = {
         /* 0 */ { TP_IFACE_CONNECTION_INTERFACE_LOCATION,
           conn_location_properties_getter,
@@ -992,6 +1169,11 @@ gabble_connection_class_init (GabbleConnectionClass *gabble_connection_class)
           NULL,
           power_saving_props,
         },
+        { GABBLE_IFACE_CONNECTION_INTERFACE_GABBLE_IQ_STATS,
+          conn_iq_stats_properties_getter,
+          NULL,
+          iq_stats_props,
+        },
         { NULL }
   };
 
@@ -1206,6 +1388,133 @@ gabble_connection_class_init (GabbleConnectionClass *gabble_connection_class)
           FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (
+      object_class, PROP_CAPS_SNAPSHOT,
+      g_param_spec_boolean (
+          "caps-snapshot", "Keep a capabilities snapshot?",
+          "Save contacts' capabilities on disconnection, and use them "
+          "until fresh presence arrives after reconnecting",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_COALESCE_PRESENCE_SIGNALS,
+      g_param_spec_boolean (
+          "coalesce-presence-signals", "Coalesce presence signals?",
+          "Gather contacts' presence, capability and avatar changes, and "
+          "room occupants arriving and leaving, and signal them together",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_COALESCE_PRESENCE_WINDOW,
+      g_param_spec_uint (
+          "coalesce-presence-window", "Presence coalescing window",
+          "Milliseconds to gather changes for if coalesce-presence-signals "
+          "is set, or 0 to signal them on the next main loop iteration",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_VCARD_CACHE,
+      g_param_spec_boolean (
+          "vcard-cache", "Keep contacts' vCards on disk?",
+          "Save contacts' vCards between connections, and use them while "
+          "their avatar hash in presence still matches",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_VCARD_CACHE_MAX_ENTRIES,
+      g_param_spec_uint (
+          "vcard-cache-max-entries", "Maximum vCards on disk",
+          "How many of the most recently fetched vCards to save if "
+          "vcard-cache is set",
+          0, G_MAXUINT, 2000,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_VCARD_CACHE_MAX_AGE,
+      g_param_spec_uint (
+          "vcard-cache-max-age", "Maximum age of vCards on disk",
+          "Seconds after which a saved vCard is fetched again, even if the "
+          "contact's avatar hash hasn't changed",
+          0, G_MAXUINT, 7 * 24 * 60 * 60,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_AVATAR_CACHE,
+      g_param_spec_boolean (
+          "avatar-cache", "Keep contacts' avatars on disk?",
+          "Save contacts' avatars by their SHA-1, and answer requests for "
+          "avatars whose token we already have from there",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_AVATAR_CACHE_MAX_ENTRIES,
+      g_param_spec_uint (
+          "avatar-cache-max-entries", "Maximum avatars on disk",
+          "How many avatars to keep on disk if avatar-cache is set, beyond "
+          "which the least recently saved are deleted",
+          1, G_MAXUINT, 1000,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_ROSTER_CACHE,
+      g_param_spec_boolean (
+          "roster-cache", "Keep the roster on disk?",
+          "Save the roster between connections, show it before the server "
+          "answers, and ask only for what changed if the server supports "
+          "roster versioning",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_MUC_HISTORY_CACHE,
+      g_param_spec_boolean (
+          "muc-history-cache", "Remember rooms' last messages on disk?",
+          "Save when the last message from each room was sent between "
+          "connections, and ask rooms only for the history since then",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_MUC_PRESENCE_RATE,
+      g_param_spec_uint (
+          "muc-presence-rate", "Room presences per second",
+          "How many presences a second to send to rooms when our presence "
+          "changes, or 0 to send them all at once",
+          0, G_MAXUINT, 10,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_ROOMLIST_PAGE_SIZE,
+      g_param_spec_uint (
+          "roomlist-page-size", "Rooms to ask for at a time",
+          "How many rooms to ask a conference server for in each page of "
+          "a room list (XEP-0059), or 0 to ask for them all at once",
+          0, G_MAXUINT, 100,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_ROOMLIST_ROOM_INFO,
+      g_param_spec_boolean (
+          "roomlist-room-info", "Ask each listed room about itself?",
+          "Whether to query every room in a room list for its name and "
+          "settings, rather than listing just what the server says",
+          TRUE,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (
+      object_class, PROP_ROOMLIST_CACHE_TTL,
+      g_param_spec_uint (
+          "roomlist-cache-ttl", "Seconds to remember room lists",
+          "How long to reuse a conference server's room list before "
+          "asking it again, or 0 to always ask",
+          0, G_MAXUINT, 300,
+          G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_property (
       object_class, PROP_DOWNLOAD_AT_CONNECTION,
       g_param_spec_boolean (
@@ -1294,6 +1603,7 @@ gabble_connection_dispose (GObject *object)
   conn_olpc_activity_properties_dispose (self);
 
   g_hash_table_unref (self->avatar_requests);
+  tp_clear_pointer (&self->pep_avatars, g_hash_table_unref);
   g_hash_table_unref (self->vcard_requests);
 
   conn_presence_dispose (self);
@@ -1326,6 +1636,7 @@ gabble_connection_dispose (GObject *object)
 
   tp_clear_object (&self->pep_location);
   tp_clear_object (&self->pep_nick);
+  tp_clear_object (&self->pep_avatar_metadata);
   tp_clear_object (&self->pep_olpc_buddy_props);
   tp_clear_object (&self->pep_olpc_activities);
   tp_clear_object (&self->pep_olpc_current_act);
@@ -1365,6 +1676,9 @@ gabble_connection_finalize (GObject *object)
   g_free (priv->alias);
   g_free (priv->stream_id);
 
+  g_hash_table_unref (priv->shared_gets);
+  conn_iq_stats_finalize (self);
+
   tp_contacts_mixin_finalize (G_OBJECT(self));
 
   conn_presence_finalize (self);
@@ -1372,6 +1686,9 @@ gabble_connection_finalize (GObject *object)
 
   gabble_capabilities_finalize (self);
 
+  gabble_timer_wheel_destroy (self->timer_wheel);
+  tp_clear_pointer (&self->avatar_store, gabble_avatar_store_free);
+
   G_OBJECT_CLASS (gabble_connection_parent_class)->finalize (object);
 }
 
@@ -1544,37 +1861,115 @@ msg_handler_data_free (GabbleMsgHandlerData *handler_data)
   g_slice_free (GabbleMsgHandlerData, handler_data);
 }
 
+/* A get IQ in flight on behalf of everyone who asked for the same thing
+ * while it was outstanding. */
+typedef struct {
+    /* owned; the key under which we're stored in @table */
+    gchar *fingerprint;
+    /* owned reference to GabbleConnectionPrivate.shared_gets, so we can
+     * remove ourselves even if the reply arrives after the connection has
+     * gone away */
+    GHashTable *table;
+    /* owned GabbleMsgHandlerData *, in the order they were sent */
+    GQueue waiters;
+
+    /* For IQ statistics: the connection (borrowed), the stanza that was
+     * actually sent, and when; sent_at is 0 if nobody wanted statistics. We
+     * also keep a ref to the connection's iq_reply_cancellable, which is
+     * cancelled when the connection is disposed, to tell whether @conn is
+     * still safe to use. */
+    GabbleConnection *conn;
+    WockyStanza *msg;
+    gint64 sent_at;
+    GCancellable *cancellable;
+} GabbleSharedGet;
+
+/* Returns a string identifying what @msg asks for, such that two gets with
+ * the same fingerprint are guaranteed to get the same answer; or NULL if
+ * @msg is not something we can share. */
+static gchar *
+iq_get_fingerprint (WockyStanza *msg)
+{
+  WockyStanzaType type;
+  WockyStanzaSubType sub_type;
+  WockyNode *payload;
+  const gchar *to;
+  gchar *payload_str, *ret;
+
+  wocky_stanza_get_type_info (msg, &type, &sub_type);
+
+  if (type != WOCKY_STANZA_TYPE_IQ || sub_type != WOCKY_STANZA_SUB_TYPE_GET)
+    return NULL;
+
+  payload = wocky_node_get_first_child (wocky_stanza_get_top_node (msg));
+
+  if (payload == NULL)
+    return NULL;
+
+  /* The serialization includes the payload's namespace, its attributes (such
+   * as a disco node) and all its children, but not the <iq/>'s id. */
+  to = wocky_stanza_get_to (msg);
+  payload_str = wocky_node_to_string (payload);
+  ret = g_strdup_printf ("%s\n%s", to != NULL ? to : "", payload_str);
+  g_free (payload_str);
+
+  return ret;
+}
+
 static void
 message_send_reply_cb (
     GObject *source,
     GAsyncResult *result,
     gpointer user_data)
 {
-  GabbleMsgHandlerData *handler_data = user_data;
+  GabbleSharedGet *shared = user_data;
+  GabbleMsgHandlerData *handler_data;
+  WockyPorter *porter = WOCKY_PORTER (source);
+  GError *error = NULL;
+  WockyStanza *stanza = wocky_porter_send_iq_finish (porter, result, &error);
 
-  if (handler_data->object_alive && handler_data->reply_func != NULL)
-    {
-      WockyPorter *porter = WOCKY_PORTER (source);
-      GError *error = NULL;
-      WockyStanza *stanza = wocky_porter_send_iq_finish (porter, result, &error);
+  /* Anyone asking for the same thing from now on has to send a new get. */
+  if (shared->fingerprint != NULL &&
+      g_hash_table_lookup (shared->table, shared->fingerprint) == shared)
+    g_hash_table_remove (shared->table, shared->fingerprint);
 
+  if (shared->sent_at != 0 &&
+      !g_cancellable_is_cancelled (shared->cancellable))
+    {
       if (stanza != NULL)
+        conn_iq_stats_replied (shared->conn, shared->msg, stanza,
+            shared->sent_at);
+      else
+        conn_iq_stats_failed (shared->conn, shared->msg, shared->sent_at);
+    }
+
+  if (stanza == NULL)
+    {
+      DEBUG ("send_iq_async failed: %s", error->message);
+      g_error_free (error);
+    }
+
+  while ((handler_data = g_queue_pop_head (&shared->waiters)) != NULL)
+    {
+      if (stanza != NULL &&
+          handler_data->object_alive && handler_data->reply_func != NULL)
         {
           handler_data->reply_func (handler_data->conn,
                                     handler_data->sent_msg,
                                     stanza,
                                     handler_data->object,
                                     handler_data->user_data);
-          g_object_unref (stanza);
-        }
-      else
-        {
-          DEBUG ("send_iq_async failed: %s", error->message);
-          g_error_free (error);
         }
+
+      msg_handler_data_free (handler_data);
     }
 
-  msg_handler_data_free (handler_data);
+  tp_clear_object (&stanza);
+  g_object_unref (shared->msg);
+  g_object_unref (shared->cancellable);
+  g_hash_table_unref (shared->table);
+  g_free (shared->fingerprint);
+  g_slice_free (GabbleSharedGet, shared);
 }
 
 /**
@@ -1586,6 +1981,10 @@ message_send_reply_cb (
  * which means that if the object is destroyed the callback will not be invoked.
  *
  * if reply_func is NULL the reply will be ignored.
+ *
+ * If msg is a get IQ identical to one which is already in flight, it is not
+ * sent: instead, reply_func will be called with the reply to the earlier one.
+ * Callers must not modify the reply.
  */
 gboolean
 _gabble_connection_send_with_reply (GabbleConnection *conn,
@@ -1597,6 +1996,8 @@ _gabble_connection_send_with_reply (GabbleConnection *conn,
 {
   GabbleConnectionPrivate *priv;
   GabbleMsgHandlerData *handler_data;
+  GabbleSharedGet *shared = NULL;
+  gchar *fingerprint;
 
   g_assert (GABBLE_IS_CONNECTION (conn));
   priv = conn->priv;
@@ -1625,8 +2026,40 @@ _gabble_connection_send_with_reply (GabbleConnection *conn,
                          handler_data);
     }
 
+  fingerprint = iq_get_fingerprint (msg);
+
+  if (fingerprint != NULL)
+    shared = g_hash_table_lookup (priv->shared_gets, fingerprint);
+
+  if (shared != NULL)
+    {
+      DEBUG ("an identical get to %s is already in flight; sharing it",
+          wocky_stanza_get_to (msg));
+      priv->shared_gets_hits++;
+      conn_iq_stats_shared (conn, msg);
+      g_queue_push_tail (&shared->waiters, handler_data);
+      g_free (fingerprint);
+      return TRUE;
+    }
+
+  shared = g_slice_new0 (GabbleSharedGet);
+  shared->table = g_hash_table_ref (priv->shared_gets);
+  shared->conn = conn;
+  shared->msg = g_object_ref (msg);
+  shared->cancellable = g_object_ref (priv->iq_reply_cancellable);
+  shared->sent_at = conn_iq_stats_sent (conn, msg);
+  g_queue_init (&shared->waiters);
+  g_queue_push_tail (&shared->waiters, handler_data);
+
+  if (fingerprint != NULL)
+    {
+      shared->fingerprint = fingerprint;
+      g_hash_table_insert (priv->shared_gets, fingerprint, shared);
+      priv->shared_gets_misses++;
+    }
+
   wocky_porter_send_iq_async (priv->porter, msg,
-      priv->iq_reply_cancellable, message_send_reply_cb, handler_data);
+      priv->iq_reply_cancellable, message_send_reply_cb, shared);
 
   return TRUE;
 }
@@ -1921,6 +2354,25 @@ connector_connected (GabbleConnection *self,
       return;
     }
 
+  /* Roster versioning is advertised as a stream feature rather than in
+   * disco, so check for it before the connector and its features go */
+  if (conn != NULL && priv->connector != NULL)
+    {
+      WockyStanza *features = NULL;
+
+      g_object_get (priv->connector, "features", &features, NULL);
+
+      if (features != NULL &&
+          wocky_node_get_child_ns (wocky_stanza_get_top_node (features),
+            "ver", NS_ROSTER_VERSIONING) != NULL)
+        {
+          DEBUG ("Server supports roster versioning");
+          self->features |= GABBLE_CONNECTION_FEATURES_ROSTER_VERSIONING;
+        }
+
+      tp_clear_object (&features);
+    }
+
   /* We don't need the connector any more */
   tp_clear_object (&priv->connector);
 
@@ -1951,6 +2403,7 @@ connector_connected (GabbleConnection *self,
 
   wocky_pep_service_start (self->pep_location, self->session);
   wocky_pep_service_start (self->pep_nick, self->session);
+  wocky_pep_service_start (self->pep_avatar_metadata, self->session);
   wocky_pep_service_start (self->pep_olpc_buddy_props, self->session);
   wocky_pep_service_start (self->pep_olpc_activities, self->session);
   wocky_pep_service_start (self->pep_olpc_current_act, self->session);
@@ -2345,6 +2798,9 @@ connection_shut_down (TpBaseConnection *base)
 
   priv->closing = TRUE;
 
+  DEBUG ("shared get IQs: %u hits, %u misses", priv->shared_gets_hits,
+      priv->shared_gets_misses);
+
   if (priv->porter != NULL)
     {
       DEBUG ("connection may still be open; closing it: %p", base);
@@ -3126,59 +3582,76 @@ gabble_connection_build_contact_caps (
   return ret;
 }
 
+/* Emits CapabilitiesChanged and ContactCapabilitiesChanged once each for
+ * all of @n_handles contacts whose caps have changed */
 static void
-_emit_capabilities_changed (GabbleConnection *conn,
-                            TpHandle handle,
-                            const GabbleCapabilitySet *old_set,
-                            const GabbleCapabilitySet *new_set)
+_emit_capabilities_changed_multiple (GabbleConnection *conn,
+    guint n_handles,
+    const TpHandle *handles,
+    const GabbleCapabilitySet * const *old_sets,
+    const GabbleCapabilitySet * const *new_sets)
 {
   GPtrArray *caps_arr;
   const CapabilityConversionData *ccd;
   GHashTable *hash;
-  guint i;
-
-  if (gabble_capability_set_equals (old_set, new_set))
-    return;
+  guint i, j;
 
   /* o.f.T.C.Capabilities */
 
   caps_arr = g_ptr_array_new ();
+  hash = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) gabble_free_rcc_list);
 
-  for (ccd = capabilities_conversions; NULL != ccd->iface; ccd++)
+  for (j = 0; j < n_handles; j++)
     {
-      guint old_specific = ccd->c2tf_fn (old_set);
-      guint new_specific = ccd->c2tf_fn (new_set);
+      TpHandle handle = handles[j];
+      const GabbleCapabilitySet *old_set = old_sets[j];
+      const GabbleCapabilitySet *new_set = new_sets[j];
 
-      if (old_specific != 0 || new_specific != 0)
+      if (gabble_capability_set_equals (old_set, new_set))
+        continue;
+
+      for (ccd = capabilities_conversions; NULL != ccd->iface; ccd++)
         {
-          GValue caps_monster_struct = {0, };
-          guint old_generic = old_specific ?
-            TP_CONNECTION_CAPABILITY_FLAG_CREATE |
-            TP_CONNECTION_CAPABILITY_FLAG_INVITE : 0;
-          guint new_generic = new_specific ?
-            TP_CONNECTION_CAPABILITY_FLAG_CREATE |
-            TP_CONNECTION_CAPABILITY_FLAG_INVITE : 0;
-
-          if (0 == (old_specific ^ new_specific))
-            continue;
-
-          g_value_init (&caps_monster_struct,
-              TP_STRUCT_TYPE_CAPABILITY_CHANGE);
-          g_value_take_boxed (&caps_monster_struct,
-              dbus_g_type_specialized_construct
-                (TP_STRUCT_TYPE_CAPABILITY_CHANGE));
-
-          dbus_g_type_struct_set (&caps_monster_struct,
-              0, handle,
-              1, ccd->iface,
-              2, old_generic,
-              3, new_generic,
-              4, old_specific,
-              5, new_specific,
-              G_MAXUINT);
-
-          g_ptr_array_add (caps_arr, g_value_get_boxed (&caps_monster_struct));
+          guint old_specific = ccd->c2tf_fn (old_set);
+          guint new_specific = ccd->c2tf_fn (new_set);
+
+          if (old_specific != 0 || new_specific != 0)
+            {
+              GValue caps_monster_struct = {0, };
+              guint old_generic = old_specific ?
+                TP_CONNECTION_CAPABILITY_FLAG_CREATE |
+                TP_CONNECTION_CAPABILITY_FLAG_INVITE : 0;
+              guint new_generic = new_specific ?
+                TP_CONNECTION_CAPABILITY_FLAG_CREATE |
+                TP_CONNECTION_CAPABILITY_FLAG_INVITE : 0;
+
+              if (0 == (old_specific ^ new_specific))
+                continue;
+
+              g_value_init (&caps_monster_struct,
+                  TP_STRUCT_TYPE_CAPABILITY_CHANGE);
+              g_value_take_boxed (&caps_monster_struct,
+                  dbus_g_type_specialized_construct
+                    (TP_STRUCT_TYPE_CAPABILITY_CHANGE));
+
+              dbus_g_type_struct_set (&caps_monster_struct,
+                  0, handle,
+                  1, ccd->iface,
+                  2, old_generic,
+                  3, new_generic,
+                  4, old_specific,
+                  5, new_specific,
+                  G_MAXUINT);
+
+              g_ptr_array_add (caps_arr,
+                  g_value_get_boxed (&caps_monster_struct));
+            }
         }
+
+      /* o.f.T.C.ContactCapabilities */
+      g_hash_table_insert (hash, GUINT_TO_POINTER (handle),
+          gabble_connection_build_contact_caps (conn, handle, new_set));
     }
 
   if (caps_arr->len)
@@ -3193,19 +3666,22 @@ _emit_capabilities_changed (GabbleConnection *conn,
     }
   g_ptr_array_unref (caps_arr);
 
-  /* o.f.T.C.ContactCapabilities */
-  caps_arr = gabble_connection_build_contact_caps (conn, handle, new_set);
-
-  hash = g_hash_table_new_full (NULL, NULL, NULL,
-      (GDestroyNotify) gabble_free_rcc_list);
-  g_hash_table_insert (hash, GUINT_TO_POINTER (handle), caps_arr);
-
-  tp_svc_connection_interface_contact_capabilities_emit_contact_capabilities_changed (
-      conn, hash);
+  if (g_hash_table_size (hash) > 0)
+    tp_svc_connection_interface_contact_capabilities_emit_contact_capabilities_changed (
+        conn, hash);
 
   g_hash_table_unref (hash);
 }
 
+static void
+_emit_capabilities_changed (GabbleConnection *conn,
+                            TpHandle handle,
+                            const GabbleCapabilitySet *old_set,
+                            const GabbleCapabilitySet *new_set)
+{
+  _emit_capabilities_changed_multiple (conn, 1, &handle, &old_set, &new_set);
+}
+
 static const GabbleCapabilitySet *
 empty_caps_set (void)
 {
@@ -3233,6 +3709,9 @@ gabble_connection_get_handle_contact_capabilities (
 
   if (handle == tp_base_connection_get_self_handle (base))
     p = self->self_presence;
+  else if (gabble_presence_cache_peek_snapshot (self->presence_cache, handle,
+        &caps, NULL))
+    return gabble_connection_build_contact_caps (self, handle, caps);
   else
     p = gabble_presence_cache_get (self->presence_cache, handle);
 
@@ -3256,6 +3735,21 @@ connection_capabilities_update_cb (GabblePresenceCache *cache,
   _emit_capabilities_changed (conn, handle, old_cap_set, new_cap_set);
 }
 
+static void
+connection_capabilities_batch_update_cb (GabblePresenceCache *cache,
+    const GArray *handles,
+    const GPtrArray *old_cap_sets,
+    const GPtrArray *new_cap_sets,
+    gpointer user_data)
+{
+  GabbleConnection *conn = GABBLE_CONNECTION (user_data);
+
+  _emit_capabilities_changed_multiple (conn, handles->len,
+      (const TpHandle *) handles->data,
+      (const GabbleCapabilitySet * const *) old_cap_sets->pdata,
+      (const GabbleCapabilitySet * const *) new_cap_sets->pdata);
+}
+
 /**
  * gabble_connection_advertise_capabilities
  *
@@ -3642,9 +4136,13 @@ gabble_connection_get_handle_capabilities (GabbleConnection *self,
     }
 
   if (handle == tp_base_connection_get_self_handle (base))
-    pres = self->self_presence;
+    {
+      pres = self->self_presence;
+    }
   else
-    pres = gabble_presence_cache_get (self->presence_cache, handle);
+    {
+      pres = gabble_presence_cache_get (self->presence_cache, handle);
+    }
 
   if (NULL != pres)
     {
@@ -3782,6 +4280,12 @@ gabble_connection_get_capabilities (TpSvcConnectionInterfaceCapabilities *iface,
       return;
     }
 
+  /* someone has asked, so if we've put off finding out, don't any more;
+   * unlike contact attributes, which are fetched in bulk. Neither 0 nor the
+   * self handle are ever lazy. */
+  gabble_presence_cache_ensure_caps_for_handles (self->presence_cache,
+      handles);
+
   ret = g_ptr_array_new ();
 
   for (i = 0; i < handles->len; i++)
@@ -3832,6 +4336,10 @@ gabble_connection_get_contact_capabilities (
       return;
     }
 
+  /* as in GetCapabilities, asking explicitly ends any laziness */
+  gabble_presence_cache_ensure_caps_for_handles (self->presence_cache,
+      handles);
+
   ret = g_hash_table_new_full (NULL, NULL, NULL,
       (GDestroyNotify) gabble_free_rcc_list);
 
@@ -30,6 +30,7 @@
 #include <wocky/wocky.h>
 
 #include "gabble/capabilities.h"
+#include "avatar-store.h"
 #ifdef ENABLE_FILE_TRANSFER
 #include "ft-manager.h"
 #endif
@@ -37,6 +38,7 @@
 #include "jingle-mint.h"
 #endif
 #include "muc-factory.h"
+#include "timer-wheel.h"
 #include "types.h"
 
 #include <gabble/capabilities-set.h>
@@ -137,11 +139,13 @@ typedef enum
   GABBLE_CONNECTION_FEATURES_GOOGLE_QUEUE = 1 << 8,
   GABBLE_CONNECTION_FEATURES_GOOGLE_SETTING = 1 << 9,
   GABBLE_CONNECTION_FEATURES_WLM_JID_LOOKUP = 1 << 10,
+  GABBLE_CONNECTION_FEATURES_ROSTER_VERSIONING = 1 << 11,
 } GabbleConnectionFeatures;
 
 typedef struct _GabbleConnectionPrivate GabbleConnectionPrivate;
 typedef struct _GabbleConnectionMailNotificationPrivate GabbleConnectionMailNotificationPrivate;
 typedef struct _GabbleConnectionPresencePrivate GabbleConnectionPresencePrivate;
+typedef struct _GabbleConnectionIqStatsPrivate GabbleConnectionIqStatsPrivate;
 
 typedef void (*GabbleConnectionMsgReplyFunc) (
     GabbleConnection *conn,
@@ -203,6 +207,9 @@ struct _GabbleConnection {
     /* vCard lookup helper */
     GabbleVCardManager *vcard_manager;
 
+    /* Shared by everything which needs a timeout on an outstanding request */
+    GabbleTimerWheel *timer_wheel;
+
     /* OLPC hash tables */
     GHashTable *olpc_activities_info;
     GHashTable *olpc_pep_activities;
@@ -215,6 +222,14 @@ struct _GabbleConnection {
     /* outstanding avatar requests */
     GHashTable *avatar_requests;
 
+    /* TpHandle => what the contact last published about their avatar with
+     * XEP-0084, which is private to conn-avatars.c */
+    GHashTable *pep_avatars;
+
+    /* contacts' avatars on disk, if the "avatar-cache" parameter is set;
+     * NULL otherwise */
+    GabbleAvatarStore *avatar_store;
+
     /* outstanding vcard requests */
     GHashTable *vcard_requests;
 
@@ -230,6 +245,7 @@ struct _GabbleConnection {
     /* PEP */
     WockyPepService *pep_nick;
     WockyPepService *pep_location;
+    WockyPepService *pep_avatar_metadata;
     WockyPepService *pep_olpc_buddy_props;
     WockyPepService *pep_olpc_activities;
     WockyPepService *pep_olpc_current_act;
@@ -245,6 +261,9 @@ struct _GabbleConnection {
     /* Mail Notification */
     GabbleConnectionMailNotificationPrivate *mail_priv;
 
+    /* IQ latency and outcome statistics */
+    GabbleConnectionIqStatsPrivate *iq_stats_priv;
+
     /* ContactInfo.SupportedFields, or NULL to use the generic one */
     GPtrArray *contact_info_fields;
 
@@ -32,6 +32,7 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_DISCO
 
+#include "conn-iq-stats.h"
 #include "connection.h"
 #include "debug.h"
 #include "error.h"
@@ -72,7 +73,7 @@ struct _GabbleDiscoPrivate
 struct _GabbleDiscoRequest
 {
   GabbleDisco *disco;
-  guint timer_id;
+  GabbleTimer *timer;
 
   GabbleDiscoType type;
   gchar *jid;
@@ -301,9 +302,9 @@ delete_request (GabbleDiscoRequest *request)
           request);
     }
 
-  if (0 != request->timer_id)
+  if (NULL != request->timer)
     {
-      g_source_remove (request->timer_id);
+      gabble_timer_wheel_cancel (request->timer);
     }
 
   g_free (request->jid);
@@ -311,13 +312,13 @@ delete_request (GabbleDiscoRequest *request)
   g_slice_free (GabbleDiscoRequest, request);
 }
 
-static gboolean
+static void
 timeout_request (gpointer data)
 {
   GabbleDiscoRequest *request = (GabbleDiscoRequest *) data;
   GabbleDisco *disco;
   GError *err = NULL;
-  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_if_fail (data != NULL);
 
   err = g_error_new (GABBLE_DISCO_ERROR, GABBLE_DISCO_ERROR_TIMEOUT,
       "Request for %s on %s timed out",
@@ -328,6 +329,10 @@ timeout_request (gpointer data)
    * destroys us (as seen in test-disco-no-reply.py) */
   disco = g_object_ref (request->disco);
 
+  conn_iq_stats_timed_out (disco->priv->connection,
+      (request->type == GABBLE_DISCO_TYPE_INFO) ? NS_DISCO_INFO :
+          NS_DISCO_ITEMS);
+
   /* also, we're about to run the callback, so it's too late to cancel it -
    * avoid crashing if running the callback destroys the bound object */
   if (NULL != request->bound_object)
@@ -341,12 +346,10 @@ timeout_request (gpointer data)
                       NULL, err, request->user_data);
   g_error_free (err);
 
-  request->timer_id = 0;
+  request->timer = NULL;
   delete_request (request);
 
   g_object_unref (disco);
-
-  return FALSE;
 }
 
 static void
@@ -427,6 +430,12 @@ notify_delete_request (gpointer data, GObject *obj)
   delete_request (request);
 }
 
+static GabbleDiscoRequest *disco_request_page (GabbleDisco *self,
+    GabbleDiscoType type, const gchar *jid, const char *node,
+    guint timeout, guint page_size, const gchar *after,
+    GabbleDiscoCb callback, gpointer user_data, GObject *object,
+    GError **error);
+
 /**
  * gabble_disco_request:
  * @self: #GabbleDisco object to use for request
@@ -475,6 +484,25 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
                                    guint timeout, GabbleDiscoCb callback,
                                    gpointer user_data, GObject *object,
                                    GError **error)
+{
+  return disco_request_page (self, type, jid, node, timeout, 0, NULL,
+      callback, user_data, object, error);
+}
+
+/*
+ * disco_request_page:
+ * @page_size: if non-zero, ask for at most this many results using
+ *             XEP-0059 Result Set Management
+ * @after: if not NULL, the <last> of the previous page of results
+ *
+ * As gabble_disco_request_with_timeout(), but for one page of results.
+ */
+static GabbleDiscoRequest *
+disco_request_page (GabbleDisco *self, GabbleDiscoType type,
+                    const gchar *jid, const char *node,
+                    guint timeout, guint page_size, const gchar *after,
+                    GabbleDiscoCb callback, gpointer user_data,
+                    GObject *object, GError **error)
 {
   GabbleDiscoPrivate *priv = self->priv;
   GabbleDiscoRequest *request;
@@ -509,6 +537,18 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
       wocky_node_set_attribute (lm_node, "node", node);
     }
 
+  if (page_size > 0)
+    {
+      WockyNode *set = wocky_node_add_child_ns (lm_node, "set", NS_RSM);
+      gchar *max = g_strdup_printf ("%u", page_size);
+
+      wocky_node_add_child_with_content (set, "max", max);
+      g_free (max);
+
+      if (after != NULL)
+        wocky_node_add_child_with_content (set, "after", after);
+    }
+
   if (! _gabble_connection_send_with_reply (priv->connection, msg,
         request_reply_cb, G_OBJECT(self), request, error))
     {
@@ -518,8 +558,8 @@ gabble_disco_request_with_timeout (GabbleDisco *self, GabbleDiscoType type,
     }
   else
     {
-      request->timer_id =
-          g_timeout_add_seconds (timeout, timeout_request, request);
+      request->timer = gabble_timer_wheel_add_seconds (
+          priv->connection->timer_wheel, timeout, timeout_request, request);
       g_object_unref (msg);
       return request;
     }
@@ -553,6 +593,14 @@ struct _GabbleDiscoPipeline {
     GHashTable *remaining_items;
     GabbleDiscoRequest *list_request;
     gboolean running;
+    /* if non-zero, ask for items this many at a time (XEP-0059) */
+    guint page_size;
+    /* the <last> of the page of items we most recently asked for */
+    gchar *after;
+    /* if TRUE, report items as they are listed, without disco#info */
+    gboolean items_only;
+    /* why we couldn't list all the items, or NULL if we could */
+    GError *error;
 };
 
 static void
@@ -694,11 +742,13 @@ gabble_disco_fill_pipeline (GabbleDisco *disco, GabbleDiscoPipeline *pipeline)
           g_hash_table_remove (pipeline->remaining_items, jid);
         }
 
-      if (0 == pipeline->disco_pipeline->len)
+      if (0 == pipeline->disco_pipeline->len &&
+          NULL == pipeline->list_request)
         {
           /* signal that the pipeline has finished */
           pipeline->running = FALSE;
-          pipeline->end_callback (pipeline, pipeline->user_data);
+          pipeline->end_callback (pipeline, pipeline->error,
+              pipeline->user_data);
         }
     }
 }
@@ -717,13 +767,20 @@ disco_items_cb (GabbleDisco *disco,
   gpointer key, value;
   GabbleDiscoPipeline *pipeline = (GabbleDiscoPipeline *) user_data;
   WockyNodeIter i;
-  WockyNode *item;
+  WockyNode *item, *set;
+  guint n_items = 0;
 
   pipeline->list_request = NULL;
 
   if (error)
     {
+      /* whatever pages we did get are still reported, but they're not the
+       * whole list */
       DEBUG ("Got error on items request: %s", error->message);
+
+      if (pipeline->error == NULL)
+        pipeline->error = g_error_copy (error);
+
       goto out;
     }
 
@@ -732,9 +789,21 @@ disco_items_cb (GabbleDisco *disco,
     {
       item_jid = wocky_node_get_attribute (item, "jid");
 
-      if (NULL != item_jid &&
-          !g_hash_table_lookup_extended (pipeline->remaining_items, item_jid,
-            &key, &value))
+      if (NULL == item_jid)
+        continue;
+
+      n_items++;
+
+      if (pipeline->items_only)
+        {
+          GabbleDiscoItem listed = { NULL, };
+
+          listed.jid = item_jid;
+          listed.name = wocky_node_get_attribute (item, "name");
+          pipeline->callback (pipeline, &listed, pipeline->user_data);
+        }
+      else if (!g_hash_table_lookup_extended (pipeline->remaining_items,
+            item_jid, &key, &value))
         {
           gchar *tmp = g_strdup (item_jid);
           DEBUG ("discovered service item: %s", tmp);
@@ -742,6 +811,27 @@ disco_items_cb (GabbleDisco *disco,
         }
     }
 
+  /* If the server pages its results, ask for the next page while we look
+   * at this one; an empty page, or one which ends where the last one did,
+   * means there are no more. */
+  set = wocky_node_get_child_ns (result, "set", NS_RSM);
+
+  if (pipeline->page_size > 0 && n_items > 0 && set != NULL)
+    {
+      const gchar *last = wocky_node_get_content_from_child (set, "last");
+
+      if (last != NULL && tp_strdiff (last, pipeline->after))
+        {
+          DEBUG ("asking %s for the items after %s", jid, last);
+          g_free (pipeline->after);
+          pipeline->after = g_strdup (last);
+          pipeline->list_request = disco_request_page (pipeline->disco,
+              GABBLE_DISCO_TYPE_ITEMS, jid, NULL, DEFAULT_REQUEST_TIMEOUT,
+              pipeline->page_size, pipeline->after, disco_items_cb, pipeline,
+              G_OBJECT (pipeline->disco), NULL);
+        }
+    }
+
 out:
   gabble_disco_fill_pipeline (disco, pipeline);
 }
@@ -771,10 +861,50 @@ gpointer gabble_disco_pipeline_init (GabbleDisco *disco,
       g_free, NULL);
   pipeline->running = TRUE;
   pipeline->disco = disco;
+  pipeline->list_request = NULL;
+  pipeline->page_size = 0;
+  pipeline->after = NULL;
+  pipeline->items_only = FALSE;
+  pipeline->error = NULL;
 
   return pipeline;
 }
 
+/**
+ * gabble_disco_pipeline_set_page_size:
+ * @self: reference to the pipeline structure
+ * @page_size: how many items to ask for at a time, or 0 for all at once
+ *
+ * Asks for the server's items a page at a time using XEP-0059 Result Set
+ * Management, so that the INFO queries can start before the whole list
+ * has arrived. Servers which don't page their results send them all in
+ * response to the first request, as usual.
+ */
+void
+gabble_disco_pipeline_set_page_size (gpointer self, guint page_size)
+{
+  GabbleDiscoPipeline *pipeline = (GabbleDiscoPipeline *) self;
+
+  pipeline->page_size = page_size;
+}
+
+/**
+ * gabble_disco_pipeline_set_items_only:
+ * @self: reference to the pipeline structure
+ * @items_only: whether to skip the INFO queries
+ *
+ * If @items_only is %TRUE, the callback is called for each item as soon as
+ * the server lists it, with only its jid and (possibly %NULL) name; its
+ * category, type and features are all %NULL.
+ */
+void
+gabble_disco_pipeline_set_items_only (gpointer self, gboolean items_only)
+{
+  GabbleDiscoPipeline *pipeline = (GabbleDiscoPipeline *) self;
+
+  pipeline->items_only = items_only;
+}
+
 /**
  * gabble_disco_pipeline_run:
  * @self: reference to the pipeline structure
@@ -786,7 +916,8 @@ gpointer gabble_disco_pipeline_init (GabbleDisco *disco,
  * for destroying the hash table after it's done with.
  *
  * Upon returning all the results, the end_callback is called with
- * reference to the pipeline.
+ * reference to the pipeline, and the error which stopped us listing every
+ * item, if there was one.
  */
 void
 gabble_disco_pipeline_run (gpointer self, const char *server)
@@ -795,8 +926,13 @@ gabble_disco_pipeline_run (gpointer self, const char *server)
 
   pipeline->running = TRUE;
 
-  pipeline->list_request = gabble_disco_request (pipeline->disco,
-      GABBLE_DISCO_TYPE_ITEMS, server, NULL, disco_items_cb, pipeline,
+  g_free (pipeline->after);
+  pipeline->after = NULL;
+  g_clear_error (&pipeline->error);
+
+  pipeline->list_request = disco_request_page (pipeline->disco,
+      GABBLE_DISCO_TYPE_ITEMS, server, NULL, DEFAULT_REQUEST_TIMEOUT,
+      pipeline->page_size, NULL, disco_items_cb, pipeline,
       G_OBJECT (pipeline->disco), NULL);
 }
 
@@ -832,6 +968,8 @@ gabble_disco_pipeline_destroy (gpointer self)
 
   g_hash_table_unref (pipeline->remaining_items);
   g_ptr_array_unref (pipeline->disco_pipeline);
+  g_free (pipeline->after);
+  g_clear_error (&pipeline->error);
   g_free (pipeline);
 }
 
@@ -116,6 +116,7 @@ typedef void (*GabbleDiscoPipelineCb)(gpointer pipeline,
                                       gpointer user_data);
 
 typedef void (*GabbleDiscoEndCb)(gpointer pipeline,
+                                 const GError *error,
                                  gpointer user_data);
 
 gpointer gabble_disco_pipeline_init (GabbleDisco *disco,
@@ -123,6 +124,8 @@ gpointer gabble_disco_pipeline_init (GabbleDisco *disco,
                                      GabbleDiscoEndCb end_callback,
                                      gpointer user_data);
 
+void gabble_disco_pipeline_set_page_size (gpointer self, guint page_size);
+void gabble_disco_pipeline_set_items_only (gpointer self, gboolean items_only);
 void gabble_disco_pipeline_run (gpointer self, const char *server);
 void gabble_disco_pipeline_destroy (gpointer self);
 
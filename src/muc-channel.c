@@ -31,6 +31,8 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include "extensions/extensions.h"
+
 #define DEBUG_FLAG GABBLE_DEBUG_MUC
 #include "connection.h"
 #include "conn-aliasing.h"
@@ -55,6 +57,21 @@
 #define DEFAULT_LEAVE_TIMEOUT 180
 #define MAX_NICK_RETRIES 3
 
+/* how many occupants' presences to parse per main loop iteration, when
+ * there are too many to parse at once on joining a room */
+#define DEFERRED_PRESENCES_PER_ITERATION 100
+
+/* in rooms with more occupants than this when we join, occupants' caps are
+ * only discovered when somebody needs them */
+#define LAZY_CAPS_MIN_OCCUPANTS 100
+
+/* how far before the last live message, by our clock, to ask rooms for
+ * history from on rejoining, in case the server's clock is behind ours;
+ * anything this replays that we already had is dropped by its ID */
+#define HISTORY_CLOCK_MARGIN 60 * 5
+/* how many of the most recent messages' IDs to remember for that */
+#define MAX_RECENT_MESSAGE_IDS 50
+
 #define PROPS_POLL_INTERVAL_LOW  60 * 5
 #define PROPS_POLL_INTERVAL_HIGH 60
 
@@ -86,6 +103,8 @@ G_DEFINE_TYPE_WITH_CODE (GabbleMucChannel, gabble_muc_channel,
       tp_base_room_config_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_INTERFACE_SUBJECT,
       subject_iface_init);
+    G_IMPLEMENT_INTERFACE (
+      GABBLE_TYPE_SVC_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY, NULL);
     )
 
 static void gabble_muc_channel_send (GObject *obj, TpMessage *message,
@@ -101,7 +120,7 @@ enum
     READY,
     JOIN_ERROR,
     PRE_INVITE,
-    CONTACT_JOIN,
+    CONTACTS_JOIN,
     PRE_PRESENCE,
     NEW_TUBE,
 
@@ -134,6 +153,13 @@ enum
   PROP_SUBJECT_ACTOR,
   PROP_SUBJECT_TIMESTAMP,
   PROP_CAN_SET_SUBJECT,
+  PROP_HISTORY_MAX_CHARS,
+  PROP_HISTORY_MAX_STANZAS,
+  PROP_HISTORY_SECONDS,
+  PROP_HISTORY_SINCE,
+  PROP_LAST_MESSAGE_TIME,
+  PROP_HISTORY_SEEN_IDS,
+  PROP_RECENT_MESSAGE_IDS,
 
   LAST_PROPERTY
 };
@@ -187,6 +213,25 @@ struct _GabbleMucChannelPrivate
   DBusGMethodInvocation *set_subject_context;
   gchar *set_subject_stanza_id;
 
+  /* Gabble.MUCHistory interface: limits on the history asked for when
+   * joining, each -1 or 0 if unset */
+  gint history_max_chars;
+  gint history_max_stanzas;
+  gint history_seconds;
+  gint64 history_since;
+  /* when the most recent server-stamped (that is, replayed) message we've
+   * delivered was sent, or 0 */
+  gint64 last_stamped_time;
+  /* when, by our clock, the most recent live message we've delivered
+   * arrived, or 0 */
+  gint64 last_unstamped_time;
+  /* owned xmpp_id => owned xmpp_id: messages delivered by this room's
+   * previous channel, dropped if the history replays them */
+  GHashTable *history_seen_ids;
+  /* owned xmpp_ids of the most recent messages we've delivered, oldest
+   * first, at most MAX_RECENT_MESSAGE_IDS */
+  GQueue *recent_message_ids;
+
   gboolean ready;
   gboolean dispose_has_run;
   gboolean invited;
@@ -198,6 +243,35 @@ struct _GabbleMucChannelPrivate
   /* tube ID => owned GabbleTubeIface */
   GHashTable *tubes;
 
+  /* When we join a large room, occupants' presences are parsed a few at a
+   * time once we're in, rather than all at once before: TpHandle => owned
+   * WockyStanza, in the order received in deferred_order, unless superseded
+   * by a later presence */
+  GHashTable *deferred_presences;
+  GQueue *deferred_order;
+  guint deferred_presences_id;
+
+  /* TRUE if this room was large enough when we joined that occupants' caps
+   * are discovered lazily: see gabble_presence_cache_set_caps_lazy() */
+  gboolean lazy_caps;
+
+  /* If the "coalesce-presence-signals" parameter is set, occupants coming
+   * and going are gathered here and applied to the group mixin together by
+   * flush_member_changes(), after coalesce_window milliseconds or on the
+   * next main loop iteration. Each handle is in at most one of
+   * pending_added and pending_removed, whichever it did most recently; all
+   * of the pending changes share one message, actor and reason. */
+  gboolean coalesce_members;
+  guint coalesce_window;
+  guint pending_members_id;
+  TpIntset *pending_added;
+  TpIntset *pending_removed;
+  /* TpHandle => owner TpHandle (or 0), for handles in pending_added */
+  GHashTable *pending_owners;
+  gchar *pending_message;
+  TpHandle pending_actor;
+  TpChannelGroupChangeReason pending_reason;
+
 #ifdef ENABLE_VOIP
   /* Current active call */
   GabbleCallMucChannel *call;
@@ -240,6 +314,8 @@ gabble_muc_channel_get_interfaces (TpBaseChannel *base)
   g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_ROOM);
   g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_ROOM_CONFIG);
   g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_SUBJECT);
+  g_ptr_array_add (interfaces,
+      GABBLE_IFACE_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY);
 
   return interfaces;
 }
@@ -256,6 +332,17 @@ gabble_muc_channel_init (GabbleMucChannel *self)
 
   priv->tubes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) g_object_unref);
+  priv->deferred_presences = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) g_object_unref);
+  priv->deferred_order = g_queue_new ();
+
+  priv->pending_added = tp_intset_new ();
+  priv->pending_removed = tp_intset_new ();
+  priv->pending_owners = g_hash_table_new (NULL, NULL);
+
+  priv->history_seen_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  priv->recent_message_ids = g_queue_new ();
 }
 
 static TpHandle create_room_identity (GabbleMucChannel *)
@@ -436,6 +523,11 @@ gabble_muc_channel_constructed (GObject *obj)
   if (priv->initially_register)
     tp_base_channel_register (base);
 
+  g_object_get (base_conn,
+      "coalesce-presence-signals", &priv->coalesce_members,
+      "coalesce-presence-window", &priv->coalesce_window,
+      NULL);
+
   /* initialize group mixin */
   tp_group_mixin_init (obj,
       G_STRUCT_OFFSET (GabbleMucChannel, group),
@@ -791,8 +883,16 @@ static void
 send_join_request (GabbleMucChannel *gmuc)
 {
   GabbleMucChannelPrivate *priv = gmuc->priv;
+  GDateTime *since = NULL;
+
+  if (priv->history_since != 0)
+    since = g_date_time_new_from_unix_utc (priv->history_since);
 
-  wocky_muc_join (priv->wmuc, NULL);
+  wocky_muc_join_with_history (priv->wmuc, priv->history_max_chars,
+      priv->history_max_stanzas, priv->history_seconds, since, NULL);
+
+  if (since != NULL)
+    g_date_time_unref (since);
 }
 
 static void
@@ -872,6 +972,21 @@ send_leave_message (GabbleMucChannel *gmuc,
     g_timeout_add_seconds (DEFAULT_LEAVE_TIMEOUT, timeout_leave, gmuc);
 }
 
+/* When to ask for history since, on rejoining, to get everything after the
+ * last message we delivered; or 0 if we haven't delivered any */
+static gint64
+get_last_message_time (GabbleMucChannel *chan)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+  gint64 when = priv->last_stamped_time;
+
+  if (priv->last_unstamped_time != 0)
+    when = MAX (when,
+        MAX (priv->last_unstamped_time - (HISTORY_CLOCK_MARGIN), 1));
+
+  return when;
+}
+
 static void
 gabble_muc_channel_get_property (GObject    *object,
                                  guint       property_id,
@@ -931,6 +1046,34 @@ gabble_muc_channel_get_property (GObject    *object,
     case PROP_CAN_SET_SUBJECT:
       g_value_set_boolean (value, priv->can_set_subject);
       break;
+    case PROP_HISTORY_MAX_CHARS:
+      g_value_set_int (value, priv->history_max_chars);
+      break;
+    case PROP_HISTORY_MAX_STANZAS:
+      g_value_set_int (value, priv->history_max_stanzas);
+      break;
+    case PROP_HISTORY_SECONDS:
+      g_value_set_int (value, priv->history_seconds);
+      break;
+    case PROP_HISTORY_SINCE:
+      g_value_set_int64 (value, priv->history_since);
+      break;
+    case PROP_LAST_MESSAGE_TIME:
+      g_value_set_int64 (value, get_last_message_time (chan));
+      break;
+    case PROP_RECENT_MESSAGE_IDS:
+      {
+        GPtrArray *ids = g_ptr_array_sized_new (
+            priv->recent_message_ids->length + 1);
+        GList *l;
+
+        for (l = priv->recent_message_ids->head; l != NULL; l = l->next)
+          g_ptr_array_add (ids, g_strdup (l->data));
+
+        g_ptr_array_add (ids, NULL);
+        g_value_take_boxed (value, g_ptr_array_free (ids, FALSE));
+      }
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -984,6 +1127,27 @@ gabble_muc_channel_set_property (GObject     *object,
     case PROP_ROOM_NAME:
       priv->room_name = g_value_dup_string (value);
       break;
+    case PROP_HISTORY_MAX_CHARS:
+      priv->history_max_chars = g_value_get_int (value);
+      break;
+    case PROP_HISTORY_MAX_STANZAS:
+      priv->history_max_stanzas = g_value_get_int (value);
+      break;
+    case PROP_HISTORY_SECONDS:
+      priv->history_seconds = g_value_get_int (value);
+      break;
+    case PROP_HISTORY_SINCE:
+      priv->history_since = g_value_get_int64 (value);
+      break;
+    case PROP_HISTORY_SEEN_IDS:
+      {
+        gchar **ids = g_value_get_boxed (value);
+
+        for (; ids != NULL && *ids != NULL; ids++)
+          g_hash_table_insert (priv->history_seen_ids, g_strdup (*ids),
+              NULL);
+      }
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -1017,6 +1181,10 @@ gabble_muc_channel_fill_immutable_properties (
       TP_IFACE_CHANNEL_INTERFACE_MESSAGES, "MessageTypes",
       TP_IFACE_CHANNEL_INTERFACE_ROOM, "RoomName",
       TP_IFACE_CHANNEL_INTERFACE_ROOM, "Server",
+      GABBLE_IFACE_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY, "MaxChars",
+      GABBLE_IFACE_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY, "MaxStanzas",
+      GABBLE_IFACE_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY, "Seconds",
+      GABBLE_IFACE_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY, "Since",
       NULL);
 }
 
@@ -1044,6 +1212,13 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
       { "CanSet", "can-set-subject", NULL },
       { NULL }
   };
+  static TpDBusPropertiesMixinPropImpl history_props[] = {
+      { "MaxChars", "history-max-chars", NULL },
+      { "MaxStanzas", "history-max-stanzas", NULL },
+      { "Seconds", "history-seconds", NULL },
+      { "Since", "history-since", NULL },
+      { NULL }
+  };
 
   static TpDBusPropertiesMixinIfaceImpl prop_interfaces[] = {
     { TP_IFACE_CHANNEL_INTERFACE_CONFERENCE,
@@ -1061,6 +1236,11 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
       NULL,
       subject_props,
     },
+    { GABBLE_IFACE_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY,
+      tp_dbus_properties_mixin_getter_gobject_properties,
+      NULL,
+      history_props,
+    },
     { NULL }
   };
 
@@ -1195,6 +1375,64 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
   g_object_class_install_property (object_class, PROP_CAN_SET_SUBJECT,
       param_spec);
 
+  param_spec = g_param_spec_int ("history-max-chars",
+      "MUCHistory.MaxChars",
+      "The most characters of history to ask for on joining, or -1",
+      -1, G_MAXINT, -1,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HISTORY_MAX_CHARS,
+      param_spec);
+
+  param_spec = g_param_spec_int ("history-max-stanzas",
+      "MUCHistory.MaxStanzas",
+      "The most messages of history to ask for on joining, or -1",
+      -1, G_MAXINT, -1,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HISTORY_MAX_STANZAS,
+      param_spec);
+
+  param_spec = g_param_spec_int ("history-seconds",
+      "MUCHistory.Seconds",
+      "How many seconds of history to ask for on joining, or -1",
+      -1, G_MAXINT, -1,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HISTORY_SECONDS,
+      param_spec);
+
+  param_spec = g_param_spec_int64 ("history-since",
+      "MUCHistory.Since",
+      "The UNIX timestamp after which to ask for history on joining, or 0",
+      0, G_MAXINT64, 0,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HISTORY_SINCE,
+      param_spec);
+
+  param_spec = g_param_spec_int64 ("last-message-time",
+      "Last message time",
+      "The UNIX timestamp from which to ask for history to get everything "
+      "since the most recent message delivered, or 0",
+      0, G_MAXINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_LAST_MESSAGE_TIME,
+      param_spec);
+
+  param_spec = g_param_spec_boxed ("history-seen-ids",
+      "History seen IDs",
+      "The IDs of messages already delivered from this room, not to be "
+      "delivered again if the history replays them",
+      G_TYPE_STRV,
+      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HISTORY_SEEN_IDS,
+      param_spec);
+
+  param_spec = g_param_spec_boxed ("recent-message-ids",
+      "Recent message IDs",
+      "The IDs of the most recent messages delivered, oldest first",
+      G_TYPE_STRV,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_RECENT_MESSAGE_IDS,
+      param_spec);
+
   signals[READY] =
     g_signal_new ("ready",
                   G_OBJECT_CLASS_TYPE (gabble_muc_channel_class),
@@ -1222,14 +1460,16 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
                   g_cclosure_marshal_VOID__STRING,
                   G_TYPE_NONE, 1, G_TYPE_STRING);
 
-  signals[CONTACT_JOIN] =
-    g_signal_new ("contact-join",
+  /* Emitted once when we join, with a TpHandleSet of the owners of those
+   * occupants whose real JIDs we can see */
+  signals[CONTACTS_JOIN] =
+    g_signal_new ("contacts-join",
                   G_OBJECT_CLASS_TYPE (gabble_muc_channel_class),
                   G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
                   0,
                   NULL, NULL,
-                  g_cclosure_marshal_VOID__UINT,
-                  G_TYPE_NONE, 1, G_TYPE_UINT);
+                  g_cclosure_marshal_VOID__POINTER,
+                  G_TYPE_NONE, 1, G_TYPE_POINTER);
 
   signals[PRE_PRESENCE] =
     g_signal_new ("pre-presence",
@@ -1280,6 +1520,11 @@ gabble_muc_channel_class_init (GabbleMucChannelClass *gabble_muc_channel_class)
 static void clear_join_timer (GabbleMucChannel *chan);
 static void clear_poll_timer (GabbleMucChannel *chan);
 static void clear_leave_timer (GabbleMucChannel *chan);
+static void clear_deferred_presences (GabbleMucChannel *chan);
+static void forget_deferred_presence (GabbleMucChannel *gmuc,
+    TpHandle handle);
+static void flush_member_changes (GabbleMucChannel *gmuc);
+static void clear_member_changes (GabbleMucChannel *gmuc);
 
 void
 gabble_muc_channel_dispose (GObject *object)
@@ -1297,6 +1542,8 @@ gabble_muc_channel_dispose (GObject *object)
   clear_join_timer (self);
   clear_poll_timer (self);
   clear_leave_timer (self);
+  clear_deferred_presences (self);
+  clear_member_changes (self);
 
   tp_clear_object (&priv->wmuc);
   tp_clear_object (&priv->requests_cancellable);
@@ -1346,6 +1593,17 @@ gabble_muc_channel_finalize (GObject *object)
   g_free (priv->subject);
   g_free (priv->subject_actor);
 
+  g_hash_table_unref (priv->deferred_presences);
+  g_queue_free (priv->deferred_order);
+
+  tp_intset_destroy (priv->pending_added);
+  tp_intset_destroy (priv->pending_removed);
+  g_hash_table_unref (priv->pending_owners);
+
+  g_hash_table_unref (priv->history_seen_ids);
+  g_queue_foreach (priv->recent_message_ids, (GFunc) g_free, NULL);
+  g_queue_free (priv->recent_message_ids);
+
   tp_group_mixin_finalize (object);
   tp_message_mixin_finalize (object);
 
@@ -1580,6 +1838,8 @@ close_channel (GabbleMucChannel *chan, const gchar *reason,
   g_object_ref (chan);
 
   g_hash_table_remove_all (priv->tubes);
+  clear_deferred_presences (chan);
+  flush_member_changes (chan);
 
 #ifdef ENABLE_VOIP
   muc_call_channel_finish_requests (chan, NULL, &error);
@@ -1617,6 +1877,16 @@ close_channel (GabbleMucChannel *chan, const gchar *reason,
   handles = tp_handle_set_to_array (chan->group.members);
   gabble_presence_cache_update_many (conn->presence_cache, handles,
     NULL, GABBLE_PRESENCE_UNKNOWN, NULL, 0);
+
+  if (priv->lazy_caps)
+    {
+      guint i;
+
+      for (i = 0; i < handles->len; i++)
+        gabble_presence_cache_set_caps_lazy (conn->presence_cache,
+            g_array_index (handles, TpHandle, i), FALSE);
+    }
+
   g_array_unref (handles);
 
   if (priv->set_subject_context != NULL)
@@ -1720,6 +1990,8 @@ handle_nick_conflict (GabbleMucChannel *chan,
   tp_intset_add (add_rp, self_handle);
   tp_intset_add (remove_rp, mixin->self_handle);
 
+  /* so that nobody hears of occupants after our new self handle */
+  flush_member_changes (chan);
   tp_group_mixin_change_self_handle ((GObject *) chan, self_handle);
   tp_group_mixin_change_members ((GObject *) chan, NULL, NULL, remove_rp, NULL,
       add_rp, 0, TP_CHANNEL_GROUP_CHANGE_REASON_RENAMED);
@@ -2444,7 +2716,6 @@ handle_left (GObject *source,
   TpHandleRepoIface *contact_repo =
     tp_base_connection_get_handles (tp_base_channel_get_connection (base),
         TP_HANDLE_TYPE_CONTACT);
-  TpIntset *handles = NULL;
   TpHandle member = 0;
   TpHandle actor = 0;
 
@@ -2456,8 +2727,12 @@ handle_left (GObject *source,
       return;
     }
 
-  handles = tp_intset_new ();
-  tp_intset_add (handles, member);
+  forget_deferred_presence (gmuc, member);
+
+  if (gmuc->priv->lazy_caps)
+    gabble_presence_cache_set_caps_lazy (
+        GABBLE_CONNECTION (tp_base_channel_get_connection (base))->
+          presence_cache, member, FALSE);
 
   if (actor_jid != NULL)
     {
@@ -2471,12 +2746,9 @@ handle_left (GObject *source,
   /* handle_tube_presence creates tubes if need be, so bypass it here: */
   tubes_presence_update (gmuc, member, wocky_stanza_get_top_node (stanza));
 
-  tp_group_mixin_change_members (data, why, NULL, handles, NULL, NULL,
-      actor, reason);
+  queue_member_change (gmuc, member, FALSE, 0, why, actor, reason);
   tp_message_mixin_change_chat_state (data, member,
       TP_CHANNEL_CHAT_STATE_GONE);
-
-  tp_intset_destroy (handles);
 }
 
 /* connect to wocky-muc:SIG_PERM_CHANGE, which we will receive when the *
@@ -2561,6 +2833,8 @@ handle_renamed (GObject *source,
   TpHandle userid = tp_handle_ensure (contact_repo, me2,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
 
+  flush_member_changes (gmuc);
+
   tp_intset_add (old_self, TP_GROUP_MIXIN (gmuc)->self_handle);
   tp_group_mixin_change_self_handle (data, myself);
   tp_group_mixin_add_handle_owner (data, myself, userid);
@@ -2571,49 +2845,239 @@ handle_renamed (GObject *source,
   tp_intset_destroy (old_self);
 }
 
+/* Parses an occupant's presence, for their status and capabilities, and for
+ * any tubes they're in */
 static void
-update_roster_presence (GabbleMucChannel *gmuc,
-    WockyMucMember *member,
-    TpHandleRepoIface *contact_repo,
-    TpHandleSet *members,
-    TpHandleSet *owners,
-    GHashTable *omap)
+update_occupant_presence (GabbleMucChannel *gmuc,
+    TpHandle handle,
+    WockyStanza *presence)
 {
   TpBaseChannel *base = TP_BASE_CHANNEL (gmuc);
   GabbleConnection *conn =
       GABBLE_CONNECTION (tp_base_channel_get_connection (base));
-  TpHandle owner = 0;
-  TpHandle handle = tp_handle_ensure (contact_repo, member->from,
-      GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
 
-  if (member->jid != NULL)
+  gabble_presence_parse_presence_message (conn->presence_cache,
+      handle, wocky_stanza_get_from (presence), presence);
+  handle_tube_presence (gmuc, handle, presence);
+}
+
+static void
+clear_deferred_presences (GabbleMucChannel *chan)
+{
+  GabbleMucChannelPrivate *priv = chan->priv;
+
+  if (priv->deferred_presences_id != 0)
     {
-      owner = tp_handle_ensure (contact_repo, member->jid,
-          GUINT_TO_POINTER (GABBLE_JID_GLOBAL), NULL);
-      if (owner == 0)
-        DEBUG ("Invalid owner handle '%s', treating as no owner", member->jid);
-      else
-        tp_handle_set_add (owners, owner);
+      g_source_remove (priv->deferred_presences_id);
+      priv->deferred_presences_id = 0;
     }
 
-  gabble_presence_parse_presence_message (conn->presence_cache,
-      handle, member->from, (WockyStanza *) member->presence_stanza);
+  g_hash_table_remove_all (priv->deferred_presences);
+  g_queue_clear (priv->deferred_order);
+}
 
-  tp_handle_set_add (members, handle);
-  g_hash_table_insert (omap,
-      GUINT_TO_POINTER (handle),
-      GUINT_TO_POINTER (owner));
+static gboolean
+process_deferred_presences (gpointer data)
+{
+  GabbleMucChannel *gmuc = GABBLE_MUC_CHANNEL (data);
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+  guint i;
+
+  for (i = 0;
+      i < DEFERRED_PRESENCES_PER_ITERATION &&
+      !g_queue_is_empty (priv->deferred_order);
+      i++)
+    {
+      gpointer handle = g_queue_pop_head (priv->deferred_order);
+      WockyStanza *presence = g_hash_table_lookup (priv->deferred_presences,
+          handle);
+
+      /* they've sent another presence since, which has been dealt with */
+      if (presence == NULL)
+        continue;
+
+      g_object_ref (presence);
+      g_hash_table_remove (priv->deferred_presences, handle);
+      update_occupant_presence (gmuc, GPOINTER_TO_UINT (handle), presence);
+      g_object_unref (presence);
+    }
+
+  if (!g_queue_is_empty (priv->deferred_order))
+    return TRUE;
+
+  DEBUG ("all occupants' presences dealt with");
+  priv->deferred_presences_id = 0;
+  return FALSE;
+}
+
+static void
+defer_presence (GabbleMucChannel *gmuc,
+    TpHandle handle,
+    WockyStanza *presence)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+
+  g_hash_table_insert (priv->deferred_presences, GUINT_TO_POINTER (handle),
+      g_object_ref (presence));
+  g_queue_push_tail (priv->deferred_order, GUINT_TO_POINTER (handle));
+
+  if (priv->deferred_presences_id == 0)
+    priv->deferred_presences_id = g_idle_add (process_deferred_presences,
+        gmuc);
+}
+
+/* Called when a newer presence from @handle has arrived, which supersedes any
+ * still waiting to be parsed */
+static void
+forget_deferred_presence (GabbleMucChannel *gmuc,
+    TpHandle handle)
+{
+  g_hash_table_remove (gmuc->priv->deferred_presences,
+      GUINT_TO_POINTER (handle));
+}
+
+static void
+flush_member_changes (GabbleMucChannel *gmuc)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+
+  if (priv->pending_members_id != 0)
+    {
+      g_source_remove (priv->pending_members_id);
+      priv->pending_members_id = 0;
+    }
+
+  /* owners first, so they're known by the time anyone hears of the new
+   * members */
+  if (g_hash_table_size (priv->pending_owners) > 0)
+    {
+      tp_group_mixin_add_handle_owners ((GObject *) gmuc,
+          priv->pending_owners);
+      g_hash_table_remove_all (priv->pending_owners);
+    }
+
+  if (!tp_intset_is_empty (priv->pending_added) ||
+      !tp_intset_is_empty (priv->pending_removed))
+    {
+      DEBUG ("%u occupants arrived and %u left",
+          tp_intset_size (priv->pending_added),
+          tp_intset_size (priv->pending_removed));
+
+      tp_group_mixin_change_members ((GObject *) gmuc,
+          priv->pending_message != NULL ? priv->pending_message : "",
+          priv->pending_added, priv->pending_removed, NULL, NULL,
+          priv->pending_actor, priv->pending_reason);
+
+      tp_intset_clear (priv->pending_added);
+      tp_intset_clear (priv->pending_removed);
+    }
 
-  /* make a note of the fact that owner JIDs are visible to us    */
-  /* notify whomever that an identifiable contact joined the MUC  */
-  if (owner != 0)
+  tp_clear_pointer (&priv->pending_message, g_free);
+  priv->pending_actor = 0;
+  priv->pending_reason = TP_CHANNEL_GROUP_CHANGE_REASON_NONE;
+}
+
+static gboolean
+flush_member_changes_cb (gpointer data)
+{
+  GabbleMucChannel *gmuc = GABBLE_MUC_CHANNEL (data);
+
+  gmuc->priv->pending_members_id = 0;
+  flush_member_changes (gmuc);
+  return FALSE;
+}
+
+/* Drops any pending changes without applying them, for when the channel is
+ * going away */
+static void
+clear_member_changes (GabbleMucChannel *gmuc)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+
+  if (priv->pending_members_id != 0)
     {
-      tp_group_mixin_change_flags (G_OBJECT (gmuc), 0,
-          TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
-      g_signal_emit (gmuc, signals[CONTACT_JOIN], 0, owner);
+      g_source_remove (priv->pending_members_id);
+      priv->pending_members_id = 0;
     }
 
-  handle_tube_presence (gmuc, handle, member->presence_stanza);
+  tp_intset_clear (priv->pending_added);
+  tp_intset_clear (priv->pending_removed);
+  g_hash_table_remove_all (priv->pending_owners);
+  tp_clear_pointer (&priv->pending_message, g_free);
+}
+
+/* Records that the occupant @handle has arrived (with @owner, possibly 0) or
+ * left, to be applied to the group mixin with any other changes which follow
+ * soon after with the same @message, @actor and @reason. */
+static void
+queue_member_change (GabbleMucChannel *gmuc,
+    TpHandle handle,
+    gboolean arrived,
+    TpHandle owner,
+    const gchar *message,
+    TpHandle actor,
+    TpChannelGroupChangeReason reason)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+
+  if (message == NULL)
+    message = "";
+
+  /* changes which must be signalled differently can't be merged with those
+   * already waiting, which must be signalled before them */
+  if (tp_strdiff (message, priv->pending_message != NULL ?
+        priv->pending_message : "") ||
+      actor != priv->pending_actor ||
+      reason != priv->pending_reason)
+    flush_member_changes (gmuc);
+
+  if (priv->pending_message == NULL && message[0] != '\0')
+    priv->pending_message = g_strdup (message);
+
+  priv->pending_actor = actor;
+  priv->pending_reason = reason;
+
+  /* only the most recent change for each handle counts */
+  if (arrived)
+    {
+      tp_intset_remove (priv->pending_removed, handle);
+      tp_intset_add (priv->pending_added, handle);
+      g_hash_table_insert (priv->pending_owners, GUINT_TO_POINTER (handle),
+          GUINT_TO_POINTER (owner));
+    }
+  else
+    {
+      tp_intset_remove (priv->pending_added, handle);
+      g_hash_table_remove (priv->pending_owners, GUINT_TO_POINTER (handle));
+      tp_intset_add (priv->pending_removed, handle);
+    }
+
+  if (!priv->coalesce_members)
+    flush_member_changes (gmuc);
+  else if (priv->pending_members_id != 0)
+    return;
+  else if (priv->coalesce_window == 0)
+    priv->pending_members_id = g_idle_add (flush_member_changes_cb, gmuc);
+  else
+    priv->pending_members_id = g_timeout_add (priv->coalesce_window,
+        flush_member_changes_cb, gmuc);
+}
+
+/* TRUE if @handle is in the room, taking changes not yet applied into
+ * account */
+static gboolean
+is_occupant (GabbleMucChannel *gmuc,
+    TpHandle handle)
+{
+  GabbleMucChannelPrivate *priv = gmuc->priv;
+
+  if (tp_intset_is_member (priv->pending_added, handle))
+    return TRUE;
+
+  if (tp_intset_is_member (priv->pending_removed, handle))
+    return FALSE;
+
+  return tp_handle_set_is_member (gmuc->group.members, handle);
 }
 
 /* connect to wocky_muc SIG_JOINED which we should receive when we receive   *
@@ -2637,24 +3101,81 @@ handle_join (WockyMuc *muc,
   const gchar *me = wocky_muc_jid (muc);
   TpHandle myself = tp_handle_ensure (contact_repo, me,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
+  /* In a large room, parsing everyone's presence (and looking up their
+   * capabilities) would hold up the main loop for seconds; so in that case,
+   * everyone is added to the channel first, and their presences are dealt
+   * with afterwards, a few at a time. */
+  gboolean defer = g_hash_table_size (member_jids) >
+      DEFERRED_PRESENCES_PER_ITERATION;
   GHashTableIter iter;
   WockyMucMember *member;
 
+  gmuc->priv->lazy_caps = g_hash_table_size (member_jids) >
+      LAZY_CAPS_MIN_OCCUPANTS;
+
+  if (gmuc->priv->lazy_caps)
+    DEBUG ("%u occupants; not discovering their caps until needed",
+        g_hash_table_size (member_jids));
+
   g_hash_table_iter_init (&iter, member_jids);
 
   while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&member))
-    update_roster_presence (gmuc, member, contact_repo,
-      members, owners, omap);
+    {
+      TpHandle owner = 0;
+      TpHandle handle = tp_handle_ensure (contact_repo, member->from,
+          GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
+
+      if (handle == 0)
+        {
+          DEBUG ("ignoring malformed MUC JID '%s'", member->from);
+          continue;
+        }
+
+      if (member->jid != NULL)
+        {
+          owner = tp_handle_ensure (contact_repo, member->jid,
+              GUINT_TO_POINTER (GABBLE_JID_GLOBAL), NULL);
+
+          if (owner == 0)
+            DEBUG ("Invalid owner handle '%s', treating as no owner",
+                member->jid);
+          else
+            tp_handle_set_add (owners, owner);
+        }
+
+      tp_handle_set_add (members, handle);
+      g_hash_table_insert (omap, GUINT_TO_POINTER (handle),
+          GUINT_TO_POINTER (owner));
+
+      if (gmuc->priv->lazy_caps)
+        gabble_presence_cache_set_caps_lazy (
+            GABBLE_CONNECTION (base_conn)->presence_cache, handle, TRUE);
+
+      if (defer)
+        defer_presence (gmuc, handle, member->presence_stanza);
+      else
+        update_occupant_presence (gmuc, handle, member->presence_stanza);
+    }
 
   g_hash_table_insert (omap,
       GUINT_TO_POINTER (myself),
       GUINT_TO_POINTER (tp_base_connection_get_self_handle (base_conn)));
 
+  /* make a note of the fact that owner JIDs are visible to us */
+  if (tp_handle_set_size (owners) > 0)
+    tp_group_mixin_change_flags (G_OBJECT (gmuc), 0,
+        TP_CHANNEL_GROUP_FLAG_HANDLE_OWNERS_NOT_AVAILABLE);
+
   tp_handle_set_add (members, myself);
+  flush_member_changes (gmuc);
   tp_group_mixin_add_handle_owners (G_OBJECT (gmuc), omap);
   tp_group_mixin_change_members (G_OBJECT (gmuc), "",
       tp_handle_set_peek (members), NULL, NULL, NULL, 0, 0);
 
+  /* notify whomever that identifiable contacts joined the MUC */
+  if (tp_handle_set_size (owners) > 0)
+    g_signal_emit (gmuc, signals[CONTACTS_JOIN], 0, owners);
+
   /* accept the config of the room if it was created for us: */
   if (codes & WOCKY_MUC_CODE_NEW_ROOM)
     {
@@ -2701,7 +3222,6 @@ handle_presence (GObject *source,
   TpHandle owner = 0;
   TpHandle handle = tp_handle_ensure (contact_repo, who->from,
       GUINT_TO_POINTER (GABBLE_JID_ROOM_MEMBER), NULL);
-  TpHandleSet *handles = tp_handle_set_new (contact_repo);
 
   /* is the 'real' jid field of the presence set? If so, use it: */
   if (who->jid != NULL)
@@ -2719,16 +3239,18 @@ handle_presence (GObject *source,
         }
     }
 
+  forget_deferred_presence (gmuc, handle);
+
+  /* newcomers to a large room are treated like those there when we joined */
+  if (gmuc->priv->lazy_caps && !is_occupant (gmuc, handle))
+    gabble_presence_cache_set_caps_lazy (conn->presence_cache, handle, TRUE);
+
   gabble_presence_parse_presence_message (conn->presence_cache,
     handle, who->from, (WockyStanza *) who->presence_stanza);
 
-  /* add the member in quesion */
-  tp_handle_set_add (handles, handle);
-  tp_group_mixin_change_members (data, "", tp_handle_set_peek (handles),
-      NULL, NULL, NULL, 0, 0);
-
-  /* record the owner (0 for no owner) */
-  tp_group_mixin_add_handle_owner (data, handle, owner);
+  /* add the member in question, recording the owner (0 for no owner) */
+  queue_member_change (gmuc, handle, TRUE, owner, "", 0,
+      TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
 
   handle_tube_presence (gmuc, handle, stanza);
 
@@ -2747,8 +3269,6 @@ handle_presence (GObject *source,
         }
     }
 #endif
-
-  tp_handle_set_destroy (handles);
 }
 
 /* ************************************************************************ */
@@ -2809,10 +3329,44 @@ handle_message (GObject *source,
     }
 
   if (text != NULL)
-    _gabble_muc_channel_receive (gmuc,
-        msg_type, handle_type, from, datetime, xmpp_id, text, stanza,
-        NULL,
-        TP_DELIVERY_STATUS_DELIVERED);
+    {
+      GabbleMucChannelPrivate *priv = gmuc->priv;
+
+      /* Only history is stamped, by the server's clock; live messages are
+       * taken to have been sent when they arrive, by ours. Either way this
+       * is only used to ask for what we've missed when rejoining. */
+      if (datetime != NULL)
+        {
+          if (xmpp_id != NULL &&
+              g_hash_table_lookup_extended (priv->history_seen_ids, xmpp_id,
+                  NULL, NULL))
+            {
+              DEBUG ("already delivered %s before rejoining; ignoring it",
+                  xmpp_id);
+              return;
+            }
+
+          priv->last_stamped_time = MAX (priv->last_stamped_time,
+              g_date_time_to_unix (datetime));
+        }
+      else
+        {
+          priv->last_unstamped_time = g_get_real_time () / G_USEC_PER_SEC;
+        }
+
+      if (xmpp_id != NULL)
+        {
+          g_queue_push_tail (priv->recent_message_ids, g_strdup (xmpp_id));
+
+          if (priv->recent_message_ids->length > MAX_RECENT_MESSAGE_IDS)
+            g_free (g_queue_pop_head (priv->recent_message_ids));
+        }
+
+      _gabble_muc_channel_receive (gmuc,
+          msg_type, handle_type, from, datetime, xmpp_id, text, stanza,
+          NULL,
+          TP_DELIVERY_STATUS_DELIVERED);
+    }
 
   if (from_member && state != WOCKY_MUC_MSG_STATE_NONE)
     {
@@ -3398,6 +3952,7 @@ gabble_muc_channel_add_member (GObject *obj,
 
       tp_intset_add (set_remote_pending, handle);
 
+      flush_member_changes (self);
       tp_group_mixin_add_handle_owner (obj, mixin->self_handle,
           tp_base_connection_get_self_handle (conn));
       tp_group_mixin_change_members (obj, "", NULL, set_remove_members,
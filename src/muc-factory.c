@@ -20,6 +20,7 @@
 #include "config.h"
 #include "muc-factory.h"
 
+#include <errno.h>
 #include <string.h>
 
 #include <dbus/dbus-glib.h>
@@ -29,6 +30,8 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include "extensions/extensions.h"
+
 #define DEBUG_FLAG GABBLE_DEBUG_MUC
 
 #include "gabble/caps-channel-manager.h"
@@ -90,9 +93,56 @@ struct _GabbleMucFactoryPrivate
    * Borrowed TpExportableChannel => GSList of gpointer */
   GHashTable *queued_requests;
 
+  /* room JID => owned RoomHistory, so that rejoining only asks for what we
+   * missed */
+  GHashTable *room_histories;
+  /* If the "muc-history-cache" parameter is set, the file room_histories
+   * is kept in between connections; otherwise NULL */
+  gchar *history_store_path;
+
+  /* Rooms to which our presence is yet to be sent since it last changed,
+   * as GUINT_TO_POINTER (room handle): they're sent at most
+   * "muc-presence-rate" a second, each with whatever our presence is by
+   * then, so a room is never queued twice */
+  GQueue *presence_queue;
+  TpHandleSet *presence_queued;
+  guint presence_timer_id;
+  gint64 last_presence_sent;
+
   gboolean dispose_has_run;
 };
 
+#define HISTORY_STORE_KEY_LAST_MESSAGE "last-message-time"
+#define HISTORY_STORE_KEY_RECENT_IDS "recent-message-ids"
+
+typedef struct {
+    /* when to ask for history since, to get everything after the last
+     * message we delivered from the room */
+    gint64 since;
+    /* the IDs of the last few messages we delivered from it, which the
+     * history may replay nonetheless; may be NULL */
+    gchar **recent_ids;
+} RoomHistory;
+
+static RoomHistory *
+room_history_new (gint64 since,
+    gchar **recent_ids)
+{
+  RoomHistory *history = g_slice_new (RoomHistory);
+
+  history->since = since;
+  history->recent_ids = recent_ids;
+  return history;
+}
+
+static void
+room_history_free (RoomHistory *history)
+{
+  g_strfreev (history->recent_ids);
+  g_slice_free (RoomHistory, history);
+}
+
+
 static GObject *gabble_muc_factory_constructor (GType type, guint n_props,
     GObjectConstructParam *props);
 
@@ -118,6 +168,11 @@ gabble_muc_factory_init (GabbleMucFactory *fac)
   priv->queued_requests = g_hash_table_new_full (g_direct_hash,
       g_direct_equal, NULL, NULL);
 
+  priv->room_histories = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) room_history_free);
+
+  priv->presence_queue = g_queue_new ();
+
   priv->conn = NULL;
   priv->dispose_has_run = FALSE;
 }
@@ -157,6 +212,11 @@ gabble_muc_factory_dispose (GObject *object)
       priv->conn->disco);
   g_hash_table_unref (priv->disco_requests);
 
+  tp_clear_pointer (&priv->room_histories, g_hash_table_unref);
+  tp_clear_pointer (&priv->history_store_path, g_free);
+  tp_clear_pointer (&priv->presence_queue, g_queue_free);
+  tp_clear_pointer (&priv->presence_queued, tp_handle_set_destroy);
+
   if (G_OBJECT_CLASS (gabble_muc_factory_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_muc_factory_parent_class)->dispose (object);
 }
@@ -221,6 +281,150 @@ gabble_muc_factory_class_init (GabbleMucFactoryClass *gabble_muc_factory_class)
   g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
 }
 
+static gchar *
+history_store_build_path (GabbleMucFactory *fac)
+{
+  TpBaseConnection *base = (TpBaseConnection *) fac->priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  gchar *escaped, *filename, *path;
+
+  escaped = tp_escape_as_identifier (tp_handle_inspect (contact_repo,
+        tp_base_connection_get_self_handle (base)));
+  filename = g_strconcat (escaped, ".muc-history", NULL);
+  path = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+      "muc-history", filename, NULL);
+
+  g_free (filename);
+  g_free (escaped);
+  return path;
+}
+
+static void
+history_store_load (GabbleMucFactory *fac)
+{
+  GabbleMucFactoryPrivate *priv = fac->priv;
+  GKeyFile *keyfile = g_key_file_new ();
+  GError *error = NULL;
+  gchar **rooms;
+  guint i, n = 0;
+
+  if (!g_key_file_load_from_file (keyfile, priv->history_store_path,
+        G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("no rooms' history in %s: %s", priv->history_store_path,
+          error->message);
+      g_error_free (error);
+      g_key_file_free (keyfile);
+      return;
+    }
+
+  rooms = g_key_file_get_groups (keyfile, NULL);
+
+  for (i = 0; rooms[i] != NULL; i++)
+    {
+      gint64 when = g_key_file_get_int64 (keyfile, rooms[i],
+          HISTORY_STORE_KEY_LAST_MESSAGE, NULL);
+
+      if (when > 0)
+        {
+          g_hash_table_insert (priv->room_histories, g_strdup (rooms[i]),
+              room_history_new (when, g_key_file_get_string_list (keyfile,
+                  rooms[i], HISTORY_STORE_KEY_RECENT_IDS, NULL, NULL)));
+          n++;
+        }
+    }
+
+  DEBUG ("loaded the last message times of %u rooms from %s", n,
+      priv->history_store_path);
+
+  g_strfreev (rooms);
+  g_key_file_free (keyfile);
+}
+
+static void
+history_store_save (GabbleMucFactory *fac)
+{
+  GabbleMucFactoryPrivate *priv = fac->priv;
+  GKeyFile *keyfile;
+  GHashTableIter iter;
+  gpointer k, v;
+  gchar *dir, *data;
+  gsize len;
+  GError *error = NULL;
+
+  if (priv->history_store_path == NULL)
+    return;
+
+  keyfile = g_key_file_new ();
+  g_hash_table_iter_init (&iter, priv->room_histories);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      RoomHistory *history = v;
+
+      g_key_file_set_int64 (keyfile, k, HISTORY_STORE_KEY_LAST_MESSAGE,
+          history->since);
+
+      if (history->recent_ids != NULL)
+        g_key_file_set_string_list (keyfile, k, HISTORY_STORE_KEY_RECENT_IDS,
+            (const gchar * const *) history->recent_ids,
+            g_strv_length (history->recent_ids));
+    }
+
+  data = g_key_file_to_data (keyfile, &len, NULL);
+  dir = g_path_get_dirname (priv->history_store_path);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    DEBUG ("couldn't create %s: %s", dir, g_strerror (errno));
+  else if (!g_file_set_contents (priv->history_store_path, data, len,
+        &error))
+    {
+      DEBUG ("couldn't save rooms' history: %s", error->message);
+      g_error_free (error);
+    }
+
+  g_free (dir);
+  g_free (data);
+  g_key_file_free (keyfile);
+}
+
+/* Remembers when the last message @chan delivered was sent, and the IDs of
+ * the last few, if it delivered any, for the next time we join its room */
+static void
+remember_last_message (GabbleMucFactory *fac,
+    GabbleMucChannel *chan)
+{
+  GabbleMucFactoryPrivate *priv = fac->priv;
+  TpBaseChannel *base = TP_BASE_CHANNEL (chan);
+  TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_ROOM);
+  const gchar *room = tp_handle_inspect (room_repo,
+      tp_base_channel_get_target_handle (base));
+  RoomHistory *known;
+  gint64 when;
+  gchar **ids;
+
+  g_object_get (chan,
+      "last-message-time", &when,
+      "recent-message-ids", &ids,
+      NULL);
+
+  if (when == 0)
+    {
+      g_strfreev (ids);
+      return;
+    }
+
+  known = g_hash_table_lookup (priv->room_histories, room);
+
+  if (known != NULL && known->since > when)
+    g_strfreev (ids);
+  else
+    g_hash_table_insert (priv->room_histories, g_strdup (room),
+        room_history_new (when, ids));
+}
+
 /**
  * muc_channel_closed_cb:
  *
@@ -256,6 +460,9 @@ muc_channel_closed_cb (GabbleMucChannel *chan, gpointer user_data)
 
       DEBUG ("removing MUC channel with handle %d", room_handle);
 
+      remember_last_message (fac, chan);
+      history_store_save (fac);
+
       g_hash_table_remove (priv->text_channels, GUINT_TO_POINTER (room_handle));
     }
 }
@@ -448,13 +655,19 @@ new_muc_channel (GabbleMucFactory *fac,
                  GHashTable *initial_channels,
                  GArray *initial_handles,
                  char **initial_ids,
-                 const char *room_name)
+                 const char *room_name,
+                 GHashTable *request_properties)
 {
   GabbleMucFactoryPrivate *priv = fac->priv;
   TpBaseConnection *conn = (TpBaseConnection *) priv->conn;
+  TpHandleRepoIface *room_repo = tp_base_connection_get_handles (conn,
+      TP_HANDLE_TYPE_ROOM);
   GabbleMucChannel *chan;
   char *object_path;
   GPtrArray *initial_channels_array = NULL;
+  gint max_chars = -1, max_stanzas = -1, seconds = -1;
+  gint64 since = 0;
+  RoomHistory *history;
 
   g_assert (gabble_muc_factory_find_text_channel (fac, handle) == NULL);
 
@@ -479,6 +692,41 @@ new_muc_channel (GabbleMucFactory *fac,
   else
     initial_handles = g_array_new (FALSE, TRUE, sizeof (TpHandle));
 
+  if (request_properties != NULL)
+    {
+      gboolean valid;
+      gint value;
+
+      value = tp_asv_get_int32 (request_properties,
+          GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_MAX_CHARS, &valid);
+      if (valid)
+        max_chars = MAX (value, -1);
+
+      value = tp_asv_get_int32 (request_properties,
+          GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_MAX_STANZAS,
+          &valid);
+      if (valid)
+        max_stanzas = MAX (value, -1);
+
+      value = tp_asv_get_int32 (request_properties,
+          GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_SECONDS, &valid);
+      if (valid)
+        seconds = MAX (value, -1);
+
+      since = MAX (tp_asv_get_int64 (request_properties,
+          GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_SINCE, NULL), 0);
+    }
+
+  history = g_hash_table_lookup (priv->room_histories,
+      tp_handle_inspect (room_repo, handle));
+
+  if (since == 0 && history != NULL)
+    {
+      DEBUG ("rejoining; asking only for history since %" G_GINT64_FORMAT,
+          history->since);
+      since = history->since;
+    }
+
   DEBUG ("creating new chan, object path %s", object_path);
 
   chan = g_object_new (GABBLE_TYPE_MUC_CHANNEL,
@@ -495,6 +743,11 @@ new_muc_channel (GabbleMucFactory *fac,
        "initial-invitee-ids", initial_ids,
        "room-name", room_name,
        "initially-register", initially_register,
+       "history-max-chars", max_chars,
+       "history-max-stanzas", max_stanzas,
+       "history-seconds", seconds,
+       "history-since", since,
+       "history-seen-ids", history != NULL ? history->recent_ids : NULL,
        NULL);
 
   g_signal_connect (chan, "closed", (GCallback) muc_channel_closed_cb, fac);
@@ -544,7 +797,7 @@ do_invite (GabbleMucFactory *fac,
   if (gabble_muc_factory_find_text_channel (fac, room_handle) == NULL)
     {
       new_muc_channel (fac, room_handle, TRUE, inviter_handle, reason,
-          FALSE, TRUE, NULL, NULL, NULL, NULL);
+          FALSE, TRUE, NULL, NULL, NULL, NULL, NULL);
     }
   else
     {
@@ -810,23 +1063,132 @@ muc_factory_message_cb (
   return FALSE;
 }
 
+/* Sends our presence to the next queued room which we're still in, if any.
+ * Returns: %TRUE if there are more rooms queued */
+static gboolean
+send_next_queued_presence (GabbleMucFactory *self)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+
+  while (!g_queue_is_empty (priv->presence_queue))
+    {
+      TpHandle room = GPOINTER_TO_UINT (g_queue_pop_head (
+            priv->presence_queue));
+      GabbleMucChannel *channel;
+
+      tp_handle_set_remove (priv->presence_queued, room);
+      channel = gabble_muc_factory_find_text_channel (self, room);
+
+      if (channel != NULL)
+        {
+          gabble_muc_channel_send_presence (channel);
+          priv->last_presence_sent = g_get_monotonic_time ();
+          break;
+        }
+    }
+
+  return !g_queue_is_empty (priv->presence_queue);
+}
+
+static guint
+presence_interval_ms (GabbleMucFactory *self)
+{
+  guint rate;
+
+  g_object_get (self->priv->conn,
+      "muc-presence-rate", &rate,
+      NULL);
+
+  return rate == 0 ? 0 : MAX (1000 / rate, 1);
+}
+
+static void schedule_queued_presence (GabbleMucFactory *self);
+
+static gboolean
+queued_presence_cb (gpointer user_data)
+{
+  GabbleMucFactory *self = user_data;
+
+  self->priv->presence_timer_id = 0;
+
+  if (send_next_queued_presence (self))
+    schedule_queued_presence (self);
+
+  return FALSE;
+}
+
+/* Arranges for the next queued presence to be sent as soon as the rate
+ * allows */
+static void
+schedule_queued_presence (GabbleMucFactory *self)
+{
+  GabbleMucFactoryPrivate *priv = self->priv;
+  guint interval = presence_interval_ms (self);
+  gint64 since_last;
+
+  if (priv->presence_timer_id != 0)
+    return;
+
+  if (interval == 0)
+    {
+      while (send_next_queued_presence (self))
+        ;
+
+      return;
+    }
+
+  since_last = (g_get_monotonic_time () - priv->last_presence_sent) / 1000;
+
+  if (since_last >= interval)
+    {
+      if (!send_next_queued_presence (self))
+        return;
+
+      since_last = 0;
+    }
+
+  priv->presence_timer_id = g_timeout_add (interval - since_last,
+      queued_presence_cb, self);
+}
+
+/**
+ * gabble_muc_factory_broadcast_presence:
+ * @self: a MUC factory
+ *
+ * Sends our current presence to every room we're in, at no more than the
+ * rate the "muc-presence-rate" parameter allows. If our presence changes
+ * again before a room has been sent the last change, it's only sent the
+ * latest one.
+ */
 void
 gabble_muc_factory_broadcast_presence (GabbleMucFactory *self)
 {
   GabbleMucFactoryPrivate *priv = self->priv;
   GHashTableIter iter;
-  gpointer channel = NULL;
+  gpointer key, channel = NULL;
 
   if (priv->text_channels == NULL)
     return;
 
   g_hash_table_iter_init (&iter, priv->text_channels);
 
-  while (g_hash_table_iter_next (&iter, NULL, &channel))
+  while (g_hash_table_iter_next (&iter, &key, &channel))
     {
+      TpHandle room = GPOINTER_TO_UINT (key);
+
       g_assert (GABBLE_IS_MUC_CHANNEL (channel));
-      gabble_muc_channel_send_presence (GABBLE_MUC_CHANNEL (channel));
+
+      if (!tp_handle_set_is_member (priv->presence_queued, room))
+        {
+          tp_handle_set_add (priv->presence_queued, room);
+          g_queue_push_tail (priv->presence_queue, key);
+        }
     }
+
+  DEBUG ("%u rooms waiting for our presence",
+      g_queue_get_length (priv->presence_queue));
+
+  schedule_queued_presence (self);
 }
 
 static void
@@ -914,6 +1276,17 @@ gabble_muc_factory_close_all (GabbleMucFactory *self)
   tp_clear_pointer (&priv->queued_requests, g_hash_table_unref);
   tp_clear_pointer (&priv->text_needed_for_tube, g_hash_table_unref);
 
+  if (priv->presence_timer_id != 0)
+    {
+      g_source_remove (priv->presence_timer_id);
+      priv->presence_timer_id = 0;
+    }
+
+  g_queue_clear (priv->presence_queue);
+
+  if (priv->presence_queued != NULL)
+    tp_handle_set_clear (priv->presence_queued);
+
   /* Use a temporary variable because we don't want
    * muc_channel_closed_cb remove the channel from the hash table a
    * second time */
@@ -927,9 +1300,13 @@ gabble_muc_factory_close_all (GabbleMucFactory *self)
 
       g_hash_table_iter_init (&iter, tmp);
       while (g_hash_table_iter_next (&iter, NULL, &chan))
-        gabble_muc_channel_teardown (GABBLE_MUC_CHANNEL (chan));
+        {
+          remember_last_message (self, GABBLE_MUC_CHANNEL (chan));
+          gabble_muc_channel_teardown (GABBLE_MUC_CHANNEL (chan));
+        }
 
       g_hash_table_unref (tmp);
+      history_store_save (self);
     }
 
   if (priv->message_cb_id != 0)
@@ -963,8 +1340,22 @@ connection_status_changed_cb (GabbleConnection *conn,
                               guint reason,
                               GabbleMucFactory *self)
 {
+  gboolean store;
+
   switch (status)
     {
+    case TP_CONNECTION_STATUS_CONNECTED:
+      g_object_get (conn,
+          "muc-history-cache", &store,
+          NULL);
+
+      if (store)
+        {
+          self->priv->history_store_path = history_store_build_path (self);
+          history_store_load (self);
+        }
+      break;
+
     case TP_CONNECTION_STATUS_DISCONNECTED:
       gabble_muc_factory_close_all (self);
       break;
@@ -983,6 +1374,8 @@ gabble_muc_factory_constructor (GType type, guint n_props,
 
   priv->status_changed_id = g_signal_connect (priv->conn,
       "status-changed", (GCallback) connection_status_changed_cb, obj);
+  priv->presence_queued = tp_handle_set_new (tp_base_connection_get_handles (
+        (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_ROOM));
   tp_g_signal_connect_object (priv->conn,
       "porter-available", (GCallback) porter_available_cb, obj, 0);
 
@@ -1033,7 +1426,8 @@ ensure_muc_channel (GabbleMucFactory *fac,
                     GHashTable *initial_channels,
                     GArray *initial_handles,
                     char **initial_ids,
-                    const char *room_name)
+                    const char *room_name,
+                    GHashTable *request_properties)
 {
   TpBaseConnection *base_conn = (TpBaseConnection *) priv->conn;
 
@@ -1044,7 +1438,7 @@ ensure_muc_channel (GabbleMucFactory *fac,
       *ret = new_muc_channel (fac, handle, FALSE,
           tp_base_connection_get_self_handle (base_conn),
           NULL, requested, export_text, initial_channels,
-          initial_handles, initial_ids, room_name);
+          initial_handles, initial_ids, room_name, request_properties);
 
       gabble_muc_channel_set_autoclose (*ret, !export_text);
     }
@@ -1125,6 +1519,10 @@ static const gchar * const muc_channel_allowed_properties[] = {
     TP_PROP_CHANNEL_INTERFACE_CONFERENCE_INVITATION_MESSAGE,
     TP_PROP_CHANNEL_INTERFACE_ROOM_ROOM_NAME,
     TP_PROP_CHANNEL_INTERFACE_ROOM_SERVER,
+    GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_MAX_CHARS,
+    GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_MAX_STANZAS,
+    GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_SECONDS,
+    GABBLE_PROP_CHANNEL_INTERFACE_GABBLE_MUC_HISTORY_SINCE,
     NULL
 };
 
@@ -1440,7 +1838,8 @@ handle_text_channel_request (GabbleMucFactory *self,
     }
 
   if (ensure_muc_channel (self, priv, room, &text_chan, TRUE, TRUE,
-          final_channels, final_handles, final_ids, room_name))
+          final_channels, final_handles, final_ids, room_name,
+          request_properties))
     {
       /* channel exists */
 
@@ -1547,7 +1946,7 @@ handle_tube_channel_request (GabbleMucFactory *self,
 
   if (gmuc == NULL)
     ensure_muc_channel (self, priv, handle, &gmuc, FALSE, FALSE,
-        NULL, NULL, NULL, NULL);
+        NULL, NULL, NULL, NULL, NULL);
 
   can_announce_now = _gabble_muc_channel_is_ready (gmuc);
 
@@ -1702,7 +2101,8 @@ handle_call_channel_request (GabbleMucFactory *self,
       return FALSE;
     }
 
-  ensure_muc_channel (self, priv, handle, &muc, FALSE, FALSE, NULL, NULL, NULL, NULL);
+  ensure_muc_channel (self, priv, handle, &muc, FALSE, FALSE, NULL, NULL,
+      NULL, NULL, NULL);
 
   call = gabble_muc_channel_get_call (muc);
 
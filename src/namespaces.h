@@ -24,6 +24,8 @@
 #include "gabble/namespaces.h"
 
 #define NS_AMP                  "http://jabber.org/protocol/amp"
+#define NS_AVATAR_DATA          "urn:xmpp:avatar:data"
+#define NS_AVATAR_METADATA      "urn:xmpp:avatar:metadata"
 #define NS_BYTESTREAMS          "http://jabber.org/protocol/bytestreams"
 #define NS_CHAT_STATES          "http://jabber.org/protocol/chatstates"
 #define NS_DISCO_INFO           "http://jabber.org/protocol/disco#info"
@@ -106,6 +108,8 @@
 #define NS_RECEIPTS             "urn:xmpp:receipts"
 #define NS_REGISTER             "jabber:iq:register"
 #define NS_ROSTER               "jabber:iq:roster"
+#define NS_ROSTER_VERSIONING    "urn:xmpp:features:rosterver"
+#define NS_RSM                  "http://jabber.org/protocol/rsm"
 #define NS_SEARCH               "jabber:iq:search"
 #define NS_SI                   "http://jabber.org/protocol/si"
 #define NS_SI_MULTIPLE          "http://telepathy.freedesktop.org/xmpp/si-multiple"
@@ -23,6 +23,7 @@
 #include "vcard-manager.h"
 #include "gabble-enumtypes.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <glib.h>
@@ -42,6 +43,8 @@
 
 #include "gabble/capabilities.h"
 #include "gabble/caps-channel-manager.h"
+#include "caps-hash.h"
+#include "conn-iq-stats.h"
 #include "conn-presence.h"
 #include "debug.h"
 #include "disco.h"
@@ -55,6 +58,14 @@
  * got initial presence from all the contacts. */
 #define UNSURE_PERIOD 5
 
+/* Group keys in the capabilities snapshot */
+#define SNAPSHOT_KEY_CLIENT_TYPES "client-types"
+#define SNAPSHOT_KEY_RESOURCES "resources"
+#define SNAPSHOT_KEY_CAPS "caps"
+
+/* How many parsed disco replies to keep in front of the shared caps cache */
+#define PARSED_CAPS_MAX 256
+
 /* Time period from a de-cloak request in which we're unsure whether the
  * contact will disclose their presence later, or not at all. */
 #define DECLOAK_PERIOD 5
@@ -74,6 +85,7 @@ enum
   PRESENCES_UPDATED,
   NICKNAME_UPDATE,
   CAPABILITIES_UPDATE,
+  CAPABILITIES_BATCH_UPDATE,
   AVATAR_UPDATE,
   CAPABILITIES_DISCOVERED,
   LOCATION_UPDATED,
@@ -99,6 +111,11 @@ struct _GabblePresenceCachePrivate
   GHashTable *disco_pending;
   guint caps_serial;
 
+  /* contacts, in practice occupants of large rooms, whose caps aren't
+   * discovered until somebody needs them: see
+   * gabble_presence_cache_set_caps_lazy() */
+  TpHandleSet *lazy_caps;
+
   guint unsure_id;
   /* handle => DecloakContext */
   GHashTable *decloak_requests;
@@ -116,9 +133,103 @@ struct _GabblePresenceCachePrivate
   /* Are we resetting the image hash as per XEP-0153 section 4.4 */
   gboolean avatar_reset_pending;
 
+  /* If the "caps-snapshot" parameter is set, the file we load contacts'
+   * last-known capabilities from on connection, and save them to on
+   * disconnection; NULL otherwise. */
+  gchar *snapshot_path;
+  /* handle => SnapshotEntry, loaded from the snapshot and not yet confirmed
+   * by fresh presence */
+  GHashTable *snapshot;
+  /* handle => (resource => caps URI), as seen during this connection */
+  GHashTable *snapshot_resources;
+
+  /* If the "coalesce-presence-signals" parameter is set, contacts' changes
+   * are held back here and signalled together by batch_flush_cb(), on the
+   * next main loop iteration or after batch_window milliseconds. */
+  gboolean batching;
+  guint batch_window;
+  guint batch_source_id;
+  TpIntset *batch_presences;
+  /* handle => BatchedCaps */
+  GHashTable *batch_caps;
+  /* handle => owned avatar SHA-1 */
+  GHashTable *batch_avatars;
+  /* signals deferred since the last flush */
+  guint batch_n_queued;
+  /* signals which coalescing has saved us emitting so far */
+  guint batch_n_merged;
+
+  /* caps URI => borrowed ParsedCaps. Replies from the shared WockyCapsCache,
+   * already parsed, so that a flood of presences from contacts using the
+   * same client only reads and parses its reply once. Bounded at
+   * PARSED_CAPS_MAX entries, evicting the least recently used. */
+  GHashTable *parsed_caps;
+  /* the ParsedCaps, most recently used first */
+  GQueue parsed_caps_lru;
+
+  /* Cancelled when we disconnect or are disposed, so that replies still
+   * being hashed on the worker thread are dropped rather than processed */
+  GCancellable *hash_cancellable;
+
   gboolean dispose_has_run;
 };
 
+typedef struct {
+    /* the caps the contact had before this batch, and has now */
+    GabbleCapabilitySet *old_cap_set;
+    GabbleCapabilitySet *new_cap_set;
+} BatchedCaps;
+
+static void
+batched_caps_free (BatchedCaps *batched)
+{
+  gabble_capability_set_free (batched->old_cap_set);
+  gabble_capability_set_free (batched->new_cap_set);
+  g_slice_free (BatchedCaps, batched);
+}
+
+typedef struct {
+    /* union of the caps of the contact's last-known resources */
+    GabbleCapabilitySet *cap_set;
+    guint client_types;
+    /* resource => caps URI, kept so that it can be saved again if we
+     * disconnect before the contact's presence arrives */
+    GHashTable *resources;
+} SnapshotEntry;
+
+static void
+snapshot_entry_free (SnapshotEntry *entry)
+{
+  gabble_capability_set_free (entry->cap_set);
+  g_hash_table_unref (entry->resources);
+  g_slice_free (SnapshotEntry, entry);
+}
+
+typedef struct {
+    gchar *uri;
+    /* the whole reply, since the client types it implies depend on the
+     * resource which sent it */
+    WockyNodeTree *query;
+    /* frozen */
+    GabbleCapabilitySet *cap_set;
+    GPtrArray *data_forms;
+    /* this entry's place in priv->parsed_caps_lru */
+    GList link;
+} ParsedCaps;
+
+static void
+parsed_caps_free (ParsedCaps *parsed)
+{
+  g_free (parsed->uri);
+  g_object_unref (parsed->query);
+  gabble_capability_set_free (parsed->cap_set);
+  g_ptr_array_unref (parsed->data_forms);
+  g_slice_free (ParsedCaps, parsed);
+}
+
+static ParsedCaps *parsed_caps_lookup (GabblePresenceCache *cache,
+    const gchar *uri);
+
 typedef struct _DiscoWaiter DiscoWaiter;
 
 struct _DiscoWaiter
@@ -253,6 +364,30 @@ capability_info_free (GabbleCapabilityInfo *info)
   g_slice_free (GabbleCapabilityInfo, info);
 }
 
+/* Returns a frozen set equal to @cap_set: @cap_set itself, if it is already
+ * frozen, or otherwise a frozen copy. */
+static GabbleCapabilitySet *
+share_caps (const GabbleCapabilitySet *cap_set)
+{
+  if (gabble_capability_set_is_frozen (cap_set))
+    return gabble_capability_set_ref ((GabbleCapabilitySet *) cap_set);
+
+  return gabble_capability_set_freeze (gabble_capability_set_copy (cap_set));
+}
+
+/* Replaces the caps @info's node means with a frozen copy of @cap_set. Each
+ * node's set is shared by every resource which advertises that node, rather
+ * than copied into each of them, so it must never change in place. */
+static void
+capability_info_set_caps (GabbleCapabilityInfo *info,
+    const GabbleCapabilitySet *cap_set)
+{
+  GabbleCapabilitySet *shared = share_caps (cap_set);
+
+  tp_clear_pointer (&info->cap_set, gabble_capability_set_free);
+  info->cap_set = shared;
+}
+
 static void
 replace_data_forms (GabbleCapabilityInfo *info,
     GPtrArray *data_forms)
@@ -286,13 +421,7 @@ capability_info_recvd (GabblePresenceCache *cache,
        * never set.
        */
       tp_intset_clear (info->guys);
-
-      if (info->cap_set == NULL)
-        info->cap_set = gabble_capability_set_new ();
-      else
-        gabble_capability_set_clear (info->cap_set);
-
-      gabble_capability_set_update (info->cap_set, cap_set);
+      capability_info_set_caps (info, cap_set);
       info->trust = 0;
     }
 
@@ -416,6 +545,17 @@ gabble_presence_cache_class_init (GabblePresenceCacheClass *klass)
     NULL, NULL,
     gabble_marshal_VOID__UINT_POINTER_POINTER, G_TYPE_NONE,
     3, G_TYPE_UINT, G_TYPE_POINTER, G_TYPE_POINTER);
+  /* Emitted in place of capabilities-update when signals are being
+   * coalesced: the arguments are a GArray of handles, and GPtrArrays of
+   * their old and new GabbleCapabilitySets. */
+  signals[CAPABILITIES_BATCH_UPDATE] = g_signal_new (
+    "capabilities-batch-update",
+    G_TYPE_FROM_CLASS (klass),
+    G_SIGNAL_RUN_LAST,
+    0,
+    NULL, NULL,
+    gabble_marshal_VOID__POINTER_POINTER_POINTER, G_TYPE_NONE,
+    3, G_TYPE_POINTER, G_TYPE_POINTER, G_TYPE_POINTER);
   signals[AVATAR_UPDATE] = g_signal_new (
     "avatar-update",
     G_TYPE_FROM_CLASS (klass),
@@ -458,6 +598,8 @@ gabble_presence_cache_class_init (GabblePresenceCacheClass *klass)
     g_cclosure_marshal_VOID__UINT, G_TYPE_NONE, 1, TP_TYPE_HANDLE);
 }
 
+static void snapshot_confirm_all (GabblePresenceCache *cache);
+
 static gboolean
 gabble_presence_cache_end_unsure_period (gpointer data)
 {
@@ -465,6 +607,7 @@ gabble_presence_cache_end_unsure_period (gpointer data)
 
   DEBUG ("%p", data);
   self->priv->unsure_id = 0;
+  snapshot_confirm_all (self);
   g_signal_emit (self, signals[UNSURE_PERIOD_ENDED], 0);
   return FALSE;
 }
@@ -489,6 +632,221 @@ gabble_presence_cache_init (GabblePresenceCache *cache)
 
   priv->location = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
       (GDestroyNotify) g_hash_table_unref);
+
+  priv->snapshot = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) snapshot_entry_free);
+  priv->snapshot_resources = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_hash_table_unref);
+
+  priv->batch_presences = tp_intset_new ();
+  priv->batch_caps = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) batched_caps_free);
+  priv->batch_avatars = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  priv->parsed_caps = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) parsed_caps_free);
+  g_queue_init (&priv->parsed_caps_lru);
+
+  priv->hash_cancellable = g_cancellable_new ();
+}
+
+static gboolean
+batch_flush_cb (gpointer data)
+{
+  GabblePresenceCache *cache = GABBLE_PRESENCE_CACHE (data);
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpIntset *presences = priv->batch_presences;
+  GHashTable *caps = priv->batch_caps;
+  GHashTable *avatars = priv->batch_avatars;
+  guint n_queued = priv->batch_n_queued;
+  guint n_emitted = 0;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  priv->batch_source_id = 0;
+
+  /* Anything the signal handlers change goes into the next batch */
+  priv->batch_n_queued = 0;
+  priv->batch_presences = tp_intset_new ();
+  priv->batch_caps = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) batched_caps_free);
+  priv->batch_avatars = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  g_object_ref (cache);
+
+  if (tp_intset_size (presences) > 0)
+    {
+      GArray *handles = tp_intset_to_array (presences);
+
+      g_signal_emit (cache, signals[PRESENCES_UPDATED], 0, handles);
+      g_array_unref (handles);
+      n_emitted++;
+    }
+
+  if (g_hash_table_size (caps) > 0)
+    {
+      GArray *handles = g_array_sized_new (FALSE, FALSE, sizeof (TpHandle),
+          g_hash_table_size (caps));
+      GPtrArray *old_sets = g_ptr_array_sized_new (g_hash_table_size (caps));
+      GPtrArray *new_sets = g_ptr_array_sized_new (g_hash_table_size (caps));
+
+      g_hash_table_iter_init (&iter, caps);
+
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          TpHandle handle = GPOINTER_TO_UINT (key);
+          BatchedCaps *batched = value;
+
+          /* they may have changed back again */
+          if (gabble_capability_set_equals (batched->old_cap_set,
+                batched->new_cap_set))
+            continue;
+
+          g_array_append_val (handles, handle);
+          g_ptr_array_add (old_sets, batched->old_cap_set);
+          g_ptr_array_add (new_sets, batched->new_cap_set);
+        }
+
+      if (handles->len > 0)
+        {
+          g_signal_emit (cache, signals[CAPABILITIES_BATCH_UPDATE], 0,
+              handles, old_sets, new_sets);
+          n_emitted++;
+        }
+
+      g_array_unref (handles);
+      g_ptr_array_unref (old_sets);
+      g_ptr_array_unref (new_sets);
+    }
+
+  /* There's no D-Bus signal for several contacts' avatars, but only the
+   * latest change to each contact's avatar is worth signalling */
+  g_hash_table_iter_init (&iter, avatars);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_signal_emit (cache, signals[AVATAR_UPDATE], 0, GPOINTER_TO_UINT (key),
+          value);
+      n_emitted++;
+    }
+
+  priv->batch_n_merged += n_queued - n_emitted;
+  DEBUG ("emitted %u signals in place of %u; %u merged so far", n_emitted,
+      n_queued, priv->batch_n_merged);
+
+  tp_intset_destroy (presences);
+  g_hash_table_unref (caps);
+  g_hash_table_unref (avatars);
+  g_object_unref (cache);
+
+  return FALSE;
+}
+
+static void
+batch_schedule (GabblePresenceCache *cache)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+
+  priv->batch_n_queued++;
+
+  if (priv->batch_source_id != 0)
+    return;
+
+  if (priv->batch_window == 0)
+    priv->batch_source_id = g_idle_add (batch_flush_cb, cache);
+  else
+    priv->batch_source_id = g_timeout_add (priv->batch_window,
+        batch_flush_cb, cache);
+}
+
+static void
+batch_cancel (GabblePresenceCache *cache)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+
+  if (priv->batch_source_id != 0)
+    {
+      DEBUG ("dropping %u unsent signals", priv->batch_n_queued);
+      g_source_remove (priv->batch_source_id);
+      priv->batch_source_id = 0;
+    }
+
+  priv->batch_n_queued = 0;
+  tp_intset_clear (priv->batch_presences);
+  g_hash_table_remove_all (priv->batch_caps);
+  g_hash_table_remove_all (priv->batch_avatars);
+}
+
+static void
+emit_presences_updated (GabblePresenceCache *cache,
+    const GArray *handles)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  guint i;
+
+  if (!priv->batching)
+    {
+      g_signal_emit (cache, signals[PRESENCES_UPDATED], 0, handles);
+      return;
+    }
+
+  for (i = 0; i < handles->len; i++)
+    tp_intset_add (priv->batch_presences,
+        g_array_index (handles, TpHandle, i));
+
+  batch_schedule (cache);
+}
+
+static void
+emit_caps_update (GabblePresenceCache *cache,
+    TpHandle handle,
+    const GabbleCapabilitySet *old_cap_set,
+    const GabbleCapabilitySet *new_cap_set)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  BatchedCaps *batched;
+
+  if (!priv->batching)
+    {
+      g_signal_emit (cache, signals[CAPABILITIES_UPDATE], 0,
+          handle, old_cap_set, new_cap_set);
+      return;
+    }
+
+  batched = g_hash_table_lookup (priv->batch_caps, GUINT_TO_POINTER (handle));
+
+  if (batched == NULL)
+    {
+      batched = g_slice_new0 (BatchedCaps);
+      batched->old_cap_set = gabble_capability_set_copy (old_cap_set);
+      g_hash_table_insert (priv->batch_caps, GUINT_TO_POINTER (handle),
+          batched);
+    }
+  else
+    {
+      gabble_capability_set_free (batched->new_cap_set);
+    }
+
+  batched->new_cap_set = gabble_capability_set_copy (new_cap_set);
+  batch_schedule (cache);
+}
+
+static void
+emit_avatar_update (GabblePresenceCache *cache,
+    TpHandle handle,
+    const gchar *sha1)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+
+  if (!priv->batching)
+    {
+      g_signal_emit (cache, signals[AVATAR_UPDATE], 0, handle, sha1);
+      return;
+    }
+
+  g_hash_table_insert (priv->batch_avatars, GUINT_TO_POINTER (handle),
+      g_strdup (sha1));
+  batch_schedule (cache);
 }
 
 static void gabble_presence_cache_add_bundle_caps (GabblePresenceCache *cache,
@@ -549,12 +907,20 @@ gabble_presence_cache_dispose (GObject *object)
 
   priv->dispose_has_run = TRUE;
 
+  g_cancellable_cancel (priv->hash_cancellable);
+  g_clear_object (&priv->hash_cancellable);
+
   if (priv->unsure_id != 0)
     {
       g_source_remove (priv->unsure_id);
       priv->unsure_id = 0;
     }
 
+  batch_cancel (self);
+  tp_clear_pointer (&priv->batch_presences, tp_intset_destroy);
+  tp_clear_pointer (&priv->batch_caps, g_hash_table_unref);
+  tp_clear_pointer (&priv->batch_avatars, g_hash_table_unref);
+
   tp_clear_pointer (&priv->decloak_requests, g_hash_table_unref);
   tp_clear_pointer (&priv->decloak_handles, tp_handle_set_destroy);
 
@@ -567,7 +933,14 @@ gabble_presence_cache_dispose (GObject *object)
   tp_clear_pointer (&priv->capabilities, g_hash_table_unref);
   tp_clear_pointer (&priv->disco_pending, g_hash_table_unref);
   tp_clear_pointer (&priv->presence_handles, tp_handle_set_destroy);
+  tp_clear_pointer (&priv->lazy_caps, tp_handle_set_destroy);
   tp_clear_pointer (&priv->location, g_hash_table_unref);
+  tp_clear_pointer (&priv->snapshot, g_hash_table_unref);
+  tp_clear_pointer (&priv->snapshot_resources, g_hash_table_unref);
+
+  /* the table frees the entries, and with them the queue's links */
+  g_queue_init (&priv->parsed_caps_lru);
+  tp_clear_pointer (&priv->parsed_caps, g_hash_table_unref);
 
   if (G_OBJECT_CLASS (gabble_presence_cache_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_presence_cache_parent_class)->dispose (object);
@@ -576,8 +949,12 @@ gabble_presence_cache_dispose (GObject *object)
 static void
 gabble_presence_cache_finalize (GObject *object)
 {
+  GabblePresenceCache *self = GABBLE_PRESENCE_CACHE (object);
+
   DEBUG ("called with %p", object);
 
+  g_free (self->priv->snapshot_path);
+
   G_OBJECT_CLASS (gabble_presence_cache_parent_class)->finalize (object);
 }
 
@@ -621,6 +998,7 @@ gabble_presence_cache_set_property (GObject     *object,
           (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
       priv->presence_handles = tp_handle_set_new (contact_repo);
       priv->decloak_handles = tp_handle_set_new (contact_repo);
+      priv->lazy_caps = tp_handle_set_new (contact_repo);
       break;
 
     default:
@@ -650,6 +1028,248 @@ gabble_presence_cache_porter_available_cb (
       NULL);
 }
 
+static gchar *
+snapshot_build_path (GabblePresenceCache *cache)
+{
+  TpBaseConnection *base = (TpBaseConnection *) cache->priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  gchar *escaped, *filename, *path;
+
+  escaped = tp_escape_as_identifier (tp_handle_inspect (contact_repo,
+        tp_base_connection_get_self_handle (base)));
+  filename = g_strconcat (escaped, ".snapshot", NULL);
+  path = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+      "caps-snapshots", filename, NULL);
+
+  g_free (filename);
+  g_free (escaped);
+  return path;
+}
+
+/* Reads the contacts' last-known caps URIs, and resolves them through the
+ * caps cache into a capability set per contact. URIs which have dropped out
+ * of the caps cache are skipped; the disco triggered by fresh presence will
+ * sort them out. */
+static void
+snapshot_load (GabblePresenceCache *cache)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  GKeyFile *keyfile = g_key_file_new ();
+  GError *error = NULL;
+  gchar **groups;
+  guint i;
+
+  if (!g_key_file_load_from_file (keyfile, priv->snapshot_path,
+        G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("no usable snapshot in %s: %s", priv->snapshot_path,
+          error->message);
+      g_error_free (error);
+      g_key_file_free (keyfile);
+      return;
+    }
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      TpHandle handle = tp_handle_ensure (contact_repo, groups[i], NULL,
+          NULL);
+      SnapshotEntry *entry;
+      gchar **resources, **uris;
+      guint j;
+
+      if (handle == 0 || handle == tp_base_connection_get_self_handle (base))
+        continue;
+
+      resources = g_key_file_get_string_list (keyfile, groups[i],
+          SNAPSHOT_KEY_RESOURCES, NULL, NULL);
+      uris = g_key_file_get_string_list (keyfile, groups[i],
+          SNAPSHOT_KEY_CAPS, NULL, NULL);
+
+      entry = g_slice_new0 (SnapshotEntry);
+      entry->cap_set = gabble_capability_set_new ();
+      entry->client_types = g_key_file_get_integer (keyfile, groups[i],
+          SNAPSHOT_KEY_CLIENT_TYPES, NULL);
+      entry->resources = g_hash_table_new_full (g_str_hash, g_str_equal,
+          g_free, g_free);
+
+      for (j = 0; resources != NULL && uris != NULL &&
+          resources[j] != NULL && uris[j] != NULL; j++)
+        {
+          ParsedCaps *parsed = parsed_caps_lookup (cache, uris[j]);
+
+          g_hash_table_insert (entry->resources, g_strdup (resources[j]),
+              g_strdup (uris[j]));
+
+          if (parsed != NULL)
+            gabble_capability_set_update (entry->cap_set, parsed->cap_set);
+        }
+
+      g_strfreev (resources);
+      g_strfreev (uris);
+
+      if (gabble_capability_set_size (entry->cap_set) == 0 &&
+          entry->client_types == 0)
+        {
+          snapshot_entry_free (entry);
+          continue;
+        }
+
+      g_hash_table_insert (priv->snapshot, GUINT_TO_POINTER (handle), entry);
+    }
+
+  DEBUG ("loaded last-known capabilities of %u contacts from %s",
+      g_hash_table_size (priv->snapshot), priv->snapshot_path);
+
+  g_strfreev (groups);
+  g_key_file_free (keyfile);
+}
+
+static void
+snapshot_write_contact (GKeyFile *keyfile,
+    const gchar *jid,
+    guint client_types,
+    GHashTable *resources)
+{
+  GPtrArray *names, *uris;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  /* Group names may not contain square brackets */
+  if (strpbrk (jid, "[]") != NULL || g_hash_table_size (resources) == 0)
+    return;
+
+  names = g_ptr_array_sized_new (g_hash_table_size (resources));
+  uris = g_ptr_array_sized_new (g_hash_table_size (resources));
+  g_hash_table_iter_init (&iter, resources);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_ptr_array_add (names, key);
+      g_ptr_array_add (uris, value);
+    }
+
+  g_key_file_set_integer (keyfile, jid, SNAPSHOT_KEY_CLIENT_TYPES,
+      client_types);
+  g_key_file_set_string_list (keyfile, jid, SNAPSHOT_KEY_RESOURCES,
+      (const gchar * const *) names->pdata, names->len);
+  g_key_file_set_string_list (keyfile, jid, SNAPSHOT_KEY_CAPS,
+      (const gchar * const *) uris->pdata, uris->len);
+
+  g_ptr_array_unref (names);
+  g_ptr_array_unref (uris);
+}
+
+/* Saves the caps URIs of every contact who is online, plus those we loaded
+ * from the last snapshot and haven't heard from yet (if we're disconnected
+ * during the unsure period, they may well still be online). */
+static void
+snapshot_save (GabblePresenceCache *cache)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+  GKeyFile *keyfile = g_key_file_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *dir, *data;
+  gsize len;
+  GError *error = NULL;
+
+  g_hash_table_iter_init (&iter, priv->snapshot_resources);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      TpHandle handle = GPOINTER_TO_UINT (key);
+      GabblePresence *presence = gabble_presence_cache_get (cache, handle);
+
+      if (presence == NULL || !gabble_presence_has_resources (presence))
+        continue;
+
+      snapshot_write_contact (keyfile, tp_handle_inspect (contact_repo,
+            handle), presence->client_types, value);
+    }
+
+  g_hash_table_iter_init (&iter, priv->snapshot);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      SnapshotEntry *entry = value;
+
+      snapshot_write_contact (keyfile, tp_handle_inspect (contact_repo,
+            GPOINTER_TO_UINT (key)), entry->client_types, entry->resources);
+    }
+
+  dir = g_path_get_dirname (priv->snapshot_path);
+  data = g_key_file_to_data (keyfile, &len, NULL);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    DEBUG ("couldn't create %s: %s", dir, g_strerror (errno));
+  else if (!g_file_set_contents (priv->snapshot_path, data, len, &error))
+    DEBUG ("couldn't save snapshot: %s", error->message);
+  else
+    DEBUG ("saved capabilities snapshot to %s", priv->snapshot_path);
+
+  g_clear_error (&error);
+  g_free (data);
+  g_free (dir);
+  g_key_file_free (keyfile);
+}
+
+/* Remembers that @handle's @resource advertised the caps @node#@ver, for the
+ * next snapshot */
+static void
+snapshot_record (GabblePresenceCache *cache,
+    TpHandle handle,
+    const gchar *resource,
+    const gchar *node,
+    const gchar *ver)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  GHashTable *resources;
+
+  resources = g_hash_table_lookup (priv->snapshot_resources,
+      GUINT_TO_POINTER (handle));
+
+  if (resources == NULL)
+    {
+      resources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+          g_free);
+      g_hash_table_insert (priv->snapshot_resources, GUINT_TO_POINTER (handle),
+          resources);
+    }
+
+  g_hash_table_insert (resources, g_strdup (resource),
+      g_strdup_printf ("%s#%s", node, ver));
+}
+
+static void
+snapshot_forget (GabblePresenceCache *cache,
+    TpHandle handle,
+    const gchar *resource)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  GHashTable *resources;
+
+  if (resource == NULL)
+    {
+      g_hash_table_remove (priv->snapshot_resources,
+          GUINT_TO_POINTER (handle));
+      return;
+    }
+
+  resources = g_hash_table_lookup (priv->snapshot_resources,
+      GUINT_TO_POINTER (handle));
+
+  if (resources != NULL)
+    g_hash_table_remove (resources, resource);
+}
+
 static void
 gabble_presence_cache_status_changed_cb (GabbleConnection *conn,
                                          TpConnectionStatus status,
@@ -667,6 +1287,24 @@ gabble_presence_cache_status_changed_cb (GabbleConnection *conn,
       break;
 
     case TP_CONNECTION_STATUS_CONNECTED:
+      {
+        gboolean snapshot;
+
+        g_object_get (conn,
+            "caps-snapshot", &snapshot,
+            "coalesce-presence-signals", &priv->batching,
+            "coalesce-presence-window", &priv->batch_window,
+            NULL);
+
+        /* Until fresh presence arrives, answer capability queries with what
+         * contacts had last time we were connected. */
+        if (snapshot)
+          {
+            priv->snapshot_path = snapshot_build_path (cache);
+            snapshot_load (cache);
+          }
+      }
+
       /* After waiting UNSURE_PERIOD seconds for initial presences to trickle
        * in, the "unsure period" ends. */
       priv->unsure_id = g_timeout_add_seconds (UNSURE_PERIOD,
@@ -674,6 +1312,12 @@ gabble_presence_cache_status_changed_cb (GabbleConnection *conn,
       break;
 
     case TP_CONNECTION_STATUS_DISCONNECTED:
+      batch_cancel (cache);
+      g_cancellable_cancel (priv->hash_cancellable);
+
+      if (priv->snapshot_path != NULL)
+        snapshot_save (cache);
+
       if (conn->session != NULL)
         {
           WockyPorter *porter = wocky_session_get_porter (conn->session);
@@ -917,8 +1561,9 @@ _grab_avatar_sha1 (GabblePresenceCache *cache,
         {
           g_free (presence->avatar_sha1);
           presence->avatar_sha1 = g_strdup (sha1);
-          gabble_vcard_manager_invalidate_cache (priv->conn->vcard_manager, handle);
-          g_signal_emit (cache, signals[AVATAR_UPDATE], 0, handle, sha1);
+          gabble_vcard_manager_photo_changed (priv->conn->vcard_manager,
+              handle, sha1);
+          emit_avatar_update (cache, handle, sha1);
         }
     }
 }
@@ -1105,12 +1750,27 @@ find_matching_waiter (GSList *waiters,
   return NULL;
 }
 
+static gboolean gabble_presence_cache_caps_pending (
+    GabblePresenceCache *cache, TpHandle handle);
+static gboolean snapshot_maybe_confirm (GabblePresenceCache *cache,
+    TpHandle handle);
+
 static void
 emit_capabilities_update (GabblePresenceCache *cache,
     TpHandle handle,
     const GabbleCapabilitySet *old_cap_set,
     const GabbleCapabilitySet *new_cap_set)
 {
+  /* If clients have been answered from the snapshot, the change they need to
+   * hear about is relative to that */
+  if (g_hash_table_lookup (cache->priv->snapshot, GUINT_TO_POINTER (handle)))
+    {
+      if (!snapshot_maybe_confirm (cache, handle))
+        DEBUG ("still discovering %u's caps; keeping their snapshot", handle);
+
+      return;
+    }
+
   if (gabble_capability_set_equals (old_cap_set, new_cap_set))
     {
       DEBUG ("no change in caps for handle %u", handle);
@@ -1126,11 +1786,70 @@ emit_capabilities_update (GabblePresenceCache *cache,
           g_free (diff);
         }
 
-      g_signal_emit (cache, signals[CAPABILITIES_UPDATE], 0,
-          handle, old_cap_set, new_cap_set);
+      emit_caps_update (cache, handle, old_cap_set, new_cap_set);
     }
 }
 
+/* Drops @handle's snapshot entry, now that we know their real caps (or that
+ * they aren't online), and tells clients about any difference. Returns FALSE
+ * if we're still discovering what their caps are. */
+static gboolean
+snapshot_maybe_confirm (GabblePresenceCache *cache,
+    TpHandle handle)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  GabblePresence *presence = gabble_presence_cache_get (cache, handle);
+  SnapshotEntry *entry;
+  GabbleCapabilitySet *empty = NULL;
+  const GabbleCapabilitySet *new_cap_set;
+  guint client_types = 0;
+
+  entry = g_hash_table_lookup (priv->snapshot, GUINT_TO_POINTER (handle));
+
+  if (entry == NULL)
+    return TRUE;
+
+  if (priv->unsure_id != 0 &&
+      gabble_presence_cache_caps_pending (cache, handle))
+    return FALSE;
+
+  g_hash_table_steal (priv->snapshot, GUINT_TO_POINTER (handle));
+  DEBUG ("done with the snapshot of %u's caps", handle);
+
+  if (presence != NULL)
+    {
+      new_cap_set = gabble_presence_peek_caps (presence);
+      client_types = presence->client_types;
+    }
+  else
+    {
+      new_cap_set = empty = gabble_capability_set_new ();
+    }
+
+  emit_capabilities_update (cache, handle, entry->cap_set, new_cap_set);
+
+  if (client_types != entry->client_types)
+    g_signal_emit (cache, signals[CLIENT_TYPES_UPDATED], 0, handle);
+
+  tp_clear_pointer (&empty, gabble_capability_set_free);
+  snapshot_entry_free (entry);
+  return TRUE;
+}
+
+/* At the end of the unsure period, whatever we haven't heard is gone */
+static void
+snapshot_confirm_all (GabblePresenceCache *cache)
+{
+  GList *handles, *l;
+
+  handles = g_hash_table_get_keys (cache->priv->snapshot);
+
+  for (l = handles; l != NULL; l = l->next)
+    snapshot_maybe_confirm (cache, GPOINTER_TO_UINT (l->data));
+
+  g_list_free (handles);
+}
+
 /**
  * set_caps_for:
  *
@@ -1243,7 +1962,110 @@ data_forms_from_message (WockyNode *node)
         g_ptr_array_add (out, form);
    }
 
-  return out;
+  return out;
+}
+
+static void
+parsed_caps_remove (GabblePresenceCache *cache,
+    ParsedCaps *parsed)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+
+  g_queue_unlink (&priv->parsed_caps_lru, &parsed->link);
+  g_hash_table_remove (priv->parsed_caps, parsed->uri);
+}
+
+/* Remembers that @uri means @query, which parses to @cap_set and
+ * @data_forms, replacing anything we thought it meant before. */
+static ParsedCaps *
+parsed_caps_insert (GabblePresenceCache *cache,
+    const gchar *uri,
+    WockyNodeTree *query,
+    const GabbleCapabilitySet *cap_set,
+    GPtrArray *data_forms)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  ParsedCaps *parsed = g_hash_table_lookup (priv->parsed_caps, uri);
+
+  if (parsed != NULL)
+    parsed_caps_remove (cache, parsed);
+
+  while (priv->parsed_caps_lru.length >= PARSED_CAPS_MAX)
+    {
+      parsed_caps_remove (cache, priv->parsed_caps_lru.tail->data);
+      conn_iq_stats_cache_event (priv->conn, NS_DISCO_INFO,
+          CONN_IQ_STATS_CACHE_EVICTION);
+    }
+
+  parsed = g_slice_new0 (ParsedCaps);
+  parsed->uri = g_strdup (uri);
+  parsed->query = g_object_ref (query);
+  parsed->cap_set = share_caps (cap_set);
+  parsed->data_forms = g_ptr_array_ref (data_forms);
+  parsed->link.data = parsed;
+
+  g_hash_table_insert (priv->parsed_caps, parsed->uri, parsed);
+  g_queue_push_head_link (&priv->parsed_caps_lru, &parsed->link);
+
+  return parsed;
+}
+
+/* Returns what @uri means, if we've trusted a reply for it, in this
+ * connection or a previous one; or NULL. The result is only valid until the
+ * next lookup or insertion. */
+static ParsedCaps *
+parsed_caps_lookup (GabblePresenceCache *cache,
+    const gchar *uri)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  ParsedCaps *parsed = g_hash_table_lookup (priv->parsed_caps, uri);
+  WockyCapsCache *caps_cache;
+  WockyNodeTree *query_tree;
+  WockyNode *query;
+  GabbleCapabilitySet *cap_set;
+  GPtrArray *data_forms;
+
+  if (parsed != NULL)
+    {
+      conn_iq_stats_cache_event (priv->conn, NS_DISCO_INFO,
+          CONN_IQ_STATS_CACHE_HIT);
+      g_queue_unlink (&priv->parsed_caps_lru, &parsed->link);
+      g_queue_push_head_link (&priv->parsed_caps_lru, &parsed->link);
+      return parsed;
+    }
+
+  conn_iq_stats_cache_event (priv->conn, NS_DISCO_INFO,
+      CONN_IQ_STATS_CACHE_MISS);
+
+  caps_cache = wocky_caps_cache_dup_shared ();
+  query_tree = wocky_caps_cache_lookup (caps_cache, uri);
+  g_object_unref (caps_cache);
+
+  if (query_tree == NULL)
+    return NULL;
+
+  query = wocky_node_tree_get_top_node (query_tree);
+  cap_set = gabble_capability_set_new_from_stanza (query);
+
+  if (cap_set == NULL)
+    {
+      gchar *query_str = wocky_node_to_string (query);
+
+      g_warning ("couldn't re-parse cached query node, which was: %s",
+          query_str);
+      g_free (query_str);
+      g_object_unref (query_tree);
+      return NULL;
+    }
+
+  data_forms = data_forms_from_message (query);
+  parsed = parsed_caps_insert (cache, uri, query_tree, cap_set, data_forms);
+
+  gabble_capability_set_free (cap_set);
+  g_ptr_array_unref (data_forms);
+  g_object_unref (query_tree);
+
+  return parsed;
 }
 
 static void
@@ -1254,77 +2076,73 @@ _signal_presences_updated (GabblePresenceCache *cache,
 
   handles = g_array_sized_new (FALSE, FALSE, sizeof (TpHandle), 1);
   g_array_append_val (handles, handle);
-  g_signal_emit (cache, signals[PRESENCES_UPDATED], 0, handles);
+  emit_presences_updated (cache, handles);
   g_array_unref (handles);
 }
 
-static void
-_caps_disco_cb (GabbleDisco *disco,
-                GabbleDiscoRequest *request,
-                const gchar *jid,
-                const gchar *node,
-                WockyNode *query_result,
-                GError *error,
-                gpointer user_data)
+/* Returns the waiter for which @jid's reply about @node was requested, or
+ * NULL if we're no longer waiting for it. */
+static DiscoWaiter *
+find_waiter_for_reply (GabblePresenceCache *cache,
+    const gchar *jid,
+    const gchar *node,
+    TpHandle *handle)
 {
-  GSList *waiters, *i;
-  DiscoWaiter *waiter_self;
-  GabblePresenceCache *cache;
-  GabblePresenceCachePrivate *priv;
-  TpHandleRepoIface *contact_repo;
-  GabbleCapabilitySet *cap_set;
-  guint trust;
-  TpHandle handle = 0;
-  gboolean bad_hash = FALSE;
-  TpBaseConnection *base_conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) cache->priv->conn, TP_HANDLE_TYPE_CONTACT);
+  GSList *waiters = g_hash_table_lookup (cache->priv->disco_pending, node);
+  DiscoWaiter *waiter;
   gchar *resource;
   gboolean jid_is_valid;
-  gpointer key;
-  guint client_types = 0;
-  GPtrArray *data_forms = NULL;
-
-  cache = GABBLE_PRESENCE_CACHE (user_data);
-  priv = cache->priv;
-  base_conn = TP_BASE_CONNECTION (priv->conn);
-  contact_repo = tp_base_connection_get_handles (base_conn,
-      TP_HANDLE_TYPE_CONTACT);
 
-  if (NULL == node)
-    {
-      DEBUG ("got disco response with NULL node, ignoring");
-      return;
-    }
-
-  waiters = g_hash_table_lookup (priv->disco_pending, node);
-
-  if (NULL != error)
-    {
-      DEBUG ("disco query failed: %s", error->message);
-
-      disco_failed (cache, disco, node, waiters);
-
-      return;
-    }
-
-  handle = tp_handle_ensure (contact_repo, jid, NULL, NULL);
+  *handle = tp_handle_ensure (contact_repo, jid, NULL, NULL);
 
-  if (handle == 0)
+  if (*handle == 0)
     {
       DEBUG ("Ignoring presence from invalid JID %s", jid);
-      return;
+      return NULL;
     }
 
   /* If tp_handle_ensure () was happy with the jid, it's valid. */
   jid_is_valid = wocky_decode_jid (jid, NULL, NULL, &resource);
   g_assert (jid_is_valid);
-  waiter_self = find_matching_waiter (waiters, handle, resource);
+  waiter = find_matching_waiter (waiters, *handle, resource);
   g_free (resource);
 
+  if (NULL == waiter)
+    DEBUG ("Ignoring non requested disco reply from %s", jid);
+
+  return waiter;
+}
+
+/* Acts on @jid's reply to our disco#info query about @node. If the reply was
+ * for a node with a SHA-1 verification string, @computed_hash is our hash of
+ * @query_result, or NULL if it couldn't be hashed. */
+static void
+caps_disco_process (GabblePresenceCache *cache,
+    GabbleDisco *disco,
+    const gchar *jid,
+    const gchar *node,
+    WockyNode *query_result,
+    const gchar *computed_hash)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  GSList *waiters, *i;
+  DiscoWaiter *waiter_self;
+  GabbleCapabilitySet *cap_set;
+  guint trust;
+  TpHandle handle = 0;
+  gboolean bad_hash = FALSE;
+  gpointer key;
+  guint client_types = 0;
+  GPtrArray *data_forms = NULL;
+
+  waiter_self = find_waiter_for_reply (cache, jid, node, &handle);
+
   if (NULL == waiter_self)
-    {
-      DEBUG ("Ignoring non requested disco reply from %s", jid);
-      return;
-    }
+    return;
+
+  waiters = g_hash_table_lookup (priv->disco_pending, node);
 
   /* Now onto caps */
   cap_set = gabble_capability_set_new_from_stanza (query_result);
@@ -1339,10 +2157,6 @@ _caps_disco_cb (GabbleDisco *disco,
    * stanza. */
   if (!tp_strdiff (waiter_self->hash, "sha-1"))
     {
-      gchar *computed_hash;
-
-      computed_hash = wocky_caps_hash_compute_from_node (query_result);
-
       if (computed_hash == NULL)
         {
           DEBUG ("Unable to compute caps hash for '%s'.", jid);
@@ -1362,8 +2176,6 @@ _caps_disco_cb (GabbleDisco *disco,
           trust = 0;
           bad_hash = TRUE;
         }
-
-      g_free (computed_hash);
     }
   else
     {
@@ -1398,18 +2210,21 @@ _caps_disco_cb (GabbleDisco *disco,
           g_free (tmp);
         }
 
-      /* Update external cache. */
+      /* Update external cache, and our parsed copy of it. */
       wocky_caps_cache_insert (caps_cache, node, query_node);
+      parsed_caps_insert (cache, node, query_node,
+          capability_info_get (cache, node)->cap_set, data_forms);
       g_object_unref (caps_cache);
       g_object_unref (query_node);
 
-      /* We trust this caps node. Serve all its waiters. */
+      /* We trust this caps node. Serve all its waiters, with the set they
+       * can all share. */
       for (i = waiters; NULL != i; i = i->next)
         {
           DiscoWaiter *waiter = (DiscoWaiter *) i->data;
 
-          set_caps_for (waiter, cache, cap_set, client_types,
-              data_forms, handle, jid);
+          set_caps_for (waiter, cache, capability_info_get (cache,
+                node)->cap_set, client_types, data_forms, handle, jid);
           emit_capabilities_discovered (cache, waiter->handle);
         }
 
@@ -1467,6 +2282,110 @@ _caps_disco_cb (GabbleDisco *disco,
   g_ptr_array_unref (data_forms);
 }
 
+typedef struct {
+    /* not reffed: if it goes away, the hashing is cancelled */
+    GabblePresenceCache *cache;
+    gchar *jid;
+    gchar *node;
+    WockyNodeTree *reply;
+} CapsReply;
+
+static void
+caps_reply_free (CapsReply *reply)
+{
+  g_free (reply->jid);
+  g_free (reply->node);
+  g_object_unref (reply->reply);
+  g_slice_free (CapsReply, reply);
+}
+
+static void
+caps_reply_hashed_cb (GObject *source G_GNUC_UNUSED,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  CapsReply *reply = user_data;
+  GError *error = NULL;
+  gchar *computed_hash = caps_hash_compute_from_reply_finish (result,
+      &error);
+
+  if (error != NULL)
+    {
+      /* reply->cache may well have been freed by now */
+      DEBUG ("disconnected while hashing %s's reply; ignoring it: %s",
+          reply->jid, error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      GabblePresenceCache *cache = reply->cache;
+
+      caps_disco_process (cache, cache->priv->conn->disco, reply->jid,
+          reply->node, wocky_node_tree_get_top_node (reply->reply),
+          computed_hash);
+    }
+
+  g_free (computed_hash);
+  caps_reply_free (reply);
+}
+
+static void
+_caps_disco_cb (GabbleDisco *disco,
+                GabbleDiscoRequest *request,
+                const gchar *jid,
+                const gchar *node,
+                WockyNode *query_result,
+                GError *error,
+                gpointer user_data)
+{
+  GabblePresenceCache *cache = GABBLE_PRESENCE_CACHE (user_data);
+  GabblePresenceCachePrivate *priv = cache->priv;
+  DiscoWaiter *waiter_self;
+  TpHandle handle;
+  CapsReply *reply;
+
+  if (NULL == node)
+    {
+      DEBUG ("got disco response with NULL node, ignoring");
+      return;
+    }
+
+  if (NULL != error)
+    {
+      DEBUG ("disco query failed: %s", error->message);
+
+      disco_failed (cache, disco, node,
+          g_hash_table_lookup (priv->disco_pending, node));
+
+      return;
+    }
+
+  waiter_self = find_waiter_for_reply (cache, jid, node, &handle);
+
+  if (NULL == waiter_self)
+    return;
+
+  /* Only 'sha-1' is mandatory to implement by XEP-0115, and the other
+   * algorithms aren't checked at all; see caps_disco_process(). */
+  if (tp_strdiff (waiter_self->hash, "sha-1"))
+    {
+      caps_disco_process (cache, disco, jid, node, query_result, NULL);
+      return;
+    }
+
+  /* Check the reply against the verification string on the hashing thread.
+   * Until it's done, the waiter still counts as an outstanding request, so
+   * other contacts announcing the same node don't cause more discos. */
+  reply = g_slice_new0 (CapsReply);
+  reply->cache = cache;
+  reply->jid = g_strdup (jid);
+  reply->node = g_strdup (node);
+  reply->reply = wocky_node_tree_new_from_node (query_result);
+
+  caps_hash_compute_from_reply_async (reply->reply, priv->hash_cancellable,
+      caps_reply_hashed_cb, reply);
+}
+
 static gboolean
 get_google_cap (const gchar *fragment,
     const gchar **ns)
@@ -1517,11 +2436,12 @@ _process_caps_uri (GabblePresenceCache *cache,
                    guint serial)
 {
   GabbleCapabilityInfo *info;
-  WockyNodeTree *cached_query_reply;
+  ParsedCaps *parsed;
+  WockyNodeTree *cached_query_reply = NULL;
   GabbleCapabilitySet *cached_caps = NULL;
+  GPtrArray *cached_data_forms = NULL;
   GabblePresenceCachePrivate *priv;
   TpHandleRepoIface *contact_repo;
-  WockyCapsCache *caps_cache;
   gchar *uri = g_strdup_printf ("%s#%s", node, fragment);
   const gchar *ns = NULL;
 
@@ -1529,34 +2449,30 @@ _process_caps_uri (GabblePresenceCache *cache,
   contact_repo = tp_base_connection_get_handles (
       (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
   info = capability_info_get (cache, uri);
+  parsed = parsed_caps_lookup (cache, uri);
 
-  caps_cache = wocky_caps_cache_dup_shared ();
-  cached_query_reply = wocky_caps_cache_lookup (caps_cache, uri);
-
-  if (cached_query_reply != NULL)
+  if (parsed != NULL)
     {
-      WockyNode *query = wocky_node_tree_get_top_node (cached_query_reply);
+      /* Keep these even if something below pushes them out of the LRU */
+      cached_query_reply = g_object_ref (parsed->query);
+      cached_caps = gabble_capability_set_ref (parsed->cap_set);
+      cached_data_forms = g_ptr_array_ref (parsed->data_forms);
 
-      cached_caps = gabble_capability_set_new_from_stanza (query);
-
-      if (cached_caps == NULL)
+      if (info->cap_set == NULL)
         {
-          gchar *query_str = wocky_node_to_string (query);
-
-          g_warning ("couldn't re-parse cached query node, which was: %s",
-              query_str);
-          g_free (query_str);
+          capability_info_set_caps (info, cached_caps);
+          replace_data_forms (info, cached_data_forms);
         }
     }
 
-  g_object_unref (caps_cache);
-
   if (cached_caps != NULL ||
       info->trust >= CAPABILITY_BUNDLE_ENOUGH_TRUST ||
       tp_intset_is_member (info->guys, handle))
     {
       GabblePresence *presence = gabble_presence_cache_get (cache, handle);
       GabbleCapabilitySet *cap_set = cached_caps ? cached_caps : info->cap_set;
+      GPtrArray *data_forms = cached_data_forms ? cached_data_forms :
+          info->data_forms;
 
       /* we already have enough trust for this node; apply the cached value to
        * the (handle, resource) */
@@ -1568,7 +2484,7 @@ _process_caps_uri (GabblePresenceCache *cache,
           guint types;
 
           gabble_presence_set_capabilities (
-              presence, resource, cap_set, info->data_forms, serial);
+              presence, resource, cap_set, data_forms, serial);
 
           /* We can only get this information from actual disco replies,
            * so we depend on having this information from the caps cache. */
@@ -1587,9 +2503,6 @@ _process_caps_uri (GabblePresenceCache *cache,
         }
       else
         DEBUG ("presence not found");
-
-      if (cached_caps != NULL)
-        gabble_capability_set_free (cached_caps);
     }
   else if (hash == NULL && get_google_cap (fragment, &ns))
     {
@@ -1668,7 +2581,15 @@ _process_caps_uri (GabblePresenceCache *cache,
        */
       possible_trust = disco_waiter_list_get_request_count (waiters);
 
-      if (info->trust + possible_trust < CAPABILITY_BUNDLE_ENOUGH_TRUST)
+      if (info->trust + possible_trust < CAPABILITY_BUNDLE_ENOUGH_TRUST &&
+          tp_handle_set_is_member (priv->lazy_caps, handle))
+        {
+          /* the waiter will be served if someone else's reply is trusted,
+           * or asked itself if someone needs to know */
+          DEBUG ("not sending disco for URI %s to %s until it's needed", uri,
+              from);
+        }
+      else if (info->trust + possible_trust < CAPABILITY_BUNDLE_ENOUGH_TRUST)
         {
           /* DISCO */
           DEBUG ("only %u trust out of %u possible thus far, sending "
@@ -1685,6 +2606,12 @@ out:
   if (cached_query_reply != NULL)
     g_object_unref (cached_query_reply);
 
+  if (cached_caps != NULL)
+    gabble_capability_set_free (cached_caps);
+
+  if (cached_data_forms != NULL)
+    g_ptr_array_unref (cached_data_forms);
+
   g_free (uri);
 }
 
@@ -1712,6 +2639,10 @@ _process_caps (GabblePresenceCache *cache,
 
   uris = _parse_cap_bundles (lm_node, &hash, &ver, &node);
 
+  if (priv->snapshot_path != NULL && resource != NULL && hash != NULL &&
+      node != NULL && ver != NULL)
+    snapshot_record (cache, handle, resource, node, ver);
+
   if (presence)
     {
       old_cap_set = gabble_presence_dup_caps (presence);
@@ -1911,6 +2842,12 @@ gabble_presence_parse_presence_message (
       gabble_presence_cache_update (cache, handle, resource,
           presence_id, status_message, priority);
 
+      snapshot_forget (cache, handle, resource);
+      presence = gabble_presence_cache_get (cache, handle);
+
+      if (presence == NULL || !gabble_presence_has_resources (presence))
+        snapshot_maybe_confirm (cache, handle);
+
       return TRUE;
 
     default:
@@ -2200,7 +3137,7 @@ gabble_presence_cache_update_many (
     }
 
   if (updated->len > 0)
-    g_signal_emit (cache, signals[PRESENCES_UPDATED], 0, updated);
+    emit_presences_updated (cache, updated);
 
   g_array_unref (updated);
 
@@ -2224,13 +3161,23 @@ gabble_presence_cache_add_bundle_caps (GabblePresenceCache *cache,
   info = capability_info_get (cache, node);
 
   /* The caps are immediately valid, because we already know this bundle */
-  if (info->cap_set == NULL)
-    info->cap_set = gabble_capability_set_new ();
-
   info->trust = CAPABILITY_BUNDLE_ENOUGH_TRUST;
 
-  if (namespace != NULL)
-    gabble_capability_set_add (info->cap_set, namespace);
+  if (info->cap_set == NULL || namespace != NULL)
+    {
+      GabbleCapabilitySet *cap_set;
+
+      if (info->cap_set == NULL)
+        cap_set = gabble_capability_set_new ();
+      else
+        cap_set = gabble_capability_set_copy (info->cap_set);
+
+      if (namespace != NULL)
+        gabble_capability_set_add (cap_set, namespace);
+
+      capability_info_set_caps (info, cap_set);
+      gabble_capability_set_free (cap_set);
+    }
 }
 
 void
@@ -2254,15 +3201,7 @@ gabble_presence_cache_add_own_caps (
    * the entry's correct, or someone's poisoning us with a SHA-1 collision.
    * Let's update the entry just in case.
    */
-  if (info->cap_set == NULL)
-    {
-      info->cap_set = gabble_capability_set_copy (cap_set);
-    }
-  else
-    {
-      gabble_capability_set_clear (info->cap_set);
-      gabble_capability_set_update (info->cap_set, cap_set);
-    }
+  capability_info_set_caps (info, cap_set);
 
   wocky_disco_identity_array_free (info->identities);
 
@@ -2368,7 +3307,7 @@ gabble_presence_cache_contacts_added_to_olpc_view (GabblePresenceCache *self,
 
   if (changed->len > 0)
     {
-      g_signal_emit (self, signals[PRESENCES_UPDATED], 0, changed);
+      emit_presences_updated (self, changed);
     }
 
   g_array_unref (tmp);
@@ -2409,7 +3348,7 @@ gabble_presence_cache_contacts_removed_from_olpc_view (
 
   if (changed->len > 0)
     {
-      g_signal_emit (self, signals[PRESENCES_UPDATED], 0, changed);
+      emit_presences_updated (self, changed);
     }
 
   g_array_unref (tmp);
@@ -2484,10 +3423,19 @@ gabble_presence_cache_is_unsure (GabblePresenceCache *cache,
    * not in it won't be sending us an initial presence, so ideally the
    * above should be roster-aware? */
 
-  /* if we don't know what the caps mean, we're unsure */
+  /* if we don't know what the caps mean, we're unsure; and if we haven't
+   * tried to find out yet, now is the time */
   if (gabble_presence_cache_caps_pending (cache, handle))
     {
       DEBUG ("Still working out what %u's caps hash means", handle);
+      gabble_presence_cache_ensure_caps (cache, handle);
+      return TRUE;
+    }
+
+  /* if we're still answering from a snapshot, we're unsure */
+  if (g_hash_table_lookup (priv->snapshot, GUINT_TO_POINTER (handle)) != NULL)
+    {
+      DEBUG ("Only have last connection's caps for %u so far", handle);
       return TRUE;
     }
 
@@ -2502,6 +3450,41 @@ gabble_presence_cache_is_unsure (GabblePresenceCache *cache,
   return FALSE;
 }
 
+/*
+ * gabble_presence_cache_peek_snapshot:
+ * @cap_set: (out) (allow-none): set to the union of the contact's caps as of
+ *  the last connection
+ * @client_types: (out) (allow-none): set to their client types as of the last
+ *  connection
+ *
+ * If the "caps-snapshot" parameter is set, then for a short while after
+ * connecting, contacts' capabilities are answered from a snapshot saved when
+ * we were last disconnected, rather than reported as empty until their
+ * presence arrives and their caps have been discovered.
+ *
+ * Returns: TRUE if @handle's caps should still come from the snapshot
+ */
+gboolean
+gabble_presence_cache_peek_snapshot (GabblePresenceCache *cache,
+    TpHandle handle,
+    const GabbleCapabilitySet **cap_set,
+    guint *client_types)
+{
+  SnapshotEntry *entry = g_hash_table_lookup (cache->priv->snapshot,
+      GUINT_TO_POINTER (handle));
+
+  if (entry == NULL)
+    return FALSE;
+
+  if (cap_set != NULL)
+    *cap_set = entry->cap_set;
+
+  if (client_types != NULL)
+    *client_types = entry->client_types;
+
+  return TRUE;
+}
+
 static gboolean
 gabble_presence_cache_decloak_timeout_cb (gpointer data)
 {
@@ -2609,6 +3592,138 @@ gabble_presence_cache_get_location (GabblePresenceCache *cache,
   return NULL;
 }
 
+/**
+ * gabble_presence_cache_set_caps_lazy:
+ * @cache: a presence cache
+ * @handle: a contact
+ * @lazy: whether to put off discovering @handle's capabilities
+ *
+ * If @lazy is %TRUE, caps which @handle advertises and which we don't know
+ * the meaning of are only discovered once somebody needs them, by calling
+ * gabble_presence_cache_ensure_caps(), or if someone else with the same caps
+ * is asked; until then, @handle has no capabilities. This is meant for the
+ * occupants of large rooms, whose capabilities are mostly never looked at.
+ */
+void
+gabble_presence_cache_set_caps_lazy (GabblePresenceCache *cache,
+    TpHandle handle,
+    gboolean lazy)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+
+  if (lazy)
+    tp_handle_set_add (priv->lazy_caps, handle);
+  else
+    tp_handle_set_remove (priv->lazy_caps, handle);
+}
+
+/* Sends any disco requests put off for the handles in @wanted, which must
+ * no longer be lazy, in one pass over the pending requests. */
+static void
+ensure_caps_for_set (GabblePresenceCache *cache,
+    TpIntset *wanted)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpIntset *asked = tp_intset_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, priv->disco_pending);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const gchar *uri = key;
+      GSList *waiters = value;
+      GabbleCapabilityInfo *info = capability_info_get (cache, uri);
+      GSList *l;
+
+      /* one resource per contact is enough to ask about each URI */
+      tp_intset_clear (asked);
+
+      for (l = waiters; l != NULL; l = l->next)
+        {
+          DiscoWaiter *waiter = l->data;
+
+          if (info->trust + disco_waiter_list_get_request_count (waiters) >=
+              CAPABILITY_BUNDLE_ENOUGH_TRUST)
+            break;
+
+          if (waiter->disco_requested ||
+              !tp_intset_is_member (wanted, waiter->handle) ||
+              tp_intset_is_member (asked, waiter->handle))
+            continue;
+
+          DEBUG ("%u's caps are needed; sending disco for URI %s",
+              waiter->handle, uri);
+          tp_intset_add (asked, waiter->handle);
+          redisco (cache, priv->conn->disco, waiter, uri);
+        }
+    }
+
+  tp_intset_destroy (asked);
+}
+
+/**
+ * gabble_presence_cache_ensure_caps:
+ * @cache: a presence cache
+ * @handle: a contact
+ *
+ * Sends any disco requests put off by gabble_presence_cache_set_caps_lazy()
+ * for @handle's capabilities, unless requests to others with the same caps
+ * would already be enough. From now on, @handle's caps are discovered as soon
+ * as they're seen.
+ */
+void
+gabble_presence_cache_ensure_caps (GabblePresenceCache *cache,
+    TpHandle handle)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpIntset *wanted;
+
+  if (!tp_handle_set_remove (priv->lazy_caps, handle))
+    return;
+
+  wanted = tp_intset_new_containing (handle);
+  ensure_caps_for_set (cache, wanted);
+  tp_intset_destroy (wanted);
+}
+
+/**
+ * gabble_presence_cache_ensure_caps_for_handles:
+ * @cache: a presence cache
+ * @handles: contacts, as a #GArray of #TpHandle
+ *
+ * Like calling gabble_presence_cache_ensure_caps() for each of @handles, but
+ * looks through the pending disco requests only once.
+ */
+void
+gabble_presence_cache_ensure_caps_for_handles (GabblePresenceCache *cache,
+    const GArray *handles)
+{
+  GabblePresenceCachePrivate *priv = cache->priv;
+  TpIntset *wanted = NULL;
+  guint i;
+
+  for (i = 0; i < handles->len; i++)
+    {
+      TpHandle handle = g_array_index (handles, TpHandle, i);
+
+      if (!tp_handle_set_remove (priv->lazy_caps, handle))
+        continue;
+
+      if (wanted == NULL)
+        wanted = tp_intset_new ();
+
+      tp_intset_add (wanted, handle);
+    }
+
+  if (wanted == NULL)
+    return;
+
+  ensure_caps_for_set (cache, wanted);
+  tp_intset_destroy (wanted);
+}
+
 gboolean
 gabble_presence_cache_disco_in_progress (GabblePresenceCache *cache,
     TpHandle handle,
@@ -136,6 +136,10 @@ void gabble_presence_cache_contacts_removed_from_olpc_view (
 gboolean gabble_presence_cache_is_unsure (GabblePresenceCache *cache,
     TpHandle handle);
 
+gboolean gabble_presence_cache_peek_snapshot (GabblePresenceCache *cache,
+    TpHandle handle, const GabbleCapabilitySet **cap_set,
+    guint *client_types);
+
 gboolean gabble_presence_cache_request_decloaking (GabblePresenceCache *self,
     TpHandle handle, const gchar *reason);
 
@@ -147,6 +151,13 @@ GHashTable* gabble_presence_cache_get_location (GabblePresenceCache *cache,
 gboolean gabble_presence_cache_disco_in_progress (GabblePresenceCache *cache,
     TpHandle handle, const gchar *resource);
 
+void gabble_presence_cache_set_caps_lazy (GabblePresenceCache *cache,
+    TpHandle handle, gboolean lazy);
+void gabble_presence_cache_ensure_caps (GabblePresenceCache *cache,
+    TpHandle handle);
+void gabble_presence_cache_ensure_caps_for_handles (
+    GabblePresenceCache *cache, const GArray *handles);
+
 TpHandle gabble_presence_cache_get_handle (GabblePresenceCache *cache,
     GabblePresence *presence);
 
@@ -46,6 +46,8 @@ G_DEFINE_TYPE_WITH_CODE (GabblePresence, gabble_presence, G_TYPE_OBJECT,
 typedef struct _Resource Resource;
 
 struct _Resource {
+    /* links this resource into GabblePresencePrivate.resources */
+    GList link;
     gchar *name;
     guint client_type;
     GabbleCapabilitySet *cap_set;
@@ -61,14 +63,23 @@ struct _Resource {
 };
 
 struct _GabblePresencePrivate {
-    /* The aggregated caps of all the contacts' resources. */
+    /* The aggregated caps of all the contacts' resources. If cap_set_dirty is
+     * set, a resource has lost some caps since this was last calculated, so it
+     * must be rebuilt before use: see ensure_aggregates(). */
     GabbleCapabilitySet *cap_set;
+    gboolean cap_set_dirty;
 
-    /* The aggregated data forms of all the contacts' resources */
+    /* The aggregated data forms of all the contacts' resources, likewise */
     GPtrArray *data_forms;
+    gboolean data_forms_dirty;
 
     gchar *no_resource_status_message;
-    GSList *resources;
+    /* Resource structs, oldest first */
+    GQueue resources;
+    /* borrowed Resource.name => borrowed Resource */
+    GHashTable *resources_by_name;
+    /* the most preferable resource, as chosen by pick_best_resource() */
+    Resource *best;
     guint olpc_views;
 
     gchar *active_resource;
@@ -78,6 +89,7 @@ static Resource *
 _resource_new (gchar *name)
 {
   Resource *new = g_slice_new0 (Resource);
+  new->link.data = new;
   new->name = name;
   new->client_type = 0;
   new->cap_set = gabble_capability_set_new ();
@@ -106,14 +118,15 @@ _resource_free (Resource *resource)
 static void
 gabble_presence_finalize (GObject *object)
 {
-  GSList *i;
+  GList *link;
   GabblePresence *presence = GABBLE_PRESENCE (object);
   GabblePresencePrivate *priv = presence->priv;
 
-  for (i = priv->resources; NULL != i; i = i->next)
-    _resource_free (i->data);
+  g_hash_table_unref (priv->resources_by_name);
+
+  while ((link = g_queue_pop_head_link (&priv->resources)) != NULL)
+    _resource_free (link->data);
 
-  g_slist_free (priv->resources);
   gabble_capability_set_free (priv->cap_set);
   g_ptr_array_unref (priv->data_forms);
 
@@ -143,7 +156,8 @@ gabble_presence_init (GabblePresence *self)
   priv->cap_set = gabble_capability_set_new ();
   priv->data_forms = g_ptr_array_new_with_free_func (
       (GDestroyNotify) g_object_unref);
-  priv->resources = NULL;
+  g_queue_init (&priv->resources);
+  priv->resources_by_name = g_hash_table_new (g_str_hash, g_str_equal);
 
   self->status = GABBLE_PRESENCE_UNKNOWN;
 }
@@ -190,12 +204,63 @@ resource_better_than (
     return (a->priority > b->priority);
 }
 
+static void
+extend_and_dup (GPtrArray *target,
+    GPtrArray *source)
+{
+  if (source == NULL)
+    return;
+
+  g_ptr_array_foreach (source, (GFunc) g_object_ref, NULL);
+  tp_g_ptr_array_extend (target, source);
+}
+
+/* Rebuilds the aggregated caps and data forms if a resource has lost any
+ * since they were last calculated. Gaining them is cheap to handle as it
+ * happens, but losing them means starting again from every resource. */
+static void
+ensure_aggregates (GabblePresence *presence)
+{
+  GabblePresencePrivate *priv = presence->priv;
+  GList *l;
+
+  if (priv->cap_set_dirty)
+    {
+      gabble_capability_set_clear (priv->cap_set);
+
+      for (l = priv->resources.head; l != NULL; l = l->next)
+        {
+          Resource *r = l->data;
+
+          gabble_capability_set_update (priv->cap_set, r->cap_set);
+        }
+
+      priv->cap_set_dirty = FALSE;
+    }
+
+  if (priv->data_forms_dirty)
+    {
+      g_ptr_array_set_size (priv->data_forms, 0);
+
+      /* TODO: deal with duplicates */
+      for (l = priv->resources.head; l != NULL; l = l->next)
+        {
+          Resource *r = l->data;
+
+          extend_and_dup (priv->data_forms, r->data_forms);
+        }
+
+      priv->data_forms_dirty = FALSE;
+    }
+}
+
 gboolean
 gabble_presence_has_cap (GabblePresence *presence,
     const gchar *ns)
 {
   g_return_val_if_fail (presence != NULL, FALSE);
 
+  ensure_aggregates (presence);
   return gabble_capability_set_has (presence->priv->cap_set, ns);
 }
 
@@ -203,6 +268,8 @@ GabbleCapabilitySet *
 gabble_presence_dup_caps (GabblePresence *presence)
 {
   g_return_val_if_fail (presence != NULL, NULL);
+
+  ensure_aggregates (presence);
   return gabble_capability_set_copy (presence->priv->cap_set);
 }
 
@@ -210,6 +277,8 @@ const GabbleCapabilitySet *
 gabble_presence_peek_caps (GabblePresence *presence)
 {
   g_return_val_if_fail (presence != NULL, NULL);
+
+  ensure_aggregates (presence);
   return presence->priv->cap_set;
 }
 
@@ -217,13 +286,15 @@ GPtrArray *
 gabble_presence_peek_data_forms (GabblePresence *presence)
 {
   g_return_val_if_fail (presence != NULL, NULL);
+
+  ensure_aggregates (presence);
   return presence->priv->data_forms;
 }
 
 gboolean
 gabble_presence_has_resources (GabblePresence *self)
 {
-  return (self->priv->resources != NULL);
+  return (self->priv->resources.length > 0);
 }
 
 /*
@@ -246,12 +317,12 @@ gabble_presence_pick_resource_by_caps (
     gconstpointer user_data)
 {
   GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  GList *i;
   Resource *chosen = NULL;
 
   g_return_val_if_fail (presence != NULL, NULL);
 
-  for (i = priv->resources; NULL != i; i = i->next)
+  for (i = priv->resources.head; NULL != i; i = i->next)
     {
       Resource *res = (Resource *) i->data;
 
@@ -274,29 +345,68 @@ gabble_presence_resource_has_caps (GabblePresence *presence,
                                    GabbleCapabilitySetPredicate predicate,
                                    gconstpointer user_data)
 {
-  GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  Resource *res;
 
-  for (i = priv->resources; NULL != i; i = i->next)
-    {
-      Resource *res = (Resource *) i->data;
+  if (resource == NULL)
+    return FALSE;
 
-      if (!tp_strdiff (res->name, resource))
-        return predicate (res->cap_set, user_data);
-    }
+  res = g_hash_table_lookup (presence->priv->resources_by_name, resource);
+
+  if (res != NULL)
+    return predicate (res->cap_set, user_data);
 
   return FALSE;
 }
 
+static Resource *
+_find_resource (GabblePresence *presence, const gchar *resource)
+{
+  /* you've been warned! */
+  g_return_val_if_fail (presence != NULL, NULL);
+  g_return_val_if_fail (resource != NULL, NULL);
+
+  return g_hash_table_lookup (presence->priv->resources_by_name, resource);
+}
+
 static void
-extend_and_dup (GPtrArray *target,
-    GPtrArray *source)
+resource_clear_caps (Resource *res)
 {
-  if (source == NULL)
-    return;
+  if (gabble_capability_set_is_frozen (res->cap_set))
+    {
+      gabble_capability_set_free (res->cap_set);
+      res->cap_set = gabble_capability_set_new ();
+    }
+  else
+    {
+      gabble_capability_set_clear (res->cap_set);
+    }
+}
 
-  g_ptr_array_foreach (source, (GFunc) g_object_ref, NULL);
-  tp_g_ptr_array_extend (target, source);
+/* Frozen sets come from the presence cache's one-per-caps-node table, and are
+ * shared rather than copied, unless the resource has other caps too (from
+ * legacy ext='' bundles, say) in which case it needs its own set again */
+static void
+resource_add_caps (Resource *res,
+    const GabbleCapabilitySet *cap_set)
+{
+  if (gabble_capability_set_is_frozen (cap_set) &&
+      gabble_capability_set_size (res->cap_set) == 0)
+    {
+      gabble_capability_set_free (res->cap_set);
+      res->cap_set = gabble_capability_set_ref (
+          (GabbleCapabilitySet *) cap_set);
+      return;
+    }
+
+  if (gabble_capability_set_is_frozen (res->cap_set))
+    {
+      GabbleCapabilitySet *copy = gabble_capability_set_copy (res->cap_set);
+
+      gabble_capability_set_free (res->cap_set);
+      res->cap_set = copy;
+    }
+
+  gabble_capability_set_update (res->cap_set, cap_set);
 }
 
 void
@@ -307,9 +417,9 @@ gabble_presence_set_capabilities (GabblePresence *presence,
                                   guint serial)
 {
   GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
+  Resource *res;
 
-  if (resource == NULL && priv->resources != NULL)
+  if (resource == NULL && priv->resources.length > 0)
     {
       /* This is consistent with the handling of presence: if we get presence
        * from a bare JID, we throw away all the resources, and if we get
@@ -321,119 +431,176 @@ gabble_presence_set_capabilities (GabblePresence *presence,
       return;
     }
 
-  gabble_capability_set_clear (priv->cap_set);
-  g_ptr_array_set_size (priv->data_forms, 0);
-
   if (resource == NULL)
     {
       DEBUG ("Setting capabilities for bare JID");
+      gabble_capability_set_clear (priv->cap_set);
       gabble_capability_set_update (priv->cap_set, cap_set);
+      priv->cap_set_dirty = FALSE;
+
+      g_ptr_array_set_size (priv->data_forms, 0);
       extend_and_dup (priv->data_forms, (GPtrArray *) data_forms);
+      priv->data_forms_dirty = FALSE;
       return;
     }
 
   DEBUG ("about to add caps to resource %s with serial %u", resource, serial);
 
-  for (i = priv->resources; NULL != i; i = i->next)
+  res = _find_resource (presence, resource);
+
+  if (res == NULL)
+    {
+      /* The aggregates are rebuilt from the remaining resources, if any, just
+       * as they would be if a resource had lost some caps */
+      priv->cap_set_dirty = TRUE;
+      priv->data_forms_dirty = TRUE;
+    }
+  else
     {
-      Resource *tmp = (Resource *) i->data;
+      DEBUG ("found resource %s", resource);
 
-      /* This does not use _find_resource() because it also refreshes
-       * priv->cap_set as we go.
-       */
-      if (0 == strcmp (tmp->name, resource))
+      if (serial > res->caps_serial)
         {
-          DEBUG ("found resource %s", resource);
-
-          if (serial > tmp->caps_serial)
-            {
-              DEBUG ("new serial %u, old %u, clearing caps", serial,
-                tmp->caps_serial);
-              tmp->caps_serial = serial;
-              gabble_capability_set_clear (tmp->cap_set);
-              g_ptr_array_set_size (tmp->data_forms, 0);
-            }
+          DEBUG ("new serial %u, old %u, clearing caps", serial,
+            res->caps_serial);
+          res->caps_serial = serial;
 
-          if (serial >= tmp->caps_serial)
-            {
-              DEBUG ("updating caps for resource %s", resource);
+          if (gabble_capability_set_size (res->cap_set) > 0)
+            priv->cap_set_dirty = TRUE;
 
-              gabble_capability_set_update (tmp->cap_set, cap_set);
+          if (res->data_forms->len > 0)
+            priv->data_forms_dirty = TRUE;
 
-              /* TODO: deal with duplicates */
-              extend_and_dup (tmp->data_forms, (GPtrArray *) data_forms);
-            }
+          resource_clear_caps (res);
+          g_ptr_array_set_size (res->data_forms, 0);
         }
 
-      gabble_capability_set_update (priv->cap_set, tmp->cap_set);
+      if (serial >= res->caps_serial)
+        {
+          DEBUG ("updating caps for resource %s", resource);
 
-      /* TODO: deal with duplicates */
-      extend_and_dup (priv->data_forms, tmp->data_forms);
+          resource_add_caps (res, cap_set);
+
+          if (!priv->cap_set_dirty)
+            gabble_capability_set_update (priv->cap_set, cap_set);
+
+          /* TODO: deal with duplicates */
+          if (data_forms != NULL && data_forms->len > 0)
+            {
+              extend_and_dup (res->data_forms, (GPtrArray *) data_forms);
+              /* the aggregate is kept in resource order */
+              priv->data_forms_dirty = TRUE;
+            }
+        }
     }
 
   g_signal_emit_by_name (presence, "capabilities-changed");
 }
 
-static Resource *
-_find_resource (GabblePresence *presence, const gchar *resource)
+/* Whether @r should be preferred to @best, the preferred resource of those
+ * which came before it. */
+static gboolean
+aggregate_better (Resource *r,
+    Resource *best)
 {
-  GSList *i;
+  /* This doesn't use resource_better_than() because phone preferences take
+   * priority above all others whereas this is only using the PC thing as a
+   * last-ditch tiebreak. wjt looked into changing this but gave up because
+   * it's messy and the phone preference stuff will go away when we do
+   * Jingle call forking anyway:
+   * <https://bugs.freedesktop.org/show_bug.cgi?id=26673>
+   */
+
+  /* trump existing status & message if it's more present
+   * or has the same presence and was more recently available
+   * or has the same presence and a higher priority */
+  return (best == NULL ||
+      r->status > best->status ||
+      (r->status == best->status &&
+          (r->last_available > best->last_available ||
+           r->priority > best->priority)) ||
+      (r->client_type & GABBLE_CLIENT_TYPE_PC
+          && !(best->client_type & GABBLE_CLIENT_TYPE_PC)));
+}
 
-  /* you've been warned! */
-  g_return_val_if_fail (presence != NULL, NULL);
-  g_return_val_if_fail (resource != NULL, NULL);
+/* aggregate_better() isn't a total order (a newer resource beats an older
+ * one, but one with a higher priority beats a newer one), so the outcome
+ * depends on the order resources are compared in: always oldest first. This
+ * means a newly-added resource need only be compared with the current best
+ * one, but any other change means going through them all again. */
+static Resource *
+pick_best_resource (GabblePresence *presence)
+{
+  GList *i;
+  Resource *best = NULL;
 
-  for (i = presence->priv->resources; NULL != i; i = i->next)
+  for (i = presence->priv->resources.head; NULL != i; i = i->next)
     {
-      Resource *res = i->data;
+      Resource *r = i->data;
 
-      if (!tp_strdiff (res->name, resource))
-        return res;
+      if (aggregate_better (r, best))
+        best = r;
     }
 
-  return NULL;
+  return best;
 }
 
-static gboolean
-aggregate_resources (GabblePresence *presence)
+static Resource *
+_add_resource (GabblePresence *presence,
+    const gchar *resource)
 {
   GabblePresencePrivate *priv = presence->priv;
-  GSList *i;
-  Resource *best = NULL;
-  guint old_client_types = presence->client_types;
+  Resource *res = _resource_new (g_strdup (resource));
 
-  /* select the most preferable Resource and update presence->* based on our
-   * choice */
-  gabble_capability_set_clear (priv->cap_set);
-  presence->status = GABBLE_PRESENCE_OFFLINE;
-
-  for (i = priv->resources; NULL != i; i = i->next)
+  /* Any caps and data forms from the bare JID are superseded by the (so far,
+   * empty) ones of this resource */
+  if (priv->resources.length == 0)
     {
-      Resource *r = (Resource *) i->data;
+      priv->cap_set_dirty = TRUE;
+      priv->data_forms_dirty = TRUE;
+    }
 
-      gabble_capability_set_update (priv->cap_set, r->cap_set);
+  g_queue_push_tail_link (&priv->resources, &res->link);
+  g_hash_table_insert (priv->resources_by_name, res->name, res);
 
-      /* This doesn't use resource_better_than() because phone preferences take
-       * priority above all others whereas this is only using the PC thing as a
-       * last-ditch tiebreak. wjt looked into changing this but gave up because
-       * it's messy and the phone preference stuff will go away when we do
-       * Jingle call forking anyway:
-       * <https://bugs.freedesktop.org/show_bug.cgi?id=26673>
-       */
+  return res;
+}
 
-      /* trump existing status & message if it's more present
-       * or has the same presence and was more recently available
-       * or has the same presence and a higher priority */
-      if (best == NULL ||
-          r->status > best->status ||
-          (r->status == best->status &&
-              (r->last_available > best->last_available ||
-               r->priority > best->priority)) ||
-          (r->client_type & GABBLE_CLIENT_TYPE_PC
-              && !(best->client_type & GABBLE_CLIENT_TYPE_PC)))
-        best = r;
+static void
+_remove_resource (GabblePresence *presence,
+    Resource *res)
+{
+  GabblePresencePrivate *priv = presence->priv;
+
+  g_hash_table_remove (priv->resources_by_name, res->name);
+  g_queue_unlink (&priv->resources, &res->link);
+
+  if (gabble_capability_set_size (res->cap_set) > 0)
+    priv->cap_set_dirty = TRUE;
+
+  if (priv->best == res)
+    priv->best = NULL;
+
+  _resource_free (res);
+}
+
+/* Updates presence->* based on priv->best, which the caller must have brought
+ * up to date. */
+static gboolean
+aggregate_resources (GabblePresence *presence)
+{
+  GabblePresencePrivate *priv = presence->priv;
+  Resource *best = priv->best;
+  guint old_client_types = presence->client_types;
+
+  if (priv->resources.length == 0)
+    {
+      gabble_capability_set_clear (priv->cap_set);
+      priv->cap_set_dirty = FALSE;
     }
 
+  presence->status = GABBLE_PRESENCE_OFFLINE;
+
   if (best != NULL)
     {
       presence->status = best->status;
@@ -469,7 +636,9 @@ gabble_presence_update (GabblePresence *presence,
   Resource *res;
   GabblePresenceId old_status;
   gchar *old_status_message;
-  GSList *i;
+  GList *link;
+  gboolean created = FALSE;
+  gboolean rerank = FALSE;
   gboolean ret = FALSE;
 
   /* save our current state */
@@ -479,13 +648,15 @@ gabble_presence_update (GabblePresence *presence,
   if (NULL == resource)
     {
       /* presence from a JID with no resource: free all resources and set
-       * presence directly */
+       * presence directly; the aggregated caps are left as they were */
+      ensure_aggregates (presence);
+
+      g_hash_table_remove_all (priv->resources_by_name);
 
-      for (i = priv->resources; i; i = i->next)
-        _resource_free (i->data);
+      while ((link = g_queue_pop_head_link (&priv->resources)) != NULL)
+        _resource_free (link->data);
 
-      g_slist_free (priv->resources);
-      priv->resources = NULL;
+      priv->best = NULL;
 
       if (tp_strdiff (priv->no_resource_status_message, status_message))
         {
@@ -505,29 +676,22 @@ gabble_presence_update (GabblePresence *presence,
     {
       if (NULL != res)
         {
-          priv->resources = g_slist_remove (priv->resources, res);
-          _resource_free (res);
+          _remove_resource (presence, res);
           res = NULL;
-
-          /* recalculate aggregate capability mask */
-          gabble_capability_set_clear (priv->cap_set);
-
-          for (i = priv->resources; i; i = i->next)
-            {
-              Resource *r = (Resource *) i->data;
-
-              gabble_capability_set_update (priv->cap_set, r->cap_set);
-            }
+          rerank = TRUE;
         }
     }
   else
     {
       if (NULL == res)
         {
-          res = _resource_new (g_strdup (resource));
-          priv->resources = g_slist_append (priv->resources, res);
+          res = _add_resource (presence, resource);
+          created = TRUE;
         }
 
+      if (res->status != status || res->priority != priority)
+        rerank = TRUE;
+
       res->status = status;
 
       if (tp_strdiff (res->status_message, status_message))
@@ -538,13 +702,26 @@ gabble_presence_update (GabblePresence *presence,
 
       res->priority = priority;
 
-      if (res->status >= GABBLE_PRESENCE_AVAILABLE)
+      if (res->status >= GABBLE_PRESENCE_AVAILABLE &&
+          res->last_available != now)
+        {
           res->last_available = now;
+          rerank = TRUE;
+        }
     }
 
   /* select the most preferable Resource and update presence->* based on our
    * choice */
-  gabble_capability_set_clear (priv->cap_set);
+  if (created)
+    {
+      if (aggregate_better (res, priv->best))
+        priv->best = res;
+    }
+  else if (rerank)
+    {
+      priv->best = pick_best_resource (presence);
+    }
+
   presence->status = GABBLE_PRESENCE_OFFLINE;
 
   /* use the status message from any offline Resource we're
@@ -650,7 +827,7 @@ gabble_presence_as_message (GabblePresence *presence,
   GabblePresencePrivate *priv = presence->priv;
   WockyStanza *message;
   WockyStanzaSubType subtype;
-  Resource *res = priv->resources->data; /* pick first resource */
+  Resource *res = g_queue_peek_head (&priv->resources); /* pick first */
 
   g_assert (NULL != res);
 
@@ -680,7 +857,7 @@ gabble_presence_as_message (GabblePresence *presence,
 gchar *
 gabble_presence_dump (GabblePresence *presence)
 {
-  GSList *i;
+  GList *i;
   GString *ret = g_string_new ("");
   gchar *tmp;
   GabblePresencePrivate *priv = presence->priv;
@@ -700,6 +877,8 @@ gabble_presence_dump (GabblePresence *presence)
     presence->status_message,
     presence->keep_unavailable);
 
+  ensure_aggregates (presence);
+
   if (priv->cap_set != NULL)
     {
       tmp = gabble_capability_set_dump (priv->cap_set, "  ");
@@ -710,7 +889,7 @@ gabble_presence_dump (GabblePresence *presence)
 
   g_string_append_printf (ret, "resources:\n");
 
-  for (i = priv->resources; i; i = i->next)
+  for (i = priv->resources.head; i; i = i->next)
     {
       Resource *res = (Resource *) i->data;
 
@@ -730,7 +909,7 @@ gabble_presence_dump (GabblePresence *presence)
         }
     }
 
-  if (priv->resources == NULL)
+  if (priv->resources.length == 0)
     g_string_append_printf (ret, "  (none)\n");
 
   return g_string_free (ret, FALSE);
@@ -825,6 +1004,8 @@ gabble_presence_pick_best_feature (GabblePresence *presence,
   g_return_val_if_fail (predicate != NULL, NULL);
   g_return_val_if_fail (table != NULL, NULL);
 
+  ensure_aggregates (presence);
+
   for (row = table; row->result != NULL; row++)
     {
       if (row->considered && predicate (presence->priv->cap_set,
@@ -847,7 +1028,7 @@ gabble_presence_update_client_types (GabblePresence *presence,
 {
   Resource *res;
 
-  if (resource == NULL && presence->priv->resources != NULL)
+  if (resource == NULL && presence->priv->resources.length > 0)
     {
       DEBUG ("Ignoring client types for NULL resource since we have "
           "presence for some resources");
@@ -867,13 +1048,19 @@ gabble_presence_update_client_types (GabblePresence *presence,
   if (res == NULL)
     return FALSE;
 
-  res->client_type = client_types;
+  if (res->client_type != client_types)
+    {
+      res->client_type = client_types;
+      presence->priv->best = pick_best_resource (presence);
+    }
+
   return aggregate_resources (presence);
 }
 
+/* Returns: a NULL-terminated array of the nicks of @client_types, such as
+ *  "pc" and "phone" */
 gchar **
-gabble_presence_get_client_types_array (GabblePresence *presence,
-    const char **resource_name)
+gabble_presence_client_types_to_strv (guint client_types)
 {
   GPtrArray *array = g_ptr_array_new ();
   GFlagsClass *klass = g_type_class_ref (GABBLE_TYPE_CLIENT_TYPE);
@@ -886,7 +1073,7 @@ gabble_presence_get_client_types_array (GabblePresence *presence,
         {
           GFlagsValue *value = &klass->values[i];
 
-          if (presence->client_types & value->value)
+          if (client_types & value->value)
             g_ptr_array_add (array, g_strdup (value->value_nick));
         }
 
@@ -895,10 +1082,17 @@ gabble_presence_get_client_types_array (GabblePresence *presence,
 
   g_ptr_array_add (array, NULL);
 
+  return (gchar **) g_ptr_array_free (array, FALSE);
+}
+
+gchar **
+gabble_presence_get_client_types_array (GabblePresence *presence,
+    const char **resource_name)
+{
   if (resource_name != NULL)
     *resource_name = presence->priv->active_resource;
 
-  return (gchar **) g_ptr_array_free (array, FALSE);
+  return gabble_presence_client_types_to_strv (presence->client_types);
 }
 
 static const GPtrArray *
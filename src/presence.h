@@ -148,6 +148,7 @@ gboolean gabble_presence_update_client_types (GabblePresence *presence,
 
 gchar **gabble_presence_get_client_types_array (GabblePresence *presence,
     const gchar **resource_name);
+gchar **gabble_presence_client_types_to_strv (guint client_types);
 
 G_END_DECLS
 
@@ -1054,6 +1054,10 @@ new_channel_from_request (GabblePrivateTubesFactory *self,
 
   tube_id = generate_tube_id (self);
 
+  /* the tube can only be offered once we know the contact supports tubes;
+   * if finding out was put off, it had better start now */
+  gabble_presence_cache_ensure_caps (priv->conn->presence_cache, handle);
+
   /* requested tubes have an empty parameters dict */
   parameters = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
       (GDestroyNotify) tp_g_value_slice_free);
@@ -177,6 +177,49 @@ static TpCMParamSpec jabber_params[] = {
   { "fallback-servers", "as", 0,
     0, NULL, 0 /* unused */, NULL, NULL },
 
+  { "caps-snapshot", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE),
+    0 /* unused */, NULL, NULL },
+  { "coalesce-presence-signals", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE),
+    0 /* unused */, NULL, NULL },
+  { "coalesce-presence-window", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (0),
+    0 /* unused */, NULL, NULL },
+  { "vcard-cache", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE),
+    0 /* unused */, NULL, NULL },
+  { "vcard-cache-max-entries", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (2000),
+    0 /* unused */, NULL, NULL },
+  { "vcard-cache-max-age", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (7 * 24 * 60 * 60),
+    0 /* unused */, NULL, NULL },
+  { "avatar-cache", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE),
+    0 /* unused */, NULL, NULL },
+  { "avatar-cache-max-entries", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (1000),
+    0 /* unused */, tp_cm_param_filter_uint_nonzero, NULL },
+  { "roster-cache", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE),
+    0 /* unused */, NULL, NULL },
+  { "muc-history-cache", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (FALSE),
+    0 /* unused */, NULL, NULL },
+  { "muc-presence-rate", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (10),
+    0 /* unused */, NULL, NULL },
+  { "roomlist-page-size", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (100),
+    0 /* unused */, NULL, NULL },
+  { "roomlist-room-info", DBUS_TYPE_BOOLEAN_AS_STRING, G_TYPE_BOOLEAN,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GINT_TO_POINTER (TRUE),
+    0 /* unused */, NULL, NULL },
+  { "roomlist-cache-ttl", "u", G_TYPE_UINT,
+    TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT, GUINT_TO_POINTER (300),
+    0 /* unused */, NULL, NULL },
+
   { "extra-certificate-identities", "as", 0,
     0, NULL, 0 /* unused */, NULL, NULL },
 
@@ -259,6 +302,20 @@ struct ParamMapping {
   MAP (GABBLE_PROP_CONNECTION_INTERFACE_GABBLE_DECLOAK_DECLOAK_AUTOMATICALLY,
        "decloak-automatically"),
   SAME ("fallback-servers"),
+  SAME ("caps-snapshot"),
+  SAME ("coalesce-presence-signals"),
+  SAME ("coalesce-presence-window"),
+  SAME ("vcard-cache"),
+  SAME ("vcard-cache-max-entries"),
+  SAME ("vcard-cache-max-age"),
+  SAME ("avatar-cache"),
+  SAME ("avatar-cache-max-entries"),
+  SAME ("roster-cache"),
+  SAME ("muc-history-cache"),
+  SAME ("muc-presence-rate"),
+  SAME ("roomlist-page-size"),
+  SAME ("roomlist-room-info"),
+  SAME ("roomlist-cache-ttl"),
   SAME ("extra-certificate-identities"),
   SAME (NULL)
 };
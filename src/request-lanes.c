@@ -0,0 +1,122 @@
+/*
+ * request-lanes.c - the request pipeline's priority lanes
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "request-lanes.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_PIPELINE
+#include "debug.h"
+
+void
+gabble_request_lanes_init (GabbleRequestLanes *lanes)
+{
+  guint i;
+
+  for (i = 0; i < GABBLE_REQUEST_PIPELINE_N_PRIORITIES; i++)
+    g_queue_init (&lanes->lanes[i]);
+
+  lanes->interactive_streak = 0;
+}
+
+guint
+gabble_request_lanes_get_length (GabbleRequestLanes *lanes)
+{
+  guint i, n = 0;
+
+  for (i = 0; i < GABBLE_REQUEST_PIPELINE_N_PRIORITIES; i++)
+    n += lanes->lanes[i].length;
+
+  return n;
+}
+
+static GabbleRequestPipelinePriority
+pick_lane (GabbleRequestLanes *lanes)
+{
+  GQueue *interactive =
+      &lanes->lanes[GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE];
+  GQueue *background =
+      &lanes->lanes[GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND];
+
+  if (interactive->length == 0)
+    {
+      lanes->interactive_streak = 0;
+      return GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND;
+    }
+
+  if (background->length > 0 &&
+      lanes->interactive_streak >= GABBLE_REQUEST_LANES_INTERACTIVE_BURST)
+    {
+      DEBUG ("letting a background request through after %u interactive "
+          "ones", lanes->interactive_streak);
+      lanes->interactive_streak = 0;
+      return GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND;
+    }
+
+  if (background->length > 0)
+    lanes->interactive_streak++;
+
+  return GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE;
+}
+
+/**
+ * gabble_request_lanes_pop:
+ * @lanes: the lanes
+ * @priority: (out) (allow-none): set to the lane the request was taken from
+ *
+ * Takes the next request to send: the head of the interactive lane, unless
+ * it has had its turn several times in a row while background requests
+ * were waiting.
+ *
+ * Returns: the link of the request taken, or %NULL if both lanes are empty
+ */
+GList *
+gabble_request_lanes_pop (GabbleRequestLanes *lanes,
+    GabbleRequestPipelinePriority *priority)
+{
+  GabbleRequestPipelinePriority lane;
+
+  if (gabble_request_lanes_get_length (lanes) == 0)
+    return NULL;
+
+  lane = pick_lane (lanes);
+
+  if (priority != NULL)
+    *priority = lane;
+
+  return g_queue_pop_head_link (&lanes->lanes[lane]);
+}
+
+/**
+ * gabble_request_lanes_raise:
+ * @lanes: the lanes
+ * @link: a request waiting in one of @lanes
+ * @priority: the lane it is waiting in
+ *
+ * Moves @link to the front of the interactive lane, ahead of every other
+ * request waiting there.
+ */
+void
+gabble_request_lanes_raise (GabbleRequestLanes *lanes,
+    GList *link,
+    GabbleRequestPipelinePriority priority)
+{
+  g_queue_unlink (&lanes->lanes[priority], link);
+  g_queue_push_head_link (
+      &lanes->lanes[GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE], link);
+}
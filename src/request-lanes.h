@@ -0,0 +1,57 @@
+/*
+ * request-lanes.h - Header for the request pipeline's priority lanes
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_REQUEST_LANES_H__
+#define __GABBLE_REQUEST_LANES_H__
+
+#include <glib.h>
+
+#include "request-pipeline.h"
+
+G_BEGIN_DECLS
+
+/* When both lanes have items waiting, send at most this many interactive
+ * requests in a row before letting a background one through, so that a
+ * steady stream of user-initiated lookups can't starve the background lane
+ * entirely. */
+#define GABBLE_REQUEST_LANES_INTERACTIVE_BURST 4
+
+typedef struct _GabbleRequestLanes GabbleRequestLanes;
+
+struct _GabbleRequestLanes {
+    /* One queue of requests waiting to be sent per
+     * GabbleRequestPipelinePriority; the caller owns the links */
+    GQueue lanes[GABBLE_REQUEST_PIPELINE_N_PRIORITIES];
+    /* Number of interactive requests taken in a row while background ones
+     * were waiting */
+    guint interactive_streak;
+};
+
+void gabble_request_lanes_init (GabbleRequestLanes *lanes);
+guint gabble_request_lanes_get_length (GabbleRequestLanes *lanes);
+
+GList *gabble_request_lanes_pop (GabbleRequestLanes *lanes,
+    GabbleRequestPipelinePriority *priority);
+void gabble_request_lanes_raise (GabbleRequestLanes *lanes,
+    GList *link,
+    GabbleRequestPipelinePriority priority);
+
+G_END_DECLS
+
+#endif /* __GABBLE_REQUEST_LANES_H__ */
@@ -25,17 +25,23 @@
 
 #define DEBUG_FLAG GABBLE_DEBUG_PIPELINE
 
+#include "conn-iq-stats.h"
 #include "connection.h"
 #include "debug.h"
+#include "request-lanes.h"
+#include "request-window.h"
 #include "util.h"
 
 #define DEFAULT_REQUEST_TIMEOUT 180
-#define REQUEST_PIPELINE_SIZE 10
 
 /* Properties */
 enum
 {
   PROP_CONNECTION = 1,
+  PROP_WINDOW,
+  PROP_IN_FLIGHT,
+  PROP_QUEUE_DEPTH,
+  PROP_RTT,
   LAST_PROPERTY
 };
 
@@ -45,10 +51,20 @@ struct _GabbleRequestPipelineItem
 {
   GabbleRequestPipeline *pipeline;
   WockyStanza *message;
-  guint timer_id;
+  GabbleTimer *timer;
   guint timeout;
   gboolean in_flight;
   gboolean zombie;
+  GabbleRequestPipelinePriority priority;
+
+  /* The pipeline queue this item is currently in (if any), and our node in
+   * it; link.data always points back to this item. */
+  GQueue *queue;
+  GList link;
+  /* Monotonic time at which the request was sent, in microseconds */
+  gint64 sent_at;
+  /* Sequence number assigned when the request was sent */
+  guint64 seq;
 
   GabbleRequestPipelineCb callback;
   gpointer user_data;
@@ -57,10 +73,14 @@ struct _GabbleRequestPipelineItem
 struct _GabbleRequestPipelinePrivate
 {
   GabbleConnection *connection;
-  GSList *pending_items;
-  GSList *items_in_flight;
+  /* Items waiting to be sent, by priority */
+  GabbleRequestLanes pending_items;
+  GQueue items_in_flight;
   /* Zombie storage (items which were cancelled while the IQ was in flight) */
-  GSList *crypt_items;
+  GQueue crypt_items;
+
+  /* How many items are allowed in flight, sized from the reply latency */
+  GabbleRequestWindow window;
 
   gboolean dispose_has_run;
 };
@@ -81,7 +101,21 @@ gabble_request_pipeline_init (GabbleRequestPipeline *obj)
 {
   GabbleRequestPipelinePrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (obj,
       GABBLE_TYPE_REQUEST_PIPELINE, GabbleRequestPipelinePrivate);
+
   obj->priv = priv;
+
+  gabble_request_lanes_init (&priv->pending_items);
+
+  g_queue_init (&priv->items_in_flight);
+  g_queue_init (&priv->crypt_items);
+
+  gabble_request_window_init (&priv->window);
+}
+
+static guint
+count_pending (GabbleRequestPipelinePrivate *priv)
+{
+  return gabble_request_lanes_get_length (&priv->pending_items);
 }
 
 static void gabble_request_pipeline_set_property (GObject *object,
@@ -112,6 +146,33 @@ gabble_request_pipeline_class_init (GabbleRequestPipelineClass *cls)
       G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
 
+  param_spec = g_param_spec_uint ("window", "Window",
+      "Current maximum number of requests in flight, adjusted according to "
+      "the server's reply latency and back-off errors",
+      GABBLE_REQUEST_WINDOW_MIN, GABBLE_REQUEST_WINDOW_MAX,
+      GABBLE_REQUEST_WINDOW_INITIAL,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_WINDOW, param_spec);
+
+  param_spec = g_param_spec_uint ("in-flight", "In flight",
+      "Number of requests which have been sent and not yet answered",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_IN_FLIGHT, param_spec);
+
+  param_spec = g_param_spec_uint ("queue-depth", "Queue depth",
+      "Number of requests waiting for a free slot in the window",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_QUEUE_DEPTH,
+      param_spec);
+
+  param_spec = g_param_spec_uint ("rtt", "Round-trip time",
+      "Smoothed estimate of the time the server takes to answer a request, "
+      "in milliseconds, or 0 if no reply has been received yet",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_RTT, param_spec);
 }
 
 static void
@@ -128,6 +189,18 @@ gabble_request_pipeline_get_property (GObject *object,
     case PROP_CONNECTION:
       g_value_set_object (value, priv->connection);
       break;
+    case PROP_WINDOW:
+      g_value_set_uint (value, priv->window.size);
+      break;
+    case PROP_IN_FLIGHT:
+      g_value_set_uint (value, priv->items_in_flight.length);
+      break;
+    case PROP_QUEUE_DEPTH:
+      g_value_set_uint (value, count_pending (priv));
+      break;
+    case PROP_RTT:
+      g_value_set_uint (value, priv->window.srtt / 1000);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -168,30 +241,29 @@ gabble_request_pipeline_new (GabbleConnection *conn)
 }
 
 static void
-delete_item (GabbleRequestPipelineItem *item)
+item_move_to_queue (GabbleRequestPipelineItem *item,
+    GQueue *queue)
 {
-  GabbleRequestPipelinePrivate *priv;
+  if (item->queue != NULL)
+    g_queue_unlink (item->queue, &item->link);
 
+  item->queue = queue;
+
+  if (queue != NULL)
+    g_queue_push_tail_link (queue, &item->link);
+}
+
+static void
+delete_item (GabbleRequestPipelineItem *item)
+{
   g_assert (GABBLE_IS_REQUEST_PIPELINE (item->pipeline));
-  priv = GABBLE_REQUEST_PIPELINE_GET_PRIVATE (item->pipeline);
 
   DEBUG ("deleting item %p", item);
 
-  if (item->zombie)
-    {
-      priv->crypt_items = g_slist_remove (priv->crypt_items, item);
-    }
-  else if (item->in_flight)
-    {
-      priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-    }
-  else
-    {
-      priv->pending_items = g_slist_remove (priv->pending_items, item);
-    }
+  item_move_to_queue (item, NULL);
 
-  if (item->timer_id)
-      g_source_remove (item->timer_id);
+  if (item->timer != NULL)
+      gabble_timer_wheel_cancel (item->timer);
 
   tp_clear_pointer (&item->message, g_object_unref);
 
@@ -207,10 +279,10 @@ gabble_request_pipeline_create_zombie (GabbleRequestPipeline *pipeline,
 
   g_assert (!item->zombie);
 
-  if (item->timer_id != 0)
+  if (item->timer != NULL)
     {
-      g_source_remove (item->timer_id);
-      item->timer_id = 0;
+      gabble_timer_wheel_cancel (item->timer);
+      item->timer = NULL;
     }
 
   (item->callback) (priv->connection, NULL, item->user_data, error);
@@ -218,9 +290,7 @@ gabble_request_pipeline_create_zombie (GabbleRequestPipeline *pipeline,
   if (item->in_flight)
     {
       item->zombie = TRUE;
-
-      priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-      priv->crypt_items = g_slist_prepend (priv->crypt_items, item);
+      item_move_to_queue (item, &priv->crypt_items);
 
       gabble_request_pipeline_go (pipeline);
     }
@@ -242,16 +312,14 @@ gabble_request_pipeline_item_cancel (GabbleRequestPipelineItem *item)
 
 static void
 gabble_request_pipeline_flush (GabbleRequestPipeline *self,
-    GSList **list)
+    GQueue *queue)
 {
   GabbleRequestPipelineItem *item;
   GError disconnected = { TP_ERROR, TP_ERROR_DISCONNECTED,
       "Request failed because connection became disconnected" };
 
-  while (*list != NULL)
+  while ((item = g_queue_peek_head (queue)) != NULL)
     {
-      item = (*list)->data;
-
       if (!item->zombie)
         (item->callback) (self->priv->connection, NULL, item->user_data,
                             &disconnected);
@@ -266,6 +334,7 @@ gabble_request_pipeline_dispose (GObject *object)
   GabbleRequestPipeline *self = GABBLE_REQUEST_PIPELINE (object);
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (self);
+  GabbleRequestLanes *lanes = &priv->pending_items;
 
   if (priv->dispose_has_run)
     return;
@@ -275,7 +344,10 @@ gabble_request_pipeline_dispose (GObject *object)
   DEBUG ("disposing request-pipeline");
 
   gabble_request_pipeline_flush (self, &priv->items_in_flight);
-  gabble_request_pipeline_flush (self, &priv->pending_items);
+  gabble_request_pipeline_flush (self, &lanes->lanes[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE]);
+  gabble_request_pipeline_flush (self, &lanes->lanes[
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND]);
   gabble_request_pipeline_flush (self, &priv->crypt_items);
 
   g_idle_remove_by_data (self);
@@ -290,6 +362,24 @@ gabble_request_pipeline_finalize (GObject *object)
   G_OBJECT_CLASS (gabble_request_pipeline_parent_class)->finalize (object);
 }
 
+static void
+adjust_window (GabbleRequestPipeline *pipeline,
+    GabbleRequestPipelineItem *item,
+    WockyStanza *reply)
+{
+  GabbleRequestPipelinePrivate *priv = pipeline->priv;
+  WockyXmppErrorType type;
+  gboolean back_off;
+
+  back_off = wocky_stanza_extract_errors (reply, &type, NULL, NULL, NULL) &&
+      type == WOCKY_XMPP_ERROR_TYPE_WAIT;
+
+  if (gabble_request_window_replied (&priv->window, item->seq,
+        g_get_monotonic_time () - item->sent_at, back_off,
+        count_pending (priv) > 0))
+    g_object_notify (G_OBJECT (pipeline), "window");
+}
+
 static void
 response_cb (GabbleConnection *conn,
              WockyStanza *sent,
@@ -306,16 +396,16 @@ response_cb (GabbleConnection *conn,
 
   DEBUG ("got reply for request %p", item);
 
-  if (NULL == g_slist_find (priv->items_in_flight, item))
-      return;
-
   g_assert (item->in_flight);
 
-  priv->items_in_flight = g_slist_remove (priv->items_in_flight, item);
-
   if (!item->zombie)
     {
       GError *error = NULL;
+
+      item_move_to_queue (item, NULL);
+
+      adjust_window (pipeline, item, reply);
+
       wocky_stanza_extract_errors (reply, NULL, &error, NULL, NULL);
       item->callback (priv->connection, reply, item->user_data, error);
       g_clear_error (&error);
@@ -330,7 +420,7 @@ response_cb (GabbleConnection *conn,
   gabble_request_pipeline_go (pipeline);
 }
 
-static gboolean
+static void
 timeout_cb (gpointer data)
 {
   GabbleRequestPipelineItem *item = (GabbleRequestPipelineItem *) data;
@@ -338,9 +428,23 @@ timeout_cb (gpointer data)
       GABBLE_REQUEST_PIPELINE_ERROR_TIMEOUT,
       "Request timed out" };
 
-  gabble_request_pipeline_create_zombie (item->pipeline, item, &timed_out);
+  item->timer = NULL;
 
-  return FALSE;
+  if (item->in_flight)
+    {
+      WockyNode *payload = wocky_node_get_first_child (
+          wocky_stanza_get_top_node (item->message));
+
+      if (gabble_request_window_timed_out (&item->pipeline->priv->window,
+            item->seq))
+        g_object_notify (G_OBJECT (item->pipeline), "window");
+
+      if (payload != NULL)
+        conn_iq_stats_timed_out (item->pipeline->priv->connection,
+            wocky_node_get_ns (payload));
+    }
+
+  gabble_request_pipeline_create_zombie (item->pipeline, item, &timed_out);
 }
 
 static void
@@ -349,31 +453,38 @@ send_next_request (GabbleRequestPipeline *pipeline)
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
   GabbleRequestPipelineItem *item;
+  GList *link;
   GError *error = NULL;
 
-  if (priv->pending_items == NULL)
+  link = gabble_request_lanes_pop (&priv->pending_items, NULL);
+
+  if (link == NULL)
       return;
 
-  item = priv->pending_items->data;
+  item = link->data;
+  item->queue = NULL;
 
-  DEBUG ("processing request %p", item);
+  DEBUG ("processing %s request %p",
+      item->priority == GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE ?
+          "interactive" : "background", item);
 
   g_assert (item->in_flight == FALSE);
 
-  priv->pending_items = g_slist_remove (priv->pending_items, item);
-
   if (!_gabble_connection_send_with_reply (priv->connection, item->message,
       response_cb, G_OBJECT (pipeline), item, &error))
     {
       item->callback (priv->connection, NULL, item->user_data, error);
+      g_error_free (error);
       delete_item (item);
-      send_next_request (pipeline);
     }
   else
     {
-      priv->items_in_flight = g_slist_prepend (priv->items_in_flight, item);
       item->in_flight = TRUE;
-      item->timer_id = g_timeout_add_seconds (item->timeout, timeout_cb, item);
+      item->sent_at = g_get_monotonic_time ();
+      item->seq = gabble_request_window_sent (&priv->window);
+      item_move_to_queue (item, &priv->items_in_flight);
+      item->timer = gabble_timer_wheel_add_seconds (
+          priv->connection->timer_wheel, item->timeout, timeout_cb, item);
     }
 }
 
@@ -383,12 +494,11 @@ gabble_request_pipeline_go (GabbleRequestPipeline *pipeline)
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
 
-  DEBUG ("called; %d pending items, %d items in flight",
-    g_slist_length (priv->pending_items),
-    g_slist_length (priv->items_in_flight));
+  DEBUG ("called; %u pending items, %u items in flight, window %u",
+    count_pending (priv), priv->items_in_flight.length, priv->window.size);
 
-  while (priv->pending_items &&
-      (g_slist_length (priv->items_in_flight) < REQUEST_PIPELINE_SIZE))
+  while (count_pending (priv) > 0 &&
+      priv->items_in_flight.length < priv->window.size)
     {
       send_next_request (pipeline);
     }
@@ -408,34 +518,94 @@ gabble_request_pipeline_enqueue (GabbleRequestPipeline *pipeline,
                                  guint timeout,
                                  GabbleRequestPipelineCb callback,
                                  gpointer user_data)
+{
+  return gabble_request_pipeline_enqueue_full (pipeline, msg, timeout,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, callback, user_data);
+}
+
+/**
+ * gabble_request_pipeline_enqueue_full:
+ * @pipeline: the pipeline
+ * @msg: the IQ to send
+ * @timeout: how long to wait for a reply once it has been sent, in seconds,
+ *  or 0 for the default
+ * @priority: which lane to queue the request in; requests made on behalf of a
+ *  D-Bus method call should use %GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE
+ * @callback: called with the reply or an error
+ * @user_data: passed to @callback
+ *
+ * Returns: an item which may be passed to
+ *  gabble_request_pipeline_item_cancel() or
+ *  gabble_request_pipeline_item_raise(), and is valid until @callback has
+ *  been called.
+ */
+GabbleRequestPipelineItem *
+gabble_request_pipeline_enqueue_full (GabbleRequestPipeline *pipeline,
+                                      WockyStanza *msg,
+                                      guint timeout,
+                                      GabbleRequestPipelinePriority priority,
+                                      GabbleRequestPipelineCb callback,
+                                      gpointer user_data)
 {
   GabbleRequestPipelinePrivate *priv =
       GABBLE_REQUEST_PIPELINE_GET_PRIVATE (pipeline);
-  GabbleRequestPipelineItem *item = g_slice_new0 (GabbleRequestPipelineItem);
+  GabbleRequestPipelineItem *item;
 
   g_return_val_if_fail (callback != NULL, NULL);
+  g_return_val_if_fail (priority < GABBLE_REQUEST_PIPELINE_N_PRIORITIES, NULL);
 
+  item = g_slice_new0 (GabbleRequestPipelineItem);
   item->pipeline = pipeline;
   item->message = msg;
   if (timeout == 0)
       timeout = DEFAULT_REQUEST_TIMEOUT;
   item->timeout = timeout;
   item->in_flight = FALSE;
+  item->priority = priority;
   item->callback = callback;
   item->user_data = user_data;
+  item->link.data = item;
 
   g_object_ref (msg);
 
-  priv->pending_items = g_slist_append (priv->pending_items, item);
+  item_move_to_queue (item, &priv->pending_items.lanes[priority]);
 
-  DEBUG ("enqueued new request as item %p", item);
-  DEBUG ("number of items in flight: %d", g_slist_length (priv->items_in_flight));
+  DEBUG ("enqueued new %s request as item %p",
+      priority == GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE ?
+          "interactive" : "background", item);
+  DEBUG ("number of items in flight: %u", priv->items_in_flight.length);
 
   /* If the pipeline isn't full, schedule a run. Run it delayed so that if
    * there's an error, the callback will be called after this function returns.
    */
-  if (g_slist_length (priv->items_in_flight) < REQUEST_PIPELINE_SIZE)
+  if (priv->items_in_flight.length < priv->window.size)
     gabble_idle_add_weak (delayed_run_pipeline, G_OBJECT (pipeline));
 
   return item;
 }
+
+/**
+ * gabble_request_pipeline_item_raise:
+ * @item: an item which has not yet completed
+ *
+ * Moves @item to the front of the interactive lane, so that it is the next
+ * request to be sent. This is used when the user asks for something which
+ * we had already queued as part of a background refresh. If @item has
+ * already been sent, this does nothing.
+ */
+void
+gabble_request_pipeline_item_raise (GabbleRequestPipelineItem *item)
+{
+  GabbleRequestPipelinePrivate *priv = item->pipeline->priv;
+
+  if (item->in_flight || item->zombie)
+    return;
+
+  DEBUG ("raising item %p", item);
+
+  gabble_request_lanes_raise (&priv->pending_items, &item->link,
+      item->priority);
+  item->priority = GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE;
+  item->queue =
+      &priv->pending_items.lanes[GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE];
+}
@@ -44,6 +44,20 @@ typedef enum
   GABBLE_REQUEST_PIPELINE_ERROR_TIMEOUT
 } GabbleRequestPipelineError;
 
+/**
+ * GabbleRequestPipelinePriority:
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND: bulk lookups which nobody is
+ *  actively waiting for, such as refreshes triggered by presence
+ * @GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE: lookups made on behalf of a
+ *  D-Bus method call, which are sent ahead of background requests
+ */
+typedef enum
+{
+  GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND,
+  GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE,
+  GABBLE_REQUEST_PIPELINE_N_PRIORITIES
+} GabbleRequestPipelinePriority;
+
 GQuark gabble_request_pipeline_error_quark (void);
 #define GABBLE_REQUEST_PIPELINE_ERROR gabble_request_pipeline_error_quark ()
 
@@ -79,7 +93,12 @@ GabbleRequestPipeline *gabble_request_pipeline_new (GabbleConnection *conn);
 GabbleRequestPipelineItem *gabble_request_pipeline_enqueue
     (GabbleRequestPipeline *pipeline, WockyStanza *msg, guint timeout,
      GabbleRequestPipelineCb callback, gpointer user_data);
+GabbleRequestPipelineItem *gabble_request_pipeline_enqueue_full
+    (GabbleRequestPipeline *pipeline, WockyStanza *msg, guint timeout,
+     GabbleRequestPipelinePriority priority,
+     GabbleRequestPipelineCb callback, gpointer user_data);
 void gabble_request_pipeline_item_cancel (GabbleRequestPipelineItem *req);
+void gabble_request_pipeline_item_raise (GabbleRequestPipelineItem *req);
 
 G_END_DECLS
 
@@ -0,0 +1,152 @@
+/*
+ * request-window.c - the request pipeline's in-flight window
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "request-window.h"
+
+#include <string.h>
+
+#define DEBUG_FLAG GABBLE_DEBUG_PIPELINE
+#include "debug.h"
+
+void
+gabble_request_window_init (GabbleRequestWindow *window)
+{
+  memset (window, 0, sizeof (GabbleRequestWindow));
+  window->size = GABBLE_REQUEST_WINDOW_INITIAL;
+}
+
+static gboolean
+set_size (GabbleRequestWindow *window,
+    guint size)
+{
+  size = CLAMP (size, GABBLE_REQUEST_WINDOW_MIN, GABBLE_REQUEST_WINDOW_MAX);
+
+  if (size == window->size)
+    return FALSE;
+
+  DEBUG ("window %u -> %u (srtt %" G_GINT64_FORMAT " ms, min rtt %"
+      G_GINT64_FORMAT " ms)", window->size, size, window->srtt / 1000,
+      window->min_rtt / 1000);
+
+  window->size = size;
+  window->credit = 0;
+  return TRUE;
+}
+
+static gboolean
+shrink (GabbleRequestWindow *window,
+    guint64 seq,
+    guint size)
+{
+  /* Everything that was already in flight when we last shrank the window
+   * was sent at the old rate, so it's expected to be in trouble too. */
+  if (seq < window->recovery_seq)
+    return FALSE;
+
+  window->recovery_seq = window->next_seq;
+  return set_size (window, size);
+}
+
+static void
+update_rtt (GabbleRequestWindow *window,
+    gint64 sample)
+{
+  /* Don't let a clock that didn't move leave us with a minimum of 0 */
+  sample = MAX (sample, 1);
+
+  if (window->srtt == 0)
+    {
+      window->srtt = sample;
+      window->min_rtt = sample;
+      return;
+    }
+
+  window->srtt += (sample - window->srtt) / 8;
+  window->min_rtt = MIN (window->min_rtt, sample);
+}
+
+/**
+ * gabble_request_window_sent:
+ * @window: a window
+ *
+ * Returns: the sequence number of a request which has just been sent, to be
+ *  passed back when it is answered or times out
+ */
+guint64
+gabble_request_window_sent (GabbleRequestWindow *window)
+{
+  return window->next_seq++;
+}
+
+/**
+ * gabble_request_window_replied:
+ * @window: a window
+ * @seq: the sequence number the request was given when it was sent
+ * @rtt: how long the reply took, in microseconds
+ * @back_off: %TRUE if the reply was an error of type "wait"
+ * @backlog: %TRUE if there are requests waiting for room in the window
+ *
+ * Returns: %TRUE if the size of @window changed
+ */
+gboolean
+gabble_request_window_replied (GabbleRequestWindow *window,
+    guint64 seq,
+    gint64 rtt,
+    gboolean back_off,
+    gboolean backlog)
+{
+  update_rtt (window, rtt);
+
+  if (back_off)
+    {
+      /* The server explicitly asked us to slow down */
+      return shrink (window, seq, window->size / 2);
+    }
+  else if (window->srtt >
+      window->min_rtt * GABBLE_REQUEST_WINDOW_RTT_SHRINK_LIMIT)
+    {
+      return shrink (window, seq, window->size - 1);
+    }
+  else if (window->srtt <=
+      window->min_rtt * GABBLE_REQUEST_WINDOW_RTT_GROW_LIMIT && backlog)
+    {
+      /* Only grow while there's a backlog to justify it: otherwise the
+       * window would creep up to the maximum while idle, and the next
+       * burst would be sent all at once. */
+      if (++window->credit >= window->size)
+        return set_size (window, window->size + 1);
+    }
+
+  return FALSE;
+}
+
+/**
+ * gabble_request_window_timed_out:
+ * @window: a window
+ * @seq: the sequence number the request was given when it was sent
+ *
+ * Returns: %TRUE if the size of @window changed
+ */
+gboolean
+gabble_request_window_timed_out (GabbleRequestWindow *window,
+    guint64 seq)
+{
+  return shrink (window, seq, window->size / 2);
+}
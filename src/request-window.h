@@ -0,0 +1,73 @@
+/*
+ * request-window.h - Header for the request pipeline's in-flight window
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_REQUEST_WINDOW_H__
+#define __GABBLE_REQUEST_WINDOW_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The number of requests we allow in flight is adjusted at runtime: it grows
+ * by one per window's worth of prompt replies and is halved whenever the
+ * server tells us to back off (an error of type "wait") or a request times
+ * out. These bound the window. */
+#define GABBLE_REQUEST_WINDOW_MIN 1
+#define GABBLE_REQUEST_WINDOW_INITIAL 10
+#define GABBLE_REQUEST_WINDOW_MAX 100
+
+/* If the smoothed RTT rises above this multiple of the smallest RTT we have
+ * seen, requests are queueing up on the server side, so stop growing... */
+#define GABBLE_REQUEST_WINDOW_RTT_GROW_LIMIT 2
+/* ... and above this multiple, shrink the window by one. */
+#define GABBLE_REQUEST_WINDOW_RTT_SHRINK_LIMIT 4
+
+typedef struct _GabbleRequestWindow GabbleRequestWindow;
+
+struct _GabbleRequestWindow {
+    /* Maximum number of requests allowed in flight */
+    guint size;
+    /* Prompt replies received since the window last grew */
+    guint credit;
+    /* Sequence number to give the next request sent */
+    guint64 next_seq;
+    /* The window is shrunk at most once per window's worth of requests: any
+     * request sent before this sequence number was sent under the old window
+     * and its outcome doesn't count against the new one. */
+    guint64 recovery_seq;
+    /* Smoothed RTT (as in RFC 6298) and the smallest RTT seen so far, both in
+     * microseconds; 0 until the first reply arrives. */
+    gint64 srtt;
+    gint64 min_rtt;
+};
+
+void gabble_request_window_init (GabbleRequestWindow *window);
+
+guint64 gabble_request_window_sent (GabbleRequestWindow *window);
+gboolean gabble_request_window_replied (GabbleRequestWindow *window,
+    guint64 seq,
+    gint64 rtt,
+    gboolean back_off,
+    gboolean backlog);
+gboolean gabble_request_window_timed_out (GabbleRequestWindow *window,
+    guint64 seq);
+
+G_END_DECLS
+
+#endif /* __GABBLE_REQUEST_WINDOW_H__ */
@@ -48,6 +48,7 @@ G_DEFINE_TYPE_WITH_CODE (GabbleRoomlistChannel, gabble_roomlist_channel,
 enum
 {
   PROP_CONFERENCE_SERVER = 1,
+  PROP_LISTING_CACHE,
   LAST_PROPERTY
 };
 
@@ -65,11 +66,48 @@ struct _GabbleRoomlistChannelPrivate
   GPtrArray *pending_room_signals;
   guint timer_source_id;
 
+  /* copies of everything signalled by the current listing, to be cached
+   * if it finishes; NULL if the listing won't be cached */
+  GPtrArray *listed_rooms;
+  /* shared with the room list manager: server name => CachedListing;
+   * NULL if listings aren't to be remembered */
+  GHashTable *listing_cache;
+
   gboolean dispose_has_run;
 };
 
 #define ROOM_SIGNAL_INTERVAL 300
 
+/* The last complete listing of a conference server's rooms, kept in a table
+ * of server name => CachedListing by the room list manager so that another
+ * room list channel for the same server can be answered straight away. */
+typedef struct {
+    gint64 listed_at;
+    GPtrArray *rooms;
+} CachedListing;
+
+static void
+room_info_free (gpointer boxed)
+{
+  g_boxed_free (TP_STRUCT_TYPE_ROOM_INFO, boxed);
+}
+
+static void
+cached_listing_free (gpointer p)
+{
+  CachedListing *listing = p;
+
+  g_ptr_array_unref (listing->rooms);
+  g_slice_free (CachedListing, listing);
+}
+
+GHashTable *
+_gabble_roomlist_channel_listing_cache_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      cached_listing_free);
+}
+
 static gboolean emit_room_signal (gpointer data);
 static void gabble_roomlist_channel_close (TpBaseChannel *base);
 
@@ -134,6 +172,9 @@ gabble_roomlist_channel_set_property (GObject     *object,
       g_free (priv->conference_server);
       priv->conference_server = g_value_dup_string (value);
       break;
+    case PROP_LISTING_CACHE:
+      priv->listing_cache = g_value_dup_boxed (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -198,6 +239,14 @@ gabble_roomlist_channel_class_init (GabbleRoomlistChannelClass *klass)
   g_object_class_install_property (object_class, PROP_CONFERENCE_SERVER,
       param_spec);
 
+  param_spec = g_param_spec_boxed ("listing-cache",
+      "Listing cache",
+      "The room list manager's last complete listing of each server, or NULL",
+      G_TYPE_HASH_TABLE,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_LISTING_CACHE,
+      param_spec);
+
   tp_dbus_properties_mixin_implement_interface (object_class,
       TP_IFACE_QUARK_CHANNEL_TYPE_ROOM_LIST,
       tp_dbus_properties_mixin_getter_gobject_properties, NULL,
@@ -219,6 +268,8 @@ gabble_roomlist_channel_dispose (GObject *object)
 
   stop_listing (self);
 
+  tp_clear_pointer (&priv->listing_cache, g_hash_table_unref);
+
   g_assert (priv->pending_room_signals != NULL);
   g_assert (priv->pending_room_signals->len == 0);
   g_ptr_array_unref (priv->pending_room_signals);
@@ -246,7 +297,8 @@ gabble_roomlist_channel_finalize (GObject *object)
 
 GabbleRoomlistChannel *
 _gabble_roomlist_channel_new (GabbleConnection *conn,
-                              const gchar *conference_server)
+                              const gchar *conference_server,
+                              GHashTable *listing_cache)
 {
   TpHandle initiator;
 
@@ -262,6 +314,7 @@ _gabble_roomlist_channel_new (GabbleConnection *conn,
                     "initiator-handle", initiator,
                     "requested", TRUE,
                     "conference-server", conference_server,
+                    "listing-cache", listing_cache,
                     NULL));
 }
 
@@ -326,15 +379,20 @@ room_info_cb (gpointer pipeline, GabbleDiscoItem *item, gpointer user_data)
   category = item->category;
   type = item->type;
 
-  if (0 != strcmp (category, "conference") ||
-      0 != strcmp (type, "text"))
-    return;
-
-  if (!g_hash_table_lookup_extended (item->features,
-        "http://jabber.org/protocol/muc", &k, &v))
+  /* Without disco#info, all we know is what the server listed; we have to
+   * trust that it's a room, and can only pass on its name. */
+  if (item->features != NULL)
     {
-      /* not muc */
-      return;
+      if (0 != strcmp (category, "conference") ||
+          0 != strcmp (type, "text"))
+        return;
+
+      if (!g_hash_table_lookup_extended (item->features,
+            "http://jabber.org/protocol/muc", &k, &v))
+        {
+          /* not muc */
+          return;
+        }
     }
 
   handle = tp_handle_ensure (room_handles, jid, NULL, NULL);
@@ -352,7 +410,12 @@ room_info_cb (gpointer pipeline, GabbleDiscoItem *item, gpointer user_data)
 
   INSERT_KEY (keys, "handle-name", G_TYPE_STRING, string,
       tp_handle_inspect (room_handles, handle));
-  INSERT_KEY (keys, "name", G_TYPE_STRING, string, name);
+
+  if (name != NULL)
+    INSERT_KEY (keys, "name", G_TYPE_STRING, string, name);
+
+  if (item->features == NULL)
+    goto features_done;
 
   if (g_hash_table_lookup_extended (item->features, "muc_membersonly", &k, &v))
     INSERT_KEY (keys, "invite-only", G_TYPE_BOOLEAN, boolean, TRUE);
@@ -403,6 +466,7 @@ room_info_cb (gpointer pipeline, GabbleDiscoItem *item, gpointer user_data)
   if (var != NULL)
     INSERT_KEY (keys, "language", G_TYPE_STRING, string, var);
 
+features_done:
   /* transfer the room handle ref to signalled_rooms */
   tp_handle_set_add (priv->signalled_rooms, handle);
 
@@ -418,11 +482,17 @@ room_info_cb (gpointer pipeline, GabbleDiscoItem *item, gpointer user_data)
 
   DEBUG ("adding new room signal data to pending: %s", jid);
   g_ptr_array_add (priv->pending_room_signals, g_value_get_boxed (&room));
+
+  if (priv->listed_rooms != NULL)
+    g_ptr_array_add (priv->listed_rooms, g_value_dup_boxed (&room));
+
   g_hash_table_unref (keys);
 }
 
 static void
-rooms_end_cb (gpointer data, gpointer user_data)
+rooms_end_cb (gpointer data,
+    const GError *error,
+    gpointer user_data)
 {
   GabbleRoomlistChannel *chan = user_data;
   GabbleRoomlistChannelPrivate *priv =
@@ -430,6 +500,28 @@ rooms_end_cb (gpointer data, gpointer user_data)
 
   emit_room_signal (chan);
 
+  /* if a page of the listing failed, what we have isn't the whole list */
+  if (error != NULL && priv->listed_rooms != NULL)
+    {
+      DEBUG ("couldn't list all the rooms on %s, so not remembering them: "
+          "%s", priv->conference_server, error->message);
+      tp_clear_pointer (&priv->listed_rooms, g_ptr_array_unref);
+    }
+
+  if (priv->listed_rooms != NULL && priv->listing_cache != NULL)
+    {
+      CachedListing *listing = g_slice_new0 (CachedListing);
+
+      DEBUG ("remembering the %u rooms on %s", priv->listed_rooms->len,
+          priv->conference_server);
+
+      listing->listed_at = g_get_monotonic_time ();
+      listing->rooms = priv->listed_rooms;
+      priv->listed_rooms = NULL;
+      g_hash_table_insert (priv->listing_cache,
+          g_strdup (priv->conference_server), listing);
+    }
+
   priv->listing = FALSE;
   tp_svc_channel_type_room_list_emit_listing_rooms (
       (TpSvcChannelTypeRoomList *) chan, FALSE);
@@ -464,6 +556,9 @@ stop_listing (GabbleRoomlistChannel *self)
       priv->timer_source_id = 0;
     }
 
+  /* an incomplete listing is no use to anyone */
+  tp_clear_pointer (&priv->listed_rooms, g_ptr_array_unref);
+
   g_assert (priv->pending_room_signals->len == 0);
 }
 
@@ -501,14 +596,52 @@ gabble_roomlist_channel_list_rooms (TpSvcChannelTypeRoomList *iface,
   TpBaseChannel *base = TP_BASE_CHANNEL (self);
   GabbleConnection *conn =
       GABBLE_CONNECTION (tp_base_channel_get_connection (base));
+  guint page_size, cache_ttl;
+  gboolean room_info;
+  CachedListing *listing = NULL;
+
+  g_object_get (conn,
+      "roomlist-page-size", &page_size,
+      "roomlist-room-info", &room_info,
+      "roomlist-cache-ttl", &cache_ttl,
+      NULL);
 
   priv->listing = TRUE;
   tp_svc_channel_type_room_list_emit_listing_rooms (iface, TRUE);
 
+  if (priv->listing_cache != NULL)
+    listing = g_hash_table_lookup (priv->listing_cache,
+        priv->conference_server);
+
+  if (listing != NULL && cache_ttl > 0 &&
+      g_get_monotonic_time () - listing->listed_at <
+        (gint64) cache_ttl * G_USEC_PER_SEC)
+    {
+      DEBUG ("reusing the %u rooms listed on %s %" G_GINT64_FORMAT "s ago",
+          listing->rooms->len, priv->conference_server,
+          (g_get_monotonic_time () - listing->listed_at) / G_USEC_PER_SEC);
+
+      if (listing->rooms->len > 0)
+        tp_svc_channel_type_room_list_emit_got_rooms (iface,
+            listing->rooms);
+
+      priv->listing = FALSE;
+      tp_svc_channel_type_room_list_emit_listing_rooms (iface, FALSE);
+      tp_svc_channel_type_room_list_return_from_list_rooms (context);
+      return;
+    }
+
+  tp_clear_pointer (&priv->listed_rooms, g_ptr_array_unref);
+
+  if (cache_ttl > 0 && priv->listing_cache != NULL)
+    priv->listed_rooms = g_ptr_array_new_with_free_func (room_info_free);
+
   if (priv->disco_pipeline == NULL)
     priv->disco_pipeline = gabble_disco_pipeline_init (conn->disco,
         room_info_cb, rooms_end_cb, self);
 
+  gabble_disco_pipeline_set_page_size (priv->disco_pipeline, page_size);
+  gabble_disco_pipeline_set_items_only (priv->disco_pipeline, !room_info);
   gabble_disco_pipeline_run (priv->disco_pipeline, priv->conference_server);
 
   priv->timer_source_id = g_timeout_add (ROOM_SIGNAL_INTERVAL,
@@ -64,7 +64,9 @@ GType gabble_roomlist_channel_get_type (void);
 
 
 GabbleRoomlistChannel *_gabble_roomlist_channel_new (GabbleConnection *conn,
-    const gchar *conference_server);
+    const gchar *conference_server, GHashTable *listing_cache);
+
+GHashTable *_gabble_roomlist_channel_listing_cache_new (void);
 
 
 G_END_DECLS
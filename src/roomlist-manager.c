@@ -64,6 +64,9 @@ struct _GabbleRoomlistManagerPrivate
 
   GPtrArray *channels;
 
+  /* server name => its last complete listing, shared with our channels */
+  GHashTable *listing_cache;
+
   gboolean dispose_has_run;
 };
 
@@ -76,6 +79,8 @@ gabble_roomlist_manager_init (GabbleRoomlistManager *self)
 
   /* In practice we probably won't have more than one room list at a time */
   self->priv->channels = g_ptr_array_sized_new (2);
+
+  self->priv->listing_cache = _gabble_roomlist_channel_listing_cache_new ();
 }
 
 
@@ -113,6 +118,8 @@ gabble_roomlist_manager_close_all (GabbleRoomlistManager *self)
 
       g_ptr_array_unref (tmp);
     }
+
+  tp_clear_pointer (&self->priv->listing_cache, g_hash_table_unref);
 }
 
 
@@ -383,7 +390,8 @@ gabble_roomlist_manager_handle_request (TpChannelManager *manager,
     }
 
   /* no existing channel is suitable - make a new one */
-  channel = _gabble_roomlist_channel_new (self->priv->conn, server);
+  channel = _gabble_roomlist_channel_new (self->priv->conn, server,
+      self->priv->listing_cache);
   g_signal_connect (channel, "closed", (GCallback) roomlist_channel_closed_cb,
       self);
   g_ptr_array_add (self->priv->channels, channel);
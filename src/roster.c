@@ -22,6 +22,7 @@
 #include "config.h"
 #include "roster.h"
 
+#include <errno.h>
 #include <string.h>
 
 #include <dbus/dbus-glib.h>
@@ -43,6 +44,13 @@
 
 #define GOOGLE_ROSTER_VERSION "2"
 
+/* Keys in the roster store. Each roster item is kept in a group named by its
+ * JID, with keys named like the attributes of <item/>; JIDs are normalized to
+ * lower case, so they can't collide with the group holding the version. */
+#define STORE_GROUP_ROSTER "Roster"
+#define STORE_KEY_VERSION "version"
+#define STORE_KEY_GROUPS "groups"
+
 /* signal enum */
 enum
 {
@@ -71,8 +79,27 @@ struct _GabbleRosterPrivate
 
   gboolean received;
   gboolean dispose_has_run;
+
+  /* If the "roster-cache" parameter is set, the file the roster is kept in
+   * between connections; otherwise NULL */
+  gchar *store_path;
+  /* the version (XEP-0237) of the roster we have, or NULL if the server
+   * hasn't given us one */
+  gchar *version;
+  /* TRUE if our roster was loaded from store_path and the server hasn't yet
+   * told us what changed since */
+  gboolean from_store;
+
+  /* Edits to different contacts are sent without waiting for each other,
+   * but at most MAX_EDITS_IN_FLIGHT at once, so that a bulk operation on
+   * thousands of contacts doesn't swamp the server; contacts with edits
+   * waiting for a slot are queued here, as GUINT_TO_POINTER (handle) */
+  guint n_edits_in_flight;
+  GQueue *queued_edits;
 };
 
+#define MAX_EDITS_IN_FLIGHT 16
+
 typedef enum
 {
   GOOGLE_ITEM_TYPE_INVALID = -1,
@@ -132,6 +159,8 @@ struct _GabbleRosterItem
    * edits immediately - instead, store them in unsent_edits */
   gboolean edits_in_flight;
   GabbleRosterItemEdit *unsent_edits;
+  /* if TRUE, unsent_edits are waiting in the roster's queued_edits */
+  gboolean edits_queued;
 
   /* Might not match @subscription and @ask_subscribe exactly, in cases where
    * we're working around server breakage */
@@ -186,6 +215,7 @@ gabble_roster_init (GabbleRoster *obj)
 
   priv->items = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) _gabble_roster_item_free);
+  priv->queued_edits = g_queue_new ();
 }
 
 static void
@@ -221,6 +251,9 @@ gabble_roster_finalize (GObject *object)
   DEBUG ("called with %p", object);
 
   g_hash_table_unref (priv->items);
+  g_queue_free (priv->queued_edits);
+  g_free (priv->store_path);
+  g_free (priv->version);
 
   G_OBJECT_CLASS (gabble_roster_parent_class)->finalize (object);
 }
@@ -481,6 +514,13 @@ _gabble_roster_item_maybe_remove (GabbleRoster *roster,
       return FALSE;
     }
 
+  /* nor those with edits waiting to be sent */
+  if (item->edits_queued)
+    {
+      DEBUG ("contact#%u has edits waiting to be sent", handle);
+      return FALSE;
+    }
+
   /* don't remove transient items that represent publish/subscribe state */
   if (item->publish != TP_SUBSCRIPTION_STATE_NO)
     {
@@ -1312,6 +1352,338 @@ process_roster (
 static void roster_item_apply_edits (GabbleRoster *roster, TpHandle contact,
     GabbleRosterItem *item);
 
+/*
+ * roster_complete:
+ * @roster: a roster object
+ *
+ * Called when we first have the whole roster, either from the server or
+ * from the roster store.
+ */
+static void
+roster_complete (GabbleRoster *roster)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  GHashTableIter iter;
+  gpointer k, v;
+  GArray *members = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+      g_hash_table_size (roster->priv->items));
+  GSList *edited_items = NULL;
+
+  /* If we're subscribed to somebody (subscription=to or =both),
+   * and we haven't received presence from them,
+   * we know they're offline. Let clients know that.
+   */
+  g_hash_table_iter_init (&iter, roster->priv->items);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      GabbleRosterItem *item = v;
+      TpHandle contact = GPOINTER_TO_UINT (k);
+      GabblePresence *presence = gabble_presence_cache_get (
+          priv->conn->presence_cache, contact);
+
+      if (item->subscribe == TP_SUBSCRIPTION_STATE_YES &&
+          (presence == NULL || presence->status == GABBLE_PRESENCE_UNKNOWN))
+        {
+          /* The contact might be in the presence cache with UNKNOWN
+           * presence if we've received a message from them before the
+           * roster arrived: an item is forcibly added to stash the
+           * nickname which might have been included in the <message/> in
+           * the presence cache. (This seems like a rather illogical place
+           * to stash such nicknames—if anything, they should live in
+           * GabbleImFactory—but there we go.)
+           *
+           * So if this is the case, we flip their status to OFFLINE. We
+           * don't use gabble_presence_update() because we want to signal
+           * all the unknown→offline transitions together.
+           */
+          if (presence != NULL)
+            presence->status = GABBLE_PRESENCE_OFFLINE;
+
+          g_array_append_val (members, contact);
+        }
+
+      if (item->unsent_edits != NULL)
+        edited_items = g_slist_prepend (edited_items, item);
+    }
+
+  conn_presence_emit_presence_update (priv->conn, members);
+  g_array_unref (members);
+
+  /* The roster is now complete and we can emit signals... */
+  tp_base_contact_list_set_list_received ((TpBaseContactList *) roster);
+  priv->received = TRUE;
+
+  /* ... and carry out any pending edits */
+  for (;
+      edited_items != NULL;
+      edited_items = g_slist_delete_link (edited_items, edited_items))
+    {
+      GabbleRosterItem *item = edited_items->data;
+
+      roster_item_apply_edits (roster, item->unsent_edits->handle, item);
+    }
+}
+
+/*
+ * forget_missing_items:
+ * @roster: a roster object
+ * @query_node: the whole roster, as sent by the server
+ *
+ * Our roster came from the roster store, but the server has sent the whole
+ * roster rather than the changes since: removes whoever isn't in it any more.
+ */
+static void
+forget_missing_items (GabbleRoster *roster,
+    WockyNode *query_node)
+{
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) roster->priv->conn, TP_HANDLE_TYPE_CONTACT);
+  TpHandleSet *present = tp_handle_set_new (contact_repo);
+  WockyNodeTree *removals = wocky_node_tree_new ("query",
+      WOCKY_XMPP_NS_ROSTER, NULL);
+  WockyNode *removals_query = wocky_node_tree_get_top_node (removals);
+  WockyNodeIter i;
+  WockyNode *item_node;
+  GHashTableIter iter;
+  gpointer k, v;
+  guint n_removed = 0;
+
+  wocky_node_iter_init (&i, query_node, "item", NULL);
+  while (wocky_node_iter_next (&i, &item_node))
+    {
+      const gchar *jid;
+      TpHandle handle = validate_roster_item (contact_repo, item_node, &jid);
+
+      if (handle != 0)
+        tp_handle_set_add (present, handle);
+    }
+
+  g_hash_table_iter_init (&iter, roster->priv->items);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      GabbleRosterItem *item = v;
+      TpHandle handle = GPOINTER_TO_UINT (k);
+
+      if (item->stored && !tp_handle_set_is_member (present, handle))
+        {
+          WockyNode *removal = wocky_node_add_child (removals_query, "item");
+
+          wocky_node_set_attribute (removal, "jid",
+              tp_handle_inspect (contact_repo, handle));
+          wocky_node_set_attribute (removal, "subscription", "remove");
+          n_removed++;
+        }
+    }
+
+  if (n_removed > 0)
+    {
+      DEBUG ("%u contacts have left the roster since it was saved",
+          n_removed);
+      process_roster (roster, removals_query);
+    }
+
+  g_object_unref (removals);
+  tp_handle_set_destroy (present);
+}
+
+static gchar *
+store_build_path (GabbleRoster *roster)
+{
+  TpBaseConnection *base = (TpBaseConnection *) roster->priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  gchar *escaped, *filename, *path;
+
+  escaped = tp_escape_as_identifier (tp_handle_inspect (contact_repo,
+        tp_base_connection_get_self_handle (base)));
+  filename = g_strconcat (escaped, ".roster", NULL);
+  path = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+      "rosters", filename, NULL);
+
+  g_free (filename);
+  g_free (escaped);
+  return path;
+}
+
+static void
+store_copy_attribute (GKeyFile *keyfile,
+    const gchar *jid,
+    WockyNode *item_node,
+    const gchar *name)
+{
+  gchar *value = g_key_file_get_string (keyfile, jid, name, NULL);
+
+  if (value != NULL)
+    wocky_node_set_attribute (item_node, name, value);
+
+  g_free (value);
+}
+
+/*
+ * store_load:
+ * @roster: a roster object
+ *
+ * Fills in the roster from the roster store, as if the server had sent it.
+ *
+ * Returns: %TRUE if there was a roster to load
+ */
+static gboolean
+store_load (GabbleRoster *roster)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  GKeyFile *keyfile = g_key_file_new ();
+  WockyNodeTree *tree;
+  WockyNode *query_node;
+  GError *error = NULL;
+  gchar **groups;
+  guint i;
+
+  if (!g_key_file_load_from_file (keyfile, priv->store_path,
+        G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("no usable roster in %s: %s", priv->store_path, error->message);
+      g_error_free (error);
+      g_key_file_free (keyfile);
+      return FALSE;
+    }
+
+  tree = wocky_node_tree_new ("query", WOCKY_XMPP_NS_ROSTER, NULL);
+  query_node = wocky_node_tree_get_top_node (tree);
+  groups = g_key_file_get_groups (keyfile, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      WockyNode *item_node;
+      gchar **names;
+      guint j;
+
+      if (!tp_strdiff (groups[i], STORE_GROUP_ROSTER))
+        continue;
+
+      item_node = wocky_node_add_child (query_node, "item");
+      wocky_node_set_attribute (item_node, "jid", groups[i]);
+      store_copy_attribute (keyfile, groups[i], item_node, "subscription");
+      store_copy_attribute (keyfile, groups[i], item_node, "ask");
+      store_copy_attribute (keyfile, groups[i], item_node, "name");
+
+      names = g_key_file_get_string_list (keyfile, groups[i],
+          STORE_KEY_GROUPS, NULL, NULL);
+
+      for (j = 0; names != NULL && names[j] != NULL; j++)
+        wocky_node_add_child_with_content (item_node, "group", names[j]);
+
+      g_strfreev (names);
+    }
+
+  g_free (priv->version);
+  priv->version = g_key_file_get_string (keyfile, STORE_GROUP_ROSTER,
+      STORE_KEY_VERSION, NULL);
+
+  DEBUG ("loaded roster version %s from %s",
+      priv->version != NULL ? priv->version : "(none)", priv->store_path);
+
+  process_roster (roster, query_node);
+  roster_complete (roster);
+
+  g_object_unref (tree);
+  g_strfreev (groups);
+  g_key_file_free (keyfile);
+  return TRUE;
+}
+
+static void
+store_save (GabbleRoster *roster)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->conn;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  TpHandleRepoIface *group_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_GROUP);
+  GKeyFile *keyfile = g_key_file_new ();
+  gboolean complete = TRUE;
+  GHashTableIter iter;
+  gpointer k, v;
+  gchar *dir, *data;
+  gsize len;
+  guint n_items = 0;
+  GError *error = NULL;
+
+  g_hash_table_iter_init (&iter, priv->items);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      GabbleRosterItem *item = v;
+      const gchar *jid = tp_handle_inspect (contact_repo,
+          GPOINTER_TO_UINT (k));
+
+      /* Contacts who are only pending aren't on the server's roster */
+      if (!item->stored)
+        continue;
+
+      /* Group names may not contain square brackets */
+      if (strpbrk (jid, "[]") != NULL)
+        {
+          complete = FALSE;
+          continue;
+        }
+
+      g_key_file_set_string (keyfile, jid, "subscription",
+          _subscription_to_string (item->subscription));
+
+      if (item->ask_subscribe)
+        g_key_file_set_string (keyfile, jid, "ask", "subscribe");
+
+      if (item->name != NULL)
+        g_key_file_set_string (keyfile, jid, "name", item->name);
+
+      if (item->groups != NULL && tp_handle_set_size (item->groups) > 0)
+        {
+          GPtrArray *names = g_ptr_array_new ();
+          TpIntsetFastIter group_iter;
+          TpHandle group;
+
+          tp_intset_fast_iter_init (&group_iter,
+              tp_handle_set_peek (item->groups));
+
+          while (tp_intset_fast_iter_next (&group_iter, &group))
+            g_ptr_array_add (names,
+                (gpointer) tp_handle_inspect (group_repo, group));
+
+          g_key_file_set_string_list (keyfile, jid, STORE_KEY_GROUPS,
+              (const gchar * const *) names->pdata, names->len);
+          g_ptr_array_unref (names);
+        }
+
+      n_items++;
+    }
+
+  /* If an item couldn't be saved, the server mustn't be asked only for what
+   * changed since this version, or we'd never see that item again */
+  if (complete && priv->version != NULL)
+    g_key_file_set_string (keyfile, STORE_GROUP_ROSTER, STORE_KEY_VERSION,
+        priv->version);
+
+  dir = g_path_get_dirname (priv->store_path);
+  data = g_key_file_to_data (keyfile, &len, NULL);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    DEBUG ("couldn't create %s: %s", dir, g_strerror (errno));
+  else if (!g_file_set_contents (priv->store_path, data, len, &error))
+    DEBUG ("couldn't save roster: %s", error->message);
+  else
+    DEBUG ("saved %u roster items at version %s to %s", n_items,
+        complete && priv->version != NULL ? priv->version : "(none)",
+        priv->store_path);
+
+  g_clear_error (&error);
+  g_free (data);
+  g_free (dir);
+  g_key_file_free (keyfile);
+}
+
 /**
  * got_roster_iq:
  *
@@ -1328,6 +1700,7 @@ got_roster_iq (GabbleRoster *roster,
   GabbleRosterPrivate *priv = roster->priv;
   WockyNode *iq_node, *query_node;
   WockyStanzaSubType sub_type;
+  const gchar *version;
 
   if (priv->conn == NULL)
     return FALSE;
@@ -1350,7 +1723,8 @@ got_roster_iq (GabbleRoster *roster,
       return FALSE;
     }
 
-  if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT && priv->received)
+  if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT && priv->received &&
+      !priv->from_store)
     {
       /* <https://bugs.freedesktop.org/show_bug.cgi?id=42186>: some super-buggy
        * XMPP server running on vk.com sends its reply to our roster query twice.
@@ -1360,71 +1734,35 @@ got_roster_iq (GabbleRoster *roster,
       return FALSE;
     }
 
-  process_roster (roster, query_node);
-
-  if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT)
+  if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT && priv->from_store)
     {
-      /* We are handling the response to our initial roster request. */
-      GHashTableIter iter;
-      gpointer k, v;
-      GArray *members = g_array_sized_new (FALSE, FALSE, sizeof (guint),
-          g_hash_table_size (roster->priv->items));
-      GSList *edited_items = NULL;
-
-      /* If we're subscribed to somebody (subscription=to or =both),
-       * and we haven't received presence from them,
-       * we know they're offline. Let clients know that.
-       */
-      g_hash_table_iter_init (&iter, roster->priv->items);
-
-      while (g_hash_table_iter_next (&iter, &k, &v))
-        {
-          GabbleRosterItem *item = v;
-          TpHandle contact = GPOINTER_TO_UINT (k);
-          GabblePresence *presence = gabble_presence_cache_get (
-              priv->conn->presence_cache, contact);
-
-          if (item->subscribe == TP_SUBSCRIPTION_STATE_YES &&
-              (presence == NULL || presence->status == GABBLE_PRESENCE_UNKNOWN))
-            {
-              /* The contact might be in the presence cache with UNKNOWN
-               * presence if we've received a message from them before the
-               * roster arrived: an item is forcibly added to stash the
-               * nickname which might have been included in the <message/> in
-               * the presence cache. (This seems like a rather illogical place
-               * to stash such nicknames—if anything, they should live in
-               * GabbleImFactory—but there we go.)
-               *
-               * So if this is the case, we flip their status to OFFLINE. We
-               * don't use gabble_presence_update() because we want to signal
-               * all the unknown→offline transitions together.
-               */
-              if (presence != NULL)
-                presence->status = GABBLE_PRESENCE_OFFLINE;
-
-              g_array_append_val (members, contact);
-            }
+      DEBUG ("the server sent the whole roster, rather than what changed "
+          "since version %s", priv->version);
+      forget_missing_items (roster, query_node);
+      priv->from_store = FALSE;
+    }
 
-          if (item->unsent_edits != NULL)
-            edited_items = g_slist_prepend (edited_items, item);
-        }
+  process_roster (roster, query_node);
 
-      conn_presence_emit_presence_update (priv->conn, members);
-      g_array_unref (members);
+  /* Pushes carry the version the roster is at once they are applied */
+  version = wocky_node_get_attribute (query_node, "ver");
 
-      /* The roster is now complete and we can emit signals... */
-      tp_base_contact_list_set_list_received ((TpBaseContactList *) roster);
-      priv->received = TRUE;
+  if (version != NULL)
+    {
+      g_free (priv->version);
+      priv->version = g_strdup (version);
+    }
 
-      /* ... and carry out any pending edits */
-      for (;
-          edited_items != NULL;
-          edited_items = g_slist_delete_link (edited_items, edited_items))
-        {
-          GabbleRosterItem *item = edited_items->data;
+  if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT)
+    {
+      /* We are handling the response to our initial roster request. */
+      if (!priv->received)
+        roster_complete (roster);
 
-          roster_item_apply_edits (roster, item->unsent_edits->handle, item);
-        }
+      /* Downloading it was the expensive part, so don't wait until we
+       * disconnect to save it */
+      if (priv->store_path != NULL)
+        store_save (roster);
     }
   else /* WOCKY_STANZA_SUB_TYPE_SET */
     {
@@ -1688,6 +2026,31 @@ gabble_roster_close_all (GabbleRoster *self)
   tp_clear_pointer (&priv->groups, tp_handle_set_destroy);
   tp_clear_pointer (&priv->pre_authorized, tp_handle_set_destroy);
 
+  /* edits still waiting to be sent never will be */
+  while (!g_queue_is_empty (priv->queued_edits))
+    {
+      TpHandle contact = GPOINTER_TO_UINT (
+          g_queue_pop_head (priv->queued_edits));
+      GabbleRosterItem *item = _gabble_roster_item_lookup (self, contact);
+      GSList *slist;
+
+      if (item == NULL || !item->edits_queued)
+        continue;
+
+      item->edits_queued = FALSE;
+
+      if (item->unsent_edits == NULL)
+        continue;
+
+      for (slist = item->unsent_edits->results; slist != NULL;
+          slist = slist->next)
+        g_simple_async_result_set_error (slist->data, TP_ERROR,
+            TP_ERROR_DISCONNECTED, "Disconnected before the roster could "
+            "be edited");
+
+      tp_clear_pointer (&item->unsent_edits, item_edit_free);
+    }
+
   if (self->priv->cancel_on_disconnect != NULL)
     g_cancellable_cancel (self->priv->cancel_on_disconnect);
 
@@ -1725,7 +2088,20 @@ roster_received_cb (GObject *source_object,
       if (conn_util_send_iq_finish ((GabbleConnection *) source_object,
             result, &response, &error))
         {
-          got_roster_iq (self, response);
+          if (self->priv->from_store &&
+              wocky_node_get_child_ns (wocky_stanza_get_top_node (response),
+                "query", WOCKY_XMPP_NS_ROSTER) == NULL)
+            {
+              /* An empty result means the roster we loaded is current, and
+               * any changes since will follow as pushes (XEP-0237) */
+              DEBUG ("roster unchanged since version %s",
+                  self->priv->version);
+              self->priv->from_store = FALSE;
+            }
+          else
+            {
+              got_roster_iq (self, response);
+            }
 
           g_object_unref (response);
         }
@@ -1781,10 +2157,33 @@ connection_status_changed_cb (GabbleConnection *conn,
 
           if (tp_base_contact_list_get_download_at_connection (base))
             {
+              WockyNode *query_node;
+              gboolean store;
+
+              g_object_get (conn,
+                  "roster-cache", &store,
+                  NULL);
+
+              /* Google's roster extensions aren't kept in the store */
+              if (store &&
+                  !(conn->features & GABBLE_CONNECTION_FEATURES_GOOGLE_ROSTER))
+                {
+                  self->priv->store_path = store_build_path (self);
+                  self->priv->from_store = store_load (self);
+                }
+
               DEBUG ("requesting roster");
 
               stanza = _gabble_roster_message_new (self, WOCKY_STANZA_SUB_TYPE_GET,
-                  NULL);
+                  &query_node);
+
+              /* An empty version asks for a versioned roster when we have
+               * none to start from */
+              if (self->priv->store_path != NULL && (conn->features &
+                    GABBLE_CONNECTION_FEATURES_ROSTER_VERSIONING) != 0)
+                wocky_node_set_attribute (query_node, "ver",
+                    self->priv->from_store && self->priv->version != NULL ?
+                        self->priv->version : "");
 
               conn_util_send_iq_async (conn, stanza,
                   self->priv->cancel_on_disconnect,
@@ -1801,6 +2200,9 @@ connection_status_changed_cb (GabbleConnection *conn,
       break;
 
     case TP_CONNECTION_STATUS_DISCONNECTED:
+      if (self->priv->store_path != NULL && self->priv->received)
+        store_save (self);
+
       gabble_roster_close_all (self);
       break;
     }
@@ -1973,6 +2375,22 @@ roster_item_apply_edits (GabbleRoster *roster,
       return;
     }
 
+  if (priv->n_edits_in_flight >= MAX_EDITS_IN_FLIGHT)
+    {
+      if (!item->edits_queued)
+        {
+          DEBUG ("%u edits in flight; queueing edits to contact#%u",
+              priv->n_edits_in_flight, contact);
+          item->edits_queued = TRUE;
+          g_queue_push_tail (priv->queued_edits, GUINT_TO_POINTER (contact));
+        }
+
+      return;
+    }
+
+  /* if this contact was queued, it needn't be any more */
+  item->edits_queued = FALSE;
+
   DEBUG ("Applying edits to contact#%u", contact);
 
   memcpy (&edited_item, item, sizeof (GabbleRosterItem));
@@ -2158,6 +2576,7 @@ roster_item_apply_edits (GabbleRoster *roster,
    * them */
   item->unsent_edits = NULL;
   item->edits_in_flight = TRUE;
+  priv->n_edits_in_flight++;
 
   conn_util_send_iq_async (priv->conn, message,
       priv->cancel_on_disconnect, roster_edited_cb,
@@ -2172,6 +2591,29 @@ roster_item_apply_edits (GabbleRoster *roster,
     }
 }
 
+/* Sends queued edits, oldest first, while there are slots for them */
+static void
+roster_apply_queued_edits (GabbleRoster *roster)
+{
+  GabbleRosterPrivate *priv = roster->priv;
+
+  while (priv->n_edits_in_flight < MAX_EDITS_IN_FLIGHT &&
+      !g_queue_is_empty (priv->queued_edits))
+    {
+      TpHandle contact = GPOINTER_TO_UINT (
+          g_queue_pop_head (priv->queued_edits));
+      GabbleRosterItem *item = _gabble_roster_item_lookup (roster, contact);
+
+      /* the item may have been removed, and its edits with it, since it was
+       * queued */
+      if (item == NULL || !item->edits_queued)
+        continue;
+
+      item->edits_queued = FALSE;
+      roster_item_apply_edits (roster, contact, item);
+    }
+}
+
 /* Called when an edit to the roster item has either succeeded or failed. */
 static void
 roster_edited_cb (GObject *source_object,
@@ -2199,7 +2641,10 @@ roster_edited_cb (GObject *source_object,
     }
 
   if (roster != NULL)
-    item = _gabble_roster_item_lookup (roster, edit->handle);
+    {
+      roster->priv->n_edits_in_flight--;
+      item = _gabble_roster_item_lookup (roster, edit->handle);
+    }
 
   if (item != NULL)
     {
@@ -2220,6 +2665,9 @@ roster_edited_cb (GObject *source_object,
       _gabble_roster_item_maybe_remove (roster, edit->handle);
     }
 
+  if (roster != NULL)
+    roster_apply_queued_edits (roster);
+
   item_edit_free (edit);
 }
 
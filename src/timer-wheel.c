@@ -0,0 +1,458 @@
+/*
+ * timer-wheel.c - A shared hierarchical timer wheel
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Request timeouts are counted in seconds and almost never fire, but at login
+ * there can be tens of thousands of them outstanding. Rather than giving each
+ * one its own GSource, they all hang off one wheel per connection, driven by a
+ * single source which is armed for the earliest occupied slot, and only
+ * while timers are pending.
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots. Level 0 holds timers
+ * due within WHEEL_SIZE ticks, one slot per tick; each higher level covers
+ * WHEEL_SIZE times the span of the one below, and its slots are cascaded
+ * down a level whenever the lower level wraps around. Adding and cancelling a
+ * timer are O(1): each timer embeds the GList link that threads it into its
+ * slot. */
+
+#include "config.h"
+#include "timer-wheel.h"
+
+#define DEBUG_FLAG GABBLE_DEBUG_CONNECTION
+
+#include "debug.h"
+
+#define TICK_USEC G_USEC_PER_SEC
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TICKS ((G_GUINT64_CONSTANT (1) << \
+      (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct _GabbleTimer {
+    GabbleTimerWheel *wheel;
+    /* the slot, or the wheel's expired queue, holding this timer */
+    GQueue *queue;
+    GList link;
+
+    /* tick number at which this timer is due */
+    guint64 expires;
+    gboolean firing;
+
+    GabbleTimerFunc func;
+    gpointer user_data;
+};
+
+struct _GabbleTimerWheel {
+    GQueue slots[WHEEL_LEVELS][WHEEL_SIZE];
+    /* timers which have expired, waiting for their callbacks to run */
+    GQueue expired;
+
+    /* monotonic time of tick 0 */
+    gint64 epoch;
+    /* the next tick to be processed */
+    guint64 base;
+    /* number of timers in slots, not counting expired ones */
+    guint n_timers;
+
+    guint source_id;
+    /* the tick for which source_id is armed */
+    guint64 armed_tick;
+    gboolean dispatching;
+    gboolean destroyed;
+};
+
+GabbleTimerWheel *
+gabble_timer_wheel_new (void)
+{
+  GabbleTimerWheel *wheel = g_slice_new0 (GabbleTimerWheel);
+  guint level, slot;
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    for (slot = 0; slot < WHEEL_SIZE; slot++)
+      g_queue_init (&wheel->slots[level][slot]);
+
+  g_queue_init (&wheel->expired);
+  wheel->epoch = g_get_monotonic_time ();
+
+  return wheel;
+}
+
+static guint64
+current_tick (GabbleTimerWheel *wheel)
+{
+  return (g_get_monotonic_time () - wheel->epoch) / TICK_USEC;
+}
+
+static void
+timer_move_to_queue (GabbleTimer *timer,
+    GQueue *queue)
+{
+  if (timer->queue != NULL)
+    g_queue_unlink (timer->queue, &timer->link);
+
+  timer->queue = queue;
+
+  if (queue != NULL)
+    g_queue_push_tail_link (queue, &timer->link);
+}
+
+static void
+internal_add (GabbleTimerWheel *wheel,
+    GabbleTimer *timer)
+{
+  guint64 delta;
+  guint level;
+
+  if (timer->expires < wheel->base)
+    {
+      /* Already due: run it on the next tick */
+      timer_move_to_queue (timer, &wheel->slots[0][wheel->base & WHEEL_MASK]);
+      return;
+    }
+
+  delta = timer->expires - wheel->base;
+
+  if (delta > WHEEL_MAX_TICKS)
+    {
+      timer->expires = wheel->base + WHEEL_MAX_TICKS;
+      delta = WHEEL_MAX_TICKS;
+    }
+
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+      if (delta < (G_GUINT64_CONSTANT (1) << (WHEEL_BITS * (level + 1))))
+        break;
+    }
+
+  timer_move_to_queue (timer, &wheel->slots[level][
+      (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+}
+
+/* Re-files every timer in the given slot into the levels below. Returns the
+ * slot index, so that the caller knows whether this level has wrapped too. */
+static guint
+cascade (GabbleTimerWheel *wheel,
+    guint level,
+    guint index)
+{
+  GQueue *slot = &wheel->slots[level][index];
+  GQueue timers = *slot;
+  GList *link;
+
+  g_queue_init (slot);
+
+  while ((link = g_queue_pop_head_link (&timers)) != NULL)
+    {
+      GabbleTimer *timer = link->data;
+
+      timer->queue = NULL;
+      internal_add (wheel, timer);
+    }
+
+  return index;
+}
+
+/* Moves every timer due on or before @target onto the expired queue */
+static void
+run_timers (GabbleTimerWheel *wheel,
+    guint64 target)
+{
+  while (wheel->base <= target && wheel->n_timers > 0)
+    {
+      guint index = wheel->base & WHEEL_MASK;
+      GQueue *slot;
+      guint level;
+
+      for (level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+        {
+          index = cascade (wheel, level,
+              (wheel->base >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+
+      slot = &wheel->slots[0][wheel->base & WHEEL_MASK];
+
+      while (slot->head != NULL)
+        {
+          timer_move_to_queue (slot->head->data, &wheel->expired);
+          wheel->n_timers--;
+        }
+
+      wheel->base++;
+    }
+
+  /* Nothing is left in the wheel, so it can skip straight to now */
+  if (wheel->n_timers == 0)
+    wheel->base = MAX (wheel->base, target + 1);
+}
+
+static void
+free_all_timers (GabbleTimerWheel *wheel)
+{
+  guint level, index;
+  GList *link;
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      for (index = 0; index < WHEEL_SIZE; index++)
+        {
+          GQueue *slot = &wheel->slots[level][index];
+
+          while ((link = g_queue_pop_head_link (slot)) != NULL)
+            g_slice_free (GabbleTimer, link->data);
+        }
+    }
+
+  while ((link = g_queue_pop_head_link (&wheel->expired)) != NULL)
+    g_slice_free (GabbleTimer, link->data);
+
+  wheel->n_timers = 0;
+}
+
+/* Returns the earliest tick at which any timer in the wheel may be due: the
+ * first occupied slot on level 0, or the start of the span covered by the
+ * first occupied slot on a higher level, since that is when run_timers()
+ * cascades it down. */
+static guint64
+next_deadline (GabbleTimerWheel *wheel)
+{
+  guint64 deadline = G_MAXUINT64;
+  guint64 i;
+  guint level;
+
+  for (i = 0; i < WHEEL_SIZE; i++)
+    {
+      if (!g_queue_is_empty (
+              &wheel->slots[0][(wheel->base + i) & WHEEL_MASK]))
+        {
+          deadline = wheel->base + i;
+          break;
+        }
+    }
+
+  for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+      guint shift = WHEEL_BITS * level;
+      guint64 position = wheel->base >> shift;
+
+      for (i = 1; i <= WHEEL_SIZE; i++)
+        {
+          guint64 start = (position + i) << shift;
+
+          if (start >= deadline)
+            break;
+
+          if (!g_queue_is_empty (
+                  &wheel->slots[level][(position + i) & WHEEL_MASK]))
+            {
+              deadline = start;
+              break;
+            }
+        }
+    }
+
+  return deadline;
+}
+
+static gboolean tick_cb (gpointer data);
+
+/* (Re-)arms the source for the earliest pending timer, or removes it if
+ * there are none. */
+static void
+schedule_tick (GabbleTimerWheel *wheel)
+{
+  gint64 delay;
+  guint seconds;
+
+  if (wheel->source_id != 0)
+    {
+      g_source_remove (wheel->source_id);
+      wheel->source_id = 0;
+    }
+
+  if (wheel->n_timers == 0)
+    return;
+
+  wheel->armed_tick = next_deadline (wheel);
+  delay = wheel->epoch + (gint64) wheel->armed_tick * TICK_USEC -
+      g_get_monotonic_time ();
+
+  /* Like the old once-a-second source, never spin: anything already due runs
+   * a second from now. If the source fires early, tick_cb() finds nothing due
+   * and re-arms it. */
+  if (delay <= G_USEC_PER_SEC)
+    seconds = 1;
+  else
+    seconds = (delay + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC;
+
+  wheel->source_id = g_timeout_add_seconds (seconds, tick_cb, wheel);
+}
+
+static gboolean
+tick_cb (gpointer data)
+{
+  GabbleTimerWheel *wheel = data;
+  GList *link;
+  guint fired = 0;
+
+  /* This source is finished with: schedule_tick() arms a new one below */
+  wheel->source_id = 0;
+
+  run_timers (wheel, current_tick (wheel));
+
+  wheel->dispatching = TRUE;
+
+  /* Callbacks may cancel other expired timers, which simply unlinks them from
+   * this queue, or add new ones, which go into the wheel. */
+  while (!wheel->destroyed &&
+      (link = g_queue_pop_head_link (&wheel->expired)) != NULL)
+    {
+      GabbleTimer *timer = link->data;
+
+      timer->queue = NULL;
+      timer->firing = TRUE;
+      timer->func (timer->user_data);
+      g_slice_free (GabbleTimer, timer);
+      fired++;
+    }
+
+  wheel->dispatching = FALSE;
+
+  if (fired > 0)
+    DEBUG ("fired %u timers, %u still pending", fired, wheel->n_timers);
+
+  if (wheel->destroyed)
+    {
+      free_all_timers (wheel);
+      g_slice_free (GabbleTimerWheel, wheel);
+      return FALSE;
+    }
+
+  schedule_tick (wheel);
+  return FALSE;
+}
+
+void
+gabble_timer_wheel_destroy (GabbleTimerWheel *wheel)
+{
+  g_return_if_fail (wheel != NULL);
+
+  if (wheel->n_timers > 0 || wheel->expired.length > 0)
+    DEBUG ("%u timers still pending; dropping them",
+        wheel->n_timers + wheel->expired.length);
+
+  if (wheel->dispatching)
+    {
+      /* tick_cb frees us once the current callback returns */
+      wheel->destroyed = TRUE;
+      return;
+    }
+
+  if (wheel->source_id != 0)
+    g_source_remove (wheel->source_id);
+
+  free_all_timers (wheel);
+  g_slice_free (GabbleTimerWheel, wheel);
+}
+
+/**
+ * gabble_timer_wheel_add_seconds:
+ * @wheel: a timer wheel
+ * @seconds: the minimum delay before @func is called
+ * @func: the function to call when the timer expires
+ * @user_data: data to pass to @func
+ *
+ * Like g_timeout_add_seconds(), the timer fires up to a second late, along
+ * with every other timer which falls due in the same tick.
+ *
+ * Returns: a timer, valid until @func is called or it is passed to
+ *  gabble_timer_wheel_cancel()
+ */
+GabbleTimer *
+gabble_timer_wheel_add_seconds (GabbleTimerWheel *wheel,
+    guint seconds,
+    GabbleTimerFunc func,
+    gpointer user_data)
+{
+  GabbleTimer *timer;
+  gint64 elapsed;
+
+  g_return_val_if_fail (wheel != NULL, NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  elapsed = g_get_monotonic_time () - wheel->epoch;
+
+  if (wheel->n_timers == 0)
+    wheel->base = MAX (wheel->base, (guint64) elapsed / TICK_USEC);
+
+  timer = g_slice_new0 (GabbleTimer);
+  timer->wheel = wheel;
+  timer->link.data = timer;
+  timer->func = func;
+  timer->user_data = user_data;
+  /* round up, so the timer never fires early */
+  timer->expires = (elapsed + (gint64) seconds * G_USEC_PER_SEC +
+      TICK_USEC - 1) / TICK_USEC;
+
+  internal_add (wheel, timer);
+  wheel->n_timers++;
+
+  /* While dispatching, tick_cb() re-arms the source once it is done */
+  if (!wheel->dispatching &&
+      (wheel->source_id == 0 || timer->expires < wheel->armed_tick))
+    schedule_tick (wheel);
+
+  return timer;
+}
+
+/**
+ * gabble_timer_wheel_cancel:
+ * @timer: a timer returned by gabble_timer_wheel_add_seconds()
+ *
+ * Stops @timer from firing and frees it. Does nothing if called from @timer's
+ * own callback.
+ */
+void
+gabble_timer_wheel_cancel (GabbleTimer *timer)
+{
+  GabbleTimerWheel *wheel;
+
+  g_return_if_fail (timer != NULL);
+
+  if (timer->firing)
+    return;
+
+  wheel = timer->wheel;
+
+  if (timer->queue != &wheel->expired)
+    wheel->n_timers--;
+
+  timer_move_to_queue (timer, NULL);
+  g_slice_free (GabbleTimer, timer);
+
+  /* Don't wake up for nothing once the last timer is gone */
+  if (wheel->n_timers == 0 && !wheel->dispatching)
+    schedule_tick (wheel);
+}
+
+guint
+gabble_timer_wheel_get_n_timers (GabbleTimerWheel *wheel)
+{
+  return wheel->n_timers + wheel->expired.length;
+}
@@ -0,0 +1,53 @@
+/*
+ * timer-wheel.h - Header for a shared hierarchical timer wheel
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GABBLE_TIMER_WHEEL_H__
+#define __GABBLE_TIMER_WHEEL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GabbleTimerWheel GabbleTimerWheel;
+typedef struct _GabbleTimer GabbleTimer;
+
+/**
+ * GabbleTimerFunc:
+ * @user_data: the data passed to gabble_timer_wheel_add_seconds()
+ *
+ * Called once when a timer expires. The timer is freed when the callback
+ * returns; cancelling it from inside its own callback is a no-op, so callers
+ * need only forget their pointer to it.
+ */
+typedef void (*GabbleTimerFunc) (gpointer user_data);
+
+GabbleTimerWheel *gabble_timer_wheel_new (void);
+void gabble_timer_wheel_destroy (GabbleTimerWheel *wheel);
+
+GabbleTimer *gabble_timer_wheel_add_seconds (GabbleTimerWheel *wheel,
+    guint seconds,
+    GabbleTimerFunc func,
+    gpointer user_data);
+void gabble_timer_wheel_cancel (GabbleTimer *timer);
+
+guint gabble_timer_wheel_get_n_timers (GabbleTimerWheel *wheel);
+
+G_END_DECLS
+
+#endif /* __GABBLE_TIMER_WHEEL_H__ */
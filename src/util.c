@@ -75,6 +75,67 @@ sha1_bin (const gchar *bytes,
   g_checksum_free (checksum);
 }
 
+/* Base64 text decoded per step of sha1_hex_from_base64(); a multiple of 4 */
+#define BASE64_CHUNK 1024
+
+/**
+ * sha1_hex_from_base64:
+ * @base64: base64-encoded data, possibly with line breaks
+ *
+ * Like sha1_hex() on the decoded data, but decodes it a chunk at a time on
+ * the stack rather than into one big buffer.
+ *
+ * Returns: the lower-case hex SHA-1 of the data @base64 encodes
+ */
+gchar *
+sha1_hex_from_base64 (const gchar *base64)
+{
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  guchar out[BASE64_CHUNK / 4 * 3 + 3];
+  gsize len = strlen (base64);
+  gint state = 0;
+  guint save = 0;
+  gchar *hex;
+
+  while (len > 0)
+    {
+      gsize step = MIN (len, BASE64_CHUNK);
+
+      g_checksum_update (checksum, out,
+          g_base64_decode_step (base64, step, out, &state, &save));
+      base64 += step;
+      len -= step;
+    }
+
+  hex = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+  return hex;
+}
+
+/**
+ * gabble_base64_decode_bytes:
+ * @base64: base64-encoded data, possibly with line breaks
+ *
+ * Decodes @base64 straight into the buffer which the returned #GBytes owns,
+ * so if that is the only reference, g_bytes_unref_to_array() and
+ * g_bytes_unref_to_data() can take the data without copying it.
+ *
+ * Returns: the decoded data
+ */
+GBytes *
+gabble_base64_decode_bytes (const gchar *base64)
+{
+  gsize len = strlen (base64);
+  guchar *data = g_malloc (len / 4 * 3 + 3);
+  gint state = 0;
+  guint save = 0;
+  gsize outlen;
+
+  outlen = g_base64_decode_step (base64, len, data, &state, &save);
+
+  return g_bytes_new_take (data, outlen);
+}
+
 
 /** gabble_generate_id:
  *
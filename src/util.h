@@ -36,6 +36,9 @@ gchar *sha1_hex (const gchar *bytes, guint len);
 /* A SHA1 digest is 20 bytes long */
 #define SHA1_HASH_SIZE 20
 void sha1_bin (const gchar *bytes, guint len, guchar out[SHA1_HASH_SIZE]);
+gchar *sha1_hex_from_base64 (const gchar *base64);
+
+GBytes *gabble_base64_decode_bytes (const gchar *base64);
 
 gchar *gabble_generate_id (void);
 
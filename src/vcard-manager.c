@@ -22,6 +22,7 @@
 #include "config.h"
 #include "vcard-manager.h"
 
+#include <errno.h>
 #include <string.h>
 
 #include <telepathy-glib/telepathy-glib.h>
@@ -35,6 +36,7 @@
 #include "connection.h"
 #include "debug.h"
 #include "namespaces.h"
+#include "presence-cache.h"
 #include "request-pipeline.h"
 #include "util.h"
 
@@ -48,6 +50,12 @@ static guint request_wait_delay = 5 * 60;
 
 static const gchar *NO_ALIAS = "none";
 
+/* keys in the vCard store */
+#define STORE_KEY_FETCHED "fetched"
+#define STORE_KEY_PHOTO_SHA1 "photo-sha1"
+#define STORE_KEY_ALIAS "alias"
+#define STORE_KEY_VCARD "vcard"
+
 struct _GabbleVCardManagerEditInfo {
     /* name of element to edit */
     gchar *element_name;
@@ -108,7 +116,7 @@ struct _GabbleVCardManagerPrivate
   TpHeap *timed_cache;
 
   /* Timer which runs out when the first item in the @timed_cache expires */
-  guint cache_timer;
+  GabbleTimer *cache_timer;
 
   /* Things to do with my own vCard, which is somewhat special - mainly because
    * we can edit it. There's only one self_handle, so there's no point
@@ -131,14 +139,51 @@ struct _GabbleVCardManagerPrivate
    * got confirmation yet. We don't want to store it in cache (visible
    * to others) before we're sure the server accepts it. */
   WockyNodeTree *patched_vcard;
+
+  /* If the "vcard-cache" parameter is set, the file contacts' vCards are
+   * kept in between connections; NULL otherwise. It's read on connection
+   * and written on disconnection. */
+  gchar *store_path;
+  guint store_max_entries;
+  guint store_max_age;
+  /* TpHandle => StoredVCard */
+  GHashTable *store;
+  WockyXmppReader *store_reader;
+  WockyXmppWriter *store_writer;
+  /* vCards served from the store rather than the network so far */
+  guint store_hits;
 };
 
+/* A contact's vCard in the store. Each is only parsed if someone asks for
+ * it, which most never are. */
+typedef struct {
+    TpHandle handle;
+    gchar *xml;
+    /* the SHA-1 of the PHOTO it contains, or "" if none */
+    gchar *photo_sha1;
+    /* the alias it implies, or NULL if none */
+    gchar *alias;
+    gint64 fetched;
+    /* TRUE if it came from the file, rather than from this connection */
+    gboolean loaded;
+} StoredVCard;
+
+static void
+stored_vcard_free (StoredVCard *stored)
+{
+  g_free (stored->xml);
+  g_free (stored->photo_sha1);
+  g_free (stored->alias);
+  g_slice_free (StoredVCard, stored);
+}
+
 struct _GabbleVCardManagerRequest
 {
   GabbleVCardManager *manager;
   GabbleVCardCacheEntry *entry;
-  guint timer_id;
+  GabbleTimer *timer;
   guint timeout;
+  GabbleRequestPipelinePriority priority;
 
   GabbleVCardManagerCb callback;
   gpointer user_data;
@@ -179,15 +224,19 @@ struct _GabbleVCardCacheEntry
 
   /* When requests for this entry receive an error of type "wait", we suspend
    * further requests and retry again after request_wait_delay seconds.
-   * 0 if not suspended.
+   * NULL if not suspended.
    */
-  guint suspended_timer_id;
+  GabbleTimer *suspended_timer;
 
   /* VCard node for this entry (owned reference), or NULL if there's no node */
   WockyNodeTree *vcard_node;
 
   /* If @vcard_node is not NULL, the time the message will expire */
   time_t expires;
+
+  /* Idle source which will answer the pending requests from the store
+   * instead of the network, or 0 */
+  guint store_source_id;
 };
 
 GQuark
@@ -214,6 +263,10 @@ static void manager_patch_vcard (
     GabbleVCardManager *self, WockyNode *vcard_node);
 static void request_send (GabbleVCardManagerRequest *request,
     guint timeout);
+static gchar *vcard_get_alias (WockyNode *vcard_node, const gchar **field);
+static void store_forget (GabbleVCardManager *self, TpHandle handle);
+static void cache_entry_invalidate (GabbleVCardManager *manager,
+    TpHandle handle);
 
 static void
 gabble_vcard_manager_init (GabbleVCardManager *obj)
@@ -227,10 +280,13 @@ gabble_vcard_manager_init (GabbleVCardManager *obj)
       cache_entry_free);
   /* no destructor here - the hash table is responsible for freeing it */
   priv->timed_cache = tp_heap_new (cache_entry_compare, NULL);
-  priv->cache_timer = 0;
+  priv->cache_timer = NULL;
 
   priv->have_self_avatar = FALSE;
   priv->edits = NULL;
+
+  priv->store = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) stored_vcard_free);
 }
 
 static void gabble_vcard_manager_set_property (GObject *object,
@@ -355,6 +411,9 @@ cache_entry_free (gpointer data)
       gabble_request_pipeline_item_cancel (entry->pipeline_item);
     }
 
+  if (entry->store_source_id != 0)
+    g_source_remove (entry->store_source_id);
+
   g_clear_object (&entry->vcard_node);
 
   g_slice_free (GabbleVCardCacheEntry, entry);
@@ -379,7 +438,7 @@ cache_entry_get (GabbleVCardManager *manager, TpHandle handle)
   return entry;
 }
 
-static gboolean
+static void
 cache_entry_timeout (gpointer data)
 {
   GabbleVCardManager *manager = data;
@@ -396,18 +455,17 @@ cache_entry_timeout (gpointer data)
       /* shouldn't have in-flight request nor any pending requests */
       g_assert (entry->pipeline_item == NULL);
 
-      gabble_vcard_manager_invalidate_cache (manager, entry->handle);
+      cache_entry_invalidate (manager, entry->handle);
     }
 
-  priv->cache_timer = 0;
+  priv->cache_timer = NULL;
 
   if (entry)
     {
-      priv->cache_timer = g_timeout_add_seconds (
-          entry->expires - time (NULL), cache_entry_timeout, manager);
+      priv->cache_timer = gabble_timer_wheel_add_seconds (
+          priv->connection->timer_wheel, entry->expires - time (NULL),
+          cache_entry_timeout, manager);
     }
-
-  return FALSE;
 }
 
 
@@ -440,7 +498,7 @@ cache_entry_attempt_to_free (GabbleVCardCacheEntry *entry)
 
   /* If there is a suspended request, it must be in entry-> pending_requests
    */
-  g_assert (entry->suspended_timer_id == 0);
+  g_assert (entry->suspended_timer == NULL);
 
   if (entry->handle == tp_base_connection_get_self_handle (base))
     {
@@ -454,17 +512,14 @@ cache_entry_attempt_to_free (GabbleVCardCacheEntry *entry)
   g_hash_table_remove (priv->cache, GUINT_TO_POINTER (entry->handle));
 }
 
-void
-gabble_vcard_manager_invalidate_cache (GabbleVCardManager *manager,
-                                       TpHandle handle)
+/* Forgets the vCard for @handle held in memory, but not the stored one */
+static void
+cache_entry_invalidate (GabbleVCardManager *manager,
+    TpHandle handle)
 {
   GabbleVCardManagerPrivate *priv = manager->priv;
   GabbleVCardCacheEntry *entry = g_hash_table_lookup (priv->cache,
       GUINT_TO_POINTER (handle));
-  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
-      (TpBaseConnection *) priv->connection, TP_HANDLE_TYPE_CONTACT);
-
-  g_return_if_fail (tp_handle_is_valid (contact_repo, handle, NULL));
 
   if (!entry)
       return;
@@ -476,6 +531,46 @@ gabble_vcard_manager_invalidate_cache (GabbleVCardManager *manager,
   cache_entry_attempt_to_free (entry);
 }
 
+void
+gabble_vcard_manager_invalidate_cache (GabbleVCardManager *manager,
+                                       TpHandle handle)
+{
+  GabbleVCardManagerPrivate *priv = manager->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->connection, TP_HANDLE_TYPE_CONTACT);
+
+  g_return_if_fail (tp_handle_is_valid (contact_repo, handle, NULL));
+
+  cache_entry_invalidate (manager, handle);
+  store_forget (manager, handle);
+}
+
+/**
+ * gabble_vcard_manager_photo_changed:
+ *
+ * To be called when @handle's presence says their vCard's PHOTO has SHA-1
+ * @sha1, or "" if it has none. Forgets their cached vCard, and their stored
+ * one too unless it has that very PHOTO.
+ */
+void
+gabble_vcard_manager_photo_changed (GabbleVCardManager *manager,
+    TpHandle handle,
+    const gchar *sha1)
+{
+  GabbleVCardManagerPrivate *priv = manager->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->connection, TP_HANDLE_TYPE_CONTACT);
+  StoredVCard *stored = g_hash_table_lookup (priv->store,
+      GUINT_TO_POINTER (handle));
+
+  g_return_if_fail (tp_handle_is_valid (contact_repo, handle, NULL));
+
+  cache_entry_invalidate (manager, handle);
+
+  if (stored != NULL && tp_strdiff (stored->photo_sha1, sha1))
+    store_forget (manager, handle);
+}
+
 static void complete_one_request (GabbleVCardManagerRequest *request,
     WockyNode *vcard_node, GError *error);
 
@@ -520,10 +615,16 @@ disconnect_entry_foreach (gpointer handle, gpointer value, gpointer unused)
   GError err = { TP_ERROR, TP_ERROR_DISCONNECTED, "Connection closed" };
   GabbleVCardCacheEntry *entry = value;
 
-  if (entry->suspended_timer_id)
+  if (entry->suspended_timer != NULL)
     {
-      g_source_remove (entry->suspended_timer_id);
-      entry->suspended_timer_id = 0;
+      gabble_timer_wheel_cancel (entry->suspended_timer);
+      entry->suspended_timer = NULL;
+    }
+
+  if (entry->store_source_id != 0)
+    {
+      g_source_remove (entry->store_source_id);
+      entry->store_source_id = 0;
     }
 
   cache_entry_complete_requests (entry, &err);
@@ -556,8 +657,8 @@ gabble_vcard_manager_dispose (GObject *object)
 
   priv->edits = NULL;
 
-  if (priv->cache_timer)
-      g_source_remove (priv->cache_timer);
+  if (priv->cache_timer != NULL)
+      gabble_timer_wheel_cancel (priv->cache_timer);
 
   g_hash_table_foreach (priv->cache, disconnect_entry_foreach, NULL);
 
@@ -569,6 +670,10 @@ gabble_vcard_manager_dispose (GObject *object)
 
   cancel_all_edit_requests (self);
 
+  tp_clear_pointer (&priv->store, g_hash_table_unref);
+  g_clear_object (&priv->store_reader);
+  g_clear_object (&priv->store_writer);
+
   if (G_OBJECT_CLASS (gabble_vcard_manager_parent_class)->dispose)
     G_OBJECT_CLASS (gabble_vcard_manager_parent_class)->dispose (object);
 }
@@ -576,7 +681,12 @@ gabble_vcard_manager_dispose (GObject *object)
 static void
 gabble_vcard_manager_finalize (GObject *object)
 {
+  GabbleVCardManager *self = GABBLE_VCARD_MANAGER (object);
+
   DEBUG ("%p", object);
+
+  g_free (self->priv->store_path);
+
   G_OBJECT_CLASS (gabble_vcard_manager_parent_class)->finalize (object);
 }
 
@@ -585,8 +695,6 @@ vcard_get_avatar_sha1 (WockyNode *vcard)
 {
   gchar *sha1;
   const gchar *binval_value;
-  guchar *avatar;
-  gsize outlen;
   WockyNode *node;
   WockyNode *binval;
 
@@ -606,21 +714,274 @@ vcard_get_avatar_sha1 (WockyNode *vcard)
   if (!binval_value)
     return g_strdup ("");
 
-  avatar = g_base64_decode (binval_value, &outlen);
+  /* This runs for every vCard we receive, so don't decode the whole PHOTO
+   * just to hash it */
+  sha1 = sha1_hex_from_base64 (binval_value);
+  DEBUG ("Successfully decoded PHOTO.BINVAL, SHA-1 %s", sha1);
+
+  return sha1;
+}
+
+static gchar *
+store_build_path (GabbleVCardManager *self)
+{
+  TpBaseConnection *base = (TpBaseConnection *) self->priv->connection;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  gchar *escaped, *filename, *path;
+
+  escaped = tp_escape_as_identifier (tp_handle_inspect (contact_repo,
+        tp_base_connection_get_self_handle (base)));
+  filename = g_strconcat (escaped, ".vcards", NULL);
+  path = g_build_filename (g_get_user_cache_dir (), "telepathy", "gabble",
+      "vcards", filename, NULL);
+
+  g_free (filename);
+  g_free (escaped);
+  return path;
+}
+
+static void
+store_load (GabbleVCardManager *self)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+      TP_HANDLE_TYPE_CONTACT);
+  GKeyFile *keyfile = g_key_file_new ();
+  gint64 now = time (NULL);
+  GError *error = NULL;
+  gchar **groups;
+  guint i;
+
+  if (!g_key_file_load_from_file (keyfile, priv->store_path,
+        G_KEY_FILE_NONE, &error))
+    {
+      DEBUG ("no usable vCard store in %s: %s", priv->store_path,
+          error->message);
+      g_error_free (error);
+      g_key_file_free (keyfile);
+      return;
+    }
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      TpHandle handle = tp_handle_ensure (contact_repo, groups[i], NULL,
+          NULL);
+      StoredVCard *stored;
+      gint64 fetched;
+      gchar *xml;
+
+      if (handle == 0 || handle == tp_base_connection_get_self_handle (base))
+        continue;
+
+      fetched = g_key_file_get_int64 (keyfile, groups[i], STORE_KEY_FETCHED,
+          NULL);
+      xml = g_key_file_get_string (keyfile, groups[i], STORE_KEY_VCARD, NULL);
+
+      if (xml == NULL || now - fetched > priv->store_max_age)
+        {
+          g_free (xml);
+          continue;
+        }
+
+      stored = g_slice_new0 (StoredVCard);
+      stored->handle = handle;
+      stored->xml = xml;
+      stored->photo_sha1 = g_key_file_get_string (keyfile, groups[i],
+          STORE_KEY_PHOTO_SHA1, NULL);
+      stored->alias = g_key_file_get_string (keyfile, groups[i],
+          STORE_KEY_ALIAS, NULL);
+      stored->fetched = fetched;
+      stored->loaded = TRUE;
+
+      if (stored->photo_sha1 == NULL)
+        stored->photo_sha1 = g_strdup ("");
+
+      g_hash_table_insert (priv->store, GUINT_TO_POINTER (handle), stored);
+
+      /* Looking up aliases shouldn't cost a vCard request per contact, so
+       * until we see their vCard again, use the alias it had last time */
+      if (stored->alias != NULL)
+        tp_handle_set_qdata (contact_repo, handle,
+            gabble_vcard_manager_cache_quark (), g_strdup (stored->alias),
+            g_free);
+      else
+        tp_handle_set_qdata (contact_repo, handle,
+            gabble_vcard_manager_cache_quark (), (gchar *) NO_ALIAS, NULL);
+    }
+
+  DEBUG ("loaded %u vCards from %s", g_hash_table_size (priv->store),
+      priv->store_path);
+
+  g_strfreev (groups);
+  g_key_file_free (keyfile);
+}
+
+static gint
+stored_vcard_cmp_newest_first (gconstpointer a,
+    gconstpointer b)
+{
+  const StoredVCard *left = *(StoredVCard * const *) a;
+  const StoredVCard *right = *(StoredVCard * const *) b;
+
+  return (left->fetched < right->fetched) - (left->fetched > right->fetched);
+}
+
+/* Saves the most recently fetched vCards, up to the configured limit */
+static void
+store_save (GabbleVCardManager *self)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->connection, TP_HANDLE_TYPE_CONTACT);
+  GKeyFile *keyfile = g_key_file_new ();
+  GPtrArray *entries = g_ptr_array_sized_new (
+      g_hash_table_size (priv->store));
+  GHashTableIter iter;
+  gpointer value;
+  gchar *dir, *data;
+  gsize len;
+  guint i;
+  GError *error = NULL;
+
+  g_hash_table_iter_init (&iter, priv->store);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (entries, value);
 
-  if (avatar)
+  g_ptr_array_sort (entries, stored_vcard_cmp_newest_first);
+
+  for (i = 0; i < entries->len && i < priv->store_max_entries; i++)
     {
-      sha1 = sha1_hex ((gchar *) avatar, outlen);
-      g_free (avatar);
-      DEBUG ("Successfully decoded PHOTO.BINVAL, SHA-1 %s", sha1);
+      StoredVCard *stored = g_ptr_array_index (entries, i);
+      const gchar *jid = tp_handle_inspect (contact_repo, stored->handle);
+
+      /* Group names may not contain square brackets */
+      if (strpbrk (jid, "[]") != NULL)
+        continue;
+
+      g_key_file_set_int64 (keyfile, jid, STORE_KEY_FETCHED,
+          stored->fetched);
+      g_key_file_set_string (keyfile, jid, STORE_KEY_PHOTO_SHA1,
+          stored->photo_sha1);
+
+      if (stored->alias != NULL)
+        g_key_file_set_string (keyfile, jid, STORE_KEY_ALIAS, stored->alias);
+
+      g_key_file_set_string (keyfile, jid, STORE_KEY_VCARD, stored->xml);
     }
+
+  dir = g_path_get_dirname (priv->store_path);
+  data = g_key_file_to_data (keyfile, &len, NULL);
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    DEBUG ("couldn't create %s: %s", dir, g_strerror (errno));
+  else if (!g_file_set_contents (priv->store_path, data, len, &error))
+    DEBUG ("couldn't save vCards: %s", error->message);
   else
+    DEBUG ("saved %u of %u vCards to %s, having answered %u requests from "
+        "there", MIN (entries->len, priv->store_max_entries), entries->len,
+        priv->store_path, priv->store_hits);
+
+  g_clear_error (&error);
+  g_free (data);
+  g_free (dir);
+  g_ptr_array_unref (entries);
+  g_key_file_free (keyfile);
+}
+
+/* Remembers @vcard as @handle's latest vCard, for this connection and the
+ * next */
+static void
+store_record (GabbleVCardManager *self,
+    TpHandle handle,
+    WockyNodeTree *vcard)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+  WockyNode *vcard_node = wocky_node_tree_get_top_node (vcard);
+  StoredVCard *stored;
+  const guint8 *data;
+  gsize len;
+
+  /* Our own vCard is always fetched afresh, since we edit it */
+  if (priv->store_path == NULL ||
+      handle == tp_base_connection_get_self_handle (base))
+    return;
+
+  if (priv->store_writer == NULL)
+    priv->store_writer = wocky_xmpp_writer_new_no_stream ();
+
+  wocky_xmpp_writer_write_node_tree (priv->store_writer, vcard, &data, &len);
+
+  stored = g_slice_new0 (StoredVCard);
+  stored->handle = handle;
+  stored->xml = g_strndup ((const gchar *) data, len);
+  stored->photo_sha1 = vcard_get_avatar_sha1 (vcard_node);
+  stored->alias = vcard_get_alias (vcard_node, NULL);
+  stored->fetched = time (NULL);
+
+  g_hash_table_insert (priv->store, GUINT_TO_POINTER (handle), stored);
+}
+
+static void
+store_forget (GabbleVCardManager *self,
+    TpHandle handle)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->connection, TP_HANDLE_TYPE_CONTACT);
+  StoredVCard *stored = g_hash_table_lookup (priv->store,
+      GUINT_TO_POINTER (handle));
+
+  if (stored == NULL)
+    return;
+
+  /* If the alias came from the file, it's as stale as the vCard was */
+  if (stored->loaded)
+    tp_handle_set_qdata (contact_repo, handle,
+        gabble_vcard_manager_cache_quark (), NULL, NULL);
+
+  g_hash_table_remove (priv->store, GUINT_TO_POINTER (handle));
+}
+
+/* Returns @handle's stored vCard if it's still good to use: that is, if it
+ * isn't too old, and if the contact has told us their avatar's hash since,
+ * it has the same PHOTO. */
+static StoredVCard *
+store_lookup (GabbleVCardManager *self,
+    TpHandle handle)
+{
+  GabbleVCardManagerPrivate *priv = self->priv;
+  StoredVCard *stored = g_hash_table_lookup (priv->store,
+      GUINT_TO_POINTER (handle));
+  GabblePresence *presence;
+
+  if (stored == NULL)
+    return NULL;
+
+  if (time (NULL) - stored->fetched > priv->store_max_age)
     {
-      DEBUG ("Avatar is in garbled Base64, ignoring it!");
-      sha1 = g_strdup ("");
+      DEBUG ("stored vCard for %u is too old", handle);
+      store_forget (self, handle);
+      return NULL;
     }
 
-  return sha1;
+  presence = gabble_presence_cache_get (priv->connection->presence_cache,
+      handle);
+
+  if (presence != NULL && presence->avatar_sha1 != NULL &&
+      tp_strdiff (presence->avatar_sha1, stored->photo_sha1))
+    {
+      DEBUG ("stored vCard for %u has a different photo", handle);
+      store_forget (self, handle);
+      return NULL;
+    }
+
+  return stored;
 }
 
 /* Called during connection. */
@@ -666,6 +1027,7 @@ status_changed_cb (GObject *object,
   GabbleVCardManagerPrivate *priv = self->priv;
   GabbleConnection *conn = GABBLE_CONNECTION (object);
   TpBaseConnection *base = (TpBaseConnection *) conn;
+  gboolean store;
 
   if (status == TP_CONNECTION_STATUS_CONNECTED)
     {
@@ -689,6 +1051,23 @@ status_changed_cb (GObject *object,
       gabble_vcard_manager_request (self,
           tp_base_connection_get_self_handle (base), 0,
           initial_request_cb, NULL, (GObject *) self);
+
+      g_object_get (conn,
+          "vcard-cache", &store,
+          "vcard-cache-max-entries", &priv->store_max_entries,
+          "vcard-cache-max-age", &priv->store_max_age,
+          NULL);
+
+      if (store)
+        {
+          priv->store_path = store_build_path (self);
+          store_load (self);
+        }
+    }
+  else if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+    {
+      if (priv->store_path != NULL)
+        store_save (self);
     }
 }
 
@@ -742,30 +1121,28 @@ delete_request (GabbleVCardManagerRequest *request)
           request);
     }
 
-  if (0 != request->timer_id)
+  if (NULL != request->timer)
     {
-      g_source_remove (request->timer_id);
+      gabble_timer_wheel_cancel (request->timer);
     }
 
   g_slice_free (GabbleVCardManagerRequest, request);
 }
 
-static gboolean
+static void
 timeout_request (gpointer data)
 {
   GabbleVCardManagerRequest *request = (GabbleVCardManagerRequest *) data;
 
-  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_if_fail (data != NULL);
   DEBUG ("Request %p timed out, notifying callback %p",
          request, request->callback);
 
-  request->timer_id = 0;
+  request->timer = NULL;
 
   /* The pipeline machinery will call our callback with the error "canceled"
    */
   gabble_request_pipeline_item_cancel (request->entry->pipeline_item);
-
-  return FALSE;
 }
 
 static void
@@ -798,17 +1175,16 @@ extract_nickname (WockyNode *vcard_node)
   return g_strdup (nick);
 }
 
-static void
-observe_vcard (GabbleConnection *conn,
-               GabbleVCardManager *manager,
-               TpHandle handle,
-               WockyNode *vcard_node)
+/* Returns the alias @vcard_node implies, if any, and if @field is not NULL,
+ * sets it to the name of the element it came from. */
+static gchar *
+vcard_get_alias (WockyNode *vcard_node,
+    const gchar **field)
 {
-  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
-      (TpBaseConnection *) conn, TP_HANDLE_TYPE_CONTACT);
-  const gchar *field = "<NICKNAME>";
   gchar *alias;
-  const gchar *old_alias;
+
+  if (field != NULL)
+    *field = "<NICKNAME>";
 
   alias = extract_nickname (vcard_node);
 
@@ -822,12 +1198,31 @@ observe_vcard (GabbleConnection *conn,
 
           if (!tp_str_empty (fn))
             {
-              field = "<FN>";
+              if (field != NULL)
+                *field = "<FN>";
+
               alias = g_strdup (fn);
             }
         }
     }
 
+  return alias;
+}
+
+static void
+observe_vcard (GabbleConnection *conn,
+               GabbleVCardManager *manager,
+               TpHandle handle,
+               WockyNode *vcard_node)
+{
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) conn, TP_HANDLE_TYPE_CONTACT);
+  const gchar *field;
+  gchar *alias;
+  const gchar *old_alias;
+
+  alias = vcard_get_alias (vcard_node, &field);
+
   g_signal_emit (G_OBJECT (manager), signals[VCARD_UPDATE], 0, handle);
 
   old_alias = gabble_vcard_manager_get_cached_alias (manager, handle);
@@ -1207,9 +1602,9 @@ manager_patch_vcard (GabbleVCardManager *self,
       NULL, NULL, NULL);
   wocky_node_add_node_tree (wocky_stanza_get_top_node (msg), vcard_node_tree);
 
-  priv->edit_pipeline_item = gabble_request_pipeline_enqueue (
+  priv->edit_pipeline_item = gabble_request_pipeline_enqueue_full (
       priv->connection->req_pipeline, msg, default_request_timeout,
-      replace_reply_cb, self);
+      GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE, replace_reply_cb, self);
 
   g_object_unref (msg);
 
@@ -1229,16 +1624,14 @@ out:
     }
 }
 
-static gboolean
+static void
 suspended_request_timeout_cb (gpointer data)
 {
   GabbleVCardManagerRequest *request = data;
 
   /* Send the request again */
-  request->entry->suspended_timer_id = 0;
+  request->entry->suspended_timer = NULL;
   request_send (request, request->timeout);
-
-  return FALSE;
 }
 
 static gboolean
@@ -1249,6 +1642,9 @@ is_item_not_found (const GError *error)
 }
 
 /* Called when a GET request in the pipeline has either succeeded or failed. */
+static void cache_entry_got_vcard (GabbleVCardCacheEntry *entry,
+    WockyNodeTree *vcard);
+
 static void
 pipeline_reply_cb (GabbleConnection *conn,
                    WockyStanza *reply_msg,
@@ -1263,13 +1659,14 @@ pipeline_reply_cb (GabbleConnection *conn,
   TpHandleRepoIface *contact_repo =
       tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
   WockyNode *vcard_node = NULL;
+  WockyNodeTree *vcard;
 
   DEBUG("called for entry %p", entry);
 
   g_assert (tp_handle_is_valid (contact_repo, entry->handle, NULL));
 
   g_assert (entry->pipeline_item != NULL);
-  g_assert (entry->suspended_timer_id == 0);
+  g_assert (entry->suspended_timer == NULL);
 
   entry->pipeline_item = NULL;
 
@@ -1296,11 +1693,12 @@ pipeline_reply_cb (GabbleConnection *conn,
                   wocky_xmpp_stanza_error_to_string (stanza_error),
                   request_wait_delay);
 
-              g_source_remove (request->timer_id);
-              request->timer_id = 0;
+              gabble_timer_wheel_cancel (request->timer);
+              request->timer = NULL;
 
-              entry->suspended_timer_id = g_timeout_add_seconds (
-                  request_wait_delay, suspended_request_timeout_cb, request);
+              entry->suspended_timer = gabble_timer_wheel_add_seconds (
+                  priv->connection->timer_wheel, request_wait_delay,
+                  suspended_request_timeout_cb, request);
 
               g_error_free (stanza_error);
               return;
@@ -1334,29 +1732,49 @@ pipeline_reply_cb (GabbleConnection *conn,
   vcard_node = wocky_node_get_child (
       wocky_stanza_get_top_node (reply_msg), "vCard");
 
+  /* Put the message in the cache. The reply may be shared with other
+   * callers who asked for the same vCard, so we mustn't modify it. */
   if (NULL == vcard_node)
     {
       /* We need a vCard node for the current API */
       DEBUG ("successful lookup response contained no <vCard> node, "
           "creating an empty one");
 
-      vcard_node = wocky_node_add_child_ns (
-          wocky_stanza_get_top_node (reply_msg), "vCard",
-          NS_VCARD_TEMP);
+      vcard = wocky_node_tree_new ("vCard", NS_VCARD_TEMP, NULL);
     }
+  else
+    {
+      vcard = wocky_node_tree_new_from_node (vcard_node);
+    }
+
+  store_record (self, entry->handle, vcard);
+  cache_entry_got_vcard (entry, vcard);
+}
+
+/* Caches @vcard (taking ownership) as @entry's vCard, and answers the
+ * requests waiting for it */
+static void
+cache_entry_got_vcard (GabbleVCardCacheEntry *entry,
+    WockyNodeTree *vcard)
+{
+  GabbleVCardManager *self = entry->manager;
+  GabbleVCardManagerPrivate *priv = self->priv;
+  TpBaseConnection *base = (TpBaseConnection *) priv->connection;
+  WockyNode *vcard_node;
 
-  /* Put the message in the cache */
-  entry->vcard_node = wocky_node_tree_new_from_node (vcard_node);
+  entry->vcard_node = vcard;
+  vcard_node = wocky_node_tree_get_top_node (entry->vcard_node);
 
   entry->expires = time (NULL) + VCARD_CACHE_ENTRY_TTL;
   tp_heap_add (priv->timed_cache, entry);
-  if (priv->cache_timer == 0)
+  if (priv->cache_timer == NULL)
     {
       GabbleVCardCacheEntry *first =
           tp_heap_peek_first (priv->timed_cache);
 
-      priv->cache_timer = g_timeout_add_seconds (
-          first->expires - time (NULL), cache_entry_timeout, self);
+      priv->cache_timer = gabble_timer_wheel_add_seconds (
+          priv->connection->timer_wheel, first->expires - time (NULL),
+          cache_entry_timeout, self);
     }
 
   /* We have freshly updated cache for our vCard, edit it if
@@ -1383,6 +1801,70 @@ notify_delete_request (gpointer data, GObject *obj)
   delete_request (request);
 }
 
+/* The entry's <iq> is sent at the highest priority of any request waiting
+ * for it. */
+static GabbleRequestPipelinePriority
+cache_entry_get_priority (GabbleVCardCacheEntry *entry)
+{
+  GSList *l;
+
+  for (l = entry->pending_requests; l != NULL; l = l->next)
+    {
+      GabbleVCardManagerRequest *request = l->data;
+
+      if (request->priority == GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE)
+        return GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE;
+    }
+
+  return GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND;
+}
+
+/* Answers @entry's requests from the store, or if the stored vCard has gone
+ * stale or can't be parsed, from the server after all */
+static gboolean
+store_answer_cb (gpointer user_data)
+{
+  GabbleVCardCacheEntry *entry = user_data;
+  GabbleVCardManager *self = entry->manager;
+  GabbleVCardManagerPrivate *priv = self->priv;
+  StoredVCard *stored = store_lookup (self, entry->handle);
+  WockyNodeTree *vcard = NULL;
+
+  entry->store_source_id = 0;
+
+  if (stored != NULL)
+    {
+      if (priv->store_reader == NULL)
+        priv->store_reader = wocky_xmpp_reader_new_no_stream ();
+
+      wocky_xmpp_reader_push (priv->store_reader,
+          (const guint8 *) stored->xml, strlen (stored->xml));
+      vcard = (WockyNodeTree *) wocky_xmpp_reader_pop_stanza (
+          priv->store_reader);
+      wocky_xmpp_reader_reset (priv->store_reader);
+
+      if (vcard == NULL)
+        {
+          DEBUG ("couldn't parse stored vCard for %u", entry->handle);
+          store_forget (self, entry->handle);
+        }
+    }
+
+  if (vcard != NULL)
+    {
+      priv->store_hits++;
+      cache_entry_got_vcard (entry, vcard);
+    }
+  else if (entry->pending_requests != NULL)
+    {
+      GabbleVCardManagerRequest *request = entry->pending_requests->data;
+
+      request_send (request, request->timeout);
+    }
+
+  return FALSE;
+}
+
 static void
 request_send (GabbleVCardManagerRequest *request, guint timeout)
 {
@@ -1392,23 +1874,37 @@ request_send (GabbleVCardManagerRequest *request, guint timeout)
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
       TP_HANDLE_TYPE_CONTACT);
 
-  g_assert (request->timer_id == 0);
+  g_assert (request->timer == NULL);
 
   if (entry->pipeline_item)
     {
       DEBUG ("adding to cache entry %p with <iq> already pending", entry);
+
+      /* Someone is waiting for this one now, so stop it languishing behind
+       * background lookups */
+      if (request->priority == GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE)
+        gabble_request_pipeline_item_raise (entry->pipeline_item);
     }
-  else if (entry->suspended_timer_id != 0)
+  else if (entry->suspended_timer != NULL)
     {
       DEBUG ("adding to cache entry %p with <iq> suspended", entry);
     }
+  else if (entry->store_source_id != 0)
+    {
+      DEBUG ("adding to cache entry %p being answered from the store", entry);
+    }
+  else if (store_lookup (entry->manager, entry->handle) != NULL)
+    {
+      DEBUG ("answering cache entry %p from the store", entry);
+      entry->store_source_id = g_idle_add (store_answer_cb, entry);
+    }
   else
     {
       const char *jid;
       WockyStanza *msg;
 
-      request->timer_id =
-          g_timeout_add_seconds (request->timeout, timeout_request, request);
+      request->timer = gabble_timer_wheel_add_seconds (conn->timer_wheel,
+          request->timeout, timeout_request, request);
 
       if (entry->handle == tp_base_connection_get_self_handle (base))
         {
@@ -1428,8 +1924,9 @@ request_send (GabbleVCardManagerRequest *request, guint timeout)
           ')',
           NULL);
 
-      entry->pipeline_item = gabble_request_pipeline_enqueue (
-          conn->req_pipeline, msg, timeout, pipeline_reply_cb, request);
+      entry->pipeline_item = gabble_request_pipeline_enqueue_full (
+          conn->req_pipeline, msg, timeout, cache_entry_get_priority (entry),
+          pipeline_reply_cb, request);
 
       g_object_unref (msg);
 
@@ -1461,6 +1958,25 @@ gabble_vcard_manager_request (GabbleVCardManager *self,
                               GabbleVCardManagerCb callback,
                               gpointer user_data,
                               GObject *object)
+{
+  return gabble_vcard_manager_request_full (self, handle, timeout,
+      GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND, callback, user_data,
+      object);
+}
+
+/* As gabble_vcard_manager_request(), but lets the caller say whether
+ * someone is actively waiting for the result (typically because it was
+ * requested by a D-Bus method call), in which case the <iq> jumps ahead of
+ * background lookups. If a background lookup for the same handle is already
+ * queued, it is moved to the front of the queue. */
+GabbleVCardManagerRequest *
+gabble_vcard_manager_request_full (GabbleVCardManager *self,
+                                   TpHandle handle,
+                                   guint timeout,
+                                   GabbleRequestPipelinePriority priority,
+                                   GabbleVCardManagerCb callback,
+                                   gpointer user_data,
+                                   GObject *object)
 {
   GabbleVCardManagerPrivate *priv = self->priv;
   TpBaseConnection *base = (TpBaseConnection *) priv->connection;
@@ -1480,6 +1996,7 @@ gabble_vcard_manager_request (GabbleVCardManager *self,
   request = g_slice_new0 (GabbleVCardManagerRequest);
   DEBUG ("Created request %p to retrieve <%u>'s vCard", request, handle);
   request->timeout = timeout;
+  request->priority = priority;
   request->manager = self;
   request->entry = entry;
   request->callback = callback;
@@ -25,6 +25,7 @@
 #include <glib-object.h>
 #include <wocky/wocky.h>
 
+#include "request-pipeline.h"
 #include "types.h"
 
 G_BEGIN_DECLS
@@ -104,6 +105,14 @@ GabbleVCardManagerRequest *gabble_vcard_manager_request (GabbleVCardManager *,
                                                        GabbleVCardManagerCb,
                                                        gpointer user_data,
                                                        GObject *object);
+GabbleVCardManagerRequest *gabble_vcard_manager_request_full (
+    GabbleVCardManager *self,
+    TpHandle handle,
+    guint timeout,
+    GabbleRequestPipelinePriority priority,
+    GabbleVCardManagerCb callback,
+    gpointer user_data,
+    GObject *object);
 
 void gabble_vcard_manager_cancel_request (GabbleVCardManager *manager,
                                           GabbleVCardManagerRequest *request);
@@ -117,6 +126,9 @@ gboolean gabble_vcard_manager_get_cached (GabbleVCardManager *,
                                           TpHandle,
                                           WockyNode **);
 void gabble_vcard_manager_invalidate_cache (GabbleVCardManager *, TpHandle);
+void gabble_vcard_manager_photo_changed (GabbleVCardManager *manager,
+    TpHandle handle,
+    const gchar *sha1);
 
 typedef void (*GabbleVCardManagerEditCb)(GabbleVCardManager *self,
                                          GabbleVCardManagerEditRequest *request,
@@ -0,0 +1,207 @@
+/*
+ * bench-avatar-decode: what it costs to get an avatar out of a vCard
+ *
+ * Run with no arguments; for each avatar size it prints the heap allocations
+ * and bytes allocated per avatar, and the time taken, when decoding a PHOTO
+ * by copying it from buffer to buffer as Gabble used to, and straight into
+ * the GBytes which is sent over D-Bus. It does the same for hashing a PHOTO
+ * without keeping it, as happens for every vCard received. Run with
+ * G_SLICE=always-malloc to count the small fixed-size allocations too.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "src/util.h"
+
+#define ROUNDS 200
+
+static guint n_allocs = 0;
+static gsize n_bytes = 0;
+
+static gpointer
+counting_malloc (gsize n)
+{
+  n_allocs++;
+  n_bytes += n;
+  return malloc (n);
+}
+
+static gpointer
+counting_realloc (gpointer mem,
+    gsize n)
+{
+  n_allocs++;
+  n_bytes += n;
+  return realloc (mem, n);
+}
+
+static gpointer
+counting_calloc (gsize n_blocks,
+    gsize n_block_bytes)
+{
+  n_allocs++;
+  n_bytes += n_blocks * n_block_bytes;
+  return calloc (n_blocks, n_block_bytes);
+}
+
+static GMemVTable counting_vtable = {
+    counting_malloc, counting_realloc, free,
+    counting_calloc, NULL, NULL };
+
+/* What parse_avatar() and its callers used to do: decode, copy into a
+ * GString, then copy again into a GArray for D-Bus */
+static void
+decode_copying (const gchar *base64)
+{
+  guchar *st;
+  gsize outlen;
+  GString *avatar;
+  GArray *arr;
+
+  st = g_base64_decode (base64, &outlen);
+  avatar = g_string_new_len ((gchar *) st, outlen);
+  g_free (st);
+
+  arr = g_array_new (FALSE, FALSE, sizeof (gchar));
+  g_array_append_vals (arr, avatar->str, avatar->len);
+  g_array_unref (arr);
+  g_string_free (avatar, TRUE);
+}
+
+static void
+decode_bytes (const gchar *base64)
+{
+  GBytes *avatar = gabble_base64_decode_bytes (base64);
+  GByteArray *arr = g_bytes_unref_to_array (avatar);
+
+  g_byte_array_unref (arr);
+}
+
+static void
+hash_decoding (const gchar *base64)
+{
+  guchar *st;
+  gsize outlen;
+  gchar *sha1;
+
+  st = g_base64_decode (base64, &outlen);
+  sha1 = sha1_hex ((gchar *) st, outlen);
+  g_free (st);
+  g_free (sha1);
+}
+
+static void
+hash_streaming (const gchar *base64)
+{
+  g_free (sha1_hex_from_base64 (base64));
+}
+
+static void
+measure (const gchar *name,
+    void (*func) (const gchar *),
+    const gchar *base64)
+{
+  GTimer *timer = g_timer_new ();
+  guint allocs;
+  gsize bytes;
+  gdouble elapsed;
+  guint i;
+
+  n_allocs = 0;
+  n_bytes = 0;
+  g_timer_start (timer);
+
+  for (i = 0; i < ROUNDS; i++)
+    func (base64);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  allocs = n_allocs;
+  bytes = n_bytes;
+  g_timer_destroy (timer);
+
+  printf ("  %-16s %6.1f allocs %9" G_GSIZE_FORMAT " bytes %8.1f us\n", name,
+      (gdouble) allocs / ROUNDS, bytes / ROUNDS,
+      elapsed * G_USEC_PER_SEC / ROUNDS);
+}
+
+/* Both ways had better give the same answers */
+static void
+check (const guchar *avatar,
+    gsize size,
+    const gchar *base64)
+{
+  GBytes *decoded = gabble_base64_decode_bytes (base64);
+  gchar *expected = sha1_hex ((const gchar *) avatar, size);
+  gchar *sha1 = sha1_hex_from_base64 (base64);
+  gconstpointer data;
+  gsize len;
+
+  data = g_bytes_get_data (decoded, &len);
+  g_assert_cmpuint (len, ==, size);
+  g_assert (memcmp (data, avatar, size) == 0);
+  g_assert_cmpstr (sha1, ==, expected);
+
+  g_bytes_unref (decoded);
+  g_free (expected);
+  g_free (sha1);
+}
+
+static void
+bench (gsize size)
+{
+  guchar *avatar = g_malloc (size);
+  gchar *base64, *wrapped, *p;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    avatar[i] = g_random_int_range (0, 256);
+
+  base64 = g_base64_encode (avatar, size);
+
+  /* vCards wrap BINVAL at 76 characters or so */
+  wrapped = g_malloc (strlen (base64) * 77 / 76 + 2);
+
+  for (i = 0, p = wrapped; base64[i] != '\0'; i++)
+    {
+      *p++ = base64[i];
+
+      if (i % 76 == 75)
+        *p++ = '\n';
+    }
+
+  *p = '\0';
+
+  check (avatar, size, wrapped);
+
+  printf ("%" G_GSIZE_FORMAT "-byte avatar:\n", size);
+  measure ("decode, copying", decode_copying, wrapped);
+  measure ("decode, GBytes", decode_bytes, wrapped);
+  measure ("hash, decoding", hash_decoding, wrapped);
+  measure ("hash, streaming", hash_streaming, wrapped);
+
+  g_free (wrapped);
+  g_free (base64);
+  g_free (avatar);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  static const gsize sizes[] = { 8 * 1024, 64 * 1024, 512 * 1024 };
+  guint i;
+
+  /* must come before anything else allocates */
+  g_mem_set_vtable (&counting_vtable);
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    bench (sizes[i]);
+
+  return 0;
+}
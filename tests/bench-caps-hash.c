@@ -0,0 +1,148 @@
+/*
+ * bench-caps-hash: how fast we can check XEP-0115 verification strings
+ *
+ * Run with no arguments; it prints how many realistic disco#info replies per
+ * second can be hashed on the main thread, and through the hashing thread
+ * which the presence cache uses.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include <glib.h>
+#include <wocky/wocky.h>
+
+#include "src/caps-hash.h"
+#include "src/debug.h"
+#include "src/namespaces.h"
+
+#define N_REPLIES 2000
+#define N_FEATURES 30
+
+static GMainLoop *loop = NULL;
+static gchar **expected = NULL;
+static guint n_hashed = 0;
+
+/* A reply of about the size a desktop client sends: an identity, a few
+ * dozen features and a software version form */
+static WockyNodeTree *
+make_reply (guint i)
+{
+  gchar *version = g_strdup_printf ("1.%u", i);
+  WockyNodeTree *tree = wocky_node_tree_new ("query", NS_DISCO_INFO,
+      '(', "identity",
+        '@', "category", "client",
+        '@', "type", "pc",
+        '@', "name", "Bench",
+      ')',
+      '(', "x",
+        ':', WOCKY_XMPP_NS_DATA,
+        '@', "type", "result",
+        '(', "field",
+          '@', "var", "FORM_TYPE",
+          '@', "type", "hidden",
+          '(', "value", '$', "urn:xmpp:dataforms:softwareinfo", ')',
+        ')',
+        '(', "field",
+          '@', "var", "os",
+          '(', "value", '$', "Linux", ')',
+        ')',
+        '(', "field",
+          '@', "var", "software",
+          '(', "value", '$', "Bench", ')',
+        ')',
+        '(', "field",
+          '@', "var", "software_version",
+          '(', "value", '$', version, ')',
+        ')',
+      ')',
+      NULL);
+  WockyNode *query = wocky_node_tree_get_top_node (tree);
+  guint j;
+
+  /* Features arrive in no particular order, so they have to be sorted */
+  for (j = N_FEATURES; j > 0; j--)
+    {
+      WockyNode *feature = wocky_node_add_child (query, "feature");
+      gchar *var = g_strdup_printf ("urn:example:feature:%u:%u", j, i % 7);
+
+      wocky_node_set_attribute (feature, "var", var);
+      g_free (var);
+    }
+
+  g_free (version);
+  return tree;
+}
+
+static void
+hashed_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  gchar *hash = caps_hash_compute_from_reply_finish (result, NULL);
+
+  /* results come back in the order the replies were submitted */
+  g_assert_cmpuint (GPOINTER_TO_UINT (user_data), ==, n_hashed);
+  g_assert_cmpstr (hash, ==, expected[n_hashed]);
+  g_free (hash);
+
+  if (++n_hashed == N_REPLIES)
+    g_main_loop_quit (loop);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  WockyNodeTree *replies[N_REPLIES];
+  GTimer *timer;
+  gdouble sync_time, async_time;
+  guint i;
+
+  g_type_init ();
+  gabble_debug_set_flags_from_env ();
+
+  loop = g_main_loop_new (NULL, FALSE);
+  timer = g_timer_new ();
+  expected = g_new0 (gchar *, N_REPLIES + 1);
+
+  for (i = 0; i < N_REPLIES; i++)
+    replies[i] = make_reply (i);
+
+  g_timer_start (timer);
+
+  for (i = 0; i < N_REPLIES; i++)
+    {
+      expected[i] = wocky_caps_hash_compute_from_node (
+          wocky_node_tree_get_top_node (replies[i]));
+      g_assert (expected[i] != NULL);
+    }
+
+  sync_time = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+
+  for (i = 0; i < N_REPLIES; i++)
+    caps_hash_compute_from_reply_async (replies[i], NULL, hashed_cb,
+        GUINT_TO_POINTER (i));
+
+  g_main_loop_run (loop);
+  async_time = g_timer_elapsed (timer, NULL);
+
+  printf ("%u replies of %u features:\n", N_REPLIES, N_FEATURES);
+  printf ("  main thread:    %10.0f verifications/s\n",
+      N_REPLIES / sync_time);
+  printf ("  hashing thread: %10.0f verifications/s\n",
+      N_REPLIES / async_time);
+
+  for (i = 0; i < N_REPLIES; i++)
+    g_object_unref (replies[i]);
+
+  g_strfreev (expected);
+  g_timer_destroy (timer);
+  g_main_loop_unref (loop);
+  gabble_debug_free ();
+
+  return 0;
+}
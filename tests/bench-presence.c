@@ -0,0 +1,119 @@
+/*
+ * bench-presence: how GabblePresence scales with the number of resources
+ *
+ * Run with no arguments; for each resource count it prints the mean time
+ * taken to update one resource's presence and caps, and to look up one
+ * resource's caps.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "src/debug.h"
+#include "src/presence.h"
+#include "src/namespaces.h"
+
+#define ROUNDS 200
+
+static gchar **
+make_names (guint n_resources)
+{
+  gchar **names = g_new0 (gchar *, n_resources + 1);
+  guint i;
+
+  for (i = 0; i < n_resources; i++)
+    names[i] = g_strdup_printf ("resource-%u", i);
+
+  return names;
+}
+
+static void
+bench (guint n_resources)
+{
+  GabblePresence *presence = gabble_presence_new ();
+  GabbleCapabilitySet *cap_set = gabble_capability_set_new ();
+  gchar **names = make_names (n_resources);
+  GTimer *timer = g_timer_new ();
+  time_t now = time (NULL);
+  gdouble update_time, lookup_time;
+  guint hits = 0;
+  guint round, i;
+
+  gabble_capability_set_add (cap_set, NS_GOOGLE_FEAT_VOICE);
+  gabble_capability_set_add (cap_set, NS_GOOGLE_FEAT_VIDEO);
+
+  for (i = 0; i < n_resources; i++)
+    {
+      gabble_presence_update (presence, names[i], GABBLE_PRESENCE_AVAILABLE,
+          NULL, 0, NULL, now);
+      gabble_presence_set_capabilities (presence, names[i], cap_set, NULL, 1);
+    }
+
+  /* Each round, every resource re-sends its presence and caps, as happens
+   * when a contact changes status on all their devices */
+  g_timer_start (timer);
+
+  for (round = 0; round < ROUNDS; round++)
+    {
+      now++;
+
+      for (i = 0; i < n_resources; i++)
+        {
+          gabble_presence_update (presence, names[i],
+              GABBLE_PRESENCE_AVAILABLE, NULL, round % 3, NULL, now);
+          gabble_presence_set_capabilities (presence, names[i], cap_set,
+              NULL, round + 2);
+          gabble_presence_peek_caps (presence);
+        }
+    }
+
+  update_time = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+
+  for (round = 0; round < ROUNDS; round++)
+    {
+      for (i = 0; i < n_resources; i++)
+        {
+          if (gabble_presence_resource_has_caps (presence, names[i],
+                gabble_capability_set_predicate_has, NS_GOOGLE_FEAT_VOICE))
+            hits++;
+        }
+    }
+
+  lookup_time = g_timer_elapsed (timer, NULL);
+
+  g_assert_cmpuint (hits, ==, ROUNDS * n_resources);
+
+  printf ("%4u resources: %8.3f us/update %8.3f us/lookup\n", n_resources,
+      update_time * G_USEC_PER_SEC / (ROUNDS * n_resources),
+      lookup_time * G_USEC_PER_SEC / (ROUNDS * n_resources));
+
+  g_timer_destroy (timer);
+  g_strfreev (names);
+  gabble_capability_set_free (cap_set);
+  g_object_unref (presence);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  static const guint sizes[] = { 1, 2, 5, 10, 20, 50, 100 };
+  guint i;
+
+  g_type_init ();
+  gabble_capabilities_init (NULL);
+  gabble_debug_set_flags_from_env ();
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    bench (sizes[i]);
+
+  gabble_capabilities_finalize (NULL);
+  gabble_debug_free ();
+
+  return 0;
+}
@@ -0,0 +1,859 @@
+/*
+ * bench-roster: how a whole connection copes with a large roster
+ *
+ * For each roster size, a GabbleConnection connects to a fake server in this
+ * process, which sends it a roster of that many contacts, then a presence
+ * from every contact carrying caps and an avatar hash (XEP-0153); then every
+ * contact's attributes are fetched, as a client does on startup. Finally it
+ * joins a room with as many occupants, first until the channel is handed
+ * out, then until the work put off until after joining is done. For each
+ * stage it prints the wall time and the heap allocations per contact, and
+ * then the peak RSS so far.
+ *
+ * Give roster sizes as arguments to override the default of 1000, 10000 and
+ * 100000. The connection is put on the bus, so run this with
+ * tests/twisted/tools/with-session-bus.sh; and run it with
+ * G_SLICE=always-malloc to count the small fixed-size allocations too. Times
+ * include the fake server's share of the work, but its allocations aren't
+ * counted.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/resource.h>
+
+#include <gio/gio.h>
+#include <telepathy-glib/telepathy-glib.h>
+#include <wocky/wocky.h>
+
+#include "src/connection.h"
+#include "src/debug.h"
+#include "src/gabble.h"
+#include "src/namespaces.h"
+
+#define JID "bench@localhost"
+#define RESOURCE "Bench"
+#define CAPS_NODE "http://example.com/bench"
+#define N_GROUPS 20
+#define PING_ID "bench-ping"
+#define ROOM "bench@conference.localhost"
+
+/* Allocations are only counted while a stage is running, and not while the
+ * fake server is working */
+static gboolean stage_running = FALSE;
+static guint in_server = 0;
+static guint n_allocs = 0;
+static gsize n_bytes = 0;
+
+static gpointer
+counting_malloc (gsize n)
+{
+  if (stage_running && in_server == 0)
+    {
+      n_allocs++;
+      n_bytes += n;
+    }
+
+  return malloc (n);
+}
+
+static gpointer
+counting_realloc (gpointer mem,
+    gsize n)
+{
+  if (stage_running && in_server == 0)
+    {
+      n_allocs++;
+      n_bytes += n;
+    }
+
+  return realloc (mem, n);
+}
+
+static gpointer
+counting_calloc (gsize n_blocks,
+    gsize n_block_bytes)
+{
+  if (stage_running && in_server == 0)
+    {
+      n_allocs++;
+      n_bytes += n_blocks * n_block_bytes;
+    }
+
+  return calloc (n_blocks, n_block_bytes);
+}
+
+static GMemVTable counting_vtable = {
+    counting_malloc, counting_realloc, free,
+    counting_calloc, NULL, NULL };
+
+static GMainLoop *loop = NULL;
+static GTimer *timer = NULL;
+
+static void
+stage_begin (void)
+{
+  n_allocs = 0;
+  n_bytes = 0;
+  stage_running = TRUE;
+  g_timer_start (timer);
+}
+
+static void
+stage_end (const gchar *name,
+    guint n_contacts)
+{
+  gdouble elapsed = g_timer_elapsed (timer, NULL);
+
+  stage_running = FALSE;
+  printf ("  %-10s %10.1f ms %8.2f us/contact %8.1f allocs/contact "
+      "%10.1f bytes/contact\n", name, elapsed * 1000,
+      elapsed * G_USEC_PER_SEC / n_contacts,
+      (gdouble) n_allocs / n_contacts, (gdouble) n_bytes / n_contacts);
+}
+
+static gchar *
+contact_jid (guint i)
+{
+  return g_strdup_printf ("contact%u@example.com", i);
+}
+
+/* The fake server: just enough XMPP to log in, then a roster and a flood of
+ * presences, answering every other request with an empty result */
+
+typedef struct {
+    guint n_contacts;
+    GSocketService *service;
+    guint16 port;
+
+    WockyXmppConnection *conn;
+    gboolean authenticated;
+    /* WockyStanza *s waiting to be sent, one at a time */
+    GQueue *outgoing;
+    gboolean sending;
+
+    /* contacts whose presence is still to be sent, once the flood starts */
+    gboolean flooding;
+    guint next_presence;
+
+    /* while we're being joined to the room, the JID we asked for in it, and
+     * the next occupant to send */
+    gchar *room_self;
+    guint next_occupant;
+
+    WockyNodeTree *disco_reply;
+    gchar *caps_ver;
+} FakeServer;
+
+static void server_send_next (FakeServer *server);
+static void server_open_received_cb (GObject *source, GAsyncResult *result,
+    gpointer user_data);
+static void server_stanza_received_cb (GObject *source, GAsyncResult *result,
+    gpointer user_data);
+
+static WockyStanza *
+make_presence (FakeServer *server,
+    guint i)
+{
+  gchar *jid = contact_jid (i);
+  gchar *from = g_strconcat (jid, "/" RESOURCE, NULL);
+  gchar *photo = g_compute_checksum_for_string (G_CHECKSUM_SHA1, jid, -1);
+  WockyStanza *presence = wocky_stanza_build (WOCKY_STANZA_TYPE_PRESENCE,
+      WOCKY_STANZA_SUB_TYPE_NONE, from, JID "/" RESOURCE,
+      '(', "status", '$', "Benchmarking", ')',
+      '(', "c",
+        ':', NS_CAPS,
+        '@', "hash", "sha-1",
+        '@', "node", CAPS_NODE,
+        '@', "ver", server->caps_ver,
+      ')',
+      '(', "x",
+        ':', NS_VCARD_TEMP_UPDATE,
+        '(', "photo", '$', photo, ')',
+      ')',
+      NULL);
+
+  g_free (photo);
+  g_free (from);
+  g_free (jid);
+  return presence;
+}
+
+static WockyStanza *
+make_occupant_presence (FakeServer *server,
+    const gchar *from,
+    const gchar *real_jid,
+    gboolean is_self)
+{
+  WockyNode *x;
+  WockyStanza *presence = wocky_stanza_build (WOCKY_STANZA_TYPE_PRESENCE,
+      WOCKY_STANZA_SUB_TYPE_NONE, from, JID "/" RESOURCE,
+      '(', "status", '$', "Benchmarking", ')',
+      '(', "c",
+        ':', NS_CAPS,
+        '@', "hash", "sha-1",
+        '@', "node", CAPS_NODE,
+        '@', "ver", server->caps_ver,
+      ')',
+      '(', "x",
+        ':', WOCKY_NS_MUC_USER,
+        '*', &x,
+        '(', "item",
+          '@', "affiliation", "member",
+          '@', "role", "participant",
+          '@', "jid", real_jid,
+        ')',
+      ')',
+      NULL);
+
+  if (is_self)
+    wocky_node_set_attribute (wocky_node_add_child (x, "status"), "code",
+        "110");
+
+  return presence;
+}
+
+static void
+server_sent_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  FakeServer *server = user_data;
+  WockyStanza *stanza = g_queue_pop_head (server->outgoing);
+  WockyStanzaType type;
+  GError *error = NULL;
+
+  in_server++;
+
+  if (!wocky_xmpp_connection_send_stanza_finish (server->conn, result,
+        &error))
+    g_error ("fake server couldn't send: %s", error->message);
+
+  server->sending = FALSE;
+  wocky_stanza_get_type_info (stanza, &type, NULL);
+  g_object_unref (stanza);
+
+  if (type == WOCKY_STANZA_TYPE_SUCCESS)
+    {
+      /* The client starts a new stream once it's authenticated */
+      wocky_xmpp_connection_reset (server->conn);
+      wocky_xmpp_connection_recv_open_async (server->conn, NULL,
+          server_open_received_cb, server);
+    }
+  else
+    {
+      server_send_next (server);
+    }
+
+  in_server--;
+}
+
+static void
+server_send_next (FakeServer *server)
+{
+  if (server->sending)
+    return;
+
+  /* Presences are only built as they're needed, to keep the peak RSS
+   * Gabble's own */
+  if (g_queue_is_empty (server->outgoing) && server->flooding)
+    {
+      if (server->next_presence < server->n_contacts)
+        {
+          g_queue_push_tail (server->outgoing,
+              make_presence (server, server->next_presence++));
+        }
+      else
+        {
+          /* Gabble handles stanzas in order, so once it answers this,
+           * it has dealt with every presence */
+          server->flooding = FALSE;
+          g_queue_push_tail (server->outgoing, wocky_stanza_build (
+                WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_GET,
+                "localhost", JID "/" RESOURCE,
+                '@', "id", PING_ID,
+                '(', "ping", ':', WOCKY_XMPP_NS_PING, ')',
+                NULL));
+        }
+    }
+
+  /* Likewise the room's occupants, who are all our contacts, and then
+   * ourselves, which means we're in */
+  if (g_queue_is_empty (server->outgoing) && server->room_self != NULL)
+    {
+      if (server->next_occupant < server->n_contacts)
+        {
+          gchar *from = g_strdup_printf (ROOM "/occupant%u",
+              server->next_occupant);
+          gchar *jid = contact_jid (server->next_occupant);
+          gchar *real_jid = g_strconcat (jid, "/" RESOURCE, NULL);
+
+          g_queue_push_tail (server->outgoing,
+              make_occupant_presence (server, from, real_jid, FALSE));
+          server->next_occupant++;
+
+          g_free (real_jid);
+          g_free (jid);
+          g_free (from);
+        }
+      else
+        {
+          g_queue_push_tail (server->outgoing, make_occupant_presence (server,
+                server->room_self, JID "/" RESOURCE, TRUE));
+          tp_clear_pointer (&server->room_self, g_free);
+        }
+    }
+
+  if (g_queue_is_empty (server->outgoing))
+    return;
+
+  server->sending = TRUE;
+  wocky_xmpp_connection_send_stanza_async (server->conn,
+      g_queue_peek_head (server->outgoing), NULL, server_sent_cb, server);
+}
+
+static void
+server_send (FakeServer *server,
+    WockyStanza *stanza)
+{
+  g_queue_push_tail (server->outgoing, stanza);
+  server_send_next (server);
+}
+
+static WockyStanza *
+make_roster_reply (FakeServer *server,
+    WockyStanza *iq)
+{
+  WockyNode *query;
+  WockyStanza *reply = wocky_stanza_build_iq_result (iq,
+      '(', "query",
+        ':', WOCKY_XMPP_NS_ROSTER,
+        '*', &query,
+      ')',
+      NULL);
+  guint i;
+
+  for (i = 0; i < server->n_contacts; i++)
+    {
+      WockyNode *item = wocky_node_add_child (query, "item");
+      gchar *jid = contact_jid (i);
+      gchar *name = g_strdup_printf ("Contact %u", i);
+      gchar *group = g_strdup_printf ("Group %u", i % N_GROUPS);
+
+      wocky_node_set_attribute (item, "jid", jid);
+      wocky_node_set_attribute (item, "subscription", "both");
+      wocky_node_set_attribute (item, "name", name);
+      wocky_node_add_child_with_content (item, "group", group);
+
+      g_free (group);
+      g_free (name);
+      g_free (jid);
+    }
+
+  return reply;
+}
+
+static void
+server_handle_iq (FakeServer *server,
+    WockyStanza *iq)
+{
+  WockyNode *top = wocky_stanza_get_top_node (iq);
+  WockyNode *query = wocky_node_get_first_child (top);
+  WockyStanzaSubType sub_type;
+  WockyStanza *reply;
+
+  wocky_stanza_get_type_info (iq, NULL, &sub_type);
+
+  if (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT ||
+      sub_type == WOCKY_STANZA_SUB_TYPE_ERROR)
+    {
+      if (!tp_strdiff (wocky_node_get_attribute (top, "id"), PING_ID))
+        g_main_loop_quit (loop);
+
+      return;
+    }
+
+  if (query != NULL && wocky_node_matches (query, "bind", WOCKY_XMPP_NS_BIND))
+    {
+      reply = wocky_stanza_build_iq_result (iq,
+          '(', "bind",
+            ':', WOCKY_XMPP_NS_BIND,
+            '(', "jid", '$', JID "/" RESOURCE, ')',
+          ')',
+          NULL);
+    }
+  else if (query != NULL && sub_type == WOCKY_STANZA_SUB_TYPE_GET &&
+      wocky_node_matches (query, "query", WOCKY_XMPP_NS_ROSTER))
+    {
+      server_send (server, make_roster_reply (server, iq));
+
+      /* from here until the roster has been received */
+      stage_begin ();
+      return;
+    }
+  else if (query != NULL &&
+      wocky_node_matches (query, "query", NS_DISCO_INFO) &&
+      g_str_has_prefix (wocky_node_get_attribute (query, "node"),
+        CAPS_NODE "#"))
+    {
+      WockyNode *info;
+
+      reply = wocky_stanza_build_iq_result (iq, NULL);
+      info = wocky_node_add_node_tree (wocky_stanza_get_top_node (reply),
+          server->disco_reply);
+      wocky_node_set_attribute (info, "node",
+          wocky_node_get_attribute (query, "node"));
+    }
+  else
+    {
+      reply = wocky_stanza_build_iq_result (iq, NULL);
+    }
+
+  server_send (server, reply);
+}
+
+static void
+server_closed_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  FakeServer *server = user_data;
+
+  wocky_xmpp_connection_send_close_finish (server->conn, result, NULL);
+  tp_clear_object (&server->conn);
+}
+
+static void
+server_stanza_received_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  FakeServer *server = user_data;
+  WockyStanza *stanza;
+  WockyStanzaType type;
+  WockyStanzaSubType sub_type;
+  GError *error = NULL;
+
+  in_server++;
+
+  stanza = wocky_xmpp_connection_recv_stanza_finish (server->conn, result,
+      &error);
+
+  if (stanza == NULL)
+    {
+      if (!g_error_matches (error, WOCKY_XMPP_CONNECTION_ERROR,
+            WOCKY_XMPP_CONNECTION_ERROR_CLOSED))
+        g_error ("fake server couldn't receive: %s", error->message);
+
+      g_error_free (error);
+      wocky_xmpp_connection_send_close_async (server->conn, NULL,
+          server_closed_cb, server);
+      in_server--;
+      return;
+    }
+
+  wocky_stanza_get_type_info (stanza, &type, &sub_type);
+
+  if (type == WOCKY_STANZA_TYPE_AUTH)
+    {
+      /* any password will do; the next stream is opened once this has been
+       * sent */
+      server->authenticated = TRUE;
+      server_send (server, wocky_stanza_build (WOCKY_STANZA_TYPE_SUCCESS,
+            WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL, NULL));
+      g_object_unref (stanza);
+      in_server--;
+      return;
+    }
+
+  if (type == WOCKY_STANZA_TYPE_IQ)
+    {
+      server_handle_iq (server, stanza);
+    }
+  else if (type == WOCKY_STANZA_TYPE_PRESENCE &&
+      sub_type == WOCKY_STANZA_SUB_TYPE_NONE &&
+      wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza), "x",
+        WOCKY_NS_MUC) != NULL)
+    {
+      /* someone wants to join the room */
+      g_assert (server->room_self == NULL);
+      server->room_self = g_strdup (wocky_stanza_get_to (stanza));
+      server->next_occupant = 0;
+      server_send_next (server);
+    }
+
+  g_object_unref (stanza);
+  wocky_xmpp_connection_recv_stanza_async (server->conn, NULL,
+      server_stanza_received_cb, server);
+
+  in_server--;
+}
+
+static void
+server_open_sent_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  FakeServer *server = user_data;
+  WockyStanza *features;
+  GError *error = NULL;
+
+  in_server++;
+
+  if (!wocky_xmpp_connection_send_open_finish (server->conn, result, &error))
+    g_error ("fake server couldn't open the stream: %s", error->message);
+
+  if (server->authenticated)
+    features = wocky_stanza_build (WOCKY_STANZA_TYPE_STREAM_FEATURES,
+        WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL,
+        '(', "bind", ':', WOCKY_XMPP_NS_BIND, ')',
+        NULL);
+  else
+    features = wocky_stanza_build (WOCKY_STANZA_TYPE_STREAM_FEATURES,
+        WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL,
+        '(', "mechanisms",
+          ':', WOCKY_XMPP_NS_SASL_AUTH,
+          '(', "mechanism", '$', "PLAIN", ')',
+        ')',
+        NULL);
+
+  server_send (server, features);
+  wocky_xmpp_connection_recv_stanza_async (server->conn, NULL,
+      server_stanza_received_cb, server);
+
+  in_server--;
+}
+
+static void
+server_open_received_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  FakeServer *server = user_data;
+  GError *error = NULL;
+
+  in_server++;
+
+  if (!wocky_xmpp_connection_recv_open_finish (server->conn, result, NULL,
+        NULL, NULL, NULL, NULL, &error))
+    g_error ("fake server didn't get a stream: %s", error->message);
+
+  wocky_xmpp_connection_send_open_async (server->conn, NULL, "localhost",
+      "1.0", NULL, "bench", NULL, server_open_sent_cb, server);
+
+  in_server--;
+}
+
+static gboolean
+server_incoming_cb (GSocketService *service,
+    GSocketConnection *connection,
+    GObject *source,
+    gpointer user_data)
+{
+  FakeServer *server = user_data;
+
+  g_assert (server->conn == NULL);
+  server->conn = wocky_xmpp_connection_new (G_IO_STREAM (connection));
+  wocky_xmpp_connection_recv_open_async (server->conn, NULL,
+      server_open_received_cb, server);
+  return TRUE;
+}
+
+static FakeServer *
+fake_server_new (guint n_contacts)
+{
+  FakeServer *server = g_slice_new0 (FakeServer);
+  GInetAddress *loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  GSocketAddress *address = g_inet_socket_address_new (loopback, 0);
+  GSocketAddress *effective = NULL;
+  GError *error = NULL;
+
+  server->n_contacts = n_contacts;
+  server->outgoing = g_queue_new ();
+
+  /* What every contact's client supports: a realistic few features, with
+   * a real verification string so Gabble believes it */
+  server->disco_reply = wocky_node_tree_new ("query", NS_DISCO_INFO,
+      '(', "identity",
+        '@', "category", "client",
+        '@', "type", "pc",
+        '@', "name", "Bench",
+      ')',
+      '(', "feature", '@', "var", NS_DISCO_INFO, ')',
+      '(', "feature", '@', "var", NS_CAPS, ')',
+      '(', "feature", '@', "var", NS_VCARD_TEMP_UPDATE, ')',
+      '(', "feature", '@', "var", WOCKY_XMPP_NS_PING, ')',
+      NULL);
+  server->caps_ver = wocky_caps_hash_compute_from_node (
+      wocky_node_tree_get_top_node (server->disco_reply));
+
+  server->service = g_socket_service_new ();
+
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (server->service),
+        address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL,
+        &effective, &error))
+    g_error ("couldn't listen: %s", error->message);
+
+  server->port = g_inet_socket_address_get_port (
+      G_INET_SOCKET_ADDRESS (effective));
+
+  g_signal_connect (server->service, "incoming",
+      G_CALLBACK (server_incoming_cb), server);
+  g_socket_service_start (server->service);
+
+  g_object_unref (effective);
+  g_object_unref (address);
+  g_object_unref (loopback);
+  return server;
+}
+
+static void
+fake_server_free (FakeServer *server)
+{
+  g_socket_service_stop (server->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (server->service));
+  g_object_unref (server->service);
+
+  g_assert (server->conn == NULL);
+  g_assert (server->room_self == NULL);
+  g_queue_foreach (server->outgoing, (GFunc) g_object_unref, NULL);
+  g_queue_free (server->outgoing);
+  g_object_unref (server->disco_reply);
+  g_free (server->caps_ver);
+  g_slice_free (FakeServer, server);
+}
+
+/* The connection under test */
+
+static GabbleConnection *
+make_connection (guint16 port)
+{
+  GabbleConnection *conn = g_object_new (GABBLE_TYPE_CONNECTION,
+      "protocol", "jabber",
+      "password", "pass",
+      NULL);
+  gchar *no_proxies[] = { NULL };
+  gchar *bus_name, *object_path;
+  GError *error = NULL;
+
+  if (!_gabble_connection_set_properties_from_account (conn, JID, &error))
+    g_error ("%s", error->message);
+
+  g_object_set (conn,
+      "resource", RESOURCE,
+      "connect-server", "127.0.0.1",
+      "port", (guint) port,
+      "require-encryption", FALSE,
+      "fallback-socks5-proxies", no_proxies,
+      "keepalive-interval", 0,
+      NULL);
+
+  /* Contact list channels are put on the bus, so the connection must be */
+  if (!tp_base_connection_register ((TpBaseConnection *) conn, "gabble",
+        &bus_name, &object_path, &error))
+    g_error ("couldn't register the connection: %s", error->message);
+
+  g_free (bus_name);
+  g_free (object_path);
+  return conn;
+}
+
+static void
+contact_list_state_changed_cb (GabbleConnection *conn,
+    guint state,
+    FakeServer *server)
+{
+  if (state != TP_CONTACT_LIST_STATE_SUCCESS)
+    return;
+
+  stage_end ("roster", server->n_contacts);
+
+  /* from here until the server's ping is answered */
+  stage_begin ();
+  server->flooding = TRUE;
+  in_server++;
+  server_send_next (server);
+  in_server--;
+}
+
+static void
+shutdown_finished_cb (TpBaseConnection *conn,
+    gpointer user_data)
+{
+  g_main_loop_quit (loop);
+}
+
+static void
+get_attributes (GabbleConnection *conn,
+    guint n_contacts)
+{
+  static const gchar *interfaces[] = {
+      TP_IFACE_CONNECTION_INTERFACE_CONTACT_LIST,
+      TP_IFACE_CONNECTION_INTERFACE_CONTACT_GROUPS,
+      TP_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
+      TP_IFACE_CONNECTION_INTERFACE_ALIASING,
+      TP_IFACE_CONNECTION_INTERFACE_AVATARS,
+      TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
+      NULL };
+  static const gchar *assumed[] = { TP_IFACE_CONNECTION, NULL };
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) conn, TP_HANDLE_TYPE_CONTACT);
+  GArray *handles = g_array_sized_new (FALSE, FALSE, sizeof (TpHandle),
+      n_contacts);
+  GHashTable *attributes;
+  guint i;
+
+  for (i = 0; i < n_contacts; i++)
+    {
+      gchar *jid = contact_jid (i);
+      TpHandle handle = tp_handle_ensure (contact_repo, jid, NULL, NULL);
+
+      g_assert (handle != 0);
+      g_array_append_val (handles, handle);
+      g_free (jid);
+    }
+
+  stage_begin ();
+  attributes = tp_contacts_mixin_get_contact_attributes (G_OBJECT (conn),
+      handles, interfaces, assumed, NULL);
+  stage_end ("attributes", n_contacts);
+
+  g_assert_cmpuint (g_hash_table_size (attributes), ==, n_contacts);
+  g_hash_table_unref (attributes);
+  g_array_unref (handles);
+}
+
+static void
+channel_created_cb (TpConnection *proxy,
+    const gchar *object_path,
+    GHashTable *properties,
+    const GError *error,
+    gpointer user_data,
+    GObject *weak_object)
+{
+  if (error != NULL)
+    g_error ("couldn't join the room: %s", error->message);
+
+  g_main_loop_quit (loop);
+}
+
+static void
+join_room (GabbleConnection *conn,
+    guint n_contacts)
+{
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  TpDBusDaemon *dbus = tp_dbus_daemon_dup (NULL);
+  TpConnection *proxy = tp_connection_new (dbus,
+      tp_base_connection_get_bus_name (base),
+      tp_base_connection_get_object_path (base), NULL);
+  GHashTable *request = tp_asv_new (
+      TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+        TP_IFACE_CHANNEL_TYPE_TEXT,
+      TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_UINT, TP_HANDLE_TYPE_ROOM,
+      TP_PROP_CHANNEL_TARGET_ID, G_TYPE_STRING, ROOM,
+      NULL);
+
+  g_assert (proxy != NULL);
+
+  /* as a client would, over the bus */
+  stage_begin ();
+  tp_cli_connection_interface_requests_call_create_channel (proxy, -1,
+      request, channel_created_cb, NULL, NULL, NULL);
+  g_main_loop_run (loop);
+  stage_end ("join", n_contacts);
+
+  /* until whatever was put off until we were in has been done */
+  stage_begin ();
+
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  stage_end ("settled", n_contacts);
+
+  g_hash_table_unref (request);
+  g_object_unref (proxy);
+  g_object_unref (dbus);
+}
+
+static void
+bench (guint n_contacts)
+{
+  FakeServer *server = fake_server_new (n_contacts);
+  GabbleConnection *conn = make_connection (server->port);
+  TpBaseConnection *base = (TpBaseConnection *) conn;
+  struct rusage usage;
+  GError *error = NULL;
+
+  printf ("%u contacts:\n", n_contacts);
+
+  g_signal_connect (conn, "contact-list-state-changed",
+      G_CALLBACK (contact_list_state_changed_cb), server);
+  g_signal_connect (conn, "shutdown-finished",
+      G_CALLBACK (shutdown_finished_cb), NULL);
+
+  /* as the Connect method would */
+  if (!TP_BASE_CONNECTION_GET_CLASS (base)->start_connecting (base, &error))
+    g_error ("couldn't connect: %s", error->message);
+
+  tp_base_connection_change_status (base, TP_CONNECTION_STATUS_CONNECTING,
+      TP_CONNECTION_STATUS_REASON_REQUESTED);
+
+  /* until the presence flood has been dealt with */
+  g_main_loop_run (loop);
+  stage_end ("presence", n_contacts);
+
+  get_attributes (conn, n_contacts);
+  join_room (conn, n_contacts);
+
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("  peak RSS so far: %ld KiB\n", usage.ru_maxrss);
+
+  tp_base_connection_change_status (base, TP_CONNECTION_STATUS_DISCONNECTED,
+      TP_CONNECTION_STATUS_REASON_REQUESTED);
+  g_main_loop_run (loop);
+
+  g_object_unref (conn);
+  fake_server_free (server);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  static const guint default_sizes[] = { 1000, 10000, 100000 };
+  gint i;
+
+  /* must come before anything else allocates */
+  g_mem_set_vtable (&counting_vtable);
+
+  /* keep the caps cache out of the user's home directory */
+  g_setenv ("WOCKY_CAPS_CACHE", ":memory:", TRUE);
+
+  gabble_init ();
+  gabble_debug_set_flags_from_env ();
+
+  loop = g_main_loop_new (NULL, FALSE);
+  timer = g_timer_new ();
+
+  if (argc > 1)
+    {
+      for (i = 1; i < argc; i++)
+        bench (atoi (argv[i]));
+    }
+  else
+    {
+      for (i = 0; i < (gint) G_N_ELEMENTS (default_sizes); i++)
+        bench (default_sizes[i]);
+    }
+
+  g_timer_destroy (timer);
+  g_main_loop_unref (loop);
+  gabble_debug_free ();
+  wocky_deinit ();
+
+  return 0;
+}
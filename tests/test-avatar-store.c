@@ -0,0 +1,295 @@
+#include "config.h"
+
+#include <string.h>
+#include <utime.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "src/avatar-store.h"
+#include "src/util.h"
+
+static const gchar avatar[] = "\x89PNG\r\n\x1a\nnot really a PNG\n\0 at all";
+
+static gchar *dir = NULL;
+static GabbleAvatarStore *store = NULL;
+static gchar *sha1 = NULL;
+
+static void
+setup (void)
+{
+  dir = g_dir_make_tmp ("test-avatar-store-XXXXXX", NULL);
+  g_assert (dir != NULL);
+
+  /* the store makes its directory when it first needs it */
+  store = gabble_avatar_store_new (dir, 100);
+  sha1 = sha1_hex (avatar, sizeof (avatar));
+}
+
+static void
+teardown (void)
+{
+  GDir *d = g_dir_open (dir, 0, NULL);
+  const gchar *name;
+
+  while ((name = g_dir_read_name (d)) != NULL)
+    {
+      gchar *path = g_build_filename (dir, name, NULL);
+
+      g_unlink (path);
+      g_free (path);
+    }
+
+  g_dir_close (d);
+  g_rmdir (dir);
+
+  gabble_avatar_store_free (store);
+  g_free (sha1);
+  g_free (dir);
+}
+
+/* Test 1: an avatar comes back from a new store over the same directory,
+ * binary data and all, and is stored once however many contacts have it. */
+static void
+test_round_trip (void)
+{
+  GabbleAvatarStore *other;
+  GBytes *data = NULL;
+  gconstpointer bytes;
+  gsize len;
+  gchar *mime_type = NULL;
+  GDir *d;
+  guint n_files = 0;
+
+  setup ();
+
+  g_assert (!gabble_avatar_store_lookup (store, sha1, &data, &mime_type));
+  g_assert (gabble_avatar_store_add (store, sha1, avatar, sizeof (avatar),
+        "image/png"));
+  g_assert (gabble_avatar_store_add (store, sha1, avatar, sizeof (avatar),
+        "image/png"));
+
+  other = gabble_avatar_store_new (dir, 100);
+  g_assert (gabble_avatar_store_lookup (other, sha1, &data, &mime_type));
+  bytes = g_bytes_get_data (data, &len);
+  g_assert_cmpuint (len, ==, sizeof (avatar));
+  g_assert (memcmp (bytes, avatar, sizeof (avatar)) == 0);
+  g_assert_cmpstr (mime_type, ==, "image/png");
+  gabble_avatar_store_free (other);
+
+  d = g_dir_open (dir, 0, NULL);
+
+  while (g_dir_read_name (d) != NULL)
+    n_files++;
+
+  g_dir_close (d);
+  g_assert_cmpuint (n_files, ==, 1);
+
+  g_bytes_unref (data);
+  g_free (mime_type);
+  teardown ();
+}
+
+/* Test 2: avatars which don't match their hash, and hashes which aren't
+ * hashes, are refused. */
+static void
+test_bad_hashes (void)
+{
+  gchar *upper;
+
+  setup ();
+  upper = g_ascii_strup (sha1, -1);
+
+  g_assert (!gabble_avatar_store_add (store, sha1, avatar,
+        sizeof (avatar) - 1, "image/png"));
+  g_assert (!gabble_avatar_store_add (store, "../../etc/passwd", avatar,
+        sizeof (avatar), "image/png"));
+  g_assert (!gabble_avatar_store_add (store, upper, avatar, sizeof (avatar),
+        "image/png"));
+  g_assert (!gabble_avatar_store_add (store, sha1, avatar, sizeof (avatar),
+        "image/png\nimage/gif"));
+
+  g_assert (!gabble_avatar_store_lookup (store, sha1, NULL, NULL));
+  g_assert (!gabble_avatar_store_lookup (store, "../../etc/passwd", NULL,
+        NULL));
+
+  g_free (upper);
+  teardown ();
+}
+
+/* Test 3: a file which no longer matches its name is thrown away rather than
+ * handed out. */
+static void
+test_damaged (void)
+{
+  gchar *path;
+
+  setup ();
+
+  g_assert (gabble_avatar_store_add (store, sha1, avatar, sizeof (avatar),
+        "image/png"));
+
+  path = g_build_filename (dir, sha1, NULL);
+  g_assert (g_file_set_contents (path, "image/png\ntruncated", -1, NULL));
+
+  g_assert (!gabble_avatar_store_lookup (store, sha1, NULL, NULL));
+  g_assert (!g_file_test (path, G_FILE_TEST_EXISTS));
+
+  /* and it can be stored again */
+  g_assert (gabble_avatar_store_add (store, sha1, avatar, sizeof (avatar),
+        ""));
+  g_assert (gabble_avatar_store_lookup (store, sha1, NULL, NULL));
+
+  g_free (path);
+  teardown ();
+}
+
+static gboolean
+stored (const gchar *hash)
+{
+  gchar *path = g_build_filename (dir, hash, NULL);
+  gboolean ret = g_file_test (path, G_FILE_TEST_EXISTS);
+
+  g_free (path);
+  return ret;
+}
+
+/* Test 4: once there are too many avatars, the ones saved longest ago are
+ * deleted, counting those saved by an earlier store in the same directory. */
+static void
+test_prune (void)
+{
+  GabbleAvatarStore *small;
+  gchar *data[4], *hashes[4];
+  guint i;
+
+  setup ();
+
+  for (i = 0; i < 4; i++)
+    {
+      data[i] = g_strdup_printf ("avatar %u", i);
+      hashes[i] = sha1_hex (data[i], strlen (data[i]));
+    }
+
+  /* Make the files' ages unambiguous, however coarse their timestamps */
+  for (i = 0; i < 3; i++)
+    {
+      struct utimbuf times;
+      gchar *path = g_build_filename (dir, hashes[i], NULL);
+
+      times.actime = times.modtime = 1000 * (i + 1);
+      g_assert (gabble_avatar_store_add (store, hashes[i], data[i],
+            strlen (data[i]), "image/png"));
+      g_assert (g_utime (path, &times) == 0);
+      g_free (path);
+    }
+
+  small = gabble_avatar_store_new (dir, 2);
+
+  g_assert (gabble_avatar_store_add (small, hashes[3], data[3],
+        strlen (data[3]), "image/png"));
+  g_assert (!stored (hashes[0]));
+  g_assert (!stored (hashes[1]));
+  g_assert (stored (hashes[2]));
+  g_assert (stored (hashes[3]));
+  g_assert (!gabble_avatar_store_lookup (small, hashes[0], NULL, NULL));
+
+  /* Saving the first one again pushes out the oldest of the rest */
+  g_assert (gabble_avatar_store_add (small, hashes[0], data[0],
+        strlen (data[0]), "image/png"));
+  g_assert (stored (hashes[0]));
+  g_assert (!stored (hashes[2]));
+  g_assert (stored (hashes[3]));
+
+  gabble_avatar_store_free (small);
+
+  for (i = 0; i < 4; i++)
+    {
+      g_free (data[i]);
+      g_free (hashes[i]);
+    }
+
+  teardown ();
+}
+
+static void
+lookup_async_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GAsyncResult **out = user_data;
+
+  g_assert (source == NULL);
+  *out = g_object_ref (result);
+}
+
+/* Looks @hash up on the worker thread, and waits for the answer */
+static gboolean
+lookup_async (const gchar *hash,
+    GBytes **data,
+    gchar **mime_type)
+{
+  GAsyncResult *result = NULL;
+  gboolean ret;
+
+  gabble_avatar_store_lookup_async (store, hash, lookup_async_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  ret = gabble_avatar_store_lookup_finish (store, result, data, mime_type);
+  g_object_unref (result);
+  return ret;
+}
+
+/* Test 5: looking avatars up on the worker thread gives the same answers,
+ * including throwing away damaged files. */
+static void
+test_async (void)
+{
+  GBytes *data = NULL;
+  gconstpointer bytes;
+  gsize len;
+  gchar *mime_type = NULL;
+  gchar *path;
+
+  setup ();
+
+  g_assert (!lookup_async (sha1, &data, &mime_type));
+  g_assert (data == NULL);
+  g_assert (!lookup_async ("../../etc/passwd", NULL, NULL));
+
+  g_assert (gabble_avatar_store_add (store, sha1, avatar, sizeof (avatar),
+        "image/png"));
+  g_assert (lookup_async (sha1, &data, &mime_type));
+  g_assert_cmpstr (mime_type, ==, "image/png");
+  bytes = g_bytes_get_data (data, &len);
+  g_assert_cmpuint (len, ==, sizeof (avatar));
+  g_assert (memcmp (bytes, avatar, len) == 0);
+
+  path = g_build_filename (dir, sha1, NULL);
+  g_assert (g_file_set_contents (path, "image/png\ntruncated", -1, NULL));
+  g_assert (!lookup_async (sha1, NULL, NULL));
+  g_assert (!g_file_test (path, G_FILE_TEST_EXISTS));
+
+  g_free (path);
+  g_bytes_unref (data);
+  g_free (mime_type);
+  teardown ();
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/avatar-store/round-trip", test_round_trip);
+  g_test_add_func ("/avatar-store/bad-hashes", test_bad_hashes);
+  g_test_add_func ("/avatar-store/damaged", test_damaged);
+  g_test_add_func ("/avatar-store/prune", test_prune);
+  g_test_add_func ("/avatar-store/async", test_async);
+
+  return g_test_run ();
+}
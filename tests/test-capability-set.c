@@ -0,0 +1,172 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "gabble/capabilities.h"
+#include "src/debug.h"
+#include "src/namespaces.h"
+
+/* Enough made-up namespaces that some of them are stored outside the
+ * bitmap, whatever else has been registered already */
+#define N_EXTRA 300
+
+static gchar *
+extra_ns (guint i)
+{
+  return g_strdup_printf ("urn:example:feature:%u", i);
+}
+
+static GabbleCapabilitySet *
+new_with_extras (guint first,
+    guint last)
+{
+  GabbleCapabilitySet *caps = gabble_capability_set_new ();
+  guint i;
+
+  for (i = first; i < last; i++)
+    {
+      gchar *ns = extra_ns (i);
+
+      gabble_capability_set_add (caps, ns);
+      g_free (ns);
+    }
+
+  return caps;
+}
+
+static void
+test_basics (void)
+{
+  GabbleCapabilitySet *caps = gabble_capability_set_new ();
+  GabbleCapabilitySet *copy;
+
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 0);
+  g_assert (!gabble_capability_set_has (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (!gabble_capability_set_has (caps, "urn:example:nobody-has-this"));
+
+  gabble_capability_set_add (caps, NS_GOOGLE_FEAT_VOICE);
+  gabble_capability_set_add (caps, QUIRK_OMITS_CONTENT_CREATORS);
+  g_assert (gabble_capability_set_has (caps, NS_GOOGLE_FEAT_VOICE));
+  g_assert (gabble_capability_set_has (caps, QUIRK_OMITS_CONTENT_CREATORS));
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 2);
+
+  copy = gabble_capability_set_copy (caps);
+  g_assert (gabble_capability_set_equals (caps, copy));
+
+  g_assert (gabble_capability_set_remove (copy, NS_GOOGLE_FEAT_VOICE));
+  g_assert (!gabble_capability_set_remove (copy, NS_GOOGLE_FEAT_VOICE));
+  g_assert (!gabble_capability_set_equals (caps, copy));
+  g_assert (gabble_capability_set_at_least (caps, copy));
+  g_assert (!gabble_capability_set_at_least (copy, caps));
+
+  gabble_capability_set_clear (caps);
+  g_assert_cmpint (gabble_capability_set_size (caps), ==, 0);
+
+  gabble_capability_set_free (caps);
+  gabble_capability_set_free (copy);
+}
+
+static void
+count_cb (gpointer var,
+    gpointer user_data)
+{
+  guint *n = user_data;
+
+  (*n)++;
+}
+
+static void
+test_overflow (void)
+{
+  GabbleCapabilitySet *low = new_with_extras (0, 10);
+  GabbleCapabilitySet *all = new_with_extras (0, N_EXTRA);
+  GabbleCapabilitySet *high = new_with_extras (N_EXTRA - 10, N_EXTRA);
+  GabbleCapabilitySet *tmp;
+  guint n = 0;
+
+  g_assert_cmpint (gabble_capability_set_size (all), ==, N_EXTRA);
+  g_assert (gabble_capability_set_at_least (all, low));
+  g_assert (gabble_capability_set_at_least (all, high));
+  g_assert (!gabble_capability_set_at_least (low, high));
+  g_assert (gabble_capability_set_has_one (all, high));
+  g_assert (!gabble_capability_set_has_one (low, high));
+
+  gabble_capability_set_add (high, QUIRK_OMITS_CONTENT_CREATORS);
+  gabble_capability_set_foreach (high, count_cb, &n);
+  /* quirks are not iterated over */
+  g_assert_cmpuint (n, ==, 10);
+
+  /* union of the two ends, then take the ends away again */
+  tmp = gabble_capability_set_copy (low);
+  gabble_capability_set_update (tmp, high);
+  g_assert_cmpint (gabble_capability_set_size (tmp), ==, 21);
+  gabble_capability_set_exclude (tmp, high);
+  g_assert (gabble_capability_set_equals (tmp, low));
+  gabble_capability_set_exclude (tmp, low);
+  g_assert_cmpint (gabble_capability_set_size (tmp), ==, 0);
+  gabble_capability_set_free (tmp);
+
+  /* intersection keeps only what's in both */
+  tmp = gabble_capability_set_copy (all);
+  gabble_capability_set_intersect (tmp, high);
+  gabble_capability_set_remove (high, QUIRK_OMITS_CONTENT_CREATORS);
+  g_assert (gabble_capability_set_equals (tmp, high));
+  gabble_capability_set_intersect (tmp, low);
+  g_assert_cmpint (gabble_capability_set_size (tmp), ==, 0);
+  gabble_capability_set_free (tmp);
+
+  gabble_capability_set_free (low);
+  gabble_capability_set_free (all);
+  gabble_capability_set_free (high);
+}
+
+static void
+test_frozen (void)
+{
+  GabbleCapabilitySet *caps = new_with_extras (0, 3);
+  GabbleCapabilitySet *shared, *copy;
+
+  g_assert (!gabble_capability_set_is_frozen (caps));
+  gabble_capability_set_freeze (caps);
+  g_assert (gabble_capability_set_is_frozen (caps));
+
+  /* Sharing a frozen set just takes a reference */
+  shared = gabble_capability_set_ref (caps);
+  g_assert (shared == caps);
+  g_assert (gabble_capability_set_equals (caps, shared));
+
+  /* ...whereas copies start out thawed */
+  copy = gabble_capability_set_copy (caps);
+  g_assert (!gabble_capability_set_is_frozen (copy));
+  g_assert (gabble_capability_set_equals (caps, copy));
+  gabble_capability_set_add (copy, NS_GOOGLE_FEAT_VOICE);
+  g_assert (!gabble_capability_set_has (caps, NS_GOOGLE_FEAT_VOICE));
+
+  gabble_capability_set_free (caps);
+  g_assert (gabble_capability_set_size (shared) == 3);
+  gabble_capability_set_free (shared);
+  gabble_capability_set_free (copy);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  int ret;
+
+  g_type_init ();
+  gabble_capabilities_init (NULL);
+  gabble_debug_set_flags_from_env ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/capability-set/basics", test_basics);
+  g_test_add_func ("/capability-set/overflow", test_overflow);
+  g_test_add_func ("/capability-set/frozen", test_frozen);
+
+  ret = g_test_run ();
+
+  gabble_capabilities_finalize (NULL);
+  gabble_debug_free ();
+
+  return ret;
+}
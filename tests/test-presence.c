@@ -204,6 +204,67 @@ prefer_higher_priority_resources (void)
   g_object_unref (presence);
 }
 
+/*
+ * aggregate_caps:
+ *
+ * The aggregated caps are kept up to date as resources come and go, and gain
+ * and lose caps.
+ */
+static void
+aggregate_caps (void)
+{
+  GabblePresence *presence = gabble_presence_new ();
+  GabbleCapabilitySet *cap_set;
+  time_t now = time (NULL);
+
+  /* caps for the bare JID are dropped once a resource turns up */
+  cap_set = gabble_capability_set_new ();
+  gabble_capability_set_add (cap_set, NS_GOOGLE_FEAT_VIDEO);
+  gabble_presence_set_capabilities (presence, NULL, cap_set, NULL, 0);
+  gabble_capability_set_free (cap_set);
+  g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VIDEO));
+
+  gabble_presence_update (presence, "foo", GABBLE_PRESENCE_AVAILABLE, NULL, 0,
+      NULL, now);
+  gabble_presence_update (presence, "bar", GABBLE_PRESENCE_AVAILABLE, NULL, 0,
+      NULL, now);
+  g_assert (!gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VIDEO));
+
+  cap_set = gabble_capability_set_new ();
+  gabble_capability_set_add (cap_set, NS_GOOGLE_FEAT_VOICE);
+  gabble_presence_set_capabilities (presence, "foo", cap_set, NULL, 1);
+  gabble_presence_set_capabilities (presence, "bar", cap_set, NULL, 1);
+  gabble_capability_set_free (cap_set);
+  g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VOICE));
+
+  /* foo's new caps replace its old ones, but bar still has voice */
+  cap_set = gabble_capability_set_new ();
+  gabble_capability_set_add (cap_set, NS_GOOGLE_FEAT_VIDEO);
+  gabble_presence_set_capabilities (presence, "foo", cap_set, NULL, 2);
+  gabble_capability_set_free (cap_set);
+  g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VOICE));
+  g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VIDEO));
+
+  /* when bar goes away, so does voice */
+  gabble_presence_update (presence, "bar", GABBLE_PRESENCE_OFFLINE, NULL, 0,
+      NULL, now);
+  g_assert (!gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VOICE));
+  g_assert (gabble_presence_has_cap (presence, NS_GOOGLE_FEAT_VIDEO));
+  g_assert (gabble_presence_resource_has_caps (presence, "foo",
+        gabble_capability_set_predicate_has, NS_GOOGLE_FEAT_VIDEO));
+  g_assert (!gabble_presence_resource_has_caps (presence, "bar",
+        gabble_capability_set_predicate_has, NS_GOOGLE_FEAT_VOICE));
+
+  /* and when foo goes away, there's nothing left */
+  gabble_presence_update (presence, "foo", GABBLE_PRESENCE_OFFLINE, NULL, 0,
+      NULL, now);
+  g_assert (!gabble_presence_has_resources (presence));
+  g_assert_cmpint (gabble_capability_set_size (
+        gabble_presence_peek_caps (presence)), ==, 0);
+
+  g_object_unref (presence);
+}
+
 int main (int argc, char **argv)
 {
   int ret;
@@ -216,6 +277,7 @@ int main (int argc, char **argv)
   g_test_add_func ("/presence/big-test-of-doom", big_test_of_doom);
   g_test_add_func ("/presence/prefer-higher-priority-resources",
       prefer_higher_priority_resources);
+  g_test_add_func ("/presence/aggregate-caps", aggregate_caps);
 
   ret = g_test_run ();
 
@@ -0,0 +1,139 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "src/request-lanes.h"
+
+#define INTERACTIVE GABBLE_REQUEST_PIPELINE_PRIORITY_INTERACTIVE
+#define BACKGROUND GABBLE_REQUEST_PIPELINE_PRIORITY_BACKGROUND
+
+/* Queues a request named @name at the back of @priority's lane */
+static void
+push (GabbleRequestLanes *lanes,
+    GabbleRequestPipelinePriority priority,
+    const gchar *name)
+{
+  g_queue_push_tail (&lanes->lanes[priority], (gpointer) name);
+}
+
+/* Takes the next request, checks it came from @priority and returns its
+ * name */
+static const gchar *
+pop (GabbleRequestLanes *lanes,
+    GabbleRequestPipelinePriority priority)
+{
+  GabbleRequestPipelinePriority taken_from;
+  GList *link;
+  const gchar *name;
+
+  link = gabble_request_lanes_pop (lanes, &taken_from);
+  g_assert (link != NULL);
+  g_assert_cmpuint (taken_from, ==, priority);
+
+  name = link->data;
+  g_list_free_1 (link);
+  return name;
+}
+
+/* Test 1: an interactive request goes out ahead of background requests
+ * which were queued before it, and each lane stays in order. */
+static void
+test_interactive_first (void)
+{
+  GabbleRequestLanes lanes;
+
+  gabble_request_lanes_init (&lanes);
+  g_assert (gabble_request_lanes_pop (&lanes, NULL) == NULL);
+
+  push (&lanes, BACKGROUND, "b1");
+  push (&lanes, BACKGROUND, "b2");
+  push (&lanes, INTERACTIVE, "i1");
+  push (&lanes, INTERACTIVE, "i2");
+  g_assert_cmpuint (gabble_request_lanes_get_length (&lanes), ==, 4);
+
+  g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "i1");
+  g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "i2");
+  g_assert_cmpstr (pop (&lanes, BACKGROUND), ==, "b1");
+  g_assert_cmpstr (pop (&lanes, BACKGROUND), ==, "b2");
+
+  g_assert_cmpuint (gabble_request_lanes_get_length (&lanes), ==, 0);
+  g_assert (gabble_request_lanes_pop (&lanes, NULL) == NULL);
+}
+
+/* Test 2: a steady stream of interactive requests still lets a background
+ * one through after each burst. */
+static void
+test_no_starvation (void)
+{
+  GabbleRequestLanes lanes;
+  guint i;
+
+  gabble_request_lanes_init (&lanes);
+
+  push (&lanes, BACKGROUND, "b1");
+  push (&lanes, BACKGROUND, "b2");
+
+  for (i = 0; i < 2 * GABBLE_REQUEST_LANES_INTERACTIVE_BURST; i++)
+    push (&lanes, INTERACTIVE, "i");
+
+  for (i = 0; i < GABBLE_REQUEST_LANES_INTERACTIVE_BURST; i++)
+    g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "i");
+
+  g_assert_cmpstr (pop (&lanes, BACKGROUND), ==, "b1");
+
+  for (i = 0; i < GABBLE_REQUEST_LANES_INTERACTIVE_BURST; i++)
+    g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "i");
+
+  g_assert_cmpstr (pop (&lanes, BACKGROUND), ==, "b2");
+  g_assert_cmpuint (gabble_request_lanes_get_length (&lanes), ==, 0);
+
+  /* Once the background lane is empty there's nothing to make way for */
+  for (i = 0; i < 2 * GABBLE_REQUEST_LANES_INTERACTIVE_BURST; i++)
+    push (&lanes, INTERACTIVE, "i");
+
+  for (i = 0; i < 2 * GABBLE_REQUEST_LANES_INTERACTIVE_BURST; i++)
+    g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "i");
+}
+
+/* Test 3: raising a queued background request moves it to the front of the
+ * interactive lane. */
+static void
+test_raise (void)
+{
+  GabbleRequestLanes lanes;
+  GList *link;
+
+  gabble_request_lanes_init (&lanes);
+
+  push (&lanes, BACKGROUND, "b1");
+  push (&lanes, BACKGROUND, "b2");
+  push (&lanes, BACKGROUND, "b3");
+  push (&lanes, INTERACTIVE, "i1");
+
+  link = g_queue_peek_nth_link (&lanes.lanes[BACKGROUND], 1);
+  g_assert_cmpstr (link->data, ==, "b2");
+  gabble_request_lanes_raise (&lanes, link, BACKGROUND);
+
+  g_assert_cmpuint (lanes.lanes[BACKGROUND].length, ==, 2);
+  g_assert_cmpuint (lanes.lanes[INTERACTIVE].length, ==, 2);
+  g_assert_cmpuint (gabble_request_lanes_get_length (&lanes), ==, 4);
+
+  g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "b2");
+  g_assert_cmpstr (pop (&lanes, INTERACTIVE), ==, "i1");
+  g_assert_cmpstr (pop (&lanes, BACKGROUND), ==, "b1");
+  g_assert_cmpstr (pop (&lanes, BACKGROUND), ==, "b3");
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/request-lanes/interactive-first",
+      test_interactive_first);
+  g_test_add_func ("/request-lanes/no-starvation", test_no_starvation);
+  g_test_add_func ("/request-lanes/raise", test_raise);
+
+  return g_test_run ();
+}
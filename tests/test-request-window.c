@@ -0,0 +1,146 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "src/request-window.h"
+
+#define PROMPT 1000
+
+/* Sends a request and has it answered straight away */
+static gboolean
+reply (GabbleRequestWindow *window,
+    gint64 rtt,
+    gboolean back_off,
+    gboolean backlog)
+{
+  guint64 seq = gabble_request_window_sent (window);
+
+  return gabble_request_window_replied (window, seq, rtt, back_off, backlog);
+}
+
+/* Test 1: with a backlog, the window grows by one per window's worth of
+ * prompt replies, up to the maximum. */
+static void
+test_grow (void)
+{
+  GabbleRequestWindow window;
+  guint i;
+
+  gabble_request_window_init (&window);
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL);
+
+  for (i = 1; i < GABBLE_REQUEST_WINDOW_INITIAL; i++)
+    g_assert (!reply (&window, PROMPT, FALSE, TRUE));
+
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL);
+  g_assert (reply (&window, PROMPT, FALSE, TRUE));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL + 1);
+
+  for (i = 0; i < GABBLE_REQUEST_WINDOW_MAX * GABBLE_REQUEST_WINDOW_MAX; i++)
+    reply (&window, PROMPT, FALSE, TRUE);
+
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_MAX);
+  g_assert (!reply (&window, PROMPT, FALSE, TRUE));
+}
+
+/* Test 2: without a backlog, or once replies are slowing down, it doesn't
+ * grow at all. */
+static void
+test_no_grow (void)
+{
+  GabbleRequestWindow window;
+  guint i;
+
+  gabble_request_window_init (&window);
+
+  for (i = 0; i < 10 * GABBLE_REQUEST_WINDOW_INITIAL; i++)
+    g_assert (!reply (&window, PROMPT, FALSE, FALSE));
+
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL);
+
+  /* Replies taking three times as long as the best we've seen pull the
+   * smoothed RTT above the growth limit but never past the shrink limit */
+  for (i = 0; i < 10 * GABBLE_REQUEST_WINDOW_INITIAL; i++)
+    reply (&window, 3 * PROMPT, FALSE, TRUE);
+
+  g_assert_cmpint (window.srtt, >,
+      GABBLE_REQUEST_WINDOW_RTT_GROW_LIMIT * PROMPT);
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL);
+}
+
+/* Test 3: replies slow enough to drag the smoothed RTT past the shrink
+ * limit shrink the window by one at a time, at most once per window's worth
+ * of requests. */
+static void
+test_shrink_on_latency (void)
+{
+  GabbleRequestWindow window;
+  guint64 seqs[GABBLE_REQUEST_WINDOW_INITIAL];
+  guint i;
+
+  gabble_request_window_init (&window);
+  reply (&window, PROMPT, FALSE, TRUE);
+
+  for (i = 0; i < G_N_ELEMENTS (seqs); i++)
+    seqs[i] = gabble_request_window_sent (&window);
+
+  for (i = 0; i < G_N_ELEMENTS (seqs); i++)
+    gabble_request_window_replied (&window, seqs[i], 100 * PROMPT, FALSE,
+        TRUE);
+
+  g_assert_cmpint (window.srtt, >,
+      GABBLE_REQUEST_WINDOW_RTT_SHRINK_LIMIT * PROMPT);
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL - 1);
+
+  /* Requests sent since then count again */
+  g_assert (reply (&window, 100 * PROMPT, FALSE, TRUE));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL - 2);
+}
+
+/* Test 4: a timeout or a "wait" error halves the window, once for
+ * everything that was in flight at the time, and never below the
+ * minimum. */
+static void
+test_shrink_on_timeout (void)
+{
+  GabbleRequestWindow window;
+  guint64 first, second;
+
+  gabble_request_window_init (&window);
+
+  first = gabble_request_window_sent (&window);
+  second = gabble_request_window_sent (&window);
+
+  g_assert (gabble_request_window_timed_out (&window, first));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL / 2);
+
+  g_assert (!gabble_request_window_timed_out (&window, second));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL / 2);
+
+  g_assert (reply (&window, PROMPT, TRUE, TRUE));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_INITIAL / 4);
+
+  g_assert (gabble_request_window_timed_out (&window,
+        gabble_request_window_sent (&window)));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_MIN);
+
+  g_assert (!gabble_request_window_timed_out (&window,
+        gabble_request_window_sent (&window)));
+  g_assert_cmpuint (window.size, ==, GABBLE_REQUEST_WINDOW_MIN);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/request-window/grow", test_grow);
+  g_test_add_func ("/request-window/no-grow", test_no_grow);
+  g_test_add_func ("/request-window/shrink-on-latency",
+      test_shrink_on_latency);
+  g_test_add_func ("/request-window/shrink-on-timeout",
+      test_shrink_on_timeout);
+
+  return g_test_run ();
+}
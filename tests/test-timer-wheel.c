@@ -0,0 +1,161 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "src/timer-wheel.h"
+
+static GMainLoop *loop = NULL;
+static GabbleTimerWheel *wheel = NULL;
+static GPtrArray *fired = NULL;
+static GabbleTimer *victim = NULL;
+
+static void
+record_cb (gpointer data)
+{
+  g_ptr_array_add (fired, data);
+}
+
+static void
+quit_cb (gpointer data)
+{
+  g_ptr_array_add (fired, data);
+  g_main_loop_quit (loop);
+}
+
+/* Cancels another timer which expires in the same tick as this one */
+static void
+cancel_victim_cb (gpointer data)
+{
+  g_ptr_array_add (fired, data);
+
+  if (victim != NULL)
+    {
+      gabble_timer_wheel_cancel (victim);
+      victim = NULL;
+    }
+}
+
+static void
+setup (void)
+{
+  loop = g_main_loop_new (NULL, FALSE);
+  wheel = gabble_timer_wheel_new ();
+  fired = g_ptr_array_new ();
+}
+
+static void
+teardown (void)
+{
+  gabble_timer_wheel_destroy (wheel);
+  g_ptr_array_unref (fired);
+  g_main_loop_unref (loop);
+  victim = NULL;
+}
+
+/* Test 1: timers fire in deadline order, and cancelled ones never fire. */
+static void
+test_order (void)
+{
+  GabbleTimer *cancelled;
+
+  setup ();
+
+  gabble_timer_wheel_add_seconds (wheel, 2, quit_cb, "second");
+  gabble_timer_wheel_add_seconds (wheel, 1, record_cb, "first");
+  cancelled = gabble_timer_wheel_add_seconds (wheel, 1, record_cb, "never");
+  g_assert_cmpuint (gabble_timer_wheel_get_n_timers (wheel), ==, 3);
+
+  gabble_timer_wheel_cancel (cancelled);
+  g_assert_cmpuint (gabble_timer_wheel_get_n_timers (wheel), ==, 2);
+
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (fired->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (fired, 0), ==, "first");
+  g_assert_cmpstr (g_ptr_array_index (fired, 1), ==, "second");
+  g_assert_cmpuint (gabble_timer_wheel_get_n_timers (wheel), ==, 0);
+
+  teardown ();
+}
+
+/* Test 2: a callback cancels a timer which expired in the same batch. */
+static void
+test_cancel_in_batch (void)
+{
+  setup ();
+
+  gabble_timer_wheel_add_seconds (wheel, 1, cancel_victim_cb, "canceller");
+  victim = gabble_timer_wheel_add_seconds (wheel, 1, record_cb, "victim");
+  gabble_timer_wheel_add_seconds (wheel, 2, quit_cb, "end");
+
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (fired->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (fired, 0), ==, "canceller");
+  g_assert_cmpstr (g_ptr_array_index (fired, 1), ==, "end");
+
+  teardown ();
+}
+
+/* Test 3: a timer due sooner than the one the wheel is waiting for fires
+ * first, and the wheel goes back to sleep until the later one. */
+static void
+test_rearm (void)
+{
+  gint64 start;
+
+  setup ();
+
+  gabble_timer_wheel_add_seconds (wheel, 3, quit_cb, "later");
+  gabble_timer_wheel_add_seconds (wheel, 1, record_cb, "sooner");
+
+  start = g_get_monotonic_time ();
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (fired->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (fired, 0), ==, "sooner");
+  g_assert_cmpstr (g_ptr_array_index (fired, 1), ==, "later");
+  g_assert_cmpint (g_get_monotonic_time () - start, >=, 3 * G_USEC_PER_SEC);
+  g_assert_cmpuint (gabble_timer_wheel_get_n_timers (wheel), ==, 0);
+
+  teardown ();
+}
+
+/* Test 4: timers far enough away to start on an upper level of the wheel
+ * can be cancelled, and destroying the wheel drops anything left. */
+static void
+test_long_timers (void)
+{
+  GabbleTimer *timer;
+  guint i;
+
+  setup ();
+
+  for (i = 0; i < 1000; i++)
+    gabble_timer_wheel_add_seconds (wheel, i * 97, record_cb, NULL);
+
+  timer = gabble_timer_wheel_add_seconds (wheel, 24 * 60 * 60, record_cb,
+      NULL);
+  g_assert_cmpuint (gabble_timer_wheel_get_n_timers (wheel), ==, 1001);
+
+  gabble_timer_wheel_cancel (timer);
+  g_assert_cmpuint (gabble_timer_wheel_get_n_timers (wheel), ==, 1000);
+  g_assert_cmpuint (fired->len, ==, 0);
+
+  teardown ();
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/timer-wheel/order", test_order);
+  g_test_add_func ("/timer-wheel/cancel-in-batch", test_cancel_in_batch);
+  g_test_add_func ("/timer-wheel/rearm", test_rearm);
+  g_test_add_func ("/timer-wheel/long-timers", test_long_timers);
+
+  return g_test_run ();
+}
@@ -0,0 +1,115 @@
+"""
+Test the caps-snapshot parameter: contacts' capabilities as of the last
+disconnection are reported straight away on reconnecting, until their fresh
+presence and caps confirm or replace them.
+"""
+
+import os
+
+from servicetest import (
+    assertEquals, assertContains, assertDoesNotContain, EventPattern,
+    )
+from gabbletest import (
+    exec_test, make_presence, sync_stream, XmppAuthenticator, cache_file,
+    )
+from caps_helper import compute_caps_hash, send_disco_reply
+import constants as cs
+import ns
+
+username = 'snapshot%d' % os.getpid()
+store = cache_file('caps-snapshots', '%s_40localhost.snapshot' % username)
+
+contact_bare_jid = 'macbeth@glamis'
+contact_jid = 'macbeth@glamis/hall'
+client = 'http://telepathy.freedesktop.org/zomg-ponies'
+identities = ['client/pc//thane']
+
+def tube_cap(service):
+    return ({cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_DBUS_TUBE,
+             cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+             cs.DBUS_TUBE_SERVICE_NAME: service},
+            [cs.TARGET_HANDLE, cs.TARGET_ID])
+
+xiangqi_features = [ns.TUBES + '/dbus#com.example.Xiangqi']
+xiangqi_tube_cap = tube_cap(u'com.example.Xiangqi')
+go_features = [ns.TUBES + '/dbus#com.example.Go']
+go_tube_cap = tube_cap(u'com.example.Go')
+
+def send_presence(stream, features):
+    ver = compute_caps_hash(identities, features, {})
+    stream.send(make_presence(contact_jid, status='Hello',
+        caps={'node': client, 'hash': 'sha-1', 'ver': ver}))
+
+def handle_disco(q, stream, features):
+    ver = compute_caps_hash(identities, features, {})
+    event = q.expect('stream-iq', to=contact_jid, query_ns=ns.DISCO_INFO)
+    assertEquals(client + '#' + ver, event.query.attributes['node'])
+    send_disco_reply(stream, event.stanza, identities, features)
+
+def get_caps(conn, handle):
+    return conn.ContactCapabilities.GetContactCapabilities([handle]).get(
+        handle, [])
+
+def test_first(q, bus, conn, stream):
+    # There's no snapshot yet, so we know nothing until Macbeth turns up
+    handle = conn.RequestHandles(cs.HT_CONTACT, [contact_bare_jid])[0]
+    assertDoesNotContain(xiangqi_tube_cap, get_caps(conn, handle))
+
+    send_presence(stream, xiangqi_features)
+    handle_disco(q, stream, xiangqi_features)
+
+    e = q.expect('dbus-signal', signal='ContactCapabilitiesChanged')
+    assertContains(xiangqi_tube_cap, e.args[0][handle])
+
+def test_confirmed(q, bus, conn, stream):
+    # Before any presence has arrived, Macbeth's caps are answered from the
+    # snapshot saved when the last connection went away...
+    handle = conn.RequestHandles(cs.HT_CONTACT, [contact_bare_jid])[0]
+    assertContains(xiangqi_tube_cap, get_caps(conn, handle))
+
+    # ...so when their presence arrives with the same caps, which are resolved
+    # from the caps cache without a disco, clients have nothing to hear about.
+    changed = [EventPattern('dbus-signal', signal='ContactCapabilitiesChanged')]
+    q.forbid_events(changed)
+
+    send_presence(stream, xiangqi_features)
+    q.expect('dbus-signal', signal='PresencesChanged')
+    sync_stream(q, stream)
+
+    assertContains(xiangqi_tube_cap, get_caps(conn, handle))
+    q.unforbid_events(changed)
+
+def test_replaced(q, bus, conn, stream):
+    handle = conn.RequestHandles(cs.HT_CONTACT, [contact_bare_jid])[0]
+    assertContains(xiangqi_tube_cap, get_caps(conn, handle))
+
+    # This time Macbeth has a different client. Until its caps have been
+    # discovered, the snapshot still stands...
+    send_presence(stream, go_features)
+    event = q.expect('stream-iq', to=contact_jid, query_ns=ns.DISCO_INFO)
+    assertContains(xiangqi_tube_cap, get_caps(conn, handle))
+
+    # ...and once they have, clients hear about the change relative to it.
+    send_disco_reply(stream, event.stanza, identities, go_features)
+
+    e = q.expect('dbus-signal', signal='ContactCapabilitiesChanged')
+    assertContains(go_tube_cap, e.args[0][handle])
+    assertDoesNotContain(xiangqi_tube_cap, e.args[0][handle])
+
+    caps = get_caps(conn, handle)
+    assertContains(go_tube_cap, caps)
+    assertDoesNotContain(xiangqi_tube_cap, caps)
+
+if __name__ == '__main__':
+    params = {
+        'account': '%s@localhost' % username,
+        'caps-snapshot': True,
+        }
+
+    try:
+        for test in [test_first, test_confirmed, test_replaced]:
+            exec_test(test, params,
+                authenticator=XmppAuthenticator(username, 'pass'))
+    finally:
+        if os.path.exists(store):
+            os.remove(store)
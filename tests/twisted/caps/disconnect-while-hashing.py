@@ -0,0 +1,48 @@
+"""
+Test disconnecting while contacts' disco replies are still being checked
+against their verification strings.
+"""
+
+from servicetest import EventPattern, call_async
+from gabbletest import exec_test, make_presence
+import constants as cs
+import ns
+from caps_helper import compute_caps_hash, send_disco_reply
+
+client = 'http://telepathy.freedesktop.org/fake-client/disconnect-hashing'
+
+def test(q, bus, conn, stream):
+    replies = []
+
+    # Each contact uses a different version of the client, so each reply has
+    # to be hashed separately.
+    for i in range(10):
+        contact = 'bilbo%d@foo.com/Foo' % i
+        features = [ns.JINGLE_015, ns.GOOGLE_P2P,
+            'http://example.com/feature-%d' % i]
+        caps = {
+            'node': client,
+            'ver': compute_caps_hash([], features, {}),
+            'hash': 'sha-1',
+            }
+
+        stream.send(make_presence(contact, status='hello', caps=caps))
+        event = q.expect('stream-iq', to=contact, query_ns=ns.DISCO_INFO)
+        replies.append((event.stanza, features))
+
+    # Answer them all and hang up straight away, so that some of the replies
+    # are still on the hashing thread when the connection goes away. Gabble
+    # should drop them, rather than crashing when they come back.
+    for stanza, features in replies:
+        send_disco_reply(stream, stanza, [], features)
+
+    call_async(q, conn, 'Disconnect')
+    q.expect_many(
+        EventPattern('dbus-signal', signal='StatusChanged',
+            args=[cs.CONN_STATUS_DISCONNECTED, cs.CSR_REQUESTED]),
+        EventPattern('stream-closed'))
+    stream.sendFooter()
+    q.expect('dbus-return', method='Disconnect')
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,55 @@
+"""
+Test that lookups in the presence cache's parsed caps replies are reported
+through the IQStats interface.
+"""
+
+from servicetest import EventPattern, assertEquals
+from gabbletest import exec_test, make_presence, sync_stream
+import constants as cs
+import ns
+from caps_helper import compute_caps_hash, presence_and_disco
+
+client = 'http://telepathy.freedesktop.org/fake-client/parsed-caps-stats'
+features = [ns.JINGLE_015, ns.GOOGLE_P2P]
+
+def get_disco_stats(conn):
+    stats = conn.GetStatistics(dbus_interface=cs.CONN_IFACE_GABBLE_IQ_STATS)
+    return stats[ns.DISCO_INFO]
+
+def test(q, bus, conn, stream):
+    conn.AddClientInterest([cs.CONN_IFACE_GABBLE_IQ_STATS])
+
+    caps = {
+        'node': client,
+        'ver': compute_caps_hash([], features, {}),
+        'hash': 'sha-1',
+        }
+
+    # The first contact using this client has to be disco'd.
+    presence_and_disco(q, conn, stream, 'bilbo1@foo.com/Foo', True, client,
+        caps, features)
+    sync_stream(q, stream)
+
+    stats = get_disco_stats(conn)
+    assertEquals(0, stats['CacheHits'])
+    assertEquals(1, stats['CacheMisses'])
+
+    # The reply matched the hash, so the others are answered from the parsed
+    # reply, without asking or parsing it again.
+    q.forbid_events([
+        EventPattern('stream-iq', query_ns=ns.DISCO_INFO,
+            query_node=client + '#' + caps['ver']),
+        ])
+
+    for contact in ['bilbo2@foo.com/Foo', 'bilbo3@foo.com/Foo']:
+        stream.send(make_presence(contact, status='hello', caps=caps))
+
+    sync_stream(q, stream)
+
+    stats = get_disco_stats(conn)
+    assertEquals(2, stats['CacheHits'])
+    assertEquals(1, stats['CacheMisses'])
+    assertEquals(0, stats['CacheEvictions'])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -28,6 +28,7 @@ FIXED_CAPS = FIXED_JINGLE_CAPS + [
     ns.GOOGLE_FEAT_SESSION,
     ns.NICK,
     ns.NICK + '+notify',
+    ns.AVATAR_METADATA + '+notify',
     ns.CHAT_STATES,
     ns.SI,
     ns.IBB,
@@ -30,10 +30,12 @@ CHANNEL_IFACE_ROOM = CHANNEL + '.Interface.Room2'
 CHANNEL_IFACE_ROOM_CONFIG = CHANNEL + '.Interface.RoomConfig1'
 CHANNEL_IFACE_SUBJECT = CHANNEL + '.Interface.Subject2'
 CHANNEL_IFACE_FILE_TRANSFER_METADATA = CHANNEL + '.Interface.FileTransfer.Metadata'
+CHANNEL_IFACE_GABBLE_MUC_HISTORY = CHANNEL + '.Interface.Gabble.MUCHistory'
 
 CHANNEL_TYPE_CALL = CHANNEL + ".Type.Call1"
 CHANNEL_TYPE_CONTACT_LIST = CHANNEL + ".Type.ContactList"
 CHANNEL_TYPE_CONTACT_SEARCH = CHANNEL + ".Type.ContactSearch"
+CHANNEL_TYPE_ROOM_LIST = CHANNEL + ".Type.RoomList"
 CHANNEL_TYPE_TEXT = CHANNEL + ".Type.Text"
 CHANNEL_TYPE_TUBES = CHANNEL + ".Type.Tubes"
 CHANNEL_TYPE_STREAM_TUBE = CHANNEL + ".Type.StreamTube"
@@ -186,6 +188,7 @@ CONN_IFACE_SIMPLE_PRESENCE = CONN + '.Interface.SimplePresence'
 CONN_IFACE_REQUESTS = CONN + '.Interface.Requests'
 CONN_IFACE_LOCATION = CONN + '.Interface.Location'
 CONN_IFACE_GABBLE_DECLOAK = CONN + '.Interface.Gabble.Decloak'
+CONN_IFACE_GABBLE_IQ_STATS = CONN + '.Interface.Gabble.IQStats'
 CONN_IFACE_MAIL_NOTIFICATION = CONN + '.Interface.MailNotification'
 CONN_IFACE_CONTACT_LIST = CONN + '.Interface.ContactList'
 CONN_IFACE_CONTACT_GROUPS = CONN + '.Interface.ContactGroups'
@@ -535,6 +538,12 @@ PASSWORD_FLAG_PROVIDE = 8
 ROOM_NAME = CHANNEL_IFACE_ROOM + '.RoomName'
 ROOM_SERVER = CHANNEL_IFACE_ROOM + '.Server'
 
+# Channel.Interface.Gabble.MUCHistory
+MUC_HISTORY_MAX_CHARS = CHANNEL_IFACE_GABBLE_MUC_HISTORY + '.MaxChars'
+MUC_HISTORY_MAX_STANZAS = CHANNEL_IFACE_GABBLE_MUC_HISTORY + '.MaxStanzas'
+MUC_HISTORY_SECONDS = CHANNEL_IFACE_GABBLE_MUC_HISTORY + '.Seconds'
+MUC_HISTORY_SINCE = CHANNEL_IFACE_GABBLE_MUC_HISTORY + '.Since'
+
 # Channel.Interface.Subject
 SUBJECT = CHANNEL_IFACE_ROOM + '.Subject'
 SUBJECT_PRESENT = 1
@@ -191,6 +191,9 @@ class XmppAuthenticator(GabbleAuthenticator):
 
         self._mechanisms = ['PLAIN']
 
+        # stream features to offer alongside bind and session
+        self.extra_features = []
+
     def streamInitialize(self, root):
         if root:
             self.xmlstream.sid = root.getAttribute('id')
@@ -206,6 +209,8 @@ class XmppAuthenticator(GabbleAuthenticator):
             elem(ns.NS_XMPP_BIND, 'bind'),
             elem(ns.NS_XMPP_SESSION, 'session'),
         )
+        for feature in self.extra_features:
+            features.addChild(feature)
         self.xmlstream.send(features)
 
         self.xmlstream.addOnetimeObserver(
@@ -539,6 +544,15 @@ def make_stream(event_func, authenticator=None, protocol=None,
     stream = protocol(event_func, authenticator)
     return stream
 
+def cache_file(*path):
+    """
+    Returns the location of path within Gabble's on-disk cache. run-test.sh
+    points XDG_CACHE_HOME at a fresh directory for each run.
+    """
+    cache_home = os.environ.get('XDG_CACHE_HOME',
+        os.path.expanduser('~/.cache'))
+    return os.path.join(cache_home, 'telepathy', 'gabble', *path)
+
 def disconnect_conn(q, conn, stream, expected_before=[], expected_after=[]):
     call_async(q, conn, 'Disconnect')
 
@@ -0,0 +1,66 @@
+"""
+Test that with coalesce-presence-signals set, occupants arriving and leaving
+close together are signalled in one MembersChanged, with only the last thing
+each of them did counting.
+"""
+
+import dbus
+
+from gabbletest import exec_test, make_muc_presence
+from servicetest import EventPattern, assertEquals, assertSameSets
+from mucutil import join_muc
+import constants as cs
+
+ROOM = 'chat@conf.localhost'
+
+def arrive(stream, nick, jid=None):
+    stream.send(make_muc_presence('none', 'participant', ROOM, nick, jid))
+
+def leave(stream, nick):
+    presence = make_muc_presence('none', 'none', ROOM, nick)
+    presence['type'] = 'unavailable'
+    stream.send(presence)
+
+def test(q, bus, conn, stream):
+    _, chan, _, _ = join_muc(q, bus, conn, stream, ROOM)
+
+    amy, bob, che, dan, che_owner = conn.RequestHandles(cs.HT_CONTACT,
+        ['%s/%s' % (ROOM, nick) for nick in ['amy', 'bob', 'che', 'dan']] +
+        ['che@foo.com'])
+
+    # Amy comes and goes, and Bob (who was already there) goes and comes
+    # back, before anyone hears about it; Che and Dan stay.
+    removal = EventPattern('dbus-signal', signal='MembersChanged',
+        predicate=lambda e: e.args[2])
+    q.forbid_events([removal])
+
+    arrive(stream, 'amy')
+    arrive(stream, 'che', 'che@foo.com')
+    leave(stream, 'amy')
+    leave(stream, 'bob')
+    arrive(stream, 'dan')
+    arrive(stream, 'bob')
+
+    e = q.expect('dbus-signal', signal='MembersChanged',
+        predicate=lambda e: che in e.args[1])
+    assertSameSets([che, dan], e.args[1])
+    assertEquals([], e.args[2])
+
+    q.unforbid_events([removal])
+
+    self_handle = chan.Group.GetSelfHandle()
+    assertSameSets([self_handle, bob, che, dan], chan.Group.GetMembers())
+    assertEquals([che_owner], chan.Group.GetHandleOwners([che]))
+
+    # Everyone leaving at once is also one change.
+    leave(stream, 'bob')
+    leave(stream, 'che')
+    leave(stream, 'dan')
+
+    e = q.expect('dbus-signal', signal='MembersChanged')
+    assertEquals([], e.args[1])
+    assertSameSets([bob, che, dan], e.args[2])
+
+if __name__ == '__main__':
+    exec_test(test, params={'coalesce-presence-signals': True,
+                            'coalesce-presence-window': dbus.UInt32(500)})
@@ -0,0 +1,146 @@
+"""
+Test limiting the history a room sends when it is joined, and rejoining with
+only the history since the last message we delivered.
+"""
+
+import calendar
+import time
+
+import dbus
+
+from twisted.words.xish import xpath
+
+from servicetest import call_async, assertEquals, assertLength, wrap_channel
+from gabbletest import exec_test, elem, make_muc_presence
+from mucutil import try_to_join_muc, echo_muc_presence
+import constants as cs
+import ns
+
+def join(q, bus, conn, stream, room, request=None):
+    event = try_to_join_muc(q, bus, conn, stream, room, request=request)
+    stream.send(make_muc_presence('none', 'participant', room, 'test'))
+
+    path, props = q.expect('dbus-return', method='CreateChannel').value
+    chan = wrap_channel(bus.get_object(conn.bus_name, path), 'Text')
+
+    return chan, props, event
+
+def get_history(event):
+    history = xpath.queryForNodes('/presence/x[@xmlns="%s"]/history' % ns.MUC,
+        event.stanza)
+
+    if history is None:
+        return None
+
+    assertLength(1, history)
+    return history[0]
+
+def leave(q, stream, chan, room):
+    call_async(q, chan, 'Close')
+    event = q.expect('stream-presence', to=room + '/test')
+    assertEquals('unavailable', event.stanza['type'])
+    echo_muc_presence(q, stream, event.stanza, 'none', 'participant')
+    q.expect('dbus-signal', signal='ChannelClosed')
+
+def test(q, bus, conn, stream):
+    room = 'chat@conf.localhost'
+
+    # With nothing asked for, the room decides.
+    chan, props, event = join(q, bus, conn, stream, room)
+    assertEquals(None, get_history(event))
+    assertEquals(-1, props[cs.MUC_HISTORY_MAX_STANZAS])
+    assertEquals(0, props[cs.MUC_HISTORY_SINCE])
+
+    # The room sends some history, which is delivered.
+    stream.send(
+        elem('message', from_=room + '/bob', type='groupchat')(
+          elem('body')(u'before you got here'),
+          elem(ns.X_DELAY, 'x', from_=room, stamp='20260102T03:04:05')
+        ))
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    chan.Text.AcknowledgePendingMessages([e.args[0][0]['pending-message-id']])
+
+    leave(q, stream, chan, room)
+
+    # Rejoining only asks for what we missed, within the limits asked for.
+    request = {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_TEXT,
+        cs.TARGET_HANDLE_TYPE: cs.HT_ROOM,
+        cs.TARGET_ID: room,
+        cs.MUC_HISTORY_MAX_STANZAS: dbus.Int32(20),
+        cs.MUC_HISTORY_SECONDS: dbus.Int32(3600),
+        }
+    chan, props, event = join(q, bus, conn, stream, room, request)
+
+    history = get_history(event)
+    assertEquals('20', history['maxstanzas'])
+    assertEquals('3600', history['seconds'])
+    assertEquals('2026-01-02T03:04:05Z', history['since'])
+    assertEquals(None, history.getAttribute('maxchars'))
+
+    assertEquals(-1, props[cs.MUC_HISTORY_MAX_CHARS])
+    assertEquals(20, props[cs.MUC_HISTORY_MAX_STANZAS])
+    assertEquals(3600, props[cs.MUC_HISTORY_SECONDS])
+    assertEquals(1767323045, props[cs.MUC_HISTORY_SINCE])
+
+    leave(q, stream, chan, room)
+
+    # Asking for no history at all, from a given time, is honoured.
+    request[cs.MUC_HISTORY_MAX_STANZAS] = dbus.Int32(0)
+    request[cs.MUC_HISTORY_SINCE] = dbus.Int64(1767225600)
+    del request[cs.MUC_HISTORY_SECONDS]
+    chan, props, event = join(q, bus, conn, stream, room, request)
+
+    history = get_history(event)
+    assertEquals('0', history['maxstanzas'])
+    assertEquals('2026-01-01T00:00:00Z', history['since'])
+    assertEquals(None, history.getAttribute('seconds'))
+
+    leave(q, stream, chan, room)
+
+    test_live(q, bus, conn, stream)
+
+def test_live(q, bus, conn, stream):
+    room = 'live@conf.localhost'
+
+    chan, props, event = join(q, bus, conn, stream, room)
+
+    # A live message isn't stamped, so we only know when it arrived.
+    before = time.time()
+    stream.send(
+        elem('message', from_=room + '/bob', type='groupchat', id='live-1')(
+          elem('body')(u'as it happens')
+        ))
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    chan.Text.AcknowledgePendingMessages([e.args[0][0]['pending-message-id']])
+    after = time.time()
+
+    leave(q, stream, chan, room)
+
+    # Rejoining asks for history from a while before then, in case the
+    # server's clock is behind ours...
+    chan, props, event = join(q, bus, conn, stream, room)
+
+    since = calendar.timegm(time.strptime(get_history(event)['since'],
+        '%Y-%m-%dT%H:%M:%SZ'))
+    assert before - 5 * 60 - 1 <= since <= after - 5 * 60, \
+        (before, since, after)
+
+    # ...so the room replays the message we already had, which is dropped;
+    # only what we missed is delivered.
+    stream.send(
+        elem('message', from_=room + '/bob', type='groupchat', id='live-1')(
+          elem('body')(u'as it happens'),
+          elem(ns.X_DELAY, 'x', from_=room, stamp='20260102T03:04:05')
+        ))
+    stream.send(
+        elem('message', from_=room + '/bob', type='groupchat', id='missed-1')(
+          elem('body')(u'while you were out'),
+          elem(ns.X_DELAY, 'x', from_=room, stamp='20260102T03:04:06')
+        ))
+
+    e = q.expect('dbus-signal', signal='MessageReceived')
+    assertEquals(u'while you were out', e.args[0][1]['content'])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,67 @@
+"""
+Test joining a room with more occupants than Gabble parses the presences of
+at once: everyone is added in one go, and their presences follow.
+"""
+
+from gabbletest import exec_test, make_muc_presence
+from servicetest import EventPattern, assertEquals
+from mucutil import try_to_join_muc
+import constants as cs
+
+ROOM = 'chat@conf.localhost'
+N_OCCUPANTS = 250
+
+def test(q, bus, conn, stream):
+    self_handle = conn.GetSelfHandle()
+    try_to_join_muc(q, bus, conn, stream, ROOM)
+
+    for i in range(N_OCCUPANTS):
+        presence = make_muc_presence('none', 'participant', ROOM,
+            'occupant%d' % i, 'contact%d@foo.com' % i)
+        presence.addElement('status', content='here')
+        stream.send(presence)
+
+    stream.send(make_muc_presence('none', 'participant', ROOM, 'test'))
+
+    # Someone changes their presence just as we get in; this wins over what
+    # they sent before, whenever that gets dealt with.
+    presence = make_muc_presence('none', 'participant', ROOM, 'occupant0',
+        'contact0@foo.com')
+    presence.addElement('show', content='away')
+    presence.addElement('status', content='back soon')
+    stream.send(presence)
+
+    occupants = conn.RequestHandles(cs.HT_CONTACT,
+        ['%s/occupant%d' % (ROOM, i) for i in range(N_OCCUPANTS)])
+    owners = conn.RequestHandles(cs.HT_CONTACT,
+        ['contact%d@foo.com' % i for i in range(N_OCCUPANTS)])
+    test = conn.RequestHandles(cs.HT_CONTACT, ['%s/test' % ROOM])[0]
+
+    # Everyone is added, with their owners, in one go.
+    owners_changed, members_changed, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='HandleOwnersChanged'),
+        EventPattern('dbus-signal', signal='MembersChanged',
+            predicate=lambda e: len(e.args[1]) > 1),
+        EventPattern('dbus-return', method='CreateChannel'))
+
+    assertEquals(sorted(occupants + [test]), sorted(members_changed.args[1]))
+    expected_owners = dict(zip(occupants, owners))
+    expected_owners[test] = self_handle
+    assertEquals(expected_owners, owners_changed.args[0])
+
+    # Then everyone's presence follows.
+    presences = {}
+
+    while len(presences) < N_OCCUPANTS:
+        e = q.expect('dbus-signal', signal='PresencesChanged')
+        presences.update(e.args[0])
+
+    assertEquals((cs.PRESENCE_AWAY, 'away', 'back soon'),
+        presences[occupants[0]])
+
+    for occupant in occupants[1:]:
+        assertEquals((cs.PRESENCE_AVAILABLE, 'available', 'here'),
+            presences[occupant])
+
+if __name__ == '__main__':
+    exec_test(test)
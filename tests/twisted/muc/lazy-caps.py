@@ -0,0 +1,92 @@
+"""
+Test that the caps of a large room's occupants are only discovered when
+somebody explicitly asks for them, not when their contact attributes are
+fetched, and that asking one occupant is enough for everyone who advertised
+the same caps.
+"""
+
+from gabbletest import exec_test, make_muc_presence, sync_stream
+from servicetest import EventPattern, assertEquals, assertContains
+from caps_helper import compute_caps_hash, send_disco_reply
+from mucutil import try_to_join_muc
+import constants as cs
+import ns
+
+ROOM = 'chat@conf.localhost'
+N_OCCUPANTS = 150
+CLIENT = 'http://example.com/fake-client'
+
+def test(q, bus, conn, stream):
+    identities = ['client/pc//lazy']
+    features = [ns.FILE_TRANSFER]
+    ver = compute_caps_hash(identities, features, {})
+
+    # Nobody in the room is asked what their caps mean while we join.
+    occupant_disco = EventPattern('stream-iq', query_ns=ns.DISCO_INFO,
+        predicate=lambda e: e.to is not None and e.to.startswith(ROOM + '/'))
+    q.forbid_events([occupant_disco])
+
+    try_to_join_muc(q, bus, conn, stream, ROOM)
+
+    for i in range(N_OCCUPANTS):
+        presence = make_muc_presence('none', 'participant', ROOM,
+            'occupant%d' % i, 'contact%d@foo.com' % i)
+        c = presence.addElement((ns.CAPS, 'c'))
+        c['node'] = CLIENT
+        c['ver'] = ver
+        c['hash'] = 'sha-1'
+        stream.send(presence)
+
+    stream.send(make_muc_presence('none', 'participant', ROOM, 'test'))
+
+    occupants = conn.RequestHandles(cs.HT_CONTACT,
+        ['%s/occupant%d' % (ROOM, i) for i in range(N_OCCUPANTS)])
+
+    q.expect('dbus-return', method='CreateChannel')
+
+    presences = {}
+
+    while len(presences) < N_OCCUPANTS:
+        e = q.expect('dbus-signal', signal='PresencesChanged')
+        presences.update(e.args[0])
+
+    sync_stream(q, stream)
+
+    # Fetching contact attributes in bulk, as a contact list or a room's
+    # member list does, doesn't count as asking.
+    attrs = conn.Contacts.GetContactAttributes(occupants,
+        [cs.CONN_IFACE_CONTACT_CAPS, cs.CONN_IFACE_CAPS], False)
+    assertEquals(N_OCCUPANTS, len(attrs))
+    sync_stream(q, stream)
+    q.unforbid_events([occupant_disco])
+
+    # Until then, occupants can't do anything special.
+    caps = conn.ContactCapabilities.GetContactCapabilities(occupants[:1])
+    assertEquals([], [c for c in caps.get(occupants[0], [])
+        if c[0][cs.CHANNEL_TYPE] == cs.CHANNEL_TYPE_FILE_TRANSFER])
+
+    # Having been asked, we find out from that one occupant...
+    e = q.expect('stream-iq', to='%s/occupant0' % ROOM,
+        query_ns=ns.DISCO_INFO)
+    assertEquals(CLIENT + '#' + ver, e.query['node'])
+
+    q.forbid_events([occupant_disco])
+    sync_stream(q, stream)
+
+    # ... which, the hash being verifiable, holds for everyone else too.
+    send_disco_reply(stream, e.stanza, identities, features)
+
+    changed = {}
+
+    while len(changed) < N_OCCUPANTS:
+        e = q.expect('dbus-signal', signal='ContactCapabilitiesChanged')
+        changed.update(e.args[0])
+
+    for occupant in occupants:
+        types = [c[0][cs.CHANNEL_TYPE] for c in changed[occupant]]
+        assertContains(cs.CHANNEL_TYPE_FILE_TRANSFER, types)
+
+    sync_stream(q, stream)
+
+if __name__ == '__main__':
+    exec_test(test)
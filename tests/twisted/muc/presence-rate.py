@@ -0,0 +1,55 @@
+"""
+Test that our presence is sent to the rooms we're in a few at a time, and
+that a room still waiting for one change is only sent the latest.
+"""
+
+import time
+
+import dbus
+
+from servicetest import assertEquals, assertLength, EventPattern
+from gabbletest import exec_test, sync_stream
+from mucutil import join_muc
+
+ROOMS = ['room%d@conf.localhost' % i for i in range(4)]
+RATE = 4
+
+def get_show(stanza):
+    shows = [e for e in stanza.elements() if e.name == 'show']
+    assertLength(1, shows)
+    return str(shows[0])
+
+def test(q, bus, conn, stream):
+    for room in ROOMS:
+        join_muc(q, bus, conn, stream, room)
+
+    sync_stream(q, stream)
+
+    in_room = lambda e: e.to is not None and e.to.split('/')[0] in ROOMS
+
+    conn.SimplePresence.SetPresence('away', '')
+    conn.SimplePresence.SetPresence('dnd', '')
+
+    # One room gets the first change straight away...
+    event = q.expect('stream-presence', predicate=in_room)
+    assertEquals('away', get_show(event.stanza))
+
+    # ... and then everyone gets the second, at the rate asked for; the
+    # rooms which hadn't been sent the first by then aren't sent it at all.
+    start = time.time()
+    received = []
+
+    while len(received) < len(ROOMS):
+        event = q.expect('stream-presence', predicate=in_room)
+        assertEquals('dnd', get_show(event.stanza))
+        received.append(event.to.split('/')[0])
+
+    assertEquals(sorted(ROOMS), sorted(received))
+    assert time.time() - start >= float(len(ROOMS) - 1) / RATE - 0.1
+
+    q.forbid_events([EventPattern('stream-presence', predicate=in_room)])
+    time.sleep(2.0 / RATE)
+    sync_stream(q, stream)
+
+if __name__ == '__main__':
+    exec_test(test, {'muc-presence-rate': dbus.UInt32(RATE)})
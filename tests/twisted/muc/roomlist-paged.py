@@ -0,0 +1,190 @@
+"""
+Test listing a conference server's rooms a page at a time, with and without
+asking each room about itself, and reusing the listing for the next room
+list on the same server unless part of it couldn't be fetched.
+"""
+
+import dbus
+
+from twisted.words.xish import xpath
+
+from servicetest import (
+    call_async, EventPattern, assertEquals, assertLength, wrap_channel,
+    )
+from gabbletest import (
+    exec_test, make_result_iq, send_error_reply, sync_stream,
+    )
+import constants as cs
+import ns
+
+SERVER = 'conf.localhost'
+ROOMS = [('room%d@%s' % (i, SERVER), 'Room %d' % i) for i in range(5)]
+PAGE = 2
+
+def request_roomlist(q, bus, conn):
+    path, props = conn.Requests.CreateChannel({
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        cs.CHANNEL_TYPE_ROOM_LIST + '.Server': SERVER,
+        })
+
+    return wrap_channel(bus.get_object(conn.bus_name, path), 'RoomList')
+
+def get_page_request(event):
+    max_ = xpath.queryForString('/iq/query/set[@xmlns="%s"]/max' % ns.RSM,
+        event.stanza)
+    after = xpath.queryForString(
+        '/iq/query/set[@xmlns="%s"]/after' % ns.RSM, event.stanza)
+
+    return max_, after or None
+
+def send_page(stream, iq, rooms, with_names):
+    result = make_result_iq(stream, iq)
+    query = result.firstChildElement()
+
+    for jid, name in rooms:
+        item = query.addElement('item')
+        item['jid'] = jid
+
+        if with_names:
+            item['name'] = name
+
+    set_ = query.addElement((ns.RSM, 'set'))
+
+    if rooms:
+        set_.addElement('first', content=rooms[0][0])
+        set_.addElement('last', content=rooms[-1][0])
+
+    set_.addElement('count', content=str(len(ROOMS)))
+    stream.send(result)
+
+def send_room_info(stream, iq, name):
+    result = make_result_iq(stream, iq)
+    query = result.firstChildElement()
+    identity = query.addElement('identity')
+    identity['category'] = 'conference'
+    identity['type'] = 'text'
+    identity['name'] = name
+    feature = query.addElement('feature')
+    feature['var'] = ns.MUC
+    stream.send(result)
+
+def items_request(after):
+    return EventPattern('stream-iq', to=SERVER, query_ns=ns.DISCO_ITEMS,
+        predicate=lambda e: get_page_request(e) == (str(PAGE), after))
+
+def info_request(jid):
+    return EventPattern('stream-iq', to=jid, query_ns=ns.DISCO_INFO)
+
+def expect_rooms(q):
+    rooms = {}
+
+    while True:
+        e = q.expect('dbus-signal',
+            predicate=lambda e: e.signal in ('GotRooms', 'ListingRooms'))
+
+        if e.signal == 'ListingRooms':
+            if not e.args[0]:
+                return rooms
+        else:
+            for handle, channel_type, info in e.args[0]:
+                assertEquals(cs.CHANNEL_TYPE_TEXT, channel_type)
+                rooms[info['handle-name']] = info.get('name')
+
+def test_items_only(q, bus, conn, stream):
+    # The rooms are listed as the pages of the listing arrive, with the
+    # names the server gives them; nobody asks them anything.
+    q.forbid_events([info_request(jid) for jid, _ in ROOMS])
+
+    chan = request_roomlist(q, bus, conn)
+    call_async(q, chan.RoomList, 'ListRooms')
+
+    after = None
+
+    for i in range(0, len(ROOMS), PAGE):
+        event = q.expect_many(items_request(after))[0]
+        page = ROOMS[i:i + PAGE]
+        send_page(stream, event.stanza, page, True)
+        after = page[-1][0]
+
+    # The page after the last one is empty.
+    event = q.expect_many(items_request(after))[0]
+    send_page(stream, event.stanza, [], True)
+
+    assertEquals(dict(ROOMS), expect_rooms(q))
+
+    chan.Close()
+
+    # Listing the same server again is answered from what we just heard.
+    listing = EventPattern('stream-iq', to=SERVER, query_ns=ns.DISCO_ITEMS)
+    q.forbid_events([listing])
+
+    chan = request_roomlist(q, bus, conn)
+    call_async(q, chan.RoomList, 'ListRooms')
+    assertEquals(dict(ROOMS), expect_rooms(q))
+
+    sync_stream(q, stream)
+
+def test_page_error(q, bus, conn, stream):
+    chan = request_roomlist(q, bus, conn)
+    call_async(q, chan.RoomList, 'ListRooms')
+
+    event = q.expect_many(items_request(None))[0]
+    send_page(stream, event.stanza, ROOMS[:PAGE], True)
+
+    # The server can't give us the second page, so we only hear about the
+    # rooms on the first...
+    event = q.expect_many(items_request(ROOMS[PAGE - 1][0]))[0]
+    send_error_reply(stream, event.stanza)
+
+    assertEquals(dict(ROOMS[:PAGE]), expect_rooms(q))
+
+    chan.Close()
+
+    # ...which aren't all of them, so the next room list asks again.
+    chan = request_roomlist(q, bus, conn)
+    call_async(q, chan.RoomList, 'ListRooms')
+
+    event = q.expect_many(items_request(None))[0]
+    send_page(stream, event.stanza, [], True)
+    assertEquals({}, expect_rooms(q))
+
+def test_info(q, bus, conn, stream):
+    for attempt in range(2):
+        chan = request_roomlist(q, bus, conn)
+        call_async(q, chan.RoomList, 'ListRooms')
+
+        event = q.expect_many(items_request(None))[0]
+        send_page(stream, event.stanza, ROOMS[:PAGE], False)
+
+        # Each room on a page is asked about itself while the next page is
+        # fetched.
+        events = q.expect_many(items_request(ROOMS[PAGE - 1][0]),
+            *[info_request(jid) for jid, _ in ROOMS[:PAGE]])
+
+        for e, (jid, name) in zip(events[1:], ROOMS[:PAGE]):
+            send_room_info(stream, e.stanza, name)
+
+        # There are no more pages.
+        send_page(stream, events[0].stanza, [], False)
+
+        rooms = expect_rooms(q)
+        assertLength(PAGE, rooms)
+        assertEquals(dict(ROOMS[:PAGE]), rooms)
+
+        # Nothing is remembered when the TTL is 0, so we ask again.
+        chan.Close()
+
+if __name__ == '__main__':
+    exec_test(test_items_only, {
+        'roomlist-page-size': dbus.UInt32(PAGE),
+        'roomlist-room-info': False,
+        })
+    exec_test(test_page_error, {
+        'roomlist-page-size': dbus.UInt32(PAGE),
+        'roomlist-room-info': False,
+        })
+    exec_test(test_info, {
+        'roomlist-page-size': dbus.UInt32(PAGE),
+        'roomlist-cache-ttl': dbus.UInt32(0),
+        })
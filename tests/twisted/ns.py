@@ -1,4 +1,6 @@
 AMP = "http://jabber.org/protocol/amp"
+AVATAR_DATA = "urn:xmpp:avatar:data"
+AVATAR_METADATA = "urn:xmpp:avatar:metadata"
 BYTESTREAMS = 'http://jabber.org/protocol/bytestreams'
 CHAT_STATES = 'http://jabber.org/protocol/chatstates'
 CAPS = "http://jabber.org/protocol/caps"
@@ -60,6 +62,8 @@ PUBSUB_EVENT = "%s#event" % PUBSUB
 RECEIPTS = "urn:xmpp:receipts"
 REGISTER = "jabber:iq:register"
 ROSTER = "jabber:iq:roster"
+ROSTER_VERSIONING = "urn:xmpp:features:rosterver"
+RSM = "http://jabber.org/protocol/rsm"
 SEARCH = 'jabber:iq:search'
 SI = 'http://jabber.org/protocol/si'
 SI_MULTIPLE = 'http://telepathy.freedesktop.org/xmpp/si-multiple'
@@ -70,6 +74,7 @@ TUBES = 'http://telepathy.freedesktop.org/xmpp/tubes'
 MUJI = 'http://telepathy.freedesktop.org/xmpp/muji'
 VCARD_TEMP = 'vcard-temp'
 VCARD_TEMP_UPDATE = 'vcard-temp:x:update'
+X_CONFERENCE = 'jabber:x:conference'
 X_DATA = 'jabber:x:data'
 X_DELAY = 'jabber:x:delay'
 XML = 'http://www.w3.org/XML/1998/namespace'
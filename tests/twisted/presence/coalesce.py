@@ -0,0 +1,37 @@
+"""
+Test that with coalesce-presence-signals set, presence changes which arrive
+close together are signalled in one PresencesChanged.
+"""
+
+import dbus
+
+from gabbletest import exec_test, make_presence
+from servicetest import assertEquals
+
+import constants as cs
+
+AVAILABLE = (cs.PRESENCE_AVAILABLE, u'available', u'')
+AWAY = (cs.PRESENCE_AWAY, u'away', u'brb')
+
+def test(q, bus, conn, stream):
+    amy, bob, che = conn.RequestHandles(cs.HT_CONTACT,
+        ['amy@foo.com', 'bob@foo.com', 'che@foo.com'])
+
+    stream.send(make_presence('amy@foo.com/Laptop'))
+    stream.send(make_presence('bob@foo.com/Phone'))
+    stream.send(make_presence('che@foo.com/Desktop'))
+    # Amy changes her mind straight away; only the latest presence should be
+    # signalled.
+    stream.send(make_presence('amy@foo.com/Laptop', show='away',
+        status='brb'))
+
+    e = q.expect('dbus-signal', signal='PresencesChanged',
+        predicate=lambda e: amy in e.args[0])
+    assertEquals({amy: AWAY, bob: AVAILABLE, che: AVAILABLE}, e.args[0])
+
+    assertEquals({amy: AWAY, bob: AVAILABLE, che: AVAILABLE},
+        conn.SimplePresence.GetPresences([amy, bob, che]))
+
+if __name__ == '__main__':
+    exec_test(test, params={'coalesce-presence-signals': True,
+                            'coalesce-presence-window': dbus.UInt32(500)})
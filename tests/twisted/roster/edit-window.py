@@ -0,0 +1,98 @@
+"""
+Test that a bulk edit to many contacts is sent as a bounded number of roster
+sets at a time, and completes once, when they all have; or fails, if we're
+disconnected with some still waiting to be sent.
+"""
+
+from gabbletest import exec_test, acknowledge_iq, sync_stream
+from servicetest import (EventPattern, assertEquals, assertLength,
+        call_async)
+import constants as cs
+import ns
+
+from twisted.words.xish import xpath
+
+N_CONTACTS = 40
+# MAX_EDITS_IN_FLIGHT in roster.c
+WINDOW = 16
+
+def expect_set(q):
+    return q.expect('stream-iq', iq_type='set', query_ns=ns.ROSTER)
+
+def send_roster(q, stream):
+    jids = ['contact%d@example.com' % i for i in range(N_CONTACTS)]
+
+    event = q.expect('stream-iq', query_ns=ns.ROSTER)
+    event.stanza['type'] = 'result'
+
+    for jid in jids:
+        item = event.query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(event.stanza)
+
+    q.expect('dbus-signal', signal='ContactListStateChanged',
+            args=[cs.CONTACT_LIST_STATE_SUCCESS])
+
+    return jids
+
+def test(q, bus, conn, stream):
+    jids = send_roster(q, stream)
+    handles = conn.RequestHandles(cs.HT_CONTACT, jids)
+    call_async(q, conn.ContactGroups, 'AddToGroup', 'friends', handles)
+
+    roster_set = EventPattern('stream-iq', iq_type='set', query_ns=ns.ROSTER)
+    returned = EventPattern('dbus-return', method='AddToGroup')
+
+    # Only the first few go out at first...
+    q.forbid_events([returned])
+    in_flight = [expect_set(q) for i in range(WINDOW)]
+    q.forbid_events([roster_set])
+    sync_stream(q, stream)
+    q.unforbid_events([roster_set])
+
+    # ... and each one answered lets another go.
+    edited = set()
+
+    while in_flight:
+        event = in_flight.pop(0)
+        items = xpath.queryForNodes('/iq/query/item', event.stanza)
+        assertLength(1, items)
+        assertEquals(['friends'],
+            [str(g) for g in xpath.queryForNodes('/item/group', items[0])])
+        edited.add(items[0]['jid'])
+
+        acknowledge_iq(stream, event.stanza)
+
+        if len(edited) + len(in_flight) < N_CONTACTS:
+            in_flight.append(expect_set(q))
+
+    assertEquals(set(jids), edited)
+
+    # The whole batch completes once every set has been answered.
+    q.unforbid_events([returned])
+    q.expect('dbus-return', method='AddToGroup')
+
+def test_disconnect(q, bus, conn, stream):
+    jids = send_roster(q, stream)
+    handles = conn.RequestHandles(cs.HT_CONTACT, jids)
+    call_async(q, conn.ContactGroups, 'AddToGroup', 'friends', handles)
+
+    for i in range(WINDOW):
+        expect_set(q)
+
+    # The rest are still queued when we go away, so the edit can never
+    # complete: it fails rather than leaving the caller waiting forever.
+    call_async(q, conn, 'Disconnect')
+    q.expect_many(
+        EventPattern('dbus-signal', signal='StatusChanged',
+            args=[cs.CONN_STATUS_DISCONNECTED, cs.CSR_REQUESTED]),
+        EventPattern('stream-closed'),
+        EventPattern('dbus-error', method='AddToGroup'))
+    stream.sendFooter()
+    q.expect('dbus-return', method='Disconnect')
+
+if __name__ == '__main__':
+    exec_test(test)
+    exec_test(test_disconnect)
@@ -0,0 +1,114 @@
+"""
+Test roster versioning (XEP-0237), with the roster kept on disk between
+connections by the roster-cache parameter.
+"""
+
+import os
+
+from servicetest import assertEquals, assertContains, assertDoesNotContain
+from gabbletest import (
+    exec_test, elem, make_result_iq, acknowledge_iq, sync_stream,
+    XmppAuthenticator, cache_file,
+    )
+from rostertest import make_roster_push
+import constants as cs
+import ns
+
+username = 'versioned%d' % os.getpid()
+store = cache_file('rosters', '%s_40localhost.roster' % username)
+
+def make_authenticator():
+    authenticator = XmppAuthenticator(username, 'pass')
+    authenticator.extra_features.append(elem(ns.ROSTER_VERSIONING, 'ver'))
+    return authenticator
+
+def get_contacts(conn):
+    return conn.ContactList.GetContactListAttributes([], False).keys()
+
+def get_state(conn):
+    return conn.Properties.Get(cs.CONN_IFACE_CONTACT_LIST,
+        'ContactListState')
+
+def push(q, stream, jid, subscription, ver):
+    iq = make_roster_push(stream, jid, subscription)
+    iq.firstChildElement()['ver'] = ver
+    stream.send(iq)
+    q.expect('stream-iq', iq_type='result', iq_id='push')
+
+def test_first(q, bus, conn, stream):
+    # With nothing saved, we ask for a versioned roster from scratch.
+    event = q.expect('stream-iq', query_ns=ns.ROSTER, iq_type='get')
+    assertEquals('', event.query['ver'])
+
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query['ver'] = '1'
+    item = query.addElement('item')
+    item['jid'] = 'amy@foo.com'
+    item['subscription'] = 'both'
+    item.addElement('group', content='Friends')
+    item = query.addElement('item')
+    item['jid'] = 'bob@foo.com'
+    item['subscription'] = 'to'
+    stream.send(result)
+
+    q.expect('dbus-signal', signal='ContactListStateChanged',
+            args=[cs.CONTACT_LIST_STATE_SUCCESS])
+
+    push(q, stream, 'che@foo.com', 'from', '2')
+
+def test_unchanged(q, bus, conn, stream):
+    amy, bob, che = conn.RequestHandles(cs.HT_CONTACT,
+            ['amy@foo.com', 'bob@foo.com', 'che@foo.com'])
+
+    # We ask for what changed since the version we saved, and the roster
+    # we saved is there before the server answers.
+    event = q.expect('stream-iq', query_ns=ns.ROSTER, iq_type='get')
+    assertEquals('2', event.query['ver'])
+    assertEquals(cs.CONTACT_LIST_STATE_SUCCESS, get_state(conn))
+    assertEquals(sorted([amy, bob, che]), sorted(get_contacts(conn)))
+    attributes = conn.ContactList.GetContactListAttributes(
+        [cs.CONN_IFACE_CONTACT_GROUPS], False)
+    assertEquals(['Friends'],
+        attributes[amy][cs.CONN_IFACE_CONTACT_GROUPS + '/groups'])
+
+    # An empty result means nothing changed; changes come as pushes.
+    acknowledge_iq(stream, event.stanza)
+    push(q, stream, 'bob@foo.com', 'remove', '3')
+    sync_stream(q, stream)
+
+    assertDoesNotContain(bob, get_contacts(conn))
+
+def test_replaced(q, bus, conn, stream):
+    amy, dave = conn.RequestHandles(cs.HT_CONTACT,
+            ['amy@foo.com', 'dave@foo.com'])
+
+    event = q.expect('stream-iq', query_ns=ns.ROSTER, iq_type='get')
+    assertEquals('3', event.query['ver'])
+    assertContains(amy, get_contacts(conn))
+
+    # The server has forgotten version 3, so sends the whole roster; whoever
+    # isn't in it has gone.
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query['ver'] = '4'
+    item = query.addElement('item')
+    item['jid'] = 'dave@foo.com'
+    item['subscription'] = 'both'
+    stream.send(result)
+
+    sync_stream(q, stream)
+    assertEquals([dave], get_contacts(conn))
+
+if __name__ == '__main__':
+    params = {
+        'account': '%s@localhost' % username,
+        'roster-cache': True,
+        }
+
+    try:
+        for test in [test_first, test_unchanged, test_replaced]:
+            exec_test(test, params, authenticator=make_authenticator())
+    finally:
+        if os.path.exists(store):
+            os.remove(store)
@@ -0,0 +1,72 @@
+"""
+Tests the Gabble.IQStats debugging interface.
+"""
+
+from servicetest import call_async, assertEquals, assertLength
+from gabbletest import (exec_test, acknowledge_iq, make_result_iq, elem,
+    sync_stream)
+import constants as cs
+import ns
+
+def get_stats(conn):
+    return conn.GetStatistics(dbus_interface=cs.CONN_IFACE_GABBLE_IQ_STATS)
+
+def request_vcard(q, stream, conn, jid):
+    handle = conn.RequestHandles(cs.HT_CONTACT, [jid])[0]
+    call_async(q, conn.ContactInfo, 'RefreshContactInfo', [handle])
+    return q.expect('stream-iq', to=jid, query_ns=ns.VCARD_TEMP,
+        query_name='vCard')
+
+def test(q, bus, conn, stream):
+    event = q.expect('stream-iq', to=None, query_ns=ns.VCARD_TEMP,
+            query_name='vCard')
+    acknowledge_iq(stream, event.stanza)
+
+    buckets = conn.Get(cs.CONN_IFACE_GABBLE_IQ_STATS, 'LatencyBuckets',
+        dbus_interface=cs.PROPERTIES_IFACE)
+    assert len(buckets) > 1, buckets
+    assertEquals(sorted(buckets), list(buckets))
+    assertEquals(2**32 - 1, buckets[-1])
+
+    # Nobody is interested yet, so nothing is recorded.
+    event = request_vcard(q, stream, conn, 'alice@foo.com')
+    acknowledge_iq(stream, event.stanza)
+    sync_stream(q, stream)
+    assertEquals({}, get_stats(conn))
+
+    conn.AddClientInterest([cs.CONN_IFACE_GABBLE_IQ_STATS])
+
+    event = request_vcard(q, stream, conn, 'bob@foo.com')
+    acknowledge_iq(stream, event.stanza)
+
+    event = request_vcard(q, stream, conn, 'chris@foo.com')
+    error = make_result_iq(stream, event.stanza)
+    error['type'] = 'error'
+    error.addChild(elem('error', type='wait')(
+        elem(ns.STANZA, 'resource-constraint')))
+    stream.send(error)
+
+    sync_stream(q, stream)
+
+    stats = get_stats(conn)[ns.VCARD_TEMP]
+    assertEquals(2, stats['Sent'])
+    assertEquals(2, stats['Replies'])
+    assertEquals(0, stats['Timeouts'])
+    assertEquals({'wait': 1}, stats['Errors'])
+    assertLength(len(buckets), stats['Latency'])
+    assertEquals(2, sum(stats['Latency']))
+    assert stats['BytesSent'] > 0, stats
+    assert stats['BytesReceived'] > 0, stats
+
+    conn.ResetStatistics(dbus_interface=cs.CONN_IFACE_GABBLE_IQ_STATS)
+    assertEquals({}, get_stats(conn))
+
+    # Losing interest stops collection.
+    conn.RemoveClientInterest([cs.CONN_IFACE_GABBLE_IQ_STATS])
+    event = request_vcard(q, stream, conn, 'dave@foo.com')
+    acknowledge_iq(stream, event.stanza)
+    sync_stream(q, stream)
+    assertEquals({}, get_stats(conn))
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,71 @@
+"""
+Test that when two parts of Gabble ask the same question at once, only one
+<iq/> is sent, and both get the answer.
+"""
+
+from servicetest import (
+    call_async, EventPattern, assertEquals, assertLength, wrap_channel,
+    )
+from gabbletest import exec_test, elem, make_result_iq, sync_stream
+import constants as cs
+import ns
+
+SERVER = 'conf.localhost'
+ROOM = 'chat@' + SERVER
+
+def test(q, bus, conn, stream):
+    conn.AddClientInterest([cs.CONN_IFACE_GABBLE_IQ_STATS])
+
+    # The room list asks the room about itself...
+    path, _ = conn.Requests.CreateChannel({
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        cs.CHANNEL_TYPE_ROOM_LIST + '.Server': SERVER,
+        })
+    roomlist = wrap_channel(bus.get_object(conn.bus_name, path), 'RoomList')
+    call_async(q, roomlist.RoomList, 'ListRooms')
+
+    event = q.expect('stream-iq', to=SERVER, query_ns=ns.DISCO_ITEMS)
+    result = make_result_iq(stream, event.stanza)
+    result.firstChildElement().addChild(elem('item', jid=ROOM))
+    stream.send(result)
+
+    event = q.expect('stream-iq', to=ROOM, query_ns=ns.DISCO_INFO)
+
+    # ... and, while it's waiting, so does the MUC factory, to check that an
+    # old-style invitation really is to a room: but nothing more is sent.
+    room_disco = EventPattern('stream-iq', to=ROOM, query_ns=ns.DISCO_INFO)
+    q.forbid_events([room_disco])
+
+    stream.send(
+        elem('message', from_='bob@foo.com/Foo', to='test@localhost')(
+          elem(ns.X_CONFERENCE, 'x', jid=ROOM)
+        ))
+    sync_stream(q, stream)
+
+    stats = conn.GetStatistics(dbus_interface=cs.CONN_IFACE_GABBLE_IQ_STATS)
+    assertEquals(1, stats[ns.DISCO_INFO]['Shared'])
+
+    result = make_result_iq(stream, event.stanza)
+    query = result.firstChildElement()
+    query.addChild(elem('identity', category='conference', type='text',
+        name='Chat'))
+    query.addChild(elem('feature', var=ns.MUC))
+    stream.send(result)
+
+    # Both get the one answer.
+    rooms, new_channels = q.expect_many(
+        EventPattern('dbus-signal', signal='GotRooms'),
+        EventPattern('dbus-signal', signal='NewChannels',
+            predicate=lambda e:
+                e.args[0][0][1][cs.CHANNEL_TYPE] == cs.CHANNEL_TYPE_TEXT),
+        )
+
+    assertLength(1, rooms.args[0])
+    assertEquals(ROOM, rooms.args[0][0][2]['handle-name'])
+    assertEquals(ROOM, new_channels.args[0][0][1][cs.TARGET_ID])
+
+    q.unforbid_events([room_disco])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,120 @@
+"""
+Test XEP-0084 avatars: a contact's metadata notification is believed, the
+image is fetched from their data node rather than from their vCard, a
+different vCard hash in their presence is ignored from then on, and our own
+avatar is published there too.
+"""
+
+import base64
+import hashlib
+
+from twisted.words.xish import xpath
+
+from servicetest import call_async, EventPattern, assertEquals, assertLength
+from gabbletest import (
+    exec_test, make_result_iq, acknowledge_iq, elem, make_presence,
+    sync_stream, expect_and_handle_get_vcard, expect_and_handle_set_vcard,
+    )
+
+import constants as cs
+import ns
+
+def test(q, bus, conn, stream):
+    event = q.expect('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard')
+
+    acknowledge_iq(stream, event.stanza)
+
+    avatar = '\x89PNG\r\n\x1a\nBob'
+    sha1 = hashlib.sha1(avatar).hexdigest()
+
+    handle = conn.RequestHandles(cs.HT_CONTACT, ['bob@foo.com'])[0]
+
+    message = elem('message', from_='bob@foo.com')(
+        elem((ns.PUBSUB_EVENT), 'event')(
+            elem('items', node=ns.AVATAR_METADATA)(
+                elem('item', id=sha1)(
+                    elem(ns.AVATAR_METADATA, 'metadata')(
+                        elem('info', id=sha1, type='image/png',
+                            bytes=str(len(avatar)))
+                    )
+                )
+            )
+        )
+    )
+    stream.send(message.toXml())
+
+    q.expect('dbus-signal', signal='AvatarUpdated', args=[handle, sha1])
+
+    call_async(q, conn.Avatars, 'RequestAvatars', [handle])
+
+    # The image comes from the data node, not from Bob's vCard.
+    q.forbid_events([EventPattern('stream-iq', to='bob@foo.com',
+        query_ns=ns.VCARD_TEMP)])
+
+    event, _ = q.expect_many(
+        EventPattern('stream-iq', to='bob@foo.com', iq_type='get',
+            query_ns=ns.PUBSUB, query_name='pubsub'),
+        EventPattern('dbus-return', method='RequestAvatars'))
+    items = event.query.firstChildElement()
+    assertEquals('items', items.name)
+    assertEquals(ns.AVATAR_DATA, items['node'])
+    item = items.firstChildElement()
+    assertEquals(sha1, item['id'])
+
+    result = make_result_iq(stream, event.stanza)
+    items = result.firstChildElement().addElement('items')
+    items['node'] = ns.AVATAR_DATA
+    item = items.addElement('item')
+    item['id'] = sha1
+    item.addElement('data', ns.AVATAR_DATA, content=base64.b64encode(avatar))
+    stream.send(result)
+
+    q.expect('dbus-signal', signal='AvatarRetrieved',
+        args=[handle, sha1, avatar, 'image/png'])
+
+    q.unforbid_all()
+
+    # Another of Bob's clients still advertises an older vCard photo. Having
+    # seen Bob's XEP-0084 metadata, we stick with that rather than flipping
+    # back and forth between the two.
+    q.forbid_events([EventPattern('dbus-signal', signal='AvatarUpdated')])
+    stream.send(make_presence('bob@foo.com/Old',
+        photo=hashlib.sha1('an older avatar').hexdigest()))
+    sync_stream(q, stream)
+    assertEquals({handle: sha1}, conn.Avatars.GetKnownAvatarTokens([handle]))
+    q.unforbid_all()
+
+    # Our own avatar goes into our vCard and then onto our PEP nodes, image
+    # first so nobody is told about a hash they can't fetch.
+    ours = '\x89PNG\r\n\x1a\nMe'
+    our_sha1 = hashlib.sha1(ours).hexdigest()
+    call_async(q, conn.Avatars, 'SetAvatar', ours, 'image/png')
+
+    expect_and_handle_get_vcard(q, stream)
+    expect_and_handle_set_vcard(q, stream)
+
+    event, _ = q.expect_many(
+        EventPattern('stream-iq', iq_type='set', query_ns=ns.PUBSUB,
+            query_name='pubsub'),
+        EventPattern('dbus-return', method='SetAvatar'))
+    publish = xpath.queryForNodes('/iq/pubsub/publish', event.stanza)
+    assertLength(1, publish)
+    assertEquals(ns.AVATAR_DATA, publish[0]['node'])
+    item = publish[0].firstChildElement()
+    assertEquals(our_sha1, item['id'])
+    assertEquals(ours, base64.b64decode(str(item.firstChildElement())))
+    acknowledge_iq(stream, event.stanza)
+
+    event = q.expect('stream-iq', iq_type='set', query_ns=ns.PUBSUB,
+        query_name='pubsub')
+    info = xpath.queryForNodes(
+        '/iq/pubsub/publish/item/metadata/info', event.stanza)
+    assertLength(1, info)
+    assertEquals(our_sha1, info[0]['id'])
+    assertEquals('image/png', info[0]['type'])
+    assertEquals(str(len(ours)), info[0]['bytes'])
+    acknowledge_iq(stream, event.stanza)
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,170 @@
+"""
+Test the vcard-cache parameter: contacts' vCards are kept on disk between
+connections, and used without asking the server again while their avatar
+hash in presence still matches, until they are too old or too many.
+"""
+
+import base64
+import hashlib
+import os
+
+import dbus
+
+from servicetest import (
+    call_async, EventPattern, assertContains,
+    )
+from gabbletest import (
+    exec_test, acknowledge_iq, make_result_iq, make_presence, sync_stream,
+    XmppAuthenticator, cache_file,
+    )
+import constants as cs
+
+username = 'vcards%d' % os.getpid()
+store = cache_file('vcards', '%s_40localhost.vcards' % username)
+
+bob = 'bob@foo.com'
+carol = 'carol@foo.com'
+
+def photo_sha1(data):
+    return hashlib.sha1(data).hexdigest()
+
+def backdate(jid, seconds):
+    """Makes the stored copy of jid's vCard look seconds older"""
+    lines = open(store).read().split('\n')
+    group = None
+
+    for i, line in enumerate(lines):
+        if line.startswith('['):
+            group = line[1:-1]
+        elif group == jid and line.startswith('fetched='):
+            fetched = int(line[len('fetched='):])
+            lines[i] = 'fetched=%d' % (fetched - seconds)
+
+    open(store, 'w').write('\n'.join(lines))
+
+def ack_own_vcard(q, stream):
+    event = q.expect('stream-iq', to=None, query_ns='vcard-temp',
+            query_name='vCard')
+    acknowledge_iq(stream, event.stanza)
+
+def request_info(q, conn, handle):
+    call_async(q, conn.ContactInfo, 'RequestContactInfo', handle)
+
+def expect_info(q, name):
+    e = q.expect('dbus-return', method='RequestContactInfo')
+    assertContains((u'fn', [], [name]), e.value[0])
+
+def answer_vcard(q, stream, jid, name, photo=None):
+    event = q.expect('stream-iq', iq_type='get', to=jid,
+        query_ns='vcard-temp', query_name='vCard')
+    result = make_result_iq(stream, event.stanza)
+    result.firstChildElement().addElement('FN', content=name)
+
+    if photo is not None:
+        p = result.firstChildElement().addElement('PHOTO')
+        p.addElement('TYPE', content='image/png')
+        p.addElement('BINVAL', content=base64.b64encode(photo))
+
+    stream.send(result)
+
+def forbid_vcard_requests(q, jids):
+    patterns = [EventPattern('stream-iq', iq_type='get', to=jid,
+        query_ns='vcard-temp') for jid in jids]
+    q.forbid_events(patterns)
+    return patterns
+
+def test_fetch(q, bus, conn, stream):
+    ack_own_vcard(q, stream)
+    bob_handle, carol_handle = conn.RequestHandles(cs.HT_CONTACT,
+        [bob, carol])
+
+    stream.send(make_presence(bob + '/Foo', photo=photo_sha1('hello')))
+
+    request_info(q, conn, bob_handle)
+    answer_vcard(q, stream, bob, 'Bob', 'hello')
+    expect_info(q, 'Bob')
+
+    request_info(q, conn, carol_handle)
+    answer_vcard(q, stream, carol, 'Carol')
+    expect_info(q, 'Carol')
+
+def test_hash_matches(q, bus, conn, stream):
+    ack_own_vcard(q, stream)
+    bob_handle = conn.RequestHandles(cs.HT_CONTACT, [bob])[0]
+
+    # Bob's avatar hasn't changed since their vCard was stored, so it's used
+    # without asking the server.
+    forbidden = forbid_vcard_requests(q, [bob])
+    stream.send(make_presence(bob + '/Foo', photo=photo_sha1('hello')))
+    request_info(q, conn, bob_handle)
+    expect_info(q, 'Bob')
+    sync_stream(q, stream)
+    q.unforbid_events(forbidden)
+
+    # Now it has, so the stored vCard is stale
+    stream.send(make_presence(bob + '/Foo', photo=photo_sha1('world')))
+    request_info(q, conn, bob_handle)
+    answer_vcard(q, stream, bob, 'Robert', 'world')
+    expect_info(q, 'Robert')
+
+def test_max_age(q, bus, conn, stream):
+    ack_own_vcard(q, stream)
+    bob_handle, carol_handle = conn.RequestHandles(cs.HT_CONTACT,
+        [bob, carol])
+
+    # Carol's vCard was stored an hour ago, which is too long...
+    request_info(q, conn, carol_handle)
+    answer_vcard(q, stream, carol, 'Caroline')
+    expect_info(q, 'Caroline')
+
+    # ...but Bob's was fetched just now.
+    forbidden = forbid_vcard_requests(q, [bob])
+    request_info(q, conn, bob_handle)
+    expect_info(q, 'Robert')
+    sync_stream(q, stream)
+    q.unforbid_events(forbidden)
+
+def test_nothing(q, bus, conn, stream):
+    # Both vCards are loaded; only the newer one is saved when we disconnect
+    ack_own_vcard(q, stream)
+
+def test_max_entries(q, bus, conn, stream):
+    ack_own_vcard(q, stream)
+    bob_handle, carol_handle = conn.RequestHandles(cs.HT_CONTACT,
+        [bob, carol])
+
+    forbidden = forbid_vcard_requests(q, [carol])
+    request_info(q, conn, carol_handle)
+    expect_info(q, 'Caroline')
+    sync_stream(q, stream)
+    q.unforbid_events(forbidden)
+
+    request_info(q, conn, bob_handle)
+    answer_vcard(q, stream, bob, 'Robert', 'world')
+    expect_info(q, 'Robert')
+
+if __name__ == '__main__':
+    params = {
+        'account': '%s@localhost' % username,
+        'vcard-cache': True,
+        }
+
+    def run(test, extra={}):
+        p = params.copy()
+        p.update(extra)
+        exec_test(test, p, authenticator=XmppAuthenticator(username, 'pass'))
+
+    try:
+        run(test_fetch)
+        run(test_hash_matches)
+
+        backdate(carol, 60 * 60)
+        run(test_max_age, {'vcard-cache-max-age': dbus.UInt32(10 * 60)})
+
+        # Make sure Carol's fresh copy is the newer of the two
+        backdate(bob, 10)
+        run(test_nothing, {'vcard-cache-max-entries': dbus.UInt32(1)})
+        run(test_max_entries)
+    finally:
+        if os.path.exists(store):
+            os.remove(store)